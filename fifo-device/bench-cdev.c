@@ -0,0 +1,577 @@
+// Copyright [2020] <Puchkov Kyryll>
+/*  Throughput and latency of /dev/cdevN next to an anonymous pipe and an AF_UNIX
+ *  socketpair. Every transport is driven the same way: W writer threads write chunks of
+ *  a given size until their share of the bytes is sent, R reader threads read with the
+ *  same buffer size until EOF. The latency of a write() or read() call is taken per
+ *  call, so p99 shows how long a side sleeps on a full or empty buffer. r_vcsw counts
+ *  the times the readers went to sleep, bytes / r_vcsw is the data moved per wakeup.
+ *
+ *  Before the sweep every transport moves a pseudo-random stream (or the file given
+ *  with -f) with one writer and one reader and compares FNV-1a hashes of both ends.
+ *
+ *  Output is CSV with a header, or JSON lines with -j, one record per run:
+ *      test,transport,chunk,writers,readers,bytes,seconds,mb_s,ops_s,
+ *      w_p50_ns,w_p99_ns,w_p999_ns,r_p50_ns,r_p99_ns,r_p999_ns,check,r_vcsw
+ *
+ *  Usage: ./bench-cdev [-d device] [-t cdev,pipe,socket] [-c chunk,...] [-w n,...]
+ *                      [-r n,...] [-m megabytes] [-n ops] [-f file] [-j]
+ */
+#define _GNU_SOURCE                                                     // RUSAGE_THREAD
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#define MAX_LIST            16
+#define MAX_THREADS         64
+#define VERIFY_CHUNK        (64 * 1024)
+#define FNV_OFFSET          1469598103934665603ULL
+#define FNV_PRIME           1099511628211ULL
+
+enum transport { CDEV, PIPE, SOCKET, TRANSPORTS };
+
+static const char *transport_names[TRANSPORTS] = { "cdev", "pipe", "socket" };
+
+struct options {
+    const char *device;
+    const char *file;                                                   ///< Verified instead of a generated stream
+    int         transports[TRANSPORTS];
+    size_t      chunks[MAX_LIST];
+    int         nchunks;
+    int         writers[MAX_LIST];
+    int         nwriters;
+    int         readers[MAX_LIST];
+    int         nreaders;
+    uint64_t    bytes;                                                  ///< Upper bound of bytes per run
+    uint64_t    ops;                                                    ///< Upper bound of writes per run
+    int         json;
+};
+
+/*  One side of one thread. Latencies are kept for the first `cap` calls only, which
+ *  is plenty for the percentiles and bounds memory for 1-byte chunks.
+ */
+struct worker {
+    pthread_t   thread;
+    struct run *run;
+    int         fd;
+    uint64_t    quota;                                                  ///< Bytes to write, writers only
+    uint64_t    bytes;
+    uint64_t    calls;
+    uint64_t   *lat;
+    uint64_t    nlat;
+    uint64_t    cap;
+    uint64_t    hash;
+    uint64_t    vcsw;                                                   ///< Voluntary context switches, readers only
+    int         error;
+};
+
+struct run {
+    enum transport    transport;
+    size_t            chunk;
+    int               verify;
+    FILE             *source;                                           ///< Verify data from a file, else generated
+    pthread_barrier_t start;
+    struct worker     writers[MAX_THREADS];
+    struct worker     readers[MAX_THREADS];
+    int               nwriters;
+    int               nreaders;
+    int               shared[2];                                        ///< pipe or socketpair ends, -1 for cdev
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t fnv1a(uint64_t hash, const unsigned char *data, size_t len) {
+    while (len-- > 0) {
+        hash = (hash ^ *data++) * FNV_PRIME;
+    }
+    return hash;
+}
+
+static void generate(uint64_t *state, unsigned char *dst, size_t len) {
+    while (len-- > 0) {
+        *state ^= *state << 13;                                         // xorshift64
+        *state ^= *state >> 7;
+        *state ^= *state << 17;
+        *dst++ = *state;
+    }
+}
+
+static void record(struct worker *w, uint64_t ns) {
+    if (w->nlat < w->cap) {
+        w->lat[w->nlat++] = ns;
+    }
+    w->calls++;
+}
+
+static void *writer_main(void *arg) {
+    struct worker *w = arg;
+    struct run *run = w->run;
+    unsigned char *buffer = malloc(run->chunk);
+    uint64_t state = 2020;
+    size_t pending = 0;                                                 ///< Bytes of buffer not written yet
+    size_t offset = 0;
+
+    w->hash = FNV_OFFSET;
+    if (buffer == NULL) {
+        w->error = ENOMEM;
+    } else {
+        memset(buffer, 0x5a, run->chunk);
+    }
+    pthread_barrier_wait(&run->start);
+
+    while (w->error == 0 && (w->bytes < w->quota || pending > 0)) {
+        uint64_t t0, t1;
+        ssize_t n;
+
+        if (pending == 0) {
+            pending = w->quota - w->bytes < run->chunk ? w->quota - w->bytes : run->chunk;
+            offset = 0;
+            if (run->verify) {
+                if (run->source != NULL) {
+                    pending = fread(buffer, 1, run->chunk, run->source);
+                    if (pending == 0) {
+                        break;                                          // End of the file
+                    }
+                } else {
+                    generate(&state, buffer, pending);
+                }
+                w->hash = fnv1a(w->hash, buffer, pending);
+            }
+        }
+        t0 = now_ns();
+        n = write(w->fd, buffer + offset, pending);
+        t1 = now_ns();
+        if (n < 0) {
+            if (errno != EINTR) {
+                w->error = errno;
+            }
+            continue;
+        }
+        record(w, t1 - t0);
+        w->bytes += n;
+        offset += n;
+        pending -= n;
+    }
+
+    if (run->shared[0] < 0) {
+        close(w->fd);                                                   // Last cdev writer to close gives readers EOF
+    }
+    free(buffer);
+    return NULL;
+}
+
+static uint64_t thread_vcsw(void) {
+    struct rusage usage;
+
+    getrusage(RUSAGE_THREAD, &usage);
+    return usage.ru_nvcsw;
+}
+
+static void *reader_main(void *arg) {
+    struct worker *w = arg;
+    struct run *run = w->run;
+    unsigned char *buffer = malloc(run->chunk);
+    uint64_t vcsw;
+
+    w->hash = FNV_OFFSET;
+    if (buffer == NULL) {
+        w->error = ENOMEM;
+    }
+    pthread_barrier_wait(&run->start);
+    vcsw = thread_vcsw();
+
+    while (w->error == 0) {
+        uint64_t t0, t1;
+        ssize_t n;
+
+        t0 = now_ns();
+        n = read(w->fd, buffer, run->chunk);
+        t1 = now_ns();
+        if (n < 0) {
+            if (errno != EINTR) {
+                w->error = errno;
+            }
+            continue;
+        }
+        if (n == 0) {
+            break;
+        }
+        record(w, t1 - t0);
+        w->bytes += n;
+        if (run->verify) {
+            w->hash = fnv1a(w->hash, buffer, n);
+        }
+    }
+    w->vcsw = thread_vcsw() - vcsw;
+    free(buffer);
+    return NULL;
+}
+
+/*  Opens every end before any thread starts: a cdev reader that opened before the
+ *  writers would see the EOF left by the previous run.
+ */
+static int open_ends(struct run *run, const char *device) {
+    int i;
+
+    run->shared[0] = run->shared[1] = -1;
+    for (i = 0; i < run->nwriters; i++) {
+        run->writers[i].fd = -1;
+    }
+    for (i = 0; i < run->nreaders; i++) {
+        run->readers[i].fd = -1;
+    }
+    switch (run->transport) {
+    case CDEV:
+        for (i = 0; i < run->nwriters; i++) {
+            if ((run->writers[i].fd = open(device, O_WRONLY)) < 0) {
+                return -1;
+            }
+        }
+        for (i = 0; i < run->nreaders; i++) {
+            if ((run->readers[i].fd = open(device, O_RDONLY)) < 0) {
+                return -1;
+            }
+        }
+        return 0;
+    case PIPE:
+        if (pipe(run->shared) < 0) {
+            return -1;
+        }
+        break;
+    case SOCKET:
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, run->shared) < 0) {
+            return -1;
+        }
+        break;
+    default:
+        return -1;
+    }
+    for (i = 0; i < run->nwriters; i++) {
+        run->writers[i].fd = run->shared[run->transport == PIPE ? 1 : 0];
+    }
+    for (i = 0; i < run->nreaders; i++) {
+        run->readers[i].fd = run->shared[run->transport == PIPE ? 0 : 1];
+    }
+    return 0;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+// Merges the samples of all workers and fills p50, p99 and p999
+static void percentiles(struct worker *workers, int count, uint64_t out[3]) {
+    static const double quantiles[3] = { 0.5, 0.99, 0.999 };
+    uint64_t total = 0;
+    uint64_t *all;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        total += workers[i].nlat;
+    }
+    memset(out, 0, 3 * sizeof(out[0]));
+    if (total == 0 || (all = malloc(total * sizeof(*all))) == NULL) {
+        return;
+    }
+    total = 0;
+    for (i = 0; i < count; i++) {
+        memcpy(all + total, workers[i].lat, workers[i].nlat * sizeof(*all));
+        total += workers[i].nlat;
+    }
+    qsort(all, total, sizeof(*all), compare_u64);
+    for (i = 0; i < 3; i++) {
+        out[i] = all[(uint64_t)((total - 1) * quantiles[i])];
+    }
+    free(all);
+}
+
+static void print_header(const struct options *opt) {
+    if (!opt->json) {
+        printf("test,transport,chunk,writers,readers,bytes,seconds,mb_s,ops_s,"
+               "w_p50_ns,w_p99_ns,w_p999_ns,r_p50_ns,r_p99_ns,r_p999_ns,check,r_vcsw\n");
+    }
+}
+
+static void print_record(const struct options *opt, const struct run *run, uint64_t bytes,
+                         uint64_t calls, double seconds, const uint64_t wp[3],
+                         const uint64_t rp[3], const char *check, uint64_t vcsw) {
+    const char *test = run->verify ? "verify" : "stream";
+    double mbs = bytes / 1048576.0 / seconds;
+    double opss = calls / seconds;
+
+    if (opt->json) {
+        printf("{\"test\":\"%s\",\"transport\":\"%s\",\"chunk\":%zu,\"writers\":%d,\"readers\":%d,"
+               "\"bytes\":%llu,\"seconds\":%.6f,\"mb_s\":%.2f,\"ops_s\":%.0f,"
+               "\"w_p50_ns\":%llu,\"w_p99_ns\":%llu,\"w_p999_ns\":%llu,"
+               "\"r_p50_ns\":%llu,\"r_p99_ns\":%llu,\"r_p999_ns\":%llu,\"check\":\"%s\",\"r_vcsw\":%llu}\n",
+               test, transport_names[run->transport], run->chunk, run->nwriters, run->nreaders,
+               (unsigned long long)bytes, seconds, mbs, opss,
+               (unsigned long long)wp[0], (unsigned long long)wp[1], (unsigned long long)wp[2],
+               (unsigned long long)rp[0], (unsigned long long)rp[1], (unsigned long long)rp[2],
+               check, (unsigned long long)vcsw);
+    } else {
+        printf("%s,%s,%zu,%d,%d,%llu,%.6f,%.2f,%.0f,%llu,%llu,%llu,%llu,%llu,%llu,%s,%llu\n",
+               test, transport_names[run->transport], run->chunk, run->nwriters, run->nreaders,
+               (unsigned long long)bytes, seconds, mbs, opss,
+               (unsigned long long)wp[0], (unsigned long long)wp[1], (unsigned long long)wp[2],
+               (unsigned long long)rp[0], (unsigned long long)rp[1], (unsigned long long)rp[2],
+               check, (unsigned long long)vcsw);
+    }
+    fflush(stdout);
+}
+
+/*  One measurement. Returns 0 on success, 1 if the run failed or did not verify.
+ */
+static int run_once(const struct options *opt, enum transport transport, size_t chunk,
+                    int nwriters, int nreaders, int verify) {
+    struct run *run = calloc(1, sizeof(*run));
+    uint64_t total, written = 0, received = 0, calls = 0, vcsw = 0;
+    uint64_t wp[3], rp[3];
+    uint64_t start, end;
+    const char *check = "-";
+    int started = 0;
+    int failed = 0;
+    int i;
+
+    if (run == NULL) {
+        perror("calloc");
+        return 1;
+    }
+    run->transport = transport;
+    run->chunk = chunk;
+    run->verify = verify;
+    run->nwriters = nwriters;
+    run->nreaders = nreaders;
+
+    // The byte budget is shared by the writers and capped by the number of writes
+    total = opt->bytes;
+    if (total / chunk > opt->ops) {
+        total = chunk * opt->ops;
+    }
+    if (verify && opt->file != NULL) {
+        run->source = fopen(opt->file, "rb");
+        if (run->source == NULL) {
+            perror(opt->file);
+            free(run);
+            return 1;
+        }
+        total = UINT64_MAX;                                             // Until the end of the file
+    }
+
+    if (open_ends(run, opt->device) < 0) {
+        fprintf(stderr, "%s: %s\n", transport_names[transport], strerror(errno));
+        failed = 1;
+        goto out;
+    }
+    pthread_barrier_init(&run->start, NULL, nwriters + nreaders + 1);
+    started = 1;
+    for (i = 0; i < nwriters; i++) {
+        struct worker *w = &run->writers[i];
+
+        w->run = run;
+        w->quota = verify ? total : total / nwriters;
+        w->lat = malloc(opt->ops * sizeof(*w->lat));
+        w->cap = w->lat != NULL ? opt->ops : 0;
+        pthread_create(&w->thread, NULL, writer_main, w);
+    }
+    for (i = 0; i < nreaders; i++) {
+        struct worker *w = &run->readers[i];
+
+        w->run = run;
+        w->lat = malloc(opt->ops * sizeof(*w->lat));
+        w->cap = w->lat != NULL ? opt->ops : 0;
+        pthread_create(&w->thread, NULL, reader_main, w);
+    }
+
+    pthread_barrier_wait(&run->start);
+    start = now_ns();
+    for (i = 0; i < nwriters; i++) {
+        pthread_join(run->writers[i].thread, NULL);
+        written += run->writers[i].bytes;
+        calls += run->writers[i].calls;
+        failed |= run->writers[i].error != 0;
+    }
+    if (transport == PIPE) {
+        close(run->shared[1]);                                          // EOF for the readers
+        run->shared[1] = -1;
+    } else if (transport == SOCKET) {
+        shutdown(run->shared[0], SHUT_WR);
+    }
+    for (i = 0; i < nreaders; i++) {
+        pthread_join(run->readers[i].thread, NULL);
+        received += run->readers[i].bytes;
+        vcsw += run->readers[i].vcsw;
+        failed |= run->readers[i].error != 0;
+    }
+    end = now_ns();
+    pthread_barrier_destroy(&run->start);
+
+    if (written != received) {
+        fprintf(stderr, "%s: wrote %llu bytes, read %llu\n", transport_names[transport],
+                (unsigned long long)written, (unsigned long long)received);
+        failed = 1;
+    }
+    if (verify) {
+        failed |= run->writers[0].hash != run->readers[0].hash;
+        check = failed ? "fail" : "ok";
+    }
+
+    percentiles(run->writers, nwriters, wp);
+    percentiles(run->readers, nreaders, rp);
+    print_record(opt, run, received, calls, (end - start) / 1e9, wp, rp, check, vcsw);
+
+out:
+    for (i = 0; i < nwriters; i++) {
+        if (transport == CDEV && !started && run->writers[i].fd >= 0) {
+            close(run->writers[i].fd);                                  // Writer threads close their own otherwise
+        }
+        free(run->writers[i].lat);
+    }
+    for (i = 0; i < nreaders; i++) {
+        if (transport == CDEV && run->readers[i].fd >= 0) {
+            close(run->readers[i].fd);
+        }
+        free(run->readers[i].lat);
+    }
+    for (i = 0; i < 2; i++) {
+        if (run->shared[i] >= 0) {
+            close(run->shared[i]);
+        }
+    }
+    if (run->source != NULL) {
+        fclose(run->source);
+    }
+    free(run);
+    return failed;
+}
+
+// Parses "a,b,c" into at most MAX_LIST positive numbers
+static int parse_list(const char *arg, uint64_t *out, uint64_t max) {
+    char *copy = strdup(arg);
+    char *token, *save = NULL;
+    int count = 0;
+
+    for (token = strtok_r(copy, ",", &save); token != NULL && count < MAX_LIST;
+         token = strtok_r(NULL, ",", &save)) {
+        uint64_t value = strtoull(token, NULL, 0);
+
+        if (value == 0 || value > max) {
+            fprintf(stderr, "bad value %s\n", token);
+            exit(2);
+        }
+        out[count++] = value;
+    }
+    free(copy);
+    return count;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "Usage: %s [-d device] [-t cdev,pipe,socket] [-c chunk,...] [-w n,...] [-r n,...]\n"
+            "          [-m megabytes] [-n ops] [-f file] [-j]\n", name);
+    exit(2);
+}
+
+int main(int argc, char *argv[]) {
+    static const size_t default_chunks[] = { 1, 16, 256, 4096, 65536, 1048576 };
+    struct options opt = {
+        .device = "/dev/cdev0",
+        .transports = { 1, 1, 1 },
+        .nwriters = 1,
+        .writers = { 1 },
+        .nreaders = 1,
+        .readers = { 1 },
+        .bytes = 64ULL << 20,
+        .ops = 200000,
+    };
+    uint64_t list[MAX_LIST];
+    int failed = 0;
+    int c, i, t, w, r;
+
+    opt.nchunks = sizeof(default_chunks) / sizeof(default_chunks[0]);
+    memcpy(opt.chunks, default_chunks, sizeof(default_chunks));
+
+    while ((c = getopt(argc, argv, "d:t:c:w:r:m:n:f:j")) != -1) {
+        switch (c) {
+        case 'd':
+            opt.device = optarg;
+            break;
+        case 't':
+            memset(opt.transports, 0, sizeof(opt.transports));
+            for (t = 0; t < TRANSPORTS; t++) {
+                opt.transports[t] = strstr(optarg, transport_names[t]) != NULL;
+            }
+            break;
+        case 'c':
+            opt.nchunks = parse_list(optarg, list, 1 << 30);
+            for (i = 0; i < opt.nchunks; i++) {
+                opt.chunks[i] = list[i];
+            }
+            break;
+        case 'w':
+            opt.nwriters = parse_list(optarg, list, MAX_THREADS);
+            for (i = 0; i < opt.nwriters; i++) {
+                opt.writers[i] = list[i];
+            }
+            break;
+        case 'r':
+            opt.nreaders = parse_list(optarg, list, MAX_THREADS);
+            for (i = 0; i < opt.nreaders; i++) {
+                opt.readers[i] = list[i];
+            }
+            break;
+        case 'm':
+            opt.bytes = strtoull(optarg, NULL, 0) << 20;
+            break;
+        case 'n':
+            opt.ops = strtoull(optarg, NULL, 0);
+            break;
+        case 'f':
+            opt.file = optarg;
+            break;
+        case 'j':
+            opt.json = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (opt.bytes == 0 || opt.ops == 0) {
+        usage(argv[0]);
+    }
+
+    print_header(&opt);
+    for (t = 0; t < TRANSPORTS; t++) {
+        if (opt.transports[t]) {
+            failed |= run_once(&opt, t, VERIFY_CHUNK, 1, 1, 1);
+        }
+    }
+    for (t = 0; t < TRANSPORTS; t++) {
+        if (!opt.transports[t]) {
+            continue;
+        }
+        for (i = 0; i < opt.nchunks; i++) {
+            for (w = 0; w < opt.nwriters; w++) {
+                for (r = 0; r < opt.nreaders; r++) {
+                    failed |= run_once(&opt, t, opt.chunks[i], opt.writers[w], opt.readers[r], 0);
+                }
+            }
+        }
+    }
+    return failed;
+}
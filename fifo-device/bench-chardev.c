@@ -0,0 +1,160 @@
+// Copyright [2020] <Puchkov Kyryll>
+/*  Message rate of /dev/chardev with one write()/read() per message versus the batch
+ *  ioctls, and a check that boundaries and contents survive both paths. Messages are
+ *  sent and received in rounds of `batch`, so the queue never fills up.
+ *
+ *  Usage: ./bench-chardev [device] [message bytes] [batch] [messages]
+ *  Output: mode,msg_bytes,batch,messages,seconds,msgs_s,check
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "chardev_msg.h"
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Message i is `size` bytes of (i + j), with its length varying so boundaries matter
+static size_t make_message(unsigned char *dst, uint64_t i, size_t size) {
+    size_t len = size > i % 4 ? size - i % 4 : 1;                       // Sizes below 4 would wrap
+    size_t j;
+
+    for (j = 0; j < len; j++) {
+        dst[j] = i + j;
+    }
+    return len;
+}
+
+static int check_message(const unsigned char *src, size_t len, uint64_t i, size_t size) {
+    unsigned char expected[CHARDEV_MESSAGE_MAX];
+
+    return make_message(expected, i, size) == len && memcmp(src, expected, len) == 0 ? 0 : -1;
+}
+
+static int run_syscalls(int fd, size_t size, size_t batch, uint64_t total) {
+    unsigned char *bufs = malloc(batch * CHARDEV_MESSAGE_MAX);
+    uint64_t sent = 0, received = 0;
+    int failed = 0;
+    double start, seconds;
+    size_t k;
+
+    start = now();
+    while (received < total && !failed) {
+        for (k = 0; k < batch && sent < total; k++, sent++) {
+            size_t len = make_message(bufs + k * CHARDEV_MESSAGE_MAX, sent, size);
+
+            if (write(fd, bufs + k * CHARDEV_MESSAGE_MAX, len) != (ssize_t)len) {
+                perror("write");
+                failed = 1;
+                break;
+            }
+        }
+        while (received < sent && !failed) {
+            ssize_t n = read(fd, bufs, CHARDEV_MESSAGE_MAX);
+
+            if (n < 0 || check_message(bufs, n, received, size) != 0) {
+                fprintf(stderr, "message %llu is wrong\n", (unsigned long long)received);
+                failed = 1;
+            }
+            received++;
+        }
+    }
+    seconds = now() - start;
+    printf("syscall,%zu,%zu,%llu,%.6f,%.0f,%s\n", size, batch, (unsigned long long)received,
+           seconds, received / seconds, failed ? "fail" : "ok");
+    free(bufs);
+    return failed;
+}
+
+static int run_batches(int fd, size_t size, size_t batch, uint64_t total) {
+    unsigned char *bufs = malloc(batch * CHARDEV_MESSAGE_MAX);
+    struct chardev_msg *msgs = calloc(batch, sizeof(*msgs));
+    struct chardev_batch b;
+    uint64_t sent = 0, received = 0;
+    int failed = 0;
+    double start, seconds;
+    size_t k;
+
+    start = now();
+    while (received < total && !failed) {
+        size_t count = total - sent < batch ? total - sent : batch;
+        long n;
+
+        for (k = 0; k < count; k++) {
+            msgs[k].data = (uintptr_t)(bufs + k * CHARDEV_MESSAGE_MAX);
+            msgs[k].len = make_message(bufs + k * CHARDEV_MESSAGE_MAX, sent + k, size);
+        }
+        b.msgs = (uintptr_t)msgs;
+        b.count = count;
+        n = ioctl(fd, CHARDEV_IOC_SEND, &b);
+        if (n != (long)count) {
+            perror("CHARDEV_IOC_SEND");
+            failed = 1;
+            break;
+        }
+        sent += n;
+
+        while (received < sent && !failed) {
+            for (k = 0; k < count; k++) {
+                msgs[k].len = CHARDEV_MESSAGE_MAX;
+            }
+            b.count = sent - received < count ? sent - received : count;
+            n = ioctl(fd, CHARDEV_IOC_RECV, &b);
+            if (n <= 0) {
+                perror("CHARDEV_IOC_RECV");
+                failed = 1;
+                break;
+            }
+            for (k = 0; k < (size_t)n; k++, received++) {
+                if (check_message(bufs + k * CHARDEV_MESSAGE_MAX, msgs[k].len, received, size) != 0) {
+                    fprintf(stderr, "message %llu is wrong\n", (unsigned long long)received);
+                    failed = 1;
+                }
+            }
+        }
+    }
+    seconds = now() - start;
+    printf("ioctl,%zu,%zu,%llu,%.6f,%.0f,%s\n", size, batch, (unsigned long long)received,
+           seconds, received / seconds, failed ? "fail" : "ok");
+    free(msgs);
+    free(bufs);
+    return failed;
+}
+
+int main(int argc, char *argv[]) {
+    const char *device = argc > 1 ? argv[1] : "/dev/chardev";
+    size_t size = argc > 2 ? strtoull(argv[2], NULL, 0) : 64;
+    size_t batch = argc > 3 ? strtoull(argv[3], NULL, 0) : 64;
+    uint64_t total = argc > 4 ? strtoull(argv[4], NULL, 0) : 1000000;
+    int failed = 0;
+    int fd;
+
+    if (size == 0 || size > CHARDEV_MESSAGE_MAX || batch == 0 || batch > CHARDEV_BATCH_MAX ||
+        batch * (size + sizeof(uint32_t)) > 64 * 1024) {
+        fprintf(stderr, "Usage: %s [device] [message bytes] [batch] [messages], one batch must fit in 64 KB\n",
+                argv[0]);
+        return 2;
+    }
+    fd = open(device, O_RDWR);
+    if (fd < 0) {
+        perror(device);
+        return 1;
+    }
+
+    printf("mode,msg_bytes,batch,messages,seconds,msgs_s,check\n");
+    failed |= run_syscalls(fd, size, batch, total);
+    failed |= run_batches(fd, size, batch, total);
+    close(fd);
+    return failed;
+}
@@ -0,0 +1,124 @@
+// Copyright [2020] <Puchkov Kyryll>
+/*  Microbenchmark of fifo_core without the kernel around it, so buffer changes can be
+ *  compared with perf on any machine. Two threads stream through a ring of 4 KB chunks
+ *  with memcpy as the copy routine, the writer spins while the ring is full and the
+ *  reader while it is empty. One CSV line per operation size:
+ *      op_bytes,ring_bytes,bytes,seconds,mb_s,ns_per_op
+ *
+ *  Usage: ./bench-fifo-core [ring pages] [megabytes per size]
+ */
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "fifo_core.h"
+
+#define CHUNK_SHIFT         12
+
+struct side {
+    struct fifo_core *core;
+    size_t            op;
+    uint64_t          total;
+    unsigned char    *buffer;
+};
+
+static size_t copy_in(void *chunk, size_t len, void *ctx) {
+    memcpy(chunk, ctx, len);
+    return len;
+}
+
+static size_t copy_out(void *chunk, size_t len, void *ctx) {
+    memcpy(ctx, chunk, len);
+    return len;
+}
+
+static void *writer_main(void *arg) {
+    struct side *s = arg;
+    uint64_t done = 0;
+
+    while (done < s->total) {
+        size_t n = s->total - done < s->op ? s->total - done : s->op;
+        size_t moved = fifo_core_write(s->core, n, copy_in, s->buffer);
+
+        if (moved == 0) {
+            sched_yield();                                              // Full, the module would sleep here
+        }
+        done += moved;
+    }
+    return NULL;
+}
+
+static void *reader_main(void *arg) {
+    struct side *s = arg;
+    uint64_t done = 0;
+
+    while (done < s->total) {
+        size_t moved = fifo_core_read(s->core, s->op, copy_out, s->buffer);
+
+        if (moved == 0) {
+            sched_yield();                                              // Empty
+        }
+        done += moved;
+    }
+    return NULL;
+}
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+    static const size_t ops[] = { 1, 16, 256, 4096, 65536 };
+    size_t pages = argc > 1 ? strtoull(argv[1], NULL, 0) : 10;
+    uint64_t total = (argc > 2 ? strtoull(argv[2], NULL, 0) : 256) << 20;
+    void **chunks = calloc(pages, sizeof(*chunks));
+    struct fifo_core core;
+    __u32 head, tail;
+    size_t i;
+
+    if (pages == 0 || chunks == NULL) {
+        fprintf(stderr, "Usage: %s [ring pages] [megabytes per size]\n", argv[0]);
+        return 2;
+    }
+    for (i = 0; i < pages; i++) {
+        chunks[i] = aligned_alloc((size_t)1 << CHUNK_SHIFT, (size_t)1 << CHUNK_SHIFT);
+        memset(chunks[i], 0, (size_t)1 << CHUNK_SHIFT);
+    }
+
+    printf("op_bytes,ring_bytes,bytes,seconds,mb_s,ns_per_op\n");
+    for (i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+        // Small operations are slow, do not let them run for minutes
+        uint64_t bytes = ops[i] < 256 ? total / (256 / ops[i]) : total;
+        struct side w = { &core, ops[i], bytes, malloc(ops[i]) };
+        struct side r = { &core, ops[i], bytes, malloc(ops[i]) };
+        pthread_t writer, reader;
+        double start, seconds;
+
+        memset(w.buffer, 0x5a, ops[i]);
+        fifo_core_init(&core, chunks, pages, CHUNK_SHIFT, &head, &tail);
+        start = now();
+        pthread_create(&writer, NULL, writer_main, &w);
+        pthread_create(&reader, NULL, reader_main, &r);
+        pthread_join(writer, NULL);
+        pthread_join(reader, NULL);
+        seconds = now() - start;
+
+        printf("%zu,%zu,%llu,%.6f,%.2f,%.1f\n", ops[i], core.size, (unsigned long long)bytes,
+               seconds, bytes / 1048576.0 / seconds, seconds * 1e9 / ((double)bytes / ops[i]));
+        free(w.buffer);
+        free(r.buffer);
+    }
+
+    for (i = 0; i < pages; i++) {
+        free(chunks[i]);
+    }
+    free(chunks);
+    return 0;
+}
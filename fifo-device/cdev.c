@@ -4,125 +4,1541 @@
 #include <linux/device.h>                                               // Header to support the kernel Driver Model
 #include <linux/kernel.h>                                               // Contains types, macros, functions for the kernel
 #include <linux/fs.h>                                                   // Header for the Linux file system support
+#include <linux/cdev.h>                                                 // struct cdev, one per minor
 #include <linux/uaccess.h>                                              // Required for the copy to user function
 #include <linux/slab.h>
+#include <linux/mutex.h>                                                // Ring buffer lock
+#include <linux/wait.h>                                                 // Wait queues for blocking readers and writers
+#include <linux/poll.h>                                                 // poll/epoll readiness masks
+#include <linux/mm.h>                                                   // vm_area_struct for mmap
+#include <linux/list.h>                                                 // Free chunk pool
+#include <linux/spinlock.h>
+#include <linux/uio.h>                                                  // iov_iter for vectored and spliced I/O
+#include <linux/debugfs.h>                                              // Latency histogram
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/cpumask.h>                                              // Per-CPU rings of the sharded orders
+#include <linux/topology.h>
+#include <linux/string.h>
+#include <linux/shmem_fs.h>                                             // Spill file for bursts that overflow the ring
+#include <linux/falloc.h>
+#include <linux/file.h>
+#include <linux/hrtimer.h>                                              // Deadline of a held back reader wakeup
+
+#include "cdev_ring.h"                                                  // Control page layout shared with user space
+#include "fifo_core.h"                                                  // Ring arithmetic, also built for user space
+
+#define CREATE_TRACE_POINTS
+#include "cdev_trace.h"                                                 // cdev_enqueue, cdev_dequeue, cdev_block, cdev_wake
 
 
 #define DEVICE_NAME         "cdev"                                   ///< Dev name as it appears in /proc/devices
 #define CLASS_NAME          "lkm"                                       //< The device class -- this is a character device driver
-#define MESSAGE_SIZE        (size_t)(10 * PAGE_SIZE)
+#define MAX_MINORS          256
+#define MAX_RING_PAGES      (1UL << 18)                                 ///< Positions in the control page are 32 bit
+#define STAMP_SLOTS         32                                          ///< Writes whose time in the ring is being measured
+#define LATENCY_BUCKETS     64                                          ///< log2 of nanoseconds
+#define SPILL_PUNCH         (256 * 1024)                                ///< Consumed spill bytes freed at once
+#define WAKE_DELAY_MAX      USEC_PER_SEC                                ///< Longest wake_delay_us accepted
+#define WAKE_GAP_SHIFT      3                                           ///< The write gap average moves by 1/8 of a sample
+#define WAKE_BATCH_WRITES   16                                          ///< Adaptive delay covers this many average gaps
 
 MODULE_LICENSE("GPL");                                                  ///< The license type -- this affects available functionality
 MODULE_AUTHOR("Puchkov Kyryll");                                        ///< The author -- visible when you use modinfo
 MODULE_DESCRIPTION("A simple fifo driver for the kernel module");       ///< The description -- see modinfo
-MODULE_VERSION("0.1");                                                  ///< A version number to inform users
+MODULE_VERSION("0.8");                                                  ///< A version number to inform users
+
+static unsigned int minors = 4;                                         ///< Number of independent channels, /dev/cdev0 and up
+module_param(minors, uint, 0444);
+MODULE_PARM_DESC(minors, "Number of fifo devices to create (1-256)");
+
+static unsigned int ring_pages = 10;                                    ///< Initial capacity of every ring, in chunks
+module_param(ring_pages, uint, 0444);
+MODULE_PARM_DESC(ring_pages, "Initial ring size in pages, change it at runtime with CDEV_RING_IOC_RESIZE or sysfs capacity");
+
+static unsigned int pool_max = 1024;                                    ///< Free chunks kept for reuse
+module_param(pool_max, uint, 0644);
+MODULE_PARM_DESC(pool_max, "Number of free ring pages kept cached for reuse");
+
+static unsigned int shard_pages = 4;                                    ///< Size of every per-CPU ring
+module_param(shard_pages, uint, 0444);
+MODULE_PARM_DESC(shard_pages, "Pages of every per-CPU ring of the round-robin and timestamp orders");
 
-static int    majorNumber;                                              ///< Stores the device number -- determined automatically
-static char*  msg_ptr;
-static int    numberOpens = 0;                                          ///< Counts the number of times the device is opened
+static unsigned long spill_max = 64UL << 20;                            ///< Initial spill cap of every device
+module_param(spill_max, ulong, 0444);
+MODULE_PARM_DESC(spill_max, "Bytes a device may spill to shmem when its ring is full, 0 blocks the writer instead; "
+                 "change it per device with sysfs spill_max");
+
+static unsigned int wake_bytes = 0;                                     ///< Initial wakeup threshold of every device
+module_param(wake_bytes, uint, 0444);
+MODULE_PARM_DESC(wake_bytes, "Bytes written before a sleeping reader is woken, 0 wakes it on every write; "
+                 "change it per device with sysfs wake_bytes");
+
+static unsigned int wake_delay_us = 100;                                ///< Initial longest delay of a wakeup
+module_param(wake_delay_us, uint, 0444);
+MODULE_PARM_DESC(wake_delay_us, "Longest time a reader wakeup is held back while wake_bytes are not reached, "
+                 "0 disables coalescing; change it per device with sysfs wake_delay_us");
+
+static bool wake_adaptive = true;                                       ///< Initial adaptive mode of every device
+module_param(wake_adaptive, bool, 0444);
+MODULE_PARM_DESC(wake_adaptive, "Shorten the wakeup delay from the write rate, so sparse writes are not delayed; "
+                 "change it per device with sysfs wake_adaptive");
+
+/*  End of a write in the byte stream (bytesIn after it) and when it happened.
+ */
+struct fifo_stamp {
+    u64    end;
+    u64    time;
+};
+
+/*  Header of a record in a per-CPU ring, published together with the data after it.
+ */
+struct fifo_record {
+    u64    stamp;                                                       ///< ktime_get_ns() at commit
+    u32    len;
+} __packed;
+
+/*  Per-CPU ring of the sharded orders (see cdev_ring.h). Writers that run on the CPU
+ *  serialize on lock; the reader side is serialized by the device's ring_lock and
+ *  lives in its own cache line, so a reader and the writers only share the positions.
+ */
+struct fifo_shard {
+    struct fifo_core ring;
+    __u32  head;
+    struct mutex lock;                                                  ///< Serializes the writers of this ring
+    u64    bytesIn;                                                     ///< Stats, updated under lock
+    u64    writeOps;
+    u64    writeWaits;
+    __u32  tail ____cacheline_aligned_in_smp;
+    bool   loaded;                                                      ///< The header of the next record has been read
+    u32    recordLeft;                                                  ///< Unread bytes of that record
+    u64    recordStamp;
+};
+
+/*  One independent channel. Everything a reader or a writer touches lives here, so
+ *  two minors never share a lock, a wait queue or a cache line of the ring.
+ *
+ *  The ring is a table of order-0 pages (chunks): byte pos lives in chunk pos / PAGE_SIZE.
+ *  Nothing needs physically contiguous memory, so any capacity can be allocated on a
+ *  fragmented machine, and the same pages are mapped to user space one by one.
+ *  The position arithmetic is in fifo_core.c, this file adds locking and sleeping.
+ */
+struct fifo_dev {
+    struct cdev cdev;                                                   ///< Char device of this minor
+    struct device* device;                                              ///< /dev node and sysfs directory
+    struct page* ctrl_page;                                             ///< Control page, mapped at offset 0
+    struct cdev_ring_ctrl* ring_ctrl;                                   ///< Producer and consumer positions, shared with user space
+    struct fifo_core ring;                                              ///< Chunk addresses and positions, the table changes under ring_lock
+    atomic_t mapCount;                                                  ///< Live mappings, the ring cannot be resized under them
+    int    numberWriters;                                               ///< Producer files, protected by ring_lock
+    atomic_t numberOpens;                                               ///< Currently open files
+    struct mutex ring_lock;                                             ///< Serializes read() callers and write() callers
+    wait_queue_head_t read_queue;                                       ///< Readers sleep here while the ring is empty
+    wait_queue_head_t write_queue;                                      ///< Writers sleep here while the ring is full
+    u64    bytesIn;                                                     ///< Stats, updated under ring_lock
+    u64    bytesOut;
+    u64    writeOps;
+    u64    readOps;
+    u64    readWaits;                                                   ///< Times a reader found the ring empty and slept
+    u64    writeWaits;                                                  ///< Times a writer found the ring full and slept
+    size_t fillMax;                                                     ///< High-water mark of the fill level
+    struct fifo_stamp stamps[STAMP_SLOTS];                              ///< Pending writes, oldest at stampFirst
+    unsigned int stampFirst;
+    unsigned int stampCount;
+    u64    latency[LATENCY_BUCKETS];                                    ///< Time in the ring, bucket n counts [2^n, 2^(n+1)) ns
+    struct dentry* debugDir;                                            ///< /sys/kernel/debug/cdev/cdevN
+    unsigned int order;                                                 ///< CDEV_RING_ORDER_*, changed under ring_lock
+    struct fifo_shard** shards;                                         ///< Per-CPU rings by CPU id, allocated for the first sharded order
+    unsigned int shardNext;                                             ///< Round-robin cursor, under ring_lock
+    int    shardCurrent;                                                ///< CPU ring whose record is half read, or -1
+    u64    shardBytesOut;                                               ///< Read from the CPU rings, under ring_lock
+    struct file* spill;                                                 ///< shmem file the FIFO order overflows into, created on the first burst
+    loff_t spillHead;                                                   ///< Next spill byte to write, under ring_lock
+    loff_t spillTail;                                                   ///< Next spill byte to read, under ring_lock
+    loff_t spillPunched;                                                ///< Spill bytes below this are freed
+    unsigned long spillMax;                                             ///< Cap of spillHead - spillTail
+    u64    spillBytes;                                                  ///< Stats, updated under ring_lock
+    u64    spillWrites;
+    struct hrtimer wakeTimer;                                           ///< Wakes the readers when a held back wakeup is due
+    atomic_long_t wakePending;                                          ///< Bytes written since the readers were last woken
+    unsigned long wakeBytes;                                            ///< Wake once this many bytes are pending, 0 on every write
+    u64    wakeDelay;                                                   ///< Longest a wakeup is held back, in ns, 0 on every write
+    bool   wakeAdaptive;                                                ///< Derive the delay from writeGap
+    u64    writeLast;                                                   ///< ktime_get_ns() of the last write, for wakeAdaptive
+    u64    writeGap;                                                    ///< Average time between writes, in ns
+    atomic64_t wakeups;                                                 ///< Stats, readers were woken
+    atomic64_t wakeDeferred;                                            ///< A write left a sleeping reader asleep
+    atomic64_t wakeTimed;                                               ///< A held back wakeup was made by wakeTimer
+};
+
+/*  Per open file state, kept in filep->private_data.
+ */
+struct fifo_file {
+    struct fifo_dev* dev;
+    bool   producer;                                                    ///< Counted in dev->numberWriters
+};
+
+static dev_t  firstDevice;                                              ///< First device number -- determined automatically
+static struct fifo_dev* fifoDevs = NULL;                                ///< Array of minors fifo devices
 static struct class*  fifoClass  = NULL;                                ///< The device-driver class struct pointer
-static struct device* fifoDevice = NULL;                                ///< The device-driver device struct pointer
+
+static LIST_HEAD(chunkPool);                                            ///< Free chunks linked through page->lru
+static unsigned int poolChunks = 0;                                     ///< Entries in chunkPool
+static DEFINE_SPINLOCK(poolLock);                                       ///< Protects chunkPool and poolChunks
+static struct dentry* debugRoot = NULL;                                 ///< /sys/kernel/debug/cdev
 
 // The prototype functions for the character driver
 static int     dev_open(struct inode *, struct file *);
 static int     dev_release(struct inode *, struct file *);
-static ssize_t dev_read(struct file *, char *, size_t, loff_t *);
-static ssize_t dev_write(struct file *, const char *, size_t, loff_t *);
+static ssize_t dev_read_iter(struct kiocb *, struct iov_iter *);
+static ssize_t dev_write_iter(struct kiocb *, struct iov_iter *);
+static __poll_t dev_poll(struct file *, poll_table *);
+static long    dev_ioctl(struct file *, unsigned int, unsigned long);
+static int     dev_mmap(struct file *, struct vm_area_struct *);
 
 static struct file_operations fops = {
     .owner = THIS_MODULE,
     .open = dev_open,
-    .read = dev_read,
-    .write = dev_write,
+    .read_iter = dev_read_iter,                                         // read, readv, preadv2 and io_uring reads
+    .write_iter = dev_write_iter,                                       // write, writev, pwritev2 and io_uring writes
+    .splice_read = generic_file_splice_read,                            // Device to pipe, fed by dev_read_iter
+    .splice_write = iter_file_splice_write,                             // Pipe to device, fed by dev_write_iter
     .release = dev_release,
+    .poll = dev_poll,
+    .unlocked_ioctl = dev_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
+    .mmap = dev_mmap,
+    .llseek = no_llseek,
+};
+
+/*  Takes a zeroed chunk, from the pool if possible. Pages of another minor's stream
+ *  may end up mapped to user space, so recycled ones are cleared as well.
+ */
+static struct page *chunk_get(void) {
+    struct page *page = NULL;
+
+    spin_lock(&poolLock);
+    if (!list_empty(&chunkPool)) {
+        page = list_first_entry(&chunkPool, struct page, lru);
+        list_del(&page->lru);
+        poolChunks--;
+    }
+    spin_unlock(&poolLock);
+
+    if (page != NULL) {
+        clear_page(page_address(page));
+        return page;
+    }
+    return alloc_page(GFP_KERNEL | __GFP_ZERO);                         // Order 0 only
+}
+
+static void chunk_put(struct page *page) {
+    spin_lock(&poolLock);
+    if (poolChunks < READ_ONCE(pool_max)) {
+        list_add(&page->lru, &chunkPool);
+        poolChunks++;
+        page = NULL;
+    }
+    spin_unlock(&poolLock);
+
+    if (page != NULL) {
+        __free_page(page);
+    }
+}
+
+static void chunk_pool_drain(void) {
+    struct page *page, *next;
+
+    list_for_each_entry_safe(page, next, &chunkPool, lru) {
+        list_del(&page->lru);
+        __free_page(page);
+    }
+    poolChunks = 0;
+}
+
+/*  Fills a table with the addresses of pool pages, on failure everything taken so far
+ *  goes back to the pool. The pages are lowmem, so virt_to_page() gives them back.
+ */
+static int chunks_fill(void **chunks, size_t count) {
+    struct page *page;
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        page = chunk_get();
+        if (page == NULL) {
+            while (i--) {
+                chunk_put(virt_to_page(chunks[i]));
+            }
+            return -ENOMEM;
+        }
+        chunks[i] = page_address(page);
+    }
+    return 0;
+}
+
+static void chunks_release(void **chunks, size_t count) {
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        chunk_put(virt_to_page(chunks[i]));
+    }
+    kvfree(chunks);
+}
+
+static inline size_t ring_fill(struct fifo_dev *dev) {
+    return fifo_core_fill(&dev->ring);
+}
+
+static inline size_t ring_space(struct fifo_dev *dev) {
+    return fifo_core_space(&dev->ring);
+}
+
+/*  Bytes waiting in the per-CPU rings, headers included.
+ */
+static size_t shards_pending(struct fifo_dev *dev) {
+    struct fifo_shard **shards = READ_ONCE(dev->shards);
+    size_t pending = 0;
+    unsigned int cpu;
+
+    if (shards == NULL) {
+        return 0;
+    }
+    for_each_possible_cpu(cpu) {
+        pending += fifo_core_fill(&shards[cpu]->ring);
+    }
+    return pending;
+}
+
+/*  Bytes waiting in the spill file. Also read without the lock. Positions are reset
+ *  to 0 once the file is drained, head before tail, so loading tail before head
+ *  makes a racing reset read as empty rather than as bytes that were never spilled.
+ */
+static inline size_t spill_fill(struct fifo_dev *dev) {
+    loff_t tail = READ_ONCE(dev->spillTail);
+    loff_t head;
+
+    smp_rmb();                                                          // Pairs with spill_read()
+    head = READ_ONCE(dev->spillHead);
+
+    return head > tail ? head - tail : 0;
+}
+
+/*  Bytes a write() may still spill. Nothing is spilled while the ring is mapped,
+ *  the mmap consumer would never see it.
+ */
+static inline size_t spill_room(struct fifo_dev *dev) {
+    unsigned long max = READ_ONCE(dev->spillMax);
+    size_t fill = spill_fill(dev);
+
+    if (atomic_read(&dev->mapCount) > 0) {
+        return 0;
+    }
+    return max > fill ? max - fill : 0;
+}
+
+static inline bool dev_has_data(struct fifo_dev *dev) {
+    return ring_fill(dev) > 0 || spill_fill(dev) > 0 || shards_pending(dev) > 0;
+}
+
+/*  A write() of the FIFO order goes to the ring while nothing is spilled and to the
+ *  spill file otherwise, so the stream stays in order.
+ */
+static inline bool fifo_writable(struct fifo_dev *dev) {
+    return (spill_fill(dev) == 0 && ring_space(dev) > 0) || spill_room(dev) > 0;
+}
+
+static inline bool ring_readable(struct fifo_dev *dev) {
+    return dev_has_data(dev) || READ_ONCE(dev->ring_ctrl->eof);
+}
+
+/*  A sharded writer needs room for a header and at least one byte in its CPU ring.
+ */
+static inline bool shard_writable(struct fifo_shard *shard) {
+    return fifo_core_space(&shard->ring) > sizeof(struct fifo_record);
+}
+
+/*  The *_wait flags tell the other side that somebody is about to sleep. They are set
+ *  before the final check of the ring and the notifier clears them, so an mmap peer
+ *  only has to make the CDEV_RING_IOC_NOTIFY syscall when a flag is set.
+ */
+static void ring_notify_readers(struct fifo_dev *dev, __poll_t key) {
+    if (READ_ONCE(dev->ring_ctrl->read_wait)) {                         // Writers on many CPUs must not bounce the line
+        WRITE_ONCE(dev->ring_ctrl->read_wait, 0);
+    }
+    if (wq_has_sleeper(&dev->read_queue)) {                             // Skip the queue lock when nobody sleeps
+        atomic64_inc(&dev->wakeups);
+        trace_cdev_wake(MINOR(dev->cdev.dev), false);
+        wake_up_interruptible_poll(&dev->read_queue, key);
+    }
+}
+
+static void ring_notify_writers(struct fifo_dev *dev) {
+    if (READ_ONCE(dev->ring_ctrl->write_wait)) {
+        WRITE_ONCE(dev->ring_ctrl->write_wait, 0);
+    }
+    if (wq_has_sleeper(&dev->write_queue)) {
+        trace_cdev_wake(MINOR(dev->cdev.dev), true);
+        wake_up_interruptible_poll(&dev->write_queue, EPOLLOUT | EPOLLWRNORM);
+    }
+}
+
+/*  Called by write() after publishing `bytes`. While coalescing is on (wakeBytes and
+ *  wakeDelay set) a sleeping reader is only woken once wakeBytes are pending, when the
+ *  writer ran out of room (`full`), or when wakeTimer expires, so a stream of small
+ *  writes costs the reader one context switch per batch and no byte waits longer than
+ *  wakeDelay. poll() still reports the data at once, only the wakeup is held back.
+ *
+ *  The adaptive mode keeps an average of the gap between writes. The delay covers at
+ *  most WAKE_BATCH_WRITES gaps, and when the next write is not expected before half
+ *  the delay has passed there is nothing to batch and the reader is woken right away,
+ *  so sparse messages keep their latency. Writers of the sharded orders update the
+ *  average without a common lock, a lost sample only makes it a little less exact.
+ *
+ *  The timer is never pushed back or cancelled: a write that finds it queued is
+ *  covered by it, and one that comes after the callback took the pending count arms
+ *  it again. A timer that fires with nothing pending finds no sleeper and costs nothing.
+ */
+static void ring_wake_readers(struct fifo_dev *dev, size_t bytes, bool full) {
+    unsigned long threshold = READ_ONCE(dev->wakeBytes);
+    u64 delay = READ_ONCE(dev->wakeDelay);
+    u64 now;
+    u64 gap;
+    u64 avg;
+
+    if (threshold == 0 || delay == 0) {
+        ring_notify_readers(dev, EPOLLIN | EPOLLRDNORM);
+        return;
+    }
+    if (READ_ONCE(dev->wakeAdaptive)) {
+        now = ktime_get_ns();
+        gap = min_t(u64, now - READ_ONCE(dev->writeLast), 2 * delay);  // One idle period must not outweigh a burst
+        WRITE_ONCE(dev->writeLast, now);
+        avg = READ_ONCE(dev->writeGap);
+        avg = avg - (avg >> WAKE_GAP_SHIFT) + (gap >> WAKE_GAP_SHIFT);
+        WRITE_ONCE(dev->writeGap, avg);
+        full |= 2 * avg > delay;                                        // Sparse, the reader would only wait
+        delay = min_t(u64, delay, avg * WAKE_BATCH_WRITES);
+    }
+    if (atomic_long_add_return(bytes, &dev->wakePending) >= threshold || full) {
+        atomic_long_set(&dev->wakePending, 0);
+        ring_notify_readers(dev, EPOLLIN | EPOLLRDNORM);
+        return;
+    }
+    if (wq_has_sleeper(&dev->read_queue)) {
+        atomic64_inc(&dev->wakeDeferred);
+    }
+    if (!hrtimer_is_queued(&dev->wakeTimer)) {
+        hrtimer_start(&dev->wakeTimer, ns_to_ktime(delay), HRTIMER_MODE_REL);
+    }
+}
+
+static enum hrtimer_restart ring_wake_timer(struct hrtimer *timer) {
+    struct fifo_dev *dev = container_of(timer, struct fifo_dev, wakeTimer);
+
+    if (atomic_long_xchg(&dev->wakePending, 0) > 0 && wq_has_sleeper(&dev->read_queue)) {
+        atomic64_inc(&dev->wakeTimed);
+    }
+    ring_notify_readers(dev, EPOLLIN | EPOLLRDNORM);
+    return HRTIMER_NORESTART;
+}
+
+/*  Time-in-buffer accounting, called under ring_lock after bytesIn/bytesOut moved.
+ *  Only the last STAMP_SLOTS writes are tracked; when they are all pending the newest
+ *  one absorbs the next write, which overstates that write's latency instead of losing it.
+ *  Data produced or consumed through mmap bypasses this and is not measured.
+ */
+static void latency_enqueue(struct fifo_dev *dev, u64 now) {
+    struct fifo_stamp *stamp;
+
+    if (dev->stampCount == STAMP_SLOTS) {
+        stamp = &dev->stamps[(dev->stampFirst + STAMP_SLOTS - 1) % STAMP_SLOTS];
+        stamp->end = dev->bytesIn;
+        return;
+    }
+    stamp = &dev->stamps[(dev->stampFirst + dev->stampCount) % STAMP_SLOTS];
+    stamp->end = dev->bytesIn;
+    stamp->time = now;
+    dev->stampCount++;
+}
+
+static void latency_dequeue(struct fifo_dev *dev, u64 now) {
+    struct fifo_stamp *stamp;
+
+    while (dev->stampCount > 0) {
+        stamp = &dev->stamps[dev->stampFirst];
+        if (stamp->end > dev->bytesOut) {
+            break;
+        }
+        dev->latency[ilog2(max_t(u64, now - stamp->time, 1))]++;
+        dev->stampFirst = (dev->stampFirst + 1) % STAMP_SLOTS;
+        dev->stampCount--;
+    }
+}
+
+/*  Counts the file as a producer. A new producer clears the EOF mark left by the
+ *  previous one, so a reader that opens after `cat > /dev/cdev0` blocks instead of
+ *  seeing an empty stream. A reader started before it still sees the old EOF.
+ */
+static void mark_producer(struct fifo_file *file) {
+    struct fifo_dev *dev = file->dev;
+
+    mutex_lock(&dev->ring_lock);
+    if (!file->producer) {
+        file->producer = true;
+        dev->numberWriters++;
+        WRITE_ONCE(dev->ring_ctrl->eof, 0);
+    }
+    mutex_unlock(&dev->ring_lock);
+}
+
+/*  Moves the stored bytes into a new table of chunks, starting at position 0.
+ *  The old chunks go back to the pool, so growing and shrinking never frees memory
+ *  that the next resize would have to allocate again. Refused while the ring is
+ *  mapped, since user space has the old layout, and when the data would not fit.
+ */
+static int ring_resize(struct fifo_dev *dev, size_t pages) {
+    void **chunks;
+    int error;
+
+    if (pages == 0 || pages > MAX_RING_PAGES) {
+        return -EINVAL;
+    }
+    chunks = kvcalloc(pages, sizeof(*chunks), GFP_KERNEL);              // Falls back to vmalloc for huge tables
+    if (chunks == NULL) {
+        return -ENOMEM;
+    }
+    error = chunks_fill(chunks, pages);
+    if (error) {
+        kvfree(chunks);
+        return error;
+    }
+
+    mutex_lock(&dev->ring_lock);
+    if (atomic_read(&dev->mapCount) > 0) {
+        error = -EBUSY;
+        goto out;
+    }
+    error = fifo_core_resize(&dev->ring, &chunks, &pages);
+    if (!error) {
+        dev->ring_ctrl->size = dev->ring.size;
+    }
+out:
+    mutex_unlock(&dev->ring_lock);
+
+    chunks_release(chunks, pages);                                      // The old table on success, the new one on error
+    if (!error) {
+        ring_notify_writers(dev);                                       // There may be more room now
+    }
+    return error;
+}
+
+static void shards_free(struct fifo_shard **shards) {
+    unsigned int cpu;
+
+    if (shards == NULL) {
+        return;
+    }
+    for_each_possible_cpu(cpu) {
+        if (shards[cpu] != NULL && shards[cpu]->ring.chunks != NULL) {
+            chunks_release(shards[cpu]->ring.chunks, shards[cpu]->ring.nchunks);
+        }
+        kfree(shards[cpu]);
+    }
+    kfree(shards);
+}
+
+/*  One ring per possible CPU, each allocated on the CPU's node.
+ */
+static struct fifo_shard **shards_alloc(void) {
+    struct fifo_shard **shards;
+    struct fifo_shard *shard;
+    void **chunks;
+    unsigned int cpu;
+
+    shards = kcalloc(nr_cpu_ids, sizeof(*shards), GFP_KERNEL);
+    if (shards == NULL) {
+        return NULL;
+    }
+    for_each_possible_cpu(cpu) {
+        shard = kzalloc_node(sizeof(*shard), GFP_KERNEL, cpu_to_node(cpu));
+        if (shard == NULL) {
+            goto fail;
+        }
+        shards[cpu] = shard;
+        chunks = kvcalloc(shard_pages, sizeof(*chunks), GFP_KERNEL);
+        if (chunks == NULL) {
+            goto fail;
+        }
+        if (chunks_fill(chunks, shard_pages)) {
+            kvfree(chunks);
+            goto fail;
+        }
+        fifo_core_init(&shard->ring, chunks, shard_pages, PAGE_SHIFT, &shard->head, &shard->tail);
+        mutex_init(&shard->lock);
+    }
+    return shards;
+fail:
+    shards_free(shards);
+    return NULL;
+}
+
+/*  Writers pick the order up with an acquire, so they see the rings it needs.
+ */
+static int fifo_set_order(struct fifo_dev *dev, u32 order) {
+    struct fifo_shard **shards = NULL;
+    int error = 0;
+
+    if (order > CDEV_RING_ORDER_TIMESTAMP) {
+        return -EINVAL;
+    }
+    if (order != CDEV_RING_ORDER_FIFO && READ_ONCE(dev->shards) == NULL) {
+        shards = shards_alloc();                                        // Outside of the lock, it may take a while
+        if (shards == NULL) {
+            return -ENOMEM;
+        }
+    }
+
+    mutex_lock(&dev->ring_lock);
+    if (order != CDEV_RING_ORDER_FIFO && atomic_read(&dev->mapCount) > 0) {
+        error = -EBUSY;
+    } else {
+        if (shards != NULL && dev->shards == NULL) {
+            WRITE_ONCE(dev->shards, shards);
+            shards = NULL;
+        }
+        smp_store_release(&dev->order, order);
+    }
+    mutex_unlock(&dev->ring_lock);
+
+    shards_free(shards);                                                // Lost a race with another caller, or EBUSY
+    return error;
+}
+
+/*  Appends up to spill_room() bytes of the iterator to the spill file. shmem pages are
+ *  swappable page cache, so a burst costs no pinned kernel memory. Called under ring_lock.
+ */
+static ssize_t spill_write(struct fifo_dev *dev, struct iov_iter *from) {
+    struct file *spill = dev->spill;
+    size_t count = iov_iter_count(from);
+    loff_t pos = dev->spillHead;
+    ssize_t written;
+
+    if (spill == NULL) {
+        spill = shmem_file_setup("cdev-spill", 0, VM_NORESERVE);
+        if (IS_ERR(spill)) {
+            return PTR_ERR(spill);
+        }
+        dev->spill = spill;
+    }
+    iov_iter_truncate(from, spill_room(dev));
+    written = vfs_iter_write(spill, from, &pos, 0);
+    iov_iter_reexpand(from, count - max_t(ssize_t, written, 0));
+    if (written > 0) {
+        WRITE_ONCE(dev->spillHead, pos);
+        dev->spillBytes += written;
+        dev->spillWrites++;
+    }
+    return written;
+}
+
+/*  Moves up to len spilled bytes into the iterator. Consumed pages are punched out of
+ *  the file in SPILL_PUNCH steps and the file is emptied once drained, so the memory of
+ *  a burst goes away with it. Called under ring_lock after the ring is drained.
+ */
+static size_t spill_read(struct fifo_dev *dev, size_t len, struct iov_iter *to) {
+    size_t count = iov_iter_count(to);
+    loff_t pos = dev->spillTail;
+    loff_t end;
+    ssize_t done;
+
+    len = min(len, spill_fill(dev));
+    if (len == 0) {
+        return 0;
+    }
+    iov_iter_truncate(to, len);
+    done = vfs_iter_read(dev->spill, to, &pos, 0);
+    if (done <= 0) {
+        iov_iter_reexpand(to, count);
+        return 0;                                                       // A fault, the data stays spilled
+    }
+    iov_iter_reexpand(to, count - done);
+    WRITE_ONCE(dev->spillTail, pos);
+    dev->bytesOut += done;
+
+    if (pos == dev->spillHead) {
+        vfs_fallocate(dev->spill, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                      dev->spillPunched, pos - dev->spillPunched);
+        WRITE_ONCE(dev->spillHead, 0);                                  // Head first, see spill_fill()
+        smp_wmb();
+        WRITE_ONCE(dev->spillTail, 0);
+        dev->spillPunched = 0;
+    } else {
+        end = round_down(pos, PAGE_SIZE);
+        if (end - dev->spillPunched >= SPILL_PUNCH) {
+            vfs_fallocate(dev->spill, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                          dev->spillPunched, end - dev->spillPunched);
+            dev->spillPunched = end;
+        }
+    }
+    return done;
+}
+
+static ssize_t stats_show(struct device *device, struct device_attribute *attr, char *buf) {
+    struct fifo_dev *dev = dev_get_drvdata(device);
+    struct fifo_shard **shards = READ_ONCE(dev->shards);
+    u64 bytesIn = dev->bytesIn;
+    u64 writeOps = dev->writeOps;
+    u64 writeWaits = dev->writeWaits;
+    u64 wakeups = atomic64_read(&dev->wakeups);
+    u64 deferred = atomic64_read(&dev->wakeDeferred);
+    u64 timed = atomic64_read(&dev->wakeTimed);                         // Each replaced at least one deferred wakeup
+    unsigned int cpu;
+
+    if (shards != NULL) {
+        for_each_possible_cpu(cpu) {
+            bytesIn += READ_ONCE(shards[cpu]->bytesIn);
+            writeOps += READ_ONCE(shards[cpu]->writeOps);
+            writeWaits += READ_ONCE(shards[cpu]->writeWaits);
+        }
+    }
+    return scnprintf(buf, PAGE_SIZE,
+                     "bytes_in %llu\nbytes_out %llu\nwrite_ops %llu\nread_ops %llu\n"
+                     "read_waits %llu\nwrite_waits %llu\nfill %zu\nfill_max %zu\nshard_fill %zu\n"
+                     "spill_fill %zu\nspill_bytes %llu\nspill_writes %llu\nopens %d\n"
+                     "wakeups %llu\nwakeups_deferred %llu\nwakeups_avoided %llu\nwakeups_timer %llu\n"
+                     "write_gap_ns %llu\n",
+                     bytesIn, dev->bytesOut + dev->shardBytesOut, writeOps, dev->readOps,
+                     dev->readWaits, writeWaits, ring_fill(dev), dev->fillMax,
+                     shards_pending(dev), spill_fill(dev), dev->spillBytes, dev->spillWrites,
+                     atomic_read(&dev->numberOpens), wakeups, deferred,
+                     deferred > timed ? deferred - timed : 0, timed, READ_ONCE(dev->writeGap));
+}
+static DEVICE_ATTR_RO(stats);                                           ///< /sys/class/lkm/cdevN/stats
+
+static ssize_t capacity_show(struct device *device, struct device_attribute *attr, char *buf) {
+    struct fifo_dev *dev = dev_get_drvdata(device);
+
+    return scnprintf(buf, PAGE_SIZE, "%zu\n", READ_ONCE(dev->ring.size));
+}
+
+static ssize_t capacity_store(struct device *device, struct device_attribute *attr,
+                              const char *buf, size_t count) {
+    struct fifo_dev *dev = dev_get_drvdata(device);
+    unsigned long bytes;
+    int error;
+
+    error = kstrtoul(buf, 0, &bytes);
+    if (error) {
+        return error;
+    }
+    error = ring_resize(dev, DIV_ROUND_UP(bytes, PAGE_SIZE));
+    return error ? error : count;
+}
+static DEVICE_ATTR_RW(capacity);                                        ///< /sys/class/lkm/cdevN/capacity, in bytes
+
+static ssize_t spill_max_show(struct device *device, struct device_attribute *attr, char *buf) {
+    struct fifo_dev *dev = dev_get_drvdata(device);
+
+    return scnprintf(buf, PAGE_SIZE, "%lu\n", READ_ONCE(dev->spillMax));
+}
+
+static ssize_t spill_max_store(struct device *device, struct device_attribute *attr,
+                               const char *buf, size_t count) {
+    struct fifo_dev *dev = dev_get_drvdata(device);
+    unsigned long bytes;
+    int error;
+
+    error = kstrtoul(buf, 0, &bytes);
+    if (error) {
+        return error;
+    }
+    WRITE_ONCE(dev->spillMax, bytes);                                   // Lowering it below the spilled data only stops new spills
+    return count;
+}
+static DEVICE_ATTR_RW(spill_max);                                       ///< /sys/class/lkm/cdevN/spill_max, in bytes
+
+static ssize_t wake_bytes_show(struct device *device, struct device_attribute *attr, char *buf) {
+    struct fifo_dev *dev = dev_get_drvdata(device);
+
+    return scnprintf(buf, PAGE_SIZE, "%lu\n", READ_ONCE(dev->wakeBytes));
+}
+
+static ssize_t wake_bytes_store(struct device *device, struct device_attribute *attr,
+                                const char *buf, size_t count) {
+    struct fifo_dev *dev = dev_get_drvdata(device);
+    unsigned long bytes;
+    int error;
+
+    error = kstrtoul(buf, 0, &bytes);
+    if (error) {
+        return error;
+    }
+    WRITE_ONCE(dev->wakeBytes, bytes);                                  // A wakeup already held back still comes from the timer
+    return count;
+}
+static DEVICE_ATTR_RW(wake_bytes);                                      ///< /sys/class/lkm/cdevN/wake_bytes, 0 wakes on every write
+
+static ssize_t wake_delay_us_show(struct device *device, struct device_attribute *attr, char *buf) {
+    struct fifo_dev *dev = dev_get_drvdata(device);
+
+    return scnprintf(buf, PAGE_SIZE, "%llu\n", div_u64(READ_ONCE(dev->wakeDelay), NSEC_PER_USEC));
+}
+
+static ssize_t wake_delay_us_store(struct device *device, struct device_attribute *attr,
+                                   const char *buf, size_t count) {
+    struct fifo_dev *dev = dev_get_drvdata(device);
+    unsigned long usecs;
+    int error;
+
+    error = kstrtoul(buf, 0, &usecs);
+    if (error) {
+        return error;
+    }
+    if (usecs > WAKE_DELAY_MAX) {
+        return -EINVAL;
+    }
+    WRITE_ONCE(dev->wakeDelay, (u64)usecs * NSEC_PER_USEC);
+    return count;
+}
+static DEVICE_ATTR_RW(wake_delay_us);                                   ///< /sys/class/lkm/cdevN/wake_delay_us, 0 wakes on every write
+
+static ssize_t wake_adaptive_show(struct device *device, struct device_attribute *attr, char *buf) {
+    struct fifo_dev *dev = dev_get_drvdata(device);
+
+    return scnprintf(buf, PAGE_SIZE, "%d\n", READ_ONCE(dev->wakeAdaptive));
+}
+
+static ssize_t wake_adaptive_store(struct device *device, struct device_attribute *attr,
+                                   const char *buf, size_t count) {
+    struct fifo_dev *dev = dev_get_drvdata(device);
+    bool adaptive;
+    int error;
+
+    error = kstrtobool(buf, &adaptive);
+    if (error) {
+        return error;
+    }
+    WRITE_ONCE(dev->wakeAdaptive, adaptive);
+    return count;
+}
+static DEVICE_ATTR_RW(wake_adaptive);                                   ///< /sys/class/lkm/cdevN/wake_adaptive, 0 or 1
+
+static const char * const order_names[] = {
+    [CDEV_RING_ORDER_FIFO] = "fifo",
+    [CDEV_RING_ORDER_ROUND_ROBIN] = "round-robin",
+    [CDEV_RING_ORDER_TIMESTAMP] = "timestamp",
+};
+
+static ssize_t order_show(struct device *device, struct device_attribute *attr, char *buf) {
+    struct fifo_dev *dev = dev_get_drvdata(device);
+
+    return scnprintf(buf, PAGE_SIZE, "%s\n", order_names[READ_ONCE(dev->order)]);
+}
+
+static ssize_t order_store(struct device *device, struct device_attribute *attr,
+                           const char *buf, size_t count) {
+    struct fifo_dev *dev = dev_get_drvdata(device);
+    int order = sysfs_match_string(order_names, buf);
+    int error;
+
+    if (order < 0) {
+        return order;
+    }
+    error = fifo_set_order(dev, order);
+    return error ? error : count;
+}
+static DEVICE_ATTR_RW(order);                                           ///< /sys/class/lkm/cdevN/order, fifo, round-robin or timestamp
+
+/*  /sys/kernel/debug/cdev/cdevN/latency: time the bytes written with write() spent in
+ *  the ring before a read() took them, one line per non-empty log2 bucket.
+ */
+static int latency_show(struct seq_file *m, void *v) {
+    struct fifo_dev *dev = m->private;
+    u64 counts[LATENCY_BUCKETS];
+    int i;
+
+    mutex_lock(&dev->ring_lock);
+    memcpy(counts, dev->latency, sizeof(counts));
+    mutex_unlock(&dev->ring_lock);
+
+    seq_puts(m, "ns_from ns_to count\n");
+    for (i = 0; i < LATENCY_BUCKETS; i++) {
+        if (counts[i] != 0) {
+            seq_printf(m, "%llu %llu %llu\n", 1ULL << i, (2ULL << i) - 1, counts[i]);
+        }
+    }
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(latency);
+
+static struct attribute *fifo_attrs[] = {
+    &dev_attr_stats.attr,
+    &dev_attr_capacity.attr,
+    &dev_attr_order.attr,
+    &dev_attr_spill_max.attr,
+    &dev_attr_wake_bytes.attr,
+    &dev_attr_wake_delay_us.attr,
+    &dev_attr_wake_adaptive.attr,
+    NULL,
 };
+ATTRIBUTE_GROUPS(fifo);
+
+static void fifo_dev_free_ring(struct fifo_dev *dev) {
+    if (dev->spill != NULL) {
+        fput(dev->spill);
+    }
+    shards_free(dev->shards);
+    chunks_release(dev->ring.chunks, dev->ring.nchunks);
+    __free_page(dev->ctrl_page);
+}
+
+/*  Allocates the ring of one minor and makes it visible as /dev/cdevN.
+ */
+static int fifo_dev_setup(struct fifo_dev *dev, unsigned int index) {
+    dev_t devt = MKDEV(MAJOR(firstDevice), MINOR(firstDevice) + index);
+    void **chunks;
+    int error;
+
+    dev->ctrl_page = alloc_page(GFP_KERNEL | __GFP_ZERO);
+    if (dev->ctrl_page == NULL) {
+        return -ENOMEM;
+    }
+    chunks = kvcalloc(ring_pages, sizeof(*chunks), GFP_KERNEL);
+    if (chunks == NULL) {
+        __free_page(dev->ctrl_page);
+        return -ENOMEM;
+    }
+    error = chunks_fill(chunks, ring_pages);
+    if (error) {
+        kvfree(chunks);
+        __free_page(dev->ctrl_page);
+        return error;
+    }
+    dev->ring_ctrl = page_address(dev->ctrl_page);
+    fifo_core_init(&dev->ring, chunks, ring_pages, PAGE_SHIFT,
+                   &dev->ring_ctrl->head, &dev->ring_ctrl->tail);
+    dev->ring_ctrl->magic = CDEV_RING_MAGIC;
+    dev->ring_ctrl->version = CDEV_RING_VERSION;
+    dev->ring_ctrl->size = dev->ring.size;
+    dev->ring_ctrl->data_offset = PAGE_SIZE;
+
+    atomic_set(&dev->numberOpens, 0);
+    atomic_set(&dev->mapCount, 0);
+    dev->shardCurrent = -1;
+    dev->spillMax = spill_max;
+    dev->wakeBytes = wake_bytes;
+    dev->wakeDelay = (u64)min_t(unsigned int, wake_delay_us, WAKE_DELAY_MAX) * NSEC_PER_USEC;
+    dev->wakeAdaptive = wake_adaptive;
+    mutex_init(&dev->ring_lock);
+    init_waitqueue_head(&dev->read_queue);
+    init_waitqueue_head(&dev->write_queue);
+    hrtimer_init(&dev->wakeTimer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    dev->wakeTimer.function = ring_wake_timer;
+
+    cdev_init(&dev->cdev, &fops);
+    dev->cdev.owner = THIS_MODULE;
+    error = cdev_add(&dev->cdev, devt, 1);
+    if (error) {
+        fifo_dev_free_ring(dev);
+        return error;
+    }
+
+    dev->device = device_create_with_groups(fifoClass, NULL, devt, dev, fifo_groups,
+                                            DEVICE_NAME "%u", index);
+    if (IS_ERR(dev->device)) {
+        cdev_del(&dev->cdev);
+        fifo_dev_free_ring(dev);
+        return PTR_ERR(dev->device);
+    }
+
+    // debugfs is optional, errors are ignored like everywhere else in the kernel
+    dev->debugDir = debugfs_create_dir(dev_name(dev->device), debugRoot);
+    debugfs_create_file("latency", 0444, dev->debugDir, dev, &latency_fops);
+    return 0;
+}
+
+static void fifo_dev_teardown(struct fifo_dev *dev) {
+    debugfs_remove_recursive(dev->debugDir);
+    device_destroy(fifoClass, dev->cdev.dev);                           // Remove the device
+    cdev_del(&dev->cdev);
+    hrtimer_cancel(&dev->wakeTimer);                                    // No writers are left to arm it again
+    fifo_dev_free_ring(dev);
+}
 
 static int __init fifodev_init(void) {
+    unsigned int i;
+    int error;
+
     printk(KERN_INFO "Fifodev: Initializing the character device for the LKM\n");
 
-    // Allocate a major number for the device
-    majorNumber = register_chrdev(0, DEVICE_NAME, &fops);
-    if (majorNumber < 0) {
+    if (minors == 0 || minors > MAX_MINORS) {
+        printk(KERN_ALERT "Fifodev: minors must be in 1..%d\n", MAX_MINORS);
+        return -EINVAL;
+    }
+    if (ring_pages == 0 || ring_pages > MAX_RING_PAGES) {
+        printk(KERN_ALERT "Fifodev: ring_pages must be in 1..%lu\n", MAX_RING_PAGES);
+        return -EINVAL;
+    }
+    if (shard_pages == 0 || shard_pages > MAX_RING_PAGES) {
+        printk(KERN_ALERT "Fifodev: shard_pages must be in 1..%lu\n", MAX_RING_PAGES);
+        return -EINVAL;
+    }
+
+    fifoDevs = kcalloc(minors, sizeof(*fifoDevs), GFP_KERNEL);
+    if (fifoDevs == NULL) {
+        return -ENOMEM;
+    }
+
+    // Allocate a range of device numbers, the major is determined automatically
+    error = alloc_chrdev_region(&firstDevice, 0, minors, DEVICE_NAME);
+    if (error < 0) {
+        kfree(fifoDevs);
         printk(KERN_ALERT "Fifodev failed to register a major number\n");
-        return majorNumber;
+        return error;
     }
-    printk(KERN_INFO "Fifodev: registered correctly with major number %d\n", majorNumber);
+    printk(KERN_INFO "Fifodev: registered correctly with major number %d\n", MAJOR(firstDevice));
 
     // Register the device class
     fifoClass = class_create(THIS_MODULE, CLASS_NAME);
     if (IS_ERR(fifoClass)) {                                         // Check for error and clean up
-        unregister_chrdev(majorNumber, DEVICE_NAME);                    // Unregister the major number
+        unregister_chrdev_region(firstDevice, minors);                  // Unregister the device numbers
+        kfree(fifoDevs);
         printk(KERN_ALERT "Failed to register device class\n");
         return PTR_ERR(fifoClass);                                   // Retrieves the error number from the pointer
     }
     printk(KERN_INFO "Fifodev: device class registered correctly\n");
 
-    // Register the device driver
-    fifoDevice = device_create(fifoClass, NULL, MKDEV(majorNumber, 0), NULL, DEVICE_NAME);
-    if (IS_ERR(fifoDevice)) {                                        // Clean up
-        class_destroy(fifoClass);                                    // Remove the device class
-        unregister_chrdev(majorNumber, DEVICE_NAME);                    // Unregister the major number
-        printk(KERN_ALERT "Failed to create the device\n");
-        return PTR_ERR(fifoDevice);                                  // Retrieves the error number from the pointer
+    debugRoot = debugfs_create_dir(DEVICE_NAME, NULL);
+
+    // Register the devices
+    for (i = 0; i < minors; i++) {
+        error = fifo_dev_setup(&fifoDevs[i], i);
+        if (error) {
+            printk(KERN_ALERT "Failed to create the device %u\n", i);
+            while (i--) {
+                fifo_dev_teardown(&fifoDevs[i]);
+            }
+            debugfs_remove_recursive(debugRoot);
+            class_destroy(fifoClass);                                // Remove the device class
+            unregister_chrdev_region(firstDevice, minors);
+            kfree(fifoDevs);
+            chunk_pool_drain();
+            return error;
+        }
     }
-    printk(KERN_INFO "Fifodev: device class created correctly\n");
+    printk(KERN_INFO "Fifodev: %u devices created correctly\n", minors);
 
-    msg_ptr = kmalloc(MESSAGE_SIZE, GFP_KERNEL);
     return 0;
 }
 
 static void __exit fifodev_exit(void) {
-    if (msg_ptr != NULL) {
-        kfree(msg_ptr);
-    }
+    unsigned int i;
 
-    device_destroy(fifoClass, MKDEV(majorNumber, 0));                // Remove the device
+    for (i = 0; i < minors; i++) {
+        fifo_dev_teardown(&fifoDevs[i]);
+    }
+    debugfs_remove_recursive(debugRoot);
     class_unregister(fifoClass);                                     // Unregister the device class
     class_destroy(fifoClass);                                        // Remove the device class
-    unregister_chrdev(majorNumber, DEVICE_NAME);                        // Unregister the major number
+    unregister_chrdev_region(firstDevice, minors);                      // Unregister the device numbers
+    kfree(fifoDevs);
+    chunk_pool_drain();
 
     printk(KERN_INFO "Fifodev: Goodbye from the fifodev lkm!\n");
 }
 
+/*  O_WRONLY files are producers right away. O_RDWR files (which mmap users need) only
+ *  become producers on their first write() or CDEV_RING_IOC_PRODUCER, so an mmap
+ *  consumer does not keep the stream from reaching EOF.
+ */
 static int dev_open(struct inode *inodep, struct file *filep) {
-    numberOpens++;
-    printk(KERN_INFO "Fifodev: %d users using device(s) right now\n", numberOpens);
+    struct fifo_file *file;
+
+    file = kzalloc(sizeof(*file), GFP_KERNEL);
+    if (file == NULL) {
+        return -ENOMEM;
+    }
+    file->dev = container_of(inodep->i_cdev, struct fifo_dev, cdev);
+    filep->private_data = file;
+    filep->f_mode |= FMODE_NOWAIT;                                      // IOCB_NOWAIT is honoured, io_uring may try inline first
+    if ((filep->f_mode & FMODE_WRITE) && !(filep->f_mode & FMODE_READ)) {
+        mark_producer(file);
+    }
+
+    atomic_inc(&file->dev->numberOpens);
     return 0;
 }
 
+/*  When the last producer goes away the readers are woken up, so they can drain
+ *  what is left in the ring and then get EOF like on a pipe.
+ */
 static int dev_release(struct inode *inodep, struct file *filep) {
-    numberOpens--;
-    printk(KERN_INFO "Fifodev: Device successfully closed\n");
+    struct fifo_file *file = filep->private_data;
+    struct fifo_dev *dev = file->dev;
+
+    if (file->producer) {
+        mutex_lock(&dev->ring_lock);
+        if (--dev->numberWriters == 0) {
+            WRITE_ONCE(dev->ring_ctrl->eof, 1);
+        }
+        mutex_unlock(&dev->ring_lock);
+        ring_notify_readers(dev, EPOLLIN | EPOLLRDNORM | EPOLLHUP);
+    }
+
+    atomic_dec(&dev->numberOpens);
+    kfree(file);
     return 0;
 }
 
-static ssize_t dev_read(struct file *filep, char *buffer, size_t len, loff_t *offset) {
-    // copy_to_user has the format ( * to, *from, size) and returns 0 on success
-    if (len + *offset > MESSAGE_SIZE) {
-        len = MESSAGE_SIZE - *offset;
+/*  The iocb may ask not to sleep even on a blocking file (RWF_NOWAIT, io_uring).
+ */
+static inline bool dev_nowait(struct kiocb *iocb) {
+    return (iocb->ki_filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+}
+
+// fifo_copy_t for fifo_core, copy_*_iter returns a short count on a fault or a full pipe
+static size_t ring_copy_to_iter(void *chunk, size_t len, void *ctx) {
+    return copy_to_iter(chunk, len, ctx);
+}
+
+static size_t ring_copy_from_iter(void *chunk, size_t len, void *ctx) {
+    return copy_from_iter(chunk, len, ctx);
+}
+
+// fifo_copy_t for record headers, ctx is a cursor into a kernel buffer
+static size_t ring_copy_out(void *chunk, size_t len, void *ctx) {
+    char **cursor = ctx;
+
+    memcpy(*cursor, chunk, len);
+    *cursor += len;
+    return len;
+}
+
+static size_t ring_copy_in(void *chunk, size_t len, void *ctx) {
+    char **cursor = ctx;
+
+    memcpy(chunk, *cursor, len);
+    *cursor += len;
+    return len;
+}
+
+/*  Reads the header of the next record of a CPU ring unless it already has been.
+ *  Header and body are published together, so a non-empty ring holds a whole record.
+ */
+static bool shard_record_load(struct fifo_shard *shard) {
+    struct fifo_record record;
+    char *cursor = (char *)&record;
+
+    if (shard->loaded) {
+        return true;
+    }
+    if (fifo_core_fill(&shard->ring) <= sizeof(record)) {
+        return false;
+    }
+    fifo_core_read(&shard->ring, sizeof(record), ring_copy_out, &cursor);
+    shard->recordLeft = record.len;
+    shard->recordStamp = record.stamp;
+    shard->loaded = record.len > 0;
+    return shard->loaded;
+}
+
+/*  CPU ring to read from next, or -1 when all are empty. A record that was read in
+ *  part is finished first, so records never interleave. Called under ring_lock.
+ */
+static int shard_pick(struct fifo_dev *dev) {
+    struct fifo_shard **shards = dev->shards;
+    unsigned int order = READ_ONCE(dev->order);
+    unsigned int i;
+    unsigned int cpu;
+    int best = -1;
+
+    if (dev->shardCurrent >= 0) {
+        return dev->shardCurrent;
+    }
+    if (order == CDEV_RING_ORDER_TIMESTAMP) {
+        for_each_possible_cpu(cpu) {
+            if (shard_record_load(shards[cpu]) &&
+                (best < 0 || shards[cpu]->recordStamp < shards[best]->recordStamp)) {
+                best = cpu;
+            }
+        }
+        return best;
+    }
+    for (i = 0; i < nr_cpu_ids; i++) {                                  // Round robin, also drains the rings after a switch back to FIFO
+        cpu = (dev->shardNext + i) % nr_cpu_ids;
+        if (cpu_possible(cpu) && shard_record_load(shards[cpu])) {
+            dev->shardNext = cpu + 1;
+            return cpu;
+        }
+    }
+    return -1;
+}
+
+/*  Moves up to len bytes of records from the CPU rings into the iterator and returns
+ *  how many. Called under ring_lock once the shared ring is drained.
+ */
+static size_t shards_read(struct fifo_dev *dev, size_t len, struct iov_iter *to) {
+    struct fifo_shard *shard;
+    size_t copied = 0;
+    size_t want;
+    size_t done;
+    int cpu;
+
+    if (dev->shards == NULL) {
+        return 0;
+    }
+    while (copied < len) {
+        cpu = shard_pick(dev);
+        if (cpu < 0) {
+            break;
+        }
+        shard = dev->shards[cpu];
+        want = min_t(size_t, len - copied, shard->recordLeft);
+        done = fifo_core_read(&shard->ring, want, ring_copy_to_iter, to);
+        shard->recordLeft -= done;
+        copied += done;
+        if (shard->recordLeft > 0) {
+            dev->shardCurrent = cpu;                                    // The caller's buffer is full, or it faulted
+            break;
+        }
+        shard->loaded = false;
+        dev->shardCurrent = -1;
+    }
+    dev->shardBytesOut += copied;
+    return copied;
+}
+
+/*  write() of the sharded orders: one record in the ring of the CPU the caller runs on.
+ *  The body is staged first and published together with its header, so a reader never
+ *  sees a partial record. Only writers that share the CPU contend for the lock.
+ */
+static ssize_t shard_write(struct fifo_dev *dev, struct kiocb *iocb, struct iov_iter *from) {
+    struct fifo_shard *shard = dev->shards[raw_smp_processor_id()];    // Migrating afterwards is fine, the lock is per ring
+    struct fifo_record record;
+    size_t len = iov_iter_count(from);
+    size_t copied;
+    size_t fill;
+    char *cursor;
+
+    if (mutex_lock_interruptible(&shard->lock)) {
+        return -ERESTARTSYS;
+    }
+    while (!shard_writable(shard)) {
+        mutex_unlock(&shard->lock);
+        if (dev_nowait(iocb)) {
+            return -EAGAIN;
+        }
+        WRITE_ONCE(dev->ring_ctrl->write_wait, 1);
+        smp_mb();                                                       // Publish the flag before the last check of tail
+        trace_cdev_block(MINOR(dev->cdev.dev), true);
+        if (wait_event_interruptible(dev->write_queue, shard_writable(shard))) {
+            return -ERESTARTSYS;
+        }
+        if (mutex_lock_interruptible(&shard->lock)) {
+            return -ERESTARTSYS;
+        }
+        shard->writeWaits++;
+    }
+
+    len = min_t(size_t, len, U32_MAX);
+    copied = fifo_core_stage(&shard->ring, sizeof(record), len, ring_copy_from_iter, from);
+    if (copied > 0) {
+        record.stamp = ktime_get_ns();
+        record.len = copied;
+        cursor = (char *)&record;
+        fifo_core_stage(&shard->ring, 0, sizeof(record), ring_copy_in, &cursor);
+        fifo_core_commit(&shard->ring, sizeof(record) + copied);
+        shard->bytesIn += copied;
+        shard->writeOps++;
+    }
+    fill = fifo_core_fill(&shard->ring);
+    trace_cdev_enqueue(MINOR(dev->cdev.dev), copied, fill);
+    mutex_unlock(&shard->lock);
+
+    if (copied == 0) {
+        return -EFAULT;
+    }
+
+    ring_wake_readers(dev, copied, !shard_writable(shard));
+    return copied;
+}
+
+/*  Whether a write() would not block: room in the shared ring or the spill file, or in
+ *  the ring of the CPU the caller runs on now for the sharded orders.
+ */
+static bool dev_writable(struct fifo_dev *dev) {
+    if (smp_load_acquire(&dev->order) == CDEV_RING_ORDER_FIFO) {
+        return fifo_writable(dev);
+    }
+    return shard_writable(dev->shards[raw_smp_processor_id()]);
+}
+
+/*  Moves up to iov_iter_count(to) bytes from the ring into the iterator, which may be
+ *  a user buffer, a user iovec array or the pages of a pipe (splice). Sleeps on
+ *  read_queue while the ring is empty and there still is a writer (or fails with
+ *  -EAGAIN when not allowed to sleep), returns 0 (EOF) once all writers are gone and
+ *  the ring is drained. The copy is done chunk by chunk.
+ */
+static ssize_t dev_read_iter(struct kiocb *iocb, struct iov_iter *to) {
+    struct fifo_file *file = iocb->ki_filp->private_data;
+    struct fifo_dev *dev = file->dev;
+    size_t len = iov_iter_count(to);
+    size_t copied;
+    size_t fill;
+
+    if (len == 0) {
+        return 0;
+    }
+
+    if (mutex_lock_interruptible(&dev->ring_lock)) {
+        return -ERESTARTSYS;
+    }
+    while (!dev_has_data(dev)) {
+        if (READ_ONCE(dev->ring_ctrl->eof)) {
+            mutex_unlock(&dev->ring_lock);
+            return 0;
+        }
+        mutex_unlock(&dev->ring_lock);
+        if (dev_nowait(iocb)) {
+            return -EAGAIN;
+        }
+        WRITE_ONCE(dev->ring_ctrl->read_wait, 1);
+        smp_mb();                                                       // Publish the flag before the last check of head
+        trace_cdev_block(MINOR(dev->cdev.dev), false);
+        if (wait_event_interruptible(dev->read_queue, ring_readable(dev))) {
+            return -ERESTARTSYS;                                        // Interrupted by a signal
+        }
+        if (mutex_lock_interruptible(&dev->ring_lock)) {
+            return -ERESTARTSYS;
+        }
+        dev->readWaits++;
+    }
+
+    fill = ring_fill(dev);
+    copied = fifo_core_read(&dev->ring, len, ring_copy_to_iter, to);
+    dev->bytesOut += copied;
+    dev->readOps++;
+    latency_dequeue(dev, ktime_get_ns());
+    trace_cdev_dequeue(MINOR(dev->cdev.dev), copied, fill - copied);
+    if (copied == fill && copied < len) {
+        copied += spill_read(dev, len - copied, to);                    // Overflow of the FIFO order is newer than the ring
+        copied += shards_read(dev, len - copied, to);                   // Records of the sharded orders
+    }
+    mutex_unlock(&dev->ring_lock);
+
+    if (copied == 0) {
+        return -EFAULT;                                                 // Failed -- return a bad address message (i.e. -14)
+    }
+
+    ring_notify_writers(dev);
+    return copied;
+}
+
+/*  Moves up to iov_iter_count(from) bytes from the iterator to the ring. When the ring
+ *  is full the data goes to the spill file up to spillMax; only when that is full too
+ *  the writer sleeps on write_queue (or fails with -EAGAIN when not allowed to sleep).
+ *  Returns a short count when only part of the data fits, so the caller keeps writing
+ *  the rest just like with a pipe. The sharded orders go to shard_write().
+ */
+static ssize_t dev_write_iter(struct kiocb *iocb, struct iov_iter *from) {
+    struct fifo_file *file = iocb->ki_filp->private_data;
+    struct fifo_dev *dev = file->dev;
+    size_t len = iov_iter_count(from);
+    ssize_t copied;
+    size_t fill;
+    bool spilled;
+
+    if (len == 0) {
+        return 0;
+    }
+    if (!file->producer) {
+        mark_producer(file);
+    }
+    if (smp_load_acquire(&dev->order) != CDEV_RING_ORDER_FIFO) {       // Pairs with fifo_set_order(), shards are set up
+        return shard_write(dev, iocb, from);
     }
-    int notReadBytes = copy_to_user(buffer + *offset, msg_ptr, len);
 
-    *offset += len - notReadBytes;
-    if (notReadBytes == 0) {            // Success
-        printk(KERN_INFO "Fifodev: Sent %d characters to the user\n", len);
-        return len - notReadBytes;  // clear the position to the start and return 0
+    if (mutex_lock_interruptible(&dev->ring_lock)) {
+        return -ERESTARTSYS;
+    }
+    while (!fifo_writable(dev)) {
+        mutex_unlock(&dev->ring_lock);
+        if (dev_nowait(iocb)) {
+            return -EAGAIN;
+        }
+        WRITE_ONCE(dev->ring_ctrl->write_wait, 1);
+        smp_mb();                                                       // Publish the flag before the last check of tail
+        trace_cdev_block(MINOR(dev->cdev.dev), true);
+        if (wait_event_interruptible(dev->write_queue, fifo_writable(dev))) {
+            return -ERESTARTSYS;                                        // Interrupted by a signal
+        }
+        if (mutex_lock_interruptible(&dev->ring_lock)) {
+            return -ERESTARTSYS;
+        }
+        dev->writeWaits++;
+    }
+
+    spilled = spill_fill(dev) > 0 || ring_space(dev) == 0;
+    if (spilled) {
+        copied = spill_write(dev, from);
     } else {
-        printk(KERN_INFO "Fifodev: Failed to send %d characters to the user\n", notReadBytes);
-        return -EFAULT;              // Failed -- return a bad address message (i.e. -14)
+        copied = fifo_core_write(&dev->ring, len, ring_copy_from_iter, from);
+    }
+    if (copied < 0) {
+        mutex_unlock(&dev->ring_lock);
+        return copied;                                                  // No shmem, or a fault in the spill file
+    }
+    dev->bytesIn += copied;
+    dev->writeOps++;
+    fill = ring_fill(dev);
+    if (fill > dev->fillMax) {
+        dev->fillMax = fill;
+    }
+    if (copied > 0 && !spilled) {
+        latency_enqueue(dev, ktime_get_ns());                           // Spilled data is not timed
     }
+    trace_cdev_enqueue(MINOR(dev->cdev.dev), copied, fill + spill_fill(dev));
+    mutex_unlock(&dev->ring_lock);
+
+    if (copied == 0) {
+        return -EFAULT;
+    }
+
+    ring_wake_readers(dev, copied, !fifo_writable(dev));
+    return copied;
 }
 
-static ssize_t dev_write(struct file *filep, const char *buffer, size_t len, loff_t *offset) {
-    if (len + *offset > MESSAGE_SIZE) {
-        len = MESSAGE_SIZE - *offset;
+/*  Reports readiness from the ring fill level, so the device can be multiplexed with
+ *  sockets in one select/poll/epoll loop. EPOLLHUP tells a reader that the writers are
+ *  gone; it stays set together with EPOLLIN until the ring is drained. A caller that
+ *  is about to sleep raises the wait flag, so an mmap peer knows it has to notify.
+ */
+static __poll_t dev_poll(struct file *filep, poll_table *wait) {
+    struct fifo_file *file = filep->private_data;
+    struct fifo_dev *dev = file->dev;
+    __poll_t mask = 0;
+    bool reader = filep->f_mode & FMODE_READ;
+    bool writer = filep->f_mode & FMODE_WRITE;
+
+    poll_wait(filep, &dev->read_queue, wait);
+    poll_wait(filep, &dev->write_queue, wait);
+
+    if (reader && !dev_has_data(dev)) {
+        WRITE_ONCE(dev->ring_ctrl->read_wait, 1);
+        smp_mb();
+    }
+    if (writer && !dev_writable(dev)) {
+        WRITE_ONCE(dev->ring_ctrl->write_wait, 1);
+        smp_mb();
     }
-    int notWrittenBytes = len - copy_from_user(msg_ptr + *offset, buffer, len);
-    *offset += notWrittenBytes;
-    msg_ptr[*offset] = '\0';
 
-    printk(KERN_INFO "Fifodev: Received %zu characters from the user\n", len);
-    return notWrittenBytes;
+    if (dev_has_data(dev)) {
+        mask |= EPOLLIN | EPOLLRDNORM;
+    }
+    if (reader && READ_ONCE(dev->ring_ctrl->eof)) {
+        mask |= EPOLLHUP;
+    }
+    if (dev_writable(dev)) {
+        mask |= EPOLLOUT | EPOLLWRNORM;
+    }
+    return mask;
+}
+
+/*  CDEV_RING_IOC_NOTIFY is the only syscall an mmap user needs on the data path:
+ *  it is made after publishing or consuming when the peer raised its wait flag.
+ */
+static long dev_ioctl(struct file *filep, unsigned int cmd, unsigned long arg) {
+    struct fifo_file *file = filep->private_data;
+    __u32 bytes;
+    __u32 order;
+
+    switch (cmd) {
+        case CDEV_RING_IOC_NOTIFY:
+            ring_notify_readers(file->dev, EPOLLIN | EPOLLRDNORM);
+            ring_notify_writers(file->dev);
+            return 0;
+        case CDEV_RING_IOC_PRODUCER:
+            if (!(filep->f_mode & FMODE_WRITE)) {
+                return -EBADF;
+            }
+            mark_producer(file);
+            return 0;
+        case CDEV_RING_IOC_RESIZE:
+            if (get_user(bytes, (__u32 __user *)arg)) {
+                return -EFAULT;
+            }
+            return ring_resize(file->dev, DIV_ROUND_UP(bytes, PAGE_SIZE));
+        case CDEV_RING_IOC_SET_ORDER:
+            if (get_user(order, (__u32 __user *)arg)) {
+                return -EFAULT;
+            }
+            return fifo_set_order(file->dev, order);
+        case CDEV_RING_IOC_GET_ORDER:
+            return put_user(READ_ONCE(file->dev->order), (__u32 __user *)arg);
+        default:
+            return -ENOTTY;
+    }
+}
+
+/*  Mappings are counted, so ring_resize() knows when user space holds the layout.
+ */
+static void fifo_vm_open(struct vm_area_struct *vma) {
+    struct fifo_dev *dev = vma->vm_private_data;
+
+    atomic_inc(&dev->mapCount);
+}
+
+static void fifo_vm_close(struct vm_area_struct *vma) {
+    struct fifo_dev *dev = vma->vm_private_data;
+
+    atomic_dec(&dev->mapCount);
+}
+
+static const struct vm_operations_struct fifo_vm_ops = {
+    .open = fifo_vm_open,
+    .close = fifo_vm_close,
+};
+
+/*  Maps the control page and the data chunks (see cdev_ring.h) page by page, so the
+ *  ring looks contiguous to user space although it is not in the kernel.
+ */
+static int dev_mmap(struct file *filep, struct vm_area_struct *vma) {
+    struct fifo_file *file = filep->private_data;
+    struct fifo_dev *dev = file->dev;
+    unsigned long addr = vma->vm_start;
+    unsigned long pgoff = vma->vm_pgoff;
+    unsigned long i;
+    int error = 0;
+
+    if (!(vma->vm_flags & VM_SHARED)) {
+        return -EINVAL;                                                 // A private copy of the ring makes no sense
+    }
+
+    mutex_lock(&dev->ring_lock);
+    if (dev->order != CDEV_RING_ORDER_FIFO || spill_fill(dev) > 0) {
+        error = -EBUSY;                                                 // The CPU rings and the spill file are not mapped
+        goto out;
+    }
+    if (pgoff + vma_pages(vma) > 1 + dev->ring.nchunks) {
+        error = -EINVAL;
+        goto out;
+    }
+    for (i = 0; i < vma_pages(vma); i++, addr += PAGE_SIZE) {
+        struct page *page = pgoff + i == 0 ? dev->ctrl_page : virt_to_page(dev->ring.chunks[pgoff + i - 1]);
+
+        error = vm_insert_page(vma, addr, page);
+        if (error) {
+            goto out;                                                   // mmap_region() unmaps what was inserted
+        }
+    }
+    vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+    vma->vm_private_data = dev;
+    vma->vm_ops = &fifo_vm_ops;
+    fifo_vm_open(vma);
+out:
+    mutex_unlock(&dev->ring_lock);
+    return error;
 }
 
 module_init(fifodev_init);
@@ -0,0 +1,66 @@
+// Copyright [2020] <Puchkov Kyryll>
+/*  Layout of the shared ring exported by each /dev/cdevN through mmap. Shared by the
+ *  driver and by user space, so only fixed-size types are used here.
+ *
+ *  mmap offset 0 is the control page, the data pages follow at data_offset.
+ *  Positions are byte offsets in [0, size); head == tail means empty and one byte
+ *  is always kept free, so (head + 1) % size == tail means full.
+ *
+ *  There is one producer side and one consumer side. Each side is either a
+ *  read()/write() caller (serialized by the driver) or a single mmap user, never both.
+ *  The producer fills the data and then publishes head with a release store, the
+ *  consumer reads head with an acquire load, consumes and releases tail the same way.
+ */
+#ifndef FIFO_DEVICE_CDEV_RING_H_
+#define FIFO_DEVICE_CDEV_RING_H_
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define CDEV_RING_MAGIC         0x43445247                              ///< "CDRG"
+#define CDEV_RING_VERSION       1
+#define CDEV_RING_CACHELINE     64
+
+struct cdev_ring_ctrl {
+    __u32 magic;                                                        ///< CDEV_RING_MAGIC
+    __u32 version;                                                      ///< CDEV_RING_VERSION
+    __u32 size;                                                         ///< Size of the data area in bytes
+    __u32 data_offset;                                                  ///< mmap offset of the data area
+
+    __u32 head __attribute__((aligned(CDEV_RING_CACHELINE)));           ///< Written by the producer only
+    __u32 tail __attribute__((aligned(CDEV_RING_CACHELINE)));           ///< Written by the consumer only
+
+    __u32 read_wait __attribute__((aligned(CDEV_RING_CACHELINE)));      ///< Consumer sleeps, producer has to notify
+    __u32 write_wait;                                                   ///< Producer sleeps, consumer has to notify
+    __u32 eof;                                                          ///< All producers are gone
+};
+
+/*  Roles of an open file. O_WRONLY files are producers from the start, other files
+ *  become producers on their first write() or by CDEV_RING_IOC_PRODUCER. The consumer
+ *  sees EOF once the last producer closes the device and the ring is drained.
+ */
+#define CDEV_RING_IOC_MAGIC     'f'
+#define CDEV_RING_IOC_NOTIFY    _IO(CDEV_RING_IOC_MAGIC, 1)             ///< Wake peers sleeping on the ring
+#define CDEV_RING_IOC_PRODUCER  _IO(CDEV_RING_IOC_MAGIC, 2)             ///< Count this file as a producer
+#define CDEV_RING_IOC_RESIZE    _IOW(CDEV_RING_IOC_MAGIC, 3, __u32)     ///< New size in bytes, fails with EBUSY while mapped
+
+/*  Ordering of the data written with write(). FIFO is the single shared ring above.
+ *  The other two give every CPU its own ring, so writers on different cores never
+ *  touch the same lock or cache line, and every write() becomes one record that a
+ *  reader returns contiguously:
+ *      ROUND_ROBIN - readers take one record per CPU ring in turn. Order is kept per
+ *                    CPU only, a writer that migrates may see its writes reordered.
+ *      TIMESTAMP   - readers take the record with the oldest commit time first, which
+ *                    keeps the order of every writer and is close to the global order.
+ *  The sharded orders need read() consumers, the ring cannot be mapped while they are
+ *  on (EBUSY). Readers take the shared ring before the CPU rings, so around a switch
+ *  data may come out of order.
+ */
+#define CDEV_RING_ORDER_FIFO        0
+#define CDEV_RING_ORDER_ROUND_ROBIN 1
+#define CDEV_RING_ORDER_TIMESTAMP   2
+
+#define CDEV_RING_IOC_SET_ORDER _IOW(CDEV_RING_IOC_MAGIC, 4, __u32)     ///< One of CDEV_RING_ORDER_*
+#define CDEV_RING_IOC_GET_ORDER _IOR(CDEV_RING_IOC_MAGIC, 5, __u32)
+
+#endif  // FIFO_DEVICE_CDEV_RING_H_
@@ -0,0 +1,76 @@
+// Copyright [2020] <Puchkov Kyryll>
+/*  Tracepoints of the cdev fifo driver, see /sys/kernel/tracing/events/cdev/.
+ *  They cost a predicted-not-taken branch while disabled, unlike a printk per call.
+ *
+ *      echo 1 > /sys/kernel/tracing/events/cdev/enable
+ *      cat /sys/kernel/tracing/trace_pipe
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM cdev
+
+#if !defined(FIFO_DEVICE_CDEV_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define FIFO_DEVICE_CDEV_TRACE_H_
+
+#include <linux/tracepoint.h>
+
+DECLARE_EVENT_CLASS(cdev_xfer,
+    TP_PROTO(unsigned int minor, size_t bytes, size_t fill),
+    TP_ARGS(minor, bytes, fill),
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(size_t, bytes)
+        __field(size_t, fill)
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->bytes = bytes;
+        __entry->fill = fill;
+    ),
+    TP_printk("minor=%u bytes=%zu fill=%zu", __entry->minor, __entry->bytes, __entry->fill)
+);
+
+// Bytes were written into the ring, fill is the level after the write
+DEFINE_EVENT(cdev_xfer, cdev_enqueue,
+    TP_PROTO(unsigned int minor, size_t bytes, size_t fill),
+    TP_ARGS(minor, bytes, fill)
+);
+
+// Bytes were read from the ring, fill is the level after the read
+DEFINE_EVENT(cdev_xfer, cdev_dequeue,
+    TP_PROTO(unsigned int minor, size_t bytes, size_t fill),
+    TP_ARGS(minor, bytes, fill)
+);
+
+DECLARE_EVENT_CLASS(cdev_wait,
+    TP_PROTO(unsigned int minor, bool writer),
+    TP_ARGS(minor, writer),
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(bool, writer)
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->writer = writer;
+    ),
+    TP_printk("minor=%u side=%s", __entry->minor, __entry->writer ? "writer" : "reader")
+);
+
+// A reader found the ring empty or a writer found it full and goes to sleep
+DEFINE_EVENT(cdev_wait, cdev_block,
+    TP_PROTO(unsigned int minor, bool writer),
+    TP_ARGS(minor, writer)
+);
+
+// Sleepers of the given side are woken up
+DEFINE_EVENT(cdev_wait, cdev_wake,
+    TP_PROTO(unsigned int minor, bool writer),
+    TP_ARGS(minor, writer)
+);
+
+#endif  // FIFO_DEVICE_CDEV_TRACE_H_
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE cdev_trace
+#include <trace/define_trace.h>
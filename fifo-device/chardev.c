@@ -5,32 +5,51 @@
 #include <linux/kernel.h>                                               // Contains types, macros, functions for the kernel
 #include <linux/fs.h>                                                   // Header for the Linux file system support
 #include <linux/uaccess.h>                                              // Required for the copy to user function
+#include <linux/slab.h>                                                 // kvmalloc/kvfree
+#include <linux/mm.h>
+#include <linux/mutex.h>                                                // Queue lock
+#include <linux/wait.h>                                                 // Wait queues for blocking readers and writers
+#include <linux/poll.h>                                                 // poll/epoll readiness masks
 
-#define  DEVICE_NAME "chardev"                                          ///< The device will appear at /dev/devchar using this value
-#define  CLASS_NAME  "lkm"                                              ///< The device class -- this is a character device driver
+#include "chardev_msg.h"                                                // Batch ioctls shared with user space
+
+#define  DEVICE_NAME "chardev"                                          ///< The device will appear at /dev/chardev using this value
+#define  CLASS_NAME  "lkmchar"                                          ///< The device class, apart from "lkm" so chardev loads next to cdev
+#define  QUEUE_SIZE  (size_t)(64 * 1024)                                ///< Bytes of queued records, headers included
+#define  RECORD_HEADER sizeof(u32)                                      ///< Every record starts with its length
 
 MODULE_LICENSE("GPL");                                                  ///< The license type -- this affects available functionality
 MODULE_AUTHOR("Puchkov Kyryll");                                        ///< The author -- visible when you use modinfo
 MODULE_DESCRIPTION("A simple char driver for the kernel module");       ///< The description -- see modinfo
-MODULE_VERSION("0.1");                                                  ///< A version number to inform users
+MODULE_VERSION("0.2");                                                  ///< A version number to inform users
 
 static int    majorNumber;                                              ///< Stores the device number -- determined automatically
-static char   message[256] = {0};                                       ///< Memory for the string that is passed from userspace
-static int    size_of_message;                                          ///< Used to remember the size of the string stored
+static char*  queue = NULL;                                             ///< Ring of length-prefixed records passed from userspace
+static size_t queueHead = 0;                                            ///< Where the next record is written
+static size_t queueTail = 0;                                            ///< Where the oldest record starts
+static size_t queueFill = 0;                                            ///< Bytes in the ring, headers included
+static unsigned int queueMessages = 0;                                  ///< Records in the ring
 static int    numberOpens = 0;                                          ///< Counts the number of times the device is opened
-static struct class*  ebbcharClass  = NULL;                             ///< The device-driver class struct pointer
-static struct device* ebbcharDevice = NULL;                             ///< The device-driver device struct pointer
+static struct class*  chardevClass  = NULL;                             ///< The device-driver class struct pointer
+static struct device* chardevDevice = NULL;                             ///< The device-driver device struct pointer
+
+static DEFINE_MUTEX(queue_lock);                                        ///< Protects the queue and numberOpens
+static DECLARE_WAIT_QUEUE_HEAD(read_queue);                             ///< Readers sleep here while there is no message
+static DECLARE_WAIT_QUEUE_HEAD(write_queue);                            ///< Writers sleep here while the message does not fit
 
 // The prototype functions for the character driver
 static int     dev_open(struct inode *, struct file *);
 static int     dev_release(struct inode *, struct file *);
 static ssize_t dev_read(struct file *, char *, size_t, loff_t *);
 static ssize_t dev_write(struct file *, const char *, size_t, loff_t *);
+static __poll_t dev_poll(struct file *, poll_table *);
+static long    dev_ioctl(struct file *, unsigned int, unsigned long);
 
 /*  Devices are represented as file structure in the kernel.
  *  The file_operations structure from /linux/fs.h lists the callback functions
  *  that you wish to associated with your file operations using a C99 syntax structure.
- *  Char devices implement open, read, write and release calls
+ *  Char devices implement open, read, write and release calls, poll and the batch
+ *  ioctls come on top of them
  */
 static struct file_operations fops = {
     .owner = THIS_MODULE,
@@ -38,21 +57,31 @@ static struct file_operations fops = {
     .read = dev_read,
     .write = dev_write,
     .release = dev_release,
+    .poll = dev_poll,
+    .unlocked_ioctl = dev_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,                                   // Only __u64 pointers in the ioctl structs
 };
 
 /*  The LKM initialization function
  *  The static keyword restricts the visibility of the function to within this C file.
  *  The __init macro means that for a built-in driver (not a LKM) the function is only
- *  used at initialization time and that it can be discarded and its memory freed up 
+ *  used at initialization time and that it can be discarded and its memory freed up
  *  after that point.
  *  Returns 0 if successful
  */
 static int __init chardev_init(void) {
     printk(KERN_INFO "Chardev: Initializing the character device for the LKM\n");
 
+    queue = kvmalloc(QUEUE_SIZE, GFP_KERNEL);
+    if (queue == NULL) {
+        printk(KERN_ALERT "Chardev failed to allocate the queue\n");
+        return -ENOMEM;
+    }
+
     // Allocate a major number for the device
     majorNumber = register_chrdev(0, DEVICE_NAME, &fops);
     if (majorNumber < 0) {
+        kvfree(queue);
         printk(KERN_ALERT "Chardev failed to register a major number\n");
         return majorNumber;
     }
@@ -62,6 +91,7 @@ static int __init chardev_init(void) {
     chardevClass = class_create(THIS_MODULE, CLASS_NAME);
     if (IS_ERR(chardevClass)) {                                         // Check for error and clean up
         unregister_chrdev(majorNumber, DEVICE_NAME);                    // Unregister the major number
+        kvfree(queue);
         printk(KERN_ALERT "Failed to register device class\n");
         return PTR_ERR(chardevClass);                                   // Retrieves the error number from the pointer
     }
@@ -72,6 +102,7 @@ static int __init chardev_init(void) {
     if (IS_ERR(chardevDevice)) {                                        // Clean up
         class_destroy(chardevClass);                                    // Remove the device class
         unregister_chrdev(majorNumber, DEVICE_NAME);                    // Unregister the major number
+        kvfree(queue);
         printk(KERN_ALERT "Failed to create the device\n");
         return PTR_ERR(chardevDevice);                                  // Retrieves the error number from the pointer
     }
@@ -84,50 +115,160 @@ static int __init chardev_init(void) {
  *  code is used for a built-in driver (not a LKM) that this function is not required.
  */
 static void __exit chardev_exit(void) {
-    device_destroy(ebbcharClass, MKDEV(majorNumber, 0));                // Remove the device
-    class_unregister(ebbcharClass);                                     // Unregister the device class
-    class_destroy(ebbcharClass);                                        // Remove the device class
+    device_destroy(chardevClass, MKDEV(majorNumber, 0));                // Remove the device
+    class_unregister(chardevClass);                                     // Unregister the device class
+    class_destroy(chardevClass);                                        // Remove the device class
     unregister_chrdev(majorNumber, DEVICE_NAME);                        // Unregister the major number
+    kvfree(queue);
 
     printk(KERN_INFO "Chardev: Goodbye from the chardev lkm!\n");
 }
 
+/*  The queue is a byte ring of records: a u32 length followed by the message. Records
+ *  wrap around the end of the ring like any other bytes, so no space is wasted on
+ *  padding. Everything below is called with queue_lock held.
+ */
+static inline bool queue_fits(size_t len) {
+    return QUEUE_SIZE - queueFill >= RECORD_HEADER + len;
+}
+
+static void queue_put(const void *src, size_t len) {
+    size_t first = min(len, QUEUE_SIZE - queueHead);
+
+    memcpy(queue + queueHead, src, first);
+    memcpy(queue, (const char *)src + first, len - first);
+    queueHead = (queueHead + len) % QUEUE_SIZE;
+}
+
+static void queue_peek(size_t pos, void *dst, size_t len) {
+    size_t first = min(len, QUEUE_SIZE - pos);
+
+    memcpy(dst, queue + pos, first);
+    memcpy((char *)dst + first, queue, len - first);
+}
+
+/*  Appends one record with the message taken from user space. Nothing is published
+ *  until the copy succeeded, a fault leaves the queue as it was.
+ */
+static int queue_push_user(const char __user *buffer, size_t len) {
+    size_t pos = (queueHead + RECORD_HEADER) % QUEUE_SIZE;
+    size_t first = min(len, QUEUE_SIZE - pos);
+    u32 header = len;
+
+    if (copy_from_user(queue + pos, buffer, first) != 0 ||
+        copy_from_user(queue, buffer + first, len - first) != 0) {
+        return -EFAULT;
+    }
+    queue_put(&header, RECORD_HEADER);
+    queueHead = (queueHead + len) % QUEUE_SIZE;
+    queueFill += RECORD_HEADER + len;
+    queueMessages++;
+    return 0;
+}
+
+/*  Length of the oldest message, the queue must not be empty.
+ */
+static size_t queue_front_len(void) {
+    u32 header;
+
+    queue_peek(queueTail, &header, RECORD_HEADER);
+    return header;
+}
+
+/*  Hands the oldest message to user space and drops it. The message stays queued if it
+ *  does not fit into size bytes (-EMSGSIZE) or the copy faults (-EFAULT).
+ */
+static int queue_pop_user(char __user *buffer, size_t size, size_t *len) {
+    size_t pos = (queueTail + RECORD_HEADER) % QUEUE_SIZE;
+    size_t first;
+
+    *len = queue_front_len();
+    if (*len > size) {
+        return -EMSGSIZE;
+    }
+    first = min(*len, QUEUE_SIZE - pos);
+    // copy_to_user has the format ( * to, *from, size) and returns 0 on success
+    if (copy_to_user(buffer, queue + pos, first) != 0 ||
+        copy_to_user(buffer + first, queue, *len - first) != 0) {
+        return -EFAULT;
+    }
+    queueTail = (pos + *len) % QUEUE_SIZE;
+    queueFill -= RECORD_HEADER + *len;
+    queueMessages--;
+    return 0;
+}
+
+/*  Sleeps until a message of len bytes fits (writer) or a message is queued (reader).
+ *  Called and returns with queue_lock held, unless it fails.
+ */
+static int queue_wait(struct file *filep, bool writer, size_t len) {
+    while (writer ? !queue_fits(len) : queueMessages == 0) {
+        mutex_unlock(&queue_lock);
+        if (filep->f_flags & O_NONBLOCK) {
+            return -EAGAIN;
+        }
+        if (writer ? wait_event_interruptible(write_queue, QUEUE_SIZE - READ_ONCE(queueFill) >= RECORD_HEADER + len)
+                   : wait_event_interruptible(read_queue, READ_ONCE(queueMessages) > 0)) {
+            return -ERESTARTSYS;
+        }
+        if (mutex_lock_interruptible(&queue_lock)) {
+            return -ERESTARTSYS;
+        }
+    }
+    return 0;
+}
+
 /*  The device open function that is called each time the device is opened
  *  This will only increment the numberOpens counter in this case.
  *  inodep — a pointer to an inode object (defined in linux/fs.h)
  *  filep — a pointer to a file object (defined in linux/fs.h)
  */
 static int dev_open(struct inode *inodep, struct file *filep) {
+    mutex_lock(&queue_lock);
     numberOpens++;
-    printk(KERN_INFO "Chardev: Device has been opened %d time(s)\n", numberOpens);
+    mutex_unlock(&queue_lock);
+
+    pr_debug("Chardev: Device has been opened %d time(s)\n", numberOpens);
     return 0;
 }
 
 /*  This function is called whenever device is being read from user space i.e. data is
- *  being sent from the device to the user. In this case is uses the copy_to_user() function to
- *  send the buffer string to the user and captures any errors.
+ *  being sent from the device to the user. Exactly one message is returned per call, in
+ *  the order they were written. A buffer shorter than the message fails with -EMSGSIZE
+ *  and leaves the message queued. With no message the reader sleeps, or fails with
+ *  -EAGAIN if the file was opened with O_NONBLOCK.
  *  filep — a pointer to a file object (defined in linux/fs.h)
  *  buffer — the pointer to the buffer to which this function writes the data
  *  len — the length of the buffer
  *  offset — the offset if required
  */
 static ssize_t dev_read(struct file *filep, char *buffer, size_t len, loff_t *offset) {
-    int error_count = 0;
-    // copy_to_user has the format ( * to, *from, size) and returns 0 on success
-    error_count = copy_to_user(buffer, message, size_of_message);
+    size_t sent;
+    int error;
 
-    if (error_count == 0) {            // Success
-        printk(KERN_INFO "Chardev: Sent %d characters to the user\n", size_of_message);
-        return (size_of_message = 0);  // clear the position to the start and return 0
-    } else {
-        printk(KERN_INFO "Chardev: Failed to send %d characters to the user\n", error_count);
-        return -EFAULT;              // Failed -- return a bad address message (i.e. -14)
+    if (mutex_lock_interruptible(&queue_lock)) {
+        return -ERESTARTSYS;
+    }
+    error = queue_wait(filep, false, 0);
+    if (error) {
+        return error;
     }
+    error = queue_pop_user(buffer, len, &sent);
+    mutex_unlock(&queue_lock);
+    if (error) {
+        pr_debug("Chardev: Failed to send a message to the user (%d)\n", error);
+        return error;
+    }
+
+    wake_up_interruptible_poll(&write_queue, EPOLLOUT | EPOLLWRNORM);
+    pr_debug("Chardev: Sent %zu characters to the user\n", sent);
+    return sent;
 }
 
 /*  This function is called whenever the device is being written to from user space i.e.
- *  data is sent to the device from the user. The data is copied to the message[] array in this
- *  LKM using the snprintf() function along with the length of the string.
+ *  data is sent to the device from the user. The whole buffer becomes one message of
+ *  up to CHARDEV_MESSAGE_MAX bytes, longer ones fail with -EMSGSIZE. A writer sleeps
+ *  until the message fits, or fails with -EAGAIN if the file was opened with O_NONBLOCK.
  *  filep — a pointer to a file object
  *  buffer — the buffer to that contains the string to write to the device
  *  len — the length of the array of data that is being passed in the const char buffer
@@ -135,19 +276,184 @@ static ssize_t dev_read(struct file *filep, char *buffer, size_t len, loff_t *of
  */
 static ssize_t dev_write(struct file *filep, const char *buffer,
         size_t len, loff_t *offset) {
-    snprintf(message, sizeof(message), "%s(%zu chars)", buffer, len);   // appending received string with its length
-    size_of_message = strlen(message);                                  // store the length of the stored message
-    printk(KERN_INFO "Chardev: Received %zu characters from the user\n", len);
+    int error;
+
+    if (len > CHARDEV_MESSAGE_MAX) {
+        return -EMSGSIZE;
+    }
+    if (len == 0) {
+        return 0;                                                       // A read could not tell it from nothing
+    }
+
+    if (mutex_lock_interruptible(&queue_lock)) {
+        return -ERESTARTSYS;
+    }
+    error = queue_wait(filep, true, len);
+    if (error) {
+        return error;
+    }
+    error = queue_push_user(buffer, len);
+    mutex_unlock(&queue_lock);
+    if (error) {
+        return error;
+    }
+
+    wake_up_interruptible_poll(&read_queue, EPOLLIN | EPOLLRDNORM);
+    pr_debug("Chardev: Received %zu characters from the user\n", len);
     return len;
 }
 
+/*  CHARDEV_IOC_SEND: queues the messages of the array in order. Sleeps only while not
+ *  even the first one fits, then stops at the first that does not fit.
+ */
+static long dev_send_batch(struct file *filep, struct chardev_batch *batch) {
+    struct chardev_msg __user *msgs = u64_to_user_ptr(batch->msgs);
+    struct chardev_msg msg;
+    long error = 0;
+    u32 done = 0;
+
+    if (mutex_lock_interruptible(&queue_lock)) {
+        return -ERESTARTSYS;
+    }
+    for (; done < batch->count; done++) {
+        if (copy_from_user(&msg, &msgs[done], sizeof(msg)) != 0) {
+            error = -EFAULT;
+            break;
+        }
+        if (msg.flags != 0 || msg.len == 0 || msg.len > CHARDEV_MESSAGE_MAX) {
+            error = msg.len > CHARDEV_MESSAGE_MAX ? -EMSGSIZE : -EINVAL;
+            break;
+        }
+        if (done > 0 && !queue_fits(msg.len)) {
+            break;
+        }
+        error = queue_wait(filep, true, msg.len);
+        if (error) {
+            goto unlocked;
+        }
+        error = queue_push_user(u64_to_user_ptr(msg.data), msg.len);
+        if (error) {
+            break;
+        }
+    }
+    mutex_unlock(&queue_lock);
+unlocked:
+    if (done > 0) {
+        wake_up_interruptible_poll(&read_queue, EPOLLIN | EPOLLRDNORM);
+    }
+    batch->done = done;
+    return done > 0 ? done : error;
+}
+
+/*  CHARDEV_IOC_RECV: fills the entries of the array with queued messages. Sleeps only
+ *  while the queue is empty, then returns what is there, up to count messages.
+ */
+static long dev_recv_batch(struct file *filep, struct chardev_batch *batch) {
+    struct chardev_msg __user *msgs = u64_to_user_ptr(batch->msgs);
+    struct chardev_msg msg;
+    long error = 0;
+    size_t len;
+    u32 done = 0;
+
+    if (mutex_lock_interruptible(&queue_lock)) {
+        return -ERESTARTSYS;
+    }
+    for (; done < batch->count; done++) {
+        if (copy_from_user(&msg, &msgs[done], sizeof(msg)) != 0) {
+            error = -EFAULT;
+            break;
+        }
+        if (msg.flags != 0) {
+            error = -EINVAL;
+            break;
+        }
+        if (done > 0 && queueMessages == 0) {
+            break;
+        }
+        error = queue_wait(filep, false, 0);
+        if (error) {
+            goto unlocked;
+        }
+        // The length goes out first, so it is never lost with a consumed message and a
+        // too small buffer learns how much room it needs
+        len = queue_front_len();
+        if (put_user((u32)len, &msgs[done].len) != 0) {
+            error = -EFAULT;
+            break;
+        }
+        error = queue_pop_user(u64_to_user_ptr(msg.data), msg.len, &len);
+        if (error) {
+            break;
+        }
+    }
+    mutex_unlock(&queue_lock);
+unlocked:
+    if (done > 0) {
+        wake_up_interruptible_poll(&write_queue, EPOLLOUT | EPOLLWRNORM);
+    }
+    batch->done = done;
+    return done > 0 ? done : error;
+}
+
+/*  The ioctl function moves arrays of messages, see chardev_msg.h.
+ *  filep — a pointer to a file object
+ *  cmd — CHARDEV_IOC_SEND or CHARDEV_IOC_RECV
+ *  arg — user pointer to a struct chardev_batch
+ */
+static long dev_ioctl(struct file *filep, unsigned int cmd, unsigned long arg) {
+    struct chardev_batch __user *ubatch = (struct chardev_batch __user *)arg;
+    struct chardev_batch batch;
+    long result;
+
+    if (cmd != CHARDEV_IOC_SEND && cmd != CHARDEV_IOC_RECV) {
+        return -ENOTTY;
+    }
+    if (copy_from_user(&batch, ubatch, sizeof(batch)) != 0) {
+        return -EFAULT;
+    }
+    if (batch.count == 0 || batch.count > CHARDEV_BATCH_MAX) {
+        return -EINVAL;
+    }
+
+    result = cmd == CHARDEV_IOC_SEND ? dev_send_batch(filep, &batch) : dev_recv_batch(filep, &batch);
+    if (put_user(batch.done, &ubatch->done) != 0) {
+        return -EFAULT;
+    }
+    pr_debug("Chardev: Batch of %u messages, %ld moved\n", batch.count, result);
+    return result;
+}
+
+/*  The poll function reports a queued message as readable and room for at least a
+ *  one-byte message as writable, so the device fits into a select/poll/epoll loop.
+ *  filep — a pointer to a file object
+ *  wait — the poll table the wait queues are registered in
+ */
+static __poll_t dev_poll(struct file *filep, poll_table *wait) {
+    __poll_t mask = 0;
+
+    poll_wait(filep, &read_queue, wait);
+    poll_wait(filep, &write_queue, wait);
+
+    if (READ_ONCE(queueMessages) > 0) {
+        mask |= EPOLLIN | EPOLLRDNORM;
+    }
+    if (QUEUE_SIZE - READ_ONCE(queueFill) > RECORD_HEADER) {
+        mask |= EPOLLOUT | EPOLLWRNORM;
+    }
+    return mask;
+}
+
 /*  The device release function that is called whenever the device is closed/released by
  *  the userspace program
  *  inodep — a pointer to an inode object (defined in linux/fs.h)
  *  filep — a pointer to a file object (defined in linux/fs.h)
  */
 static int dev_release(struct inode *inodep, struct file *filep) {
-    printk(KERN_INFO "Chardev: Device successfully closed\n");
+    mutex_lock(&queue_lock);
+    numberOpens--;
+    mutex_unlock(&queue_lock);
+
+    pr_debug("Chardev: Device successfully closed\n");
     return 0;
 }
 
@@ -0,0 +1,38 @@
+// Copyright [2020] <Puchkov Kyryll>
+/*  Batched message interface of /dev/chardev, shared by the driver and by user space.
+ *
+ *  Every write() is one message and every read() returns exactly one message, like a
+ *  datagram socket. CHARDEV_IOC_SEND and CHARDEV_IOC_RECV move a whole array of
+ *  messages in one syscall. Both sleep only until the first message can be moved and
+ *  then take as many as fit (SEND) or are queued (RECV), like sendmmsg/recvmmsg.
+ *  The ioctl returns the number of messages moved and also stores it in done.
+ */
+#ifndef FIFO_DEVICE_CHARDEV_MSG_H_
+#define FIFO_DEVICE_CHARDEV_MSG_H_
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define CHARDEV_MESSAGE_MAX     4096                                    ///< Longest message in bytes
+#define CHARDEV_BATCH_MAX       1024                                    ///< Most messages per ioctl
+
+struct chardev_msg {
+    __u64 data;                                                         ///< User buffer
+    __u32 len;                                                          ///< SEND: message length; RECV: buffer size in, message length out
+    __u32 flags;                                                        ///< Must be 0
+};
+
+struct chardev_batch {
+    __u64 msgs;                                                         ///< Array of struct chardev_msg
+    __u32 count;                                                        ///< Entries in msgs
+    __u32 done;                                                         ///< Out: messages moved
+};
+
+/*  A RECV entry whose buffer is too small for the next message fails with EMSGSIZE
+ *  (when it is the first one) and gets the needed length in len; the message stays queued.
+ */
+#define CHARDEV_IOC_MAGIC       'c'
+#define CHARDEV_IOC_SEND        _IOWR(CHARDEV_IOC_MAGIC, 1, struct chardev_batch)
+#define CHARDEV_IOC_RECV        _IOWR(CHARDEV_IOC_MAGIC, 2, struct chardev_batch)
+
+#endif  // FIFO_DEVICE_CHARDEV_MSG_H_
@@ -0,0 +1,133 @@
+// Copyright [2020] <Puchkov Kyryll>
+/*  Ring arithmetic shared by the cdev module and the user-space tools, see fifo_core.h.
+ */
+#ifdef __KERNEL__
+#include <linux/errno.h>
+#include <linux/string.h>
+#else
+#include <errno.h>
+#include <string.h>
+#endif
+
+#include "fifo_core.h"
+
+static inline size_t fifo_min(size_t a, size_t b) {
+    return a < b ? a : b;
+}
+
+void fifo_core_init(struct fifo_core *core, void **chunks, size_t nchunks,
+                    unsigned int chunk_shift, __u32 *head, __u32 *tail) {
+    core->chunks = chunks;
+    core->nchunks = nchunks;
+    core->chunk_shift = chunk_shift;
+    core->size = nchunks << chunk_shift;
+    core->head = head;
+    core->tail = tail;
+    fifo_store_release(core->head, 0);
+    fifo_store_release(core->tail, 0);
+}
+
+size_t fifo_core_write(struct fifo_core *core, size_t len, fifo_copy_t copy, void *ctx) {
+    size_t head = fifo_core_head(core);
+    size_t copied = 0;
+    size_t chunk;
+    size_t done;
+    char*  dst;
+
+    len = fifo_min(len, fifo_core_space(core));
+    while (copied < len) {
+        dst = fifo_core_ptr(core, head, &chunk);
+        chunk = fifo_min(len - copied, chunk);
+        done = copy(dst, chunk, ctx);
+        head = (head + done) % core->size;
+        fifo_store_release(core->head, head);                           // The bytes are in place, publish them
+        copied += done;
+        if (done < chunk) {
+            break;
+        }
+    }
+    return copied;
+}
+
+size_t fifo_core_stage(struct fifo_core *core, size_t offset, size_t len, fifo_copy_t copy, void *ctx) {
+    size_t space = fifo_core_space(core);
+    size_t copied = 0;
+    size_t chunk;
+    size_t done;
+    size_t pos;
+    char*  dst;
+
+    if (offset >= space) {
+        return 0;
+    }
+    len = fifo_min(len, space - offset);
+    pos = (fifo_core_head(core) + offset) % core->size;
+    while (copied < len) {
+        dst = fifo_core_ptr(core, pos, &chunk);
+        chunk = fifo_min(len - copied, chunk);
+        done = copy(dst, chunk, ctx);
+        pos = (pos + done) % core->size;
+        copied += done;
+        if (done < chunk) {
+            break;
+        }
+    }
+    return copied;
+}
+
+void fifo_core_commit(struct fifo_core *core, size_t len) {
+    fifo_store_release(core->head, (fifo_core_head(core) + len) % core->size);
+}
+
+size_t fifo_core_read(struct fifo_core *core, size_t len, fifo_copy_t copy, void *ctx) {
+    size_t tail = fifo_core_tail(core);
+    size_t copied = 0;
+    size_t chunk;
+    size_t done;
+    char*  src;
+
+    len = fifo_min(len, fifo_core_fill(core));
+    while (copied < len) {
+        src = fifo_core_ptr(core, tail, &chunk);
+        chunk = fifo_min(len - copied, chunk);
+        done = copy(src, chunk, ctx);
+        tail = (tail + done) % core->size;
+        fifo_store_release(core->tail, tail);                           // The bytes are consumed, the writer may reuse them
+        copied += done;
+        if (done < chunk) {
+            break;
+        }
+    }
+    return copied;
+}
+
+int fifo_core_resize(struct fifo_core *core, void ***chunks, size_t *nchunks) {
+    size_t chunk_size = (size_t)1 << core->chunk_shift;
+    size_t fill = fifo_core_fill(core);
+    size_t tail = fifo_core_tail(core);
+    size_t pos, chunk, avail;
+    void **old_chunks;
+    size_t old_nchunks;
+    char *src;
+
+    if (fill >= *nchunks << core->chunk_shift) {
+        return -ENOSPC;
+    }
+    for (pos = 0; pos < fill; pos += chunk) {
+        src = fifo_core_ptr(core, tail, &avail);
+        chunk = fifo_min(fifo_min(fill - pos, avail), chunk_size - (pos & (chunk_size - 1)));
+        memcpy((char *)(*chunks)[pos >> core->chunk_shift] + (pos & (chunk_size - 1)), src, chunk);
+        tail = (tail + chunk) % core->size;
+    }
+
+    old_chunks = core->chunks;
+    old_nchunks = core->nchunks;
+    core->chunks = *chunks;
+    core->nchunks = *nchunks;
+    fifo_write_once(core->size, core->nchunks << core->chunk_shift);
+    fifo_store_release(core->tail, 0);
+    fifo_store_release(core->head, fill);
+    *chunks = old_chunks;
+    *nchunks = old_nchunks;
+    return 0;
+}
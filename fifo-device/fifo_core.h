@@ -0,0 +1,103 @@
+// Copyright [2020] <Puchkov Kyryll>
+/*  Byte ring over a table of equally sized chunks. This is the buffer logic of the cdev
+ *  module without anything kernel specific, so the same source is linked into the module
+ *  and into user-space programs (fuzz-fifo-core.c, bench-fifo-core.c).
+ *
+ *  The core does no locking and never sleeps. Writers have to be serialized among
+ *  themselves and readers among themselves, as cdev.c does with ring_lock; one writer
+ *  and one reader may run concurrently. head and tail point wherever the caller keeps
+ *  the positions, for cdev that is the control page shared with user space (cdev_ring.h),
+ *  so they are reduced modulo the size on every load and a scribbling peer can only
+ *  garble the stream, never make the core index outside of the chunk table.
+ */
+#ifndef FIFO_DEVICE_FIFO_CORE_H_
+#define FIFO_DEVICE_FIFO_CORE_H_
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/compiler.h>
+#include <asm/barrier.h>
+
+#define fifo_load_acquire(p)        smp_load_acquire(p)
+#define fifo_store_release(p, v)    smp_store_release(p, v)
+#define fifo_read_once(x)           READ_ONCE(x)
+#define fifo_write_once(x, v)       WRITE_ONCE(x, v)
+#else
+#include <stdbool.h>
+#include <stddef.h>
+#include <linux/types.h>
+
+#define fifo_load_acquire(p)        __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define fifo_store_release(p, v)    __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define fifo_read_once(x)           __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define fifo_write_once(x, v)       __atomic_store_n(&(x), v, __ATOMIC_RELAXED)
+#endif
+
+struct fifo_core {
+    void**       chunks;                                                ///< Chunk addresses, byte pos lives in chunk pos >> chunk_shift
+    size_t       nchunks;
+    unsigned int chunk_shift;                                           ///< log2 of the chunk size, PAGE_SHIFT in the module
+    size_t       size;                                                  ///< nchunks << chunk_shift, one byte is kept free to tell full from empty
+    __u32*       head;                                                  ///< Next byte to write, stored by the writer only
+    __u32*       tail;                                                  ///< Next byte to read, stored by the reader only
+};
+
+/*  Moves up to len bytes between a chunk and the caller's buffer and returns how many it
+ *  moved. A short count (a fault in copy_from_iter, say) stops the transfer there.
+ */
+typedef size_t (*fifo_copy_t)(void *chunk, size_t len, void *ctx);
+
+/*  Address of byte pos of the ring and how many bytes follow it in the same chunk.
+ *  The ring size is a multiple of the chunk size, so the wrap is always at a chunk boundary.
+ */
+static inline char *fifo_core_ptr(const struct fifo_core *core, size_t pos, size_t *contiguous) {
+    size_t offset = pos & (((size_t)1 << core->chunk_shift) - 1);
+
+    *contiguous = ((size_t)1 << core->chunk_shift) - offset;
+    return (char *)core->chunks[pos >> core->chunk_shift] + offset;
+}
+
+// The acquire pairs with the release of the other side
+static inline size_t fifo_core_head(const struct fifo_core *core) {
+    return fifo_load_acquire(core->head) % fifo_read_once(core->size);
+}
+
+static inline size_t fifo_core_tail(const struct fifo_core *core) {
+    return fifo_load_acquire(core->tail) % fifo_read_once(core->size);
+}
+
+static inline size_t fifo_core_fill(const struct fifo_core *core) {
+    size_t size = fifo_read_once(core->size);
+    size_t head = fifo_core_head(core);
+    size_t tail = fifo_core_tail(core);
+
+    return (head + size - tail) % size;
+}
+
+static inline size_t fifo_core_space(const struct fifo_core *core) {
+    size_t size = fifo_read_once(core->size);
+    size_t fill = fifo_core_fill(core);
+
+    return fill < size ? size - 1 - fill : 0;                           // A racing resize may shrink size under us
+}
+
+// An empty ring over nchunks chunks of 1 << chunk_shift bytes each
+void   fifo_core_init(struct fifo_core *core, void **chunks, size_t nchunks,
+                      unsigned int chunk_shift, __u32 *head, __u32 *tail);
+// Appends up to len bytes produced by copy, returns the number appended
+size_t fifo_core_write(struct fifo_core *core, size_t len, fifo_copy_t copy, void *ctx);
+/*  Copies up to len bytes into the free space offset bytes past head without publishing
+ *  them, so a writer can fill a record body before its header. Returns the number copied.
+ */
+size_t fifo_core_stage(struct fifo_core *core, size_t offset, size_t len, fifo_copy_t copy, void *ctx);
+// Publishes len staged bytes at once
+void   fifo_core_commit(struct fifo_core *core, size_t len);
+// Removes up to len bytes handed to copy, returns the number removed
+size_t fifo_core_read(struct fifo_core *core, size_t len, fifo_copy_t copy, void *ctx);
+/*  Moves the stored bytes into *chunks starting at position 0 and swaps the tables, so
+ *  *chunks and *nchunks hold the old table on return. Needs both sides stopped.
+ *  Returns 0, or -ENOSPC if the data would not fit.
+ */
+int    fifo_core_resize(struct fifo_core *core, void ***chunks, size_t *nchunks);
+
+#endif  // FIFO_DEVICE_FIFO_CORE_H_
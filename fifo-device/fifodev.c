@@ -5,10 +5,15 @@
 #include <linux/kernel.h>                                               // Contains types, macros, functions for the kernel
 #include <linux/fs.h>                                                   // Header for the Linux file system support
 #include <linux/uaccess.h>                                              // Required for the copy to user function
+#include <linux/slab.h>                                                 // kvmalloc/kvfree
+#include <linux/mm.h>
+#include <linux/mutex.h>                                                // Buffer lock
+#include <linux/wait.h>                                                 // Wait queues for blocking readers and writers
+#include <linux/poll.h>                                                 // poll/epoll readiness masks
 
 #define DEVICE_NAME         "fifodev"                                   ///< Dev name as it appears in /proc/devices
 #define CLASS_NAME          "lkm"                                       //< The device class -- this is a character device driver
-#define MESSAGE_SIZE        10 * 1024
+#define MESSAGE_SIZE        (size_t)(10 * 1024)
 
 MODULE_LICENSE("GPL");                                                  ///< The license type -- this affects available functionality
 MODULE_AUTHOR("Puchkov Kyryll");                                        ///< The author -- visible when you use modinfo
@@ -16,26 +21,28 @@ MODULE_DESCRIPTION("A simple fifo driver for the kernel module");       ///< The
 MODULE_VERSION("0.1");                                                  ///< A version number to inform users
 
 static int    majorNumber;                                              ///< Stores the device number -- determined automatically
-// static char   message[10*  1024] = {0};                                       ///< Memory for the string that is passed from userspace
-static char*  msg_ptr;
+static char*  msg_ptr = NULL;                                           ///< Memory for the data that is passed from userspace
+static size_t size_of_message = 0;                                      ///< Number of bytes waiting in msg_ptr
 static int    numberOpens = 0;                                          ///< Counts the number of times the device is opened
-/*static int    numberReaders = 0;
-static int    numberWriters = 0;
-static int    readBytes = 0;
-static int    writtenBytes = 0;*/
 static struct class*  fifoClass  = NULL;                                ///< The device-driver class struct pointer
 static struct device* fifoDevice = NULL;                                ///< The device-driver device struct pointer
 
+static DEFINE_MUTEX(fifo_lock);                                         ///< Protects msg_ptr, size_of_message and numberOpens
+static DECLARE_WAIT_QUEUE_HEAD(read_queue);                             ///< Readers sleep here while the buffer is empty
+static DECLARE_WAIT_QUEUE_HEAD(write_queue);                            ///< Writers sleep here while the buffer is full
+
 // The prototype functions for the character driver
 static int     dev_open(struct inode *, struct file *);
 static int     dev_release(struct inode *, struct file *);
 static ssize_t dev_read(struct file *, char *, size_t, loff_t *);
 static ssize_t dev_write(struct file *, const char *, size_t, loff_t *);
+static __poll_t dev_poll(struct file *, poll_table *);
 
 /*  Devices are represented as file structure in the kernel.
  *  The file_operations structure from /linux/fs.h lists the callback functions
  *  that you wish to associated with your file operations using a C99 syntax structure.
- *  Char devices implement open, read, write and release calls
+ *  Char devices implement open, read, write and release calls, poll lets the device
+ *  take part in an event loop
  */
 static struct file_operations fops = {
     .owner = THIS_MODULE,
@@ -43,6 +50,7 @@ static struct file_operations fops = {
     .read = dev_read,
     .write = dev_write,
     .release = dev_release,
+    .poll = dev_poll,
 };
 
 /*  The LKM initialization function
@@ -55,9 +63,17 @@ static struct file_operations fops = {
 static int __init fifodev_init(void) {
     printk(KERN_INFO "Fifodev: Initializing the character device for the LKM\n");
 
+    // Allocated once for the lifetime of the module, kvmalloc does not need contiguous pages
+    msg_ptr = kvmalloc(MESSAGE_SIZE, GFP_KERNEL);
+    if (msg_ptr == NULL) {
+        printk(KERN_ALERT "Fifodev failed to allocate the buffer\n");
+        return -ENOMEM;
+    }
+
     // Allocate a major number for the device
     majorNumber = register_chrdev(0, DEVICE_NAME, &fops);
     if (majorNumber < 0) {
+        kvfree(msg_ptr);
         printk(KERN_ALERT "Fifodev failed to register a major number\n");
         return majorNumber;
     }
@@ -67,6 +83,7 @@ static int __init fifodev_init(void) {
     fifoClass = class_create(THIS_MODULE, CLASS_NAME);
     if (IS_ERR(fifoClass)) {                                         // Check for error and clean up
         unregister_chrdev(majorNumber, DEVICE_NAME);                    // Unregister the major number
+        kvfree(msg_ptr);
         printk(KERN_ALERT "Failed to register device class\n");
         return PTR_ERR(fifoClass);                                   // Retrieves the error number from the pointer
     }
@@ -77,6 +94,7 @@ static int __init fifodev_init(void) {
     if (IS_ERR(fifoDevice)) {                                        // Clean up
         class_destroy(fifoClass);                                    // Remove the device class
         unregister_chrdev(majorNumber, DEVICE_NAME);                    // Unregister the major number
+        kvfree(msg_ptr);
         printk(KERN_ALERT "Failed to create the device\n");
         return PTR_ERR(fifoDevice);                                  // Retrieves the error number from the pointer
     }
@@ -93,6 +111,7 @@ static void __exit fifodev_exit(void) {
     class_unregister(fifoClass);                                     // Unregister the device class
     class_destroy(fifoClass);                                        // Remove the device class
     unregister_chrdev(majorNumber, DEVICE_NAME);                        // Unregister the major number
+    kvfree(msg_ptr);
 
     printk(KERN_INFO "Fifodev: Goodbye from the fifodev lkm!\n");
 }
@@ -103,93 +122,131 @@ static void __exit fifodev_exit(void) {
  *  filep — a pointer to a file object (defined in linux/fs.h)
  */
 static int dev_open(struct inode *inodep, struct file *filep) {
-    msg_ptr = kmalloc(MESSAGE_SIZE, GFP_KERNEL);
-    /* If device is open, return busy */
-    /*if (numberOpens) {
-        return -EBUSY;
-    }
-    if (filep->f_mode & FMODE_READ) {
-        numberReaders++;
-    }
-    if (filep->f_mode & FMODE_WRITE) {
-        numberWriters++;
-    }*/
+    mutex_lock(&fifo_lock);
     numberOpens++;
-    printk(KERN_INFO "Fifodev: Device has been opened %d time(s)\n", numberOpens);
+    mutex_unlock(&fifo_lock);
+
+    pr_debug("Fifodev: Device has been opened %d time(s)\n", numberOpens);
     return 0;
 }
 
 /*  This function is called whenever device is being read from user space i.e. data is
- *  being sent from the device to the user. In this case is uses the copy_to_user() function to
- *  send the buffer string to the user and captures any errors.
+ *  being sent from the device to the user. The oldest bytes are copied with copy_to_user()
+ *  and dropped from the buffer. An empty buffer puts the reader to sleep, or fails with
+ *  -EAGAIN if the file was opened with O_NONBLOCK.
  *  filep — a pointer to a file object (defined in linux/fs.h)
  *  buffer — the pointer to the buffer to which this function writes the data
  *  len — the length of the buffer
  *  offset — the offset if required
  */
 static ssize_t dev_read(struct file *filep, char *buffer, size_t len, loff_t *offset) {
-    /*
-    readBytes = 0;
-
-    if (*msg_ptr == NULL) {
-        msg_ptr = message;
+    if (mutex_lock_interruptible(&fifo_lock)) {
+        return -ERESTARTSYS;
     }
-    while ((len > 0) && (*msg_ptr != NULL)) {
-        // Read one symbol from kernel ram to user ram
-        ssize_t error = put_user(*(msg_ptr++), buffer++);
-        if (error == -EFAULT) {
-            printk(KERN_INFO "Fifodev: failed to write a byte from kernel to user ram by put_user()");
+    while (size_of_message == 0) {
+        mutex_unlock(&fifo_lock);
+        if (filep->f_flags & O_NONBLOCK) {
+            return -EAGAIN;
+        }
+        if (wait_event_interruptible(read_queue, READ_ONCE(size_of_message) > 0)) {
+            return -ERESTARTSYS;
+        }
+        if (mutex_lock_interruptible(&fifo_lock)) {
+            return -ERESTARTSYS;
         }
-        len--;
-        readBytes++;
     }
 
-    return readBytes;*/
-
-    int error_count = 0;
+    if (len > size_of_message) {
+        len = size_of_message;
+    }
     // copy_to_user has the format ( * to, *from, size) and returns 0 on success
-    error_count = copy_to_user(buffer, msg_ptr, MESSAGE_SIZE);
-
-    if (error_count == 0) {            // Success
-        printk(KERN_INFO "Fifodev: Sent %d characters to the user\n", size_of_message);
-        return (size_of_message = 0);  // clear the position to the start and return 0
-    } else {
-        printk(KERN_INFO "Fifodev: Failed to send %d characters to the user\n", error_count);
+    if (copy_to_user(buffer, msg_ptr, len) != 0) {
+        mutex_unlock(&fifo_lock);
+        pr_debug("Fifodev: Failed to send %zu characters to the user\n", len);
         return -EFAULT;              // Failed -- return a bad address message (i.e. -14)
     }
+    size_of_message -= len;
+    memmove(msg_ptr, msg_ptr + len, size_of_message);
+    mutex_unlock(&fifo_lock);
+
+    wake_up_interruptible_poll(&write_queue, EPOLLOUT | EPOLLWRNORM);
+    pr_debug("Fifodev: Sent %zu characters to the user\n", len);
+    return len;
 }
 
 /*  This function is called whenever the device is being written to from user space i.e.
- *  data is sent to the device from the user. The data is copied to the message[] array in this
- *  LKM using the snprintf() function along with the length of the string.
+ *  data is sent to the device from the user. The data is appended to the buffer with
+ *  copy_from_user(), as much as fits. A full buffer puts the writer to sleep, or fails
+ *  with -EAGAIN if the file was opened with O_NONBLOCK.
  *  filep — a pointer to a file object
  *  buffer — the buffer to that contains the string to write to the device
  *  len — the length of the array of data that is being passed in the const char buffer
  *  offset — the offset if required
  */
 static ssize_t dev_write(struct file *filep, const char *buffer, size_t len, loff_t *offset) {
-    snprintf(message, sizeof(message), "%s(%zu chars)", buffer, len);   // appending received string with its length
-    size_of_message = strlen(message);                                  // store the length of the stored message
-    printk(KERN_INFO "Fifodev: Received %zu characters from the user\n", len);
+    if (mutex_lock_interruptible(&fifo_lock)) {
+        return -ERESTARTSYS;
+    }
+    while (size_of_message == MESSAGE_SIZE) {
+        mutex_unlock(&fifo_lock);
+        if (filep->f_flags & O_NONBLOCK) {
+            return -EAGAIN;
+        }
+        if (wait_event_interruptible(write_queue, READ_ONCE(size_of_message) < MESSAGE_SIZE)) {
+            return -ERESTARTSYS;
+        }
+        if (mutex_lock_interruptible(&fifo_lock)) {
+            return -ERESTARTSYS;
+        }
+    }
+
+    if (len > MESSAGE_SIZE - size_of_message) {
+        len = MESSAGE_SIZE - size_of_message;
+    }
+    if (copy_from_user(msg_ptr + size_of_message, buffer, len) != 0) {
+        mutex_unlock(&fifo_lock);
+        return -EFAULT;
+    }
+    size_of_message += len;
+    mutex_unlock(&fifo_lock);
+
+    wake_up_interruptible_poll(&read_queue, EPOLLIN | EPOLLRDNORM);
+    pr_debug("Fifodev: Received %zu characters from the user\n", len);
     return len;
 }
 
+/*  The poll function reports readiness from the buffer fill level, so the device can be
+ *  multiplexed with sockets in one select/poll/epoll loop.
+ *  filep — a pointer to a file object
+ *  wait — the poll table the wait queues are registered in
+ */
+static __poll_t dev_poll(struct file *filep, poll_table *wait) {
+    __poll_t mask = 0;
+    size_t fill = READ_ONCE(size_of_message);
+
+    poll_wait(filep, &read_queue, wait);
+    poll_wait(filep, &write_queue, wait);
+
+    if (fill > 0) {
+        mask |= EPOLLIN | EPOLLRDNORM;
+    }
+    if (fill < MESSAGE_SIZE) {
+        mask |= EPOLLOUT | EPOLLWRNORM;
+    }
+    return mask;
+}
+
 /*  The device release function that is called whenever the device is closed/released by
  *  the userspace program
  *  inodep — a pointer to an inode object (defined in linux/fs.h)
  *  filep — a pointer to a file object (defined in linux/fs.h)
  */
 static int dev_release(struct inode *inodep, struct file *filep) {
-    /*if (filep->f_mode & FMODE_READ) {
-        numberReaders--;
-    }
-    if (filep->f_mode & FMODE_WRITE) {
-        numberWriters--;
-    }*/
-    // numberOpens--;
-    kfree(msg_ptr);
+    mutex_lock(&fifo_lock);
+    numberOpens--;
+    mutex_unlock(&fifo_lock);
 
-    printk(KERN_INFO "Fifodev: Device successfully closed\n");
+    pr_debug("Fifodev: Device successfully closed\n");
     return 0;
 }
 
@@ -0,0 +1,250 @@
+// Copyright [2020] <Puchkov Kyryll>
+/*  libFuzzer target for fifo_core. The input is a program of writes, staged writes, reads, resizes and
+ *  scribbles over head/tail (what a misbehaving mmap peer can do), run against small
+ *  separately allocated chunks so that the sanitizers catch any access outside of them.
+ *  Until the first scribble the bytes read back are compared with a plain model queue.
+ *
+ *      clang -g -O1 -fsanitize=fuzzer,address,undefined fuzz-fifo-core.c fifo_core.c
+ *
+ *  Built with -DFIFO_FUZZ_STANDALONE it runs the given files, or random programs when
+ *  there are none, so gcc with -fsanitize=address,undefined can use it as well.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fifo_core.h"
+
+#define MAX_CHUNK_SHIFT     6
+#define MAX_CHUNKS          8
+#define MAX_RING            (MAX_CHUNKS << MAX_CHUNK_SHIFT)
+
+struct program {
+    const uint8_t *data;
+    size_t         len;
+};
+
+struct buffer {
+    uint8_t *data;
+    size_t   pos;
+    size_t   limit;                                                     ///< copy moves at most this much, tests short copies
+};
+
+static uint8_t next(struct program *p) {
+    if (p->len == 0) {
+        return 0;
+    }
+    p->len--;
+    return *p->data++;
+}
+
+static size_t copy_in(void *chunk, size_t len, void *ctx) {
+    struct buffer *b = ctx;
+
+    if (len > b->limit - b->pos) {
+        len = b->limit - b->pos;
+    }
+    memcpy(chunk, b->data + b->pos, len);
+    b->pos += len;
+    return len;
+}
+
+static size_t copy_out(void *chunk, size_t len, void *ctx) {
+    struct buffer *b = ctx;
+
+    if (len > b->limit - b->pos) {
+        len = b->limit - b->pos;
+    }
+    memcpy(b->data + b->pos, chunk, len);
+    b->pos += len;
+    return len;
+}
+
+static void **chunks_alloc(size_t count, unsigned int shift) {
+    void **chunks = calloc(count, sizeof(*chunks));
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        chunks[i] = malloc((size_t)1 << shift);
+    }
+    return chunks;
+}
+
+static void chunks_free(void **chunks, size_t count) {
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        free(chunks[i]);
+    }
+    free(chunks);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    struct program p = { data, size };
+    unsigned int shift = next(&p) % (MAX_CHUNK_SHIFT + 1);
+    size_t nchunks = next(&p) % MAX_CHUNKS + 1;
+    uint8_t model[MAX_RING];                                            ///< Linear copy of the expected contents
+    uint8_t scratch[MAX_RING];
+    size_t model_fill = 0;
+    int garbled = 0;
+    uint8_t serial = 0;
+    struct fifo_core core;
+    __u32 head, tail;
+
+    if (nchunks << shift < 2) {
+        nchunks = 2;                                                    // One byte is kept free, a 1-byte ring holds nothing
+    }
+    fifo_core_init(&core, chunks_alloc(nchunks, shift), nchunks, shift, &head, &tail);
+
+    while (p.len > 0) {
+        uint8_t op = next(&p);
+        size_t arg = next(&p);
+        struct buffer b = { scratch, 0, 0 };
+        size_t fill_before = fifo_core_fill(&core);
+        size_t space_before = fifo_core_space(&core);
+        size_t done, i;
+
+        switch (op % 6) {
+        case 0:                                                         // write arg bytes, maybe a short copy
+        case 1:
+            b.limit = arg % MAX_RING;
+            if (op & 0x80) {
+                b.limit /= 2;
+            }
+            for (i = 0; i < b.limit; i++) {
+                scratch[i] = serial++;
+            }
+            done = fifo_core_write(&core, arg % MAX_RING, copy_in, &b);
+            if (done > space_before || done > b.limit || fifo_core_fill(&core) != fill_before + done) {
+                abort();
+            }
+            if (!garbled) {
+                memcpy(model + model_fill, scratch, done);
+                model_fill += done;
+            }
+            break;
+        case 2:                                                         // read arg bytes
+        case 3:
+            b.limit = arg % MAX_RING;
+            if (op & 0x80) {
+                b.limit /= 2;
+            }
+            done = fifo_core_read(&core, arg % MAX_RING, copy_out, &b);
+            if (done > fill_before || done > b.limit || fifo_core_fill(&core) != fill_before - done) {
+                abort();
+            }
+            if (!garbled) {
+                if (memcmp(scratch, model, done) != 0) {
+                    abort();
+                }
+                memmove(model, model + done, model_fill - done);
+                model_fill -= done;
+            }
+            break;
+        case 4:                                                         // body at offset k, then k bytes before it, one commit
+            b.limit = arg % MAX_RING;
+            for (i = 0; i < b.limit; i++) {
+                scratch[i] = serial++;
+            }
+            {
+                uint8_t prefix[8];
+                struct buffer pb = { prefix, 0, op % 8 };
+                size_t k = pb.limit;
+                size_t staged;
+
+                for (i = 0; i < k; i++) {
+                    prefix[i] = serial++;
+                }
+                done = fifo_core_stage(&core, k, b.limit, copy_in, &b);
+                if (fifo_core_fill(&core) != fill_before || (done > 0 && k + done > space_before)) {
+                    abort();                                            // Nothing is visible before the commit
+                }
+                if (done == 0) {
+                    break;
+                }
+                staged = fifo_core_stage(&core, 0, k, copy_in, &pb);
+                if (staged != k) {
+                    abort();
+                }
+                fifo_core_commit(&core, k + done);
+                if (fifo_core_fill(&core) != fill_before + k + done) {
+                    abort();
+                }
+                if (!garbled) {
+                    memcpy(model + model_fill, prefix, k);
+                    memcpy(model + model_fill + k, scratch, done);
+                    model_fill += k + done;
+                }
+            }
+            break;
+        default:
+            if (op & 0x40) {                                            // scribble like an mmap peer
+                __u32 value = arg | (__u32)next(&p) << 8 | (__u32)next(&p) << 24;
+
+                *((op & 0x20) ? &head : &tail) = value;
+                garbled = 1;
+            } else {                                                    // resize to arg chunks
+                size_t count = arg % MAX_CHUNKS + 1;
+                void **chunks;
+                int error;
+
+                if (count << shift < 2) {
+                    break;
+                }
+                chunks = chunks_alloc(count, shift);
+                error = fifo_core_resize(&core, &chunks, &count);
+                if ((error != 0) != (fill_before >= count << shift)) {
+                    abort();
+                }
+                if (!error && fifo_core_fill(&core) != fill_before) {
+                    abort();
+                }
+                chunks_free(chunks, count);                             // The old table on success
+            }
+            break;
+        }
+        if (fifo_core_fill(&core) >= core.size || (!garbled && fifo_core_fill(&core) != model_fill)) {
+            abort();
+        }
+    }
+
+    chunks_free(core.chunks, core.nchunks);
+    return 0;
+}
+
+#ifdef FIFO_FUZZ_STANDALONE
+int main(int argc, char *argv[]) {
+    static uint8_t input[4096];
+    int i;
+
+    if (argc > 1) {
+        for (i = 1; i < argc; i++) {
+            FILE *f = fopen(argv[i], "rb");
+            size_t len;
+
+            if (f == NULL) {
+                perror(argv[i]);
+                return 1;
+            }
+            len = fread(input, 1, sizeof(input), f);
+            fclose(f);
+            LLVMFuzzerTestOneInput(input, len);
+        }
+        return 0;
+    }
+
+    srand(2020);
+    for (i = 0; i < 20000; i++) {
+        size_t len = rand() % sizeof(input);
+        size_t j;
+
+        for (j = 0; j < len; j++) {
+            input[j] = rand();
+        }
+        LLVMFuzzerTestOneInput(input, len);
+    }
+    printf("fuzz-fifo-core: 20000 random programs passed\n");
+    return 0;
+}
+#endif
@@ -0,0 +1,199 @@
+// Copyright [2020] <Puchkov Kyryll>
+#include "libcdevring.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#define load_acquire(p)         __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define store_release(p, v)     __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define full_barrier()          __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+int cdev_ring_open(struct cdev_ring *ring, const char *path, enum cdev_ring_role role) {
+    long page_size = sysconf(_SC_PAGESIZE);
+    struct cdev_ring_ctrl *ctrl;
+    void *map;
+
+    memset(ring, 0, sizeof(*ring));
+    ring->role = role;
+    ring->fd = open(path, O_RDWR | O_CLOEXEC);                          // A shared writable mapping needs O_RDWR
+    if (ring->fd < 0) {
+        return -1;
+    }
+
+    // Look at the control page first to learn the layout of the data area
+    ctrl = mmap(NULL, page_size, PROT_READ, MAP_SHARED, ring->fd, 0);
+    if (ctrl == MAP_FAILED) {
+        goto fail;
+    }
+    if (ctrl->magic != CDEV_RING_MAGIC || ctrl->version != CDEV_RING_VERSION) {
+        munmap(ctrl, page_size);
+        errno = EPROTO;
+        goto fail;
+    }
+    ring->size = ctrl->size;
+    ring->map_len = ctrl->data_offset + ctrl->size;
+    munmap(ctrl, page_size);
+
+    map = mmap(NULL, ring->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, 0);
+    if (map == MAP_FAILED) {
+        goto fail;
+    }
+    ring->ctrl = map;
+    ring->data = (char *)map + ring->ctrl->data_offset;
+
+    if (role == CDEV_RING_PRODUCER && ioctl(ring->fd, CDEV_RING_IOC_PRODUCER) < 0) {
+        munmap(map, ring->map_len);
+        goto fail;
+    }
+    return 0;
+
+fail:
+    {
+        int saved_errno = errno;
+        close(ring->fd);
+        ring->fd = -1;
+        errno = saved_errno;
+    }
+    return -1;
+}
+
+void cdev_ring_close(struct cdev_ring *ring) {
+    if (ring->ctrl != NULL) {
+        munmap(ring->ctrl, ring->map_len);
+        ring->ctrl = NULL;
+    }
+    if (ring->fd >= 0) {
+        close(ring->fd);                                                // The last producer closing marks EOF
+        ring->fd = -1;
+    }
+}
+
+static size_t ring_fill(const struct cdev_ring *ring, size_t head, size_t tail) {
+    return (head + ring->size - tail) % ring->size;
+}
+
+size_t cdev_ring_write_begin(struct cdev_ring *ring, void **ptr) {
+    size_t head = ring->ctrl->head;                                     // Only we write head
+    size_t tail = load_acquire(&ring->ctrl->tail);
+    size_t space = ring->size - 1 - ring_fill(ring, head, tail);
+    size_t contiguous = ring->size - head;
+
+    *ptr = ring->data + head;
+    return space < contiguous ? space : contiguous;
+}
+
+void cdev_ring_write_commit(struct cdev_ring *ring, size_t len) {
+    store_release(&ring->ctrl->head, (ring->ctrl->head + len) % ring->size);
+    full_barrier();                                                     // Pairs with the barrier after raising read_wait
+    if (__atomic_load_n(&ring->ctrl->read_wait, __ATOMIC_RELAXED)) {
+        ioctl(ring->fd, CDEV_RING_IOC_NOTIFY);
+    }
+}
+
+size_t cdev_ring_read_begin(struct cdev_ring *ring, const void **ptr) {
+    size_t head = load_acquire(&ring->ctrl->head);
+    size_t tail = ring->ctrl->tail;                                     // Only we write tail
+    size_t fill = ring_fill(ring, head, tail);
+    size_t contiguous = ring->size - tail;
+
+    *ptr = ring->data + tail;
+    return fill < contiguous ? fill : contiguous;
+}
+
+void cdev_ring_read_commit(struct cdev_ring *ring, size_t len) {
+    store_release(&ring->ctrl->tail, (ring->ctrl->tail + len) % ring->size);
+    full_barrier();
+    if (__atomic_load_n(&ring->ctrl->write_wait, __ATOMIC_RELAXED)) {
+        ioctl(ring->fd, CDEV_RING_IOC_NOTIFY);
+    }
+}
+
+/*  Raises the wait flag, re-checks the ring and only then sleeps in poll(), which
+ *  closes the window where the peer publishes between our check and our sleep.
+ */
+static int ring_wait(struct cdev_ring *ring, __u32 *flag, short events) {
+    struct pollfd pfd = { .fd = ring->fd, .events = events };
+    void *ptr;
+
+    for (;;) {
+        __atomic_store_n(flag, 1, __ATOMIC_RELAXED);
+        full_barrier();
+        if (events == POLLIN) {
+            if (cdev_ring_read_begin(ring, (const void **)&ptr) > 0) {
+                return 0;
+            }
+            if (load_acquire(&ring->ctrl->eof)) {
+                // The producer may have published right before leaving
+                return cdev_ring_read_begin(ring, (const void **)&ptr) > 0 ? 0 : 1;
+            }
+        } else if (cdev_ring_write_begin(ring, &ptr) > 0) {
+            return 0;
+        }
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+            return -1;
+        }
+    }
+}
+
+int cdev_ring_wait_writable(struct cdev_ring *ring) {
+    return ring_wait(ring, &ring->ctrl->write_wait, POLLOUT);
+}
+
+int cdev_ring_wait_readable(struct cdev_ring *ring) {
+    return ring_wait(ring, &ring->ctrl->read_wait, POLLIN);
+}
+
+ssize_t cdev_ring_write(struct cdev_ring *ring, const void *buf, size_t len) {
+    const char *src = buf;
+    size_t done = 0;
+    size_t span;
+    void *ptr;
+
+    while (done < len) {
+        span = cdev_ring_write_begin(ring, &ptr);
+        if (span == 0) {
+            if (cdev_ring_wait_writable(ring) < 0) {
+                return done > 0 ? (ssize_t)done : -1;
+            }
+            continue;
+        }
+        if (span > len - done) {
+            span = len - done;
+        }
+        memcpy(ptr, src + done, span);
+        cdev_ring_write_commit(ring, span);
+        done += span;
+    }
+    return done;
+}
+
+ssize_t cdev_ring_read(struct cdev_ring *ring, void *buf, size_t len) {
+    char *dst = buf;
+    size_t done = 0;
+    size_t span;
+    const void *ptr;
+    int rc;
+
+    if (len == 0) {
+        return 0;
+    }
+    rc = cdev_ring_wait_readable(ring);
+    if (rc != 0) {
+        return rc > 0 ? 0 : -1;
+    }
+    // At most two spans because of the wrap
+    while (done < len && (span = cdev_ring_read_begin(ring, &ptr)) > 0) {
+        if (span > len - done) {
+            span = len - done;
+        }
+        memcpy(dst + done, ptr, span);
+        cdev_ring_read_commit(ring, span);
+        done += span;
+    }
+    return done;
+}
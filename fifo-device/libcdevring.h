@@ -0,0 +1,51 @@
+// Copyright [2020] <Puchkov Kyryll>
+/*  User-space side of the shared /dev/cdevN ring (see cdev_ring.h).
+ *
+ *  The begin/commit pairs give direct access to the mapped data, so a record is
+ *  produced or consumed in place. Commit publishes the new position with a release
+ *  store and makes the CDEV_RING_IOC_NOTIFY syscall only if the peer is asleep.
+ *  cdev_ring_read/cdev_ring_write are copying helpers on top of them that sleep in
+ *  poll() when the ring is empty or full.
+ */
+#ifndef FIFO_DEVICE_LIBCDEVRING_H_
+#define FIFO_DEVICE_LIBCDEVRING_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "cdev_ring.h"
+
+enum cdev_ring_role {
+    CDEV_RING_CONSUMER,
+    CDEV_RING_PRODUCER,
+};
+
+struct cdev_ring {
+    int fd;
+    enum cdev_ring_role role;
+    struct cdev_ring_ctrl *ctrl;
+    char *data;
+    size_t size;
+    size_t map_len;
+};
+
+// Returns 0 on success, -1 with errno set otherwise
+int cdev_ring_open(struct cdev_ring *ring, const char *path, enum cdev_ring_role role);
+void cdev_ring_close(struct cdev_ring *ring);
+
+// Contiguous free (producer) or filled (consumer) span, 0 if there is none right now
+size_t cdev_ring_write_begin(struct cdev_ring *ring, void **ptr);
+void cdev_ring_write_commit(struct cdev_ring *ring, size_t len);
+size_t cdev_ring_read_begin(struct cdev_ring *ring, const void **ptr);
+void cdev_ring_read_commit(struct cdev_ring *ring, size_t len);
+
+// Sleep until the span above is not empty; 0 on success, 1 on EOF (consumer only), -1 on error
+int cdev_ring_wait_writable(struct cdev_ring *ring);
+int cdev_ring_wait_readable(struct cdev_ring *ring);
+
+// Writes all of buf, sleeping when the ring is full
+ssize_t cdev_ring_write(struct cdev_ring *ring, const void *buf, size_t len);
+// Reads at least one byte, sleeping when the ring is empty; 0 on EOF
+ssize_t cdev_ring_read(struct cdev_ring *ring, void *buf, size_t len);
+
+#endif  // FIFO_DEVICE_LIBCDEVRING_H_
@@ -0,0 +1,249 @@
+// Copyright [2020] <Puchkov Kyryll>
+/*  Moves a stream through /dev/cdev0 with every combination of the copy path
+ *  (read/write) and the shared ring (libcdevring), checks that the consumer got
+ *  exactly what the producer sent and prints the throughput of each combination.
+ *
+ *  Usage: ./test-cdev-ring [device] [megabytes]
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "libcdevring.h"
+
+#define PATTERN_SIZE        65521                                       ///< Prime, so the stream does not line up with the ring
+#define CHUNK_SIZE          (64 * 1024)
+
+static unsigned char pattern[PATTERN_SIZE];
+
+enum path { COPY_PATH, RING_PATH };
+
+static const char *path_name(enum path path) {
+    return path == COPY_PATH ? "copy" : "mmap";
+}
+
+// Expected stream byte at position pos is pattern[pos % PATTERN_SIZE]
+static void fill_pattern(unsigned char *dst, uint64_t pos, size_t len) {
+    while (len > 0) {
+        size_t from = pos % PATTERN_SIZE;
+        size_t n = PATTERN_SIZE - from < len ? PATTERN_SIZE - from : len;
+
+        memcpy(dst, pattern + from, n);
+        dst += n;
+        pos += n;
+        len -= n;
+    }
+}
+
+static int check_pattern(const unsigned char *src, uint64_t pos, size_t len) {
+    while (len > 0) {
+        size_t from = pos % PATTERN_SIZE;
+        size_t n = PATTERN_SIZE - from < len ? PATTERN_SIZE - from : len;
+
+        if (memcmp(src, pattern + from, n) != 0) {
+            return -1;
+        }
+        src += n;
+        pos += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Tells the parent that this producer has cleared the previous run's EOF mark
+static void signal_ready(int ready) {
+    char token = 0;
+
+    if (write(ready, &token, 1) != 1) {
+        perror("ready write");
+    }
+    close(ready);
+}
+
+static int produce(const char *device, enum path path, uint64_t total, int ready) {
+    static unsigned char buffer[CHUNK_SIZE];
+    uint64_t pos = 0;
+
+    if (path == COPY_PATH) {
+        int fd = open(device, O_WRONLY);
+        if (fd < 0) {
+            perror("producer open");
+            return 1;
+        }
+        signal_ready(ready);
+        while (pos < total) {
+            size_t n = total - pos < CHUNK_SIZE ? total - pos : CHUNK_SIZE;
+            ssize_t written;
+
+            fill_pattern(buffer, pos, n);
+            written = write(fd, buffer, n);
+            if (written < 0) {
+                perror("write");
+                return 1;
+            }
+            pos += written;
+            // A short write leaves the tail of the chunk to be regenerated next time
+        }
+        close(fd);
+    } else {
+        struct cdev_ring ring;
+
+        if (cdev_ring_open(&ring, device, CDEV_RING_PRODUCER) < 0) {
+            perror("producer cdev_ring_open");
+            return 1;
+        }
+        signal_ready(ready);
+        while (pos < total) {
+            void *ptr;
+            size_t n = cdev_ring_write_begin(&ring, &ptr);
+
+            if (n == 0) {
+                if (cdev_ring_wait_writable(&ring) < 0) {
+                    perror("cdev_ring_wait_writable");
+                    return 1;
+                }
+                continue;
+            }
+            if (n > total - pos) {
+                n = total - pos;
+            }
+            fill_pattern(ptr, pos, n);                                  // Produced right in the shared pages
+            cdev_ring_write_commit(&ring, n);
+            pos += n;
+        }
+        cdev_ring_close(&ring);
+    }
+    return 0;
+}
+
+static int consume(const char *device, enum path path, uint64_t total) {
+    static unsigned char buffer[CHUNK_SIZE];
+    uint64_t pos = 0;
+
+    if (path == COPY_PATH) {
+        int fd = open(device, O_RDONLY);
+        ssize_t n;
+
+        if (fd < 0) {
+            perror("consumer open");
+            return 1;
+        }
+        while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+            if (check_pattern(buffer, pos, n) != 0) {
+                fprintf(stderr, "data mismatch near byte %llu\n", (unsigned long long)pos);
+                return 1;
+            }
+            pos += n;
+        }
+        if (n < 0) {
+            perror("read");
+            return 1;
+        }
+        close(fd);
+    } else {
+        struct cdev_ring ring;
+        int rc;
+
+        if (cdev_ring_open(&ring, device, CDEV_RING_CONSUMER) < 0) {
+            perror("consumer cdev_ring_open");
+            return 1;
+        }
+        while ((rc = cdev_ring_wait_readable(&ring)) == 0) {
+            const void *ptr;
+            size_t n;
+
+            while ((n = cdev_ring_read_begin(&ring, &ptr)) > 0) {
+                if (check_pattern(ptr, pos, n) != 0) {              // Checked in place, never copied
+                    fprintf(stderr, "data mismatch near byte %llu\n", (unsigned long long)pos);
+                    return 1;
+                }
+                cdev_ring_read_commit(&ring, n);
+                pos += n;
+            }
+        }
+        if (rc < 0) {
+            perror("cdev_ring_wait_readable");
+            return 1;
+        }
+        cdev_ring_close(&ring);
+    }
+
+    if (pos != total) {
+        fprintf(stderr, "received %llu bytes instead of %llu\n",
+                (unsigned long long)pos, (unsigned long long)total);
+        return 1;
+    }
+    return 0;
+}
+
+static int run(const char *device, enum path producer, enum path consumer, uint64_t total) {
+    struct timespec start, end;
+    double seconds;
+    int status;
+    int ready[2];
+    char token;
+    int failed;
+    pid_t pid;
+
+    if (pipe(ready) < 0) {
+        perror("pipe");
+        return 1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return 1;
+    }
+    if (pid == 0) {
+        close(ready[0]);
+        exit(produce(device, producer, total, ready[1]));
+    }
+    close(ready[1]);
+    // Until the producer has opened the device, a reader still sees the last run's EOF
+    if (read(ready[0], &token, 1) != 1) {
+        failed = 1;
+    } else {
+        failed = consume(device, consumer, total);
+    }
+    close(ready[0]);
+    if (failed) {
+        kill(pid, SIGKILL);
+    }
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        failed = 1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%s -> %s: %s, %llu MB in %.3f s, %.1f MB/s\n",
+           path_name(producer), path_name(consumer), failed ? "FAILED" : "ok",
+           (unsigned long long)(total >> 20), seconds, (total >> 20) / seconds);
+    return failed;
+}
+
+int main(int argc, char *argv[]) {
+    const char *device = argc > 1 ? argv[1] : "/dev/cdev0";
+    uint64_t total = (argc > 2 ? strtoull(argv[2], NULL, 10) : 256) << 20;
+    int failed = 0;
+    size_t i;
+
+    srand(2020);
+    for (i = 0; i < PATTERN_SIZE; i++) {
+        pattern[i] = rand();
+    }
+
+    failed |= run(device, COPY_PATH, COPY_PATH, total);
+    failed |= run(device, RING_PATH, COPY_PATH, total);
+    failed |= run(device, COPY_PATH, RING_PATH, total);
+    failed |= run(device, RING_PATH, RING_PATH, total);
+
+    return failed;
+}
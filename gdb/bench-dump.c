@@ -0,0 +1,160 @@
+// Copyright [2020] <Puchkov Kyryll>
+/*  Time and size of a minidump against a full core of the same process. crash-test
+ *  fills the heap and crashes, once with minidump.h and once with the kernel writing
+ *  a core (ulimit -c unlimited in the child). The time runs from the "crash" line of
+ *  crash-test to the moment waitpid sees it gone: until then the service is still down.
+ *  The dumps go to a directory under /tmp and are removed.
+ *
+ *  Usage: ./bench-dump [-g heap GB] [-t threads] [-n runs]
+ *  Output: mode,heap_gb,threads,dump_ms,file_bytes,disk_bytes
+ */
+#define _GNU_SOURCE                                                     // mkdtemp in older glibc
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+struct result {
+    double    ms;
+    long long bytes;                                                    ///< st_size
+    long long disk;                                                     ///< Blocks really written
+};
+
+static long long now_ns(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Removes everything crash-test left in dir, adding up the dump files
+static void collect(const char *dir, struct result *result) {
+    DIR *entries = opendir(dir);
+    struct dirent *entry;
+    char path[4096];
+    struct stat st;
+
+    while (entries != NULL && (entry = readdir(entries)) != NULL) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+        if (stat(path, &st) == 0) {
+            result->bytes += st.st_size;
+            result->disk += (long long)st.st_blocks * 512;
+        }
+        unlink(path);
+    }
+    if (entries != NULL) {
+        closedir(entries);
+    }
+}
+
+static int run(int minidump, const char *heapGb, const char *threads, struct result *result) {
+    char dir[] = "/tmp/bench-dump.XXXXXX", line[128];
+    long long crashNs = 0;
+    int out[2], status;
+    FILE *child;
+    pid_t pid;
+
+    if (mkdtemp(dir) == NULL || pipe(out) < 0) {
+        perror("bench-dump");
+        return -1;
+    }
+    pid = fork();
+    if (pid == 0) {
+        struct rlimit core = { minidump ? 0 : RLIM_INFINITY, minidump ? 0 : RLIM_INFINITY };
+        char self[4096];
+        ssize_t len = readlink("/proc/self/exe", self, sizeof(self) - sizeof("crash-test"));
+
+        if (len < 0) {
+            _exit(127);
+        }
+        self[len] = '\0';
+        strcpy(strrchr(self, '/') + 1, "crash-test");                   // Next to bench-dump
+        dup2(out[1], STDOUT_FILENO);
+        close(out[0]);
+        close(out[1]);
+        if (setrlimit(RLIMIT_CORE, &core) < 0 || chdir(dir) < 0) {
+            _exit(127);
+        }
+        if (minidump) {
+            execl(self, "crash-test", "-g", heapGb, "-t", threads, "-d", dir, (char *)NULL);
+        } else {
+            execl(self, "crash-test", "-g", heapGb, "-t", threads, (char *)NULL);
+        }
+        _exit(127);
+    }
+    close(out[1]);
+    child = fdopen(out[0], "r");
+    while (child != NULL && fgets(line, sizeof(line), child) != NULL) {
+        if (sscanf(line, "crash %lld", &crashNs) == 1) {
+            break;
+        }
+    }
+    if (pid < 0 || waitpid(pid, &status, 0) < 0) {
+        perror("bench-dump");
+        return -1;
+    }
+    result->ms = (now_ns() - crashNs) / 1e6;
+    if (child != NULL) {
+        fclose(child);
+    }
+    result->bytes = 0;
+    result->disk = 0;
+    collect(dir, result);
+    rmdir(dir);
+    if (crashNs == 0 || !WIFSIGNALED(status)) {
+        fprintf(stderr, "crash-test did not crash (status %d)\n", status);
+        return -1;
+    }
+    if (!minidump && !WCOREDUMP(status)) {
+        fprintf(stderr, "No core: see /proc/sys/kernel/core_pattern and the hard ulimit -c\n");
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    const char *heapGb = "2", *threads = "8";
+    long runs = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "g:t:n:")) != -1) {
+        switch (opt) {
+            case 'g':
+                heapGb = optarg;
+                break;
+            case 't':
+                threads = optarg;
+                break;
+            case 'n':
+                runs = strtol(optarg, NULL, 0);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-g heap GB] [-t threads] [-n runs]\n", argv[0]);
+                return 2;
+        }
+    }
+
+    printf("mode,heap_gb,threads,dump_ms,file_bytes,disk_bytes\n");
+    for (long i = 0; i < runs; i++) {
+        for (int minidump = 1; minidump >= 0; minidump--) {
+            struct result result;
+
+            if (run(minidump, heapGb, threads, &result) < 0) {
+                return 1;
+            }
+            printf("%s,%s,%s,%.1f,%lld,%lld\n", minidump ? "minidump" : "core", heapGb, threads, result.ms,
+                   result.bytes, result.disk);
+            fflush(stdout);
+        }
+    }
+    return 0;
+}
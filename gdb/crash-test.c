@@ -0,0 +1,131 @@
+// Copyright [2020] <Puchkov Kyryll>
+/*  A process to crash: fills G GB of heap, starts T threads that wait in a few frames
+ *  of their own and then writes through a NULL pointer, as null.c does, a few calls
+ *  deep. With -d the crash goes to minidump.h and dir/minidump.<pid>.dmp, without it
+ *  the kernel writes a core if ulimit -c allows. Just before the crash it prints
+ *  "crash <CLOCK_MONOTONIC ns>" on stdout for bench-dump.
+ *
+ *  Usage: ./crash-test [-g heap GB] [-t threads] [-d dump dir] [-a]
+ *  -a calls abort() instead of the NULL write
+ */
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "minidump.h"
+
+#define CHUNK_BYTES         (64UL << 20)
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  never = PTHREAD_COND_INITIALIZER;
+static int             released;                                     ///< Never set: the workers wait forever
+static int             useAbort;
+static int             useMinidump;
+
+static __attribute__((noinline)) void wait_forever(int depth) {
+    if (depth > 0) {
+        wait_forever(depth - 1);
+        __asm__ volatile("");                                           // A real call, not a jump: a frame each
+        return;
+    }
+    pthread_mutex_lock(&lock);
+    while (!released) {
+        pthread_cond_wait(&never, &lock);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+static void *worker(void *arg) {
+    (void)arg;
+    if (useMinidump) {
+        minidump_thread_init();
+    }
+    wait_forever(3);
+    return NULL;
+}
+
+static __attribute__((noinline)) void store_null(char *where) {
+    if (useAbort) {
+        abort();
+    }
+    *where = 'c';
+}
+
+static __attribute__((noinline)) void crash(int depth) {
+    if (depth > 0) {
+        crash(depth - 1);
+        __asm__ volatile("");
+        return;
+    }
+    store_null(NULL);
+}
+
+int main(int argc, char *argv[]) {
+    double heapGb = 0;
+    long threads = 3;
+    const char *dir = NULL;
+    struct timespec now;
+    size_t chunks, i;
+    char **heap;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "g:t:d:a")) != -1) {
+        switch (opt) {
+            case 'g':
+                heapGb = strtod(optarg, NULL);
+                break;
+            case 't':
+                threads = strtol(optarg, NULL, 0);
+                break;
+            case 'd':
+                dir = optarg;
+                break;
+            case 'a':
+                useAbort = 1;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-g heap GB] [-t threads] [-d dump dir] [-a]\n", argv[0]);
+                return 2;
+        }
+    }
+    if (dir != NULL) {
+        if (minidump_install(dir) < 0) {
+            perror("minidump");
+            return 1;
+        }
+        useMinidump = 1;
+    }
+
+    // Touched pages with different contents, so that a core cannot skip them
+    chunks = heapGb * (1UL << 30) / CHUNK_BYTES;
+    heap = calloc(chunks + 1, sizeof(*heap));
+    for (i = 0; i < chunks; i++) {
+        heap[i] = malloc(CHUNK_BYTES);
+        if (heap[i] == NULL) {
+            fprintf(stderr, "Out of memory after %zu MB\n", i * (CHUNK_BYTES >> 20));
+            return 1;
+        }
+        for (size_t at = 0; at < CHUNK_BYTES; at += 4096) {
+            memset(heap[i] + at, (int)(i + at / 4096), 4096);
+        }
+    }
+    for (i = 0; i < (size_t)threads; i++) {
+        pthread_t thread;
+
+        if (pthread_create(&thread, NULL, worker, NULL) != 0) {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+    usleep(100000);                                                     // The threads reach their wait
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    printf("crash %lld\n", (long long)now.tv_sec * 1000000000 + now.tv_nsec);
+    fflush(stdout);
+    crash(3);
+    return 0;
+}
@@ -0,0 +1,562 @@
+// Copyright [2020] <Puchkov Kyryll>
+/*  Reads a dump of minidump.h on the machine where the binaries are. By default prints
+ *  the crash and a backtrace of every thread: the frame pointer chains are followed
+ *  through the saved stacks, every address is found in the module map and named with
+ *  addr2line. Frames of code built without frame pointers are skipped by the walk.
+ *
+ *  With -c it writes an ELF core instead: a note with the registers of every thread,
+ *  the auxiliary vector and the mapped files, and a segment for every saved piece of
+ *  memory. gdb opens it like a core the kernel wrote (gdb <executable> <core>) and
+ *  unwinds with the debug information, through the frames the walk here skips; memory
+ *  that was not saved reads as missing, or from the file it was mapped from.
+ *
+ *  Usage: ./minidump-read dump | ./minidump-read -c core dump
+ */
+#define _GNU_SOURCE                                                     // strsignal
+#include <elf.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/procfs.h>
+
+#include "minidump.h"
+
+#define MAX_DEPTH           64
+#define SCAN_BYTES          4096                                        ///< How far a frame record is looked for
+
+#if defined(__x86_64__)
+#define MACHINE             EM_X86_64
+#else
+#define MACHINE             EM_AARCH64
+#endif
+
+struct thread {
+    pid_t                          tid;
+    const struct user_regs_struct *regs;                                ///< NULL if it did not answer
+};
+
+struct memory {
+    uint64_t       addr;
+    uint64_t       size;
+    const uint8_t *data;
+};
+
+struct module {
+    uint64_t start;
+    uint64_t end;
+    uint64_t offset;                                                    ///< In the file
+    int      code;                                                      ///< Mapped executable
+    char    *path;
+};
+
+struct frame {
+    uint64_t  pc;
+    uint64_t  lookup;                                                   ///< Address in the module's ELF file
+    struct module *module;
+    char     *name;                                                     ///< From addr2line, "func at file:line"
+};
+
+static struct {
+    const struct minidump_header *header;
+    struct thread *threads;
+    size_t         nthreads;
+    struct memory *memory;
+    size_t         nmemory;
+    struct module *modules;
+    size_t         nmodules;
+    const uint8_t *auxv;
+    size_t         auxvSize;
+    int            complete;                                            ///< The END record is there
+} dump;
+
+static void *grow(void *array, size_t count, size_t size) {
+    void *bigger = count % 16 == 0 ? realloc(array, (count + 16) * size) : array;
+
+    if (bigger == NULL) {
+        perror("realloc");
+        exit(1);
+    }
+    return bigger;
+}
+
+static void parse_maps(const char *text, size_t len) {
+    char *copy = strndup(text, len), *line, *save = NULL;
+
+    for (line = strtok_r(copy, "\n", &save); line != NULL; line = strtok_r(NULL, "\n", &save)) {
+        uint64_t start, end, offset;
+        char perms[8];
+        int pathAt = 0;
+
+        if (sscanf(line, "%" SCNx64 "-%" SCNx64 " %7s %" SCNx64 " %*s %*s %n", &start, &end, perms, &offset,
+                   &pathAt) < 4 || pathAt == 0) {
+            continue;
+        }
+        dump.modules = grow(dump.modules, dump.nmodules, sizeof(*dump.modules));
+        dump.modules[dump.nmodules++] = (struct module){ start, end, offset, perms[2] == 'x',
+                                                         strdup(line + pathAt) };
+    }
+    free(copy);
+}
+
+static const uint8_t *load(const char *path) {
+    FILE *file = fopen(path, "rb");
+    uint8_t *data;
+    long size;
+    size_t at;
+
+    if (file == NULL || fseek(file, 0, SEEK_END) < 0 || (size = ftell(file)) < 0) {
+        perror(path);
+        exit(1);
+    }
+    rewind(file);
+    data = malloc(size + 1);
+    if (data == NULL || fread(data, 1, size, file) != (size_t)size) {
+        fprintf(stderr, "%s: cannot read\n", path);
+        exit(1);
+    }
+    fclose(file);
+
+    dump.header = (const struct minidump_header *)data;
+    if ((size_t)size < sizeof(*dump.header) || memcmp(dump.header->magic, MINIDUMP_MAGIC, 8) != 0) {
+        fprintf(stderr, "%s: not a minidump\n", path);
+        exit(1);
+    }
+    if (dump.header->machine != MACHINE) {
+        fprintf(stderr, "%s: dump of machine %u, this build reads %u\n", path, dump.header->machine, MACHINE);
+        exit(1);
+    }
+    for (at = sizeof(*dump.header); at + sizeof(struct minidump_record) <= (size_t)size;) {
+        const struct minidump_record *record = (const void *)(data + at);
+        const uint8_t *body = data + at + sizeof(*record);
+
+        if (record->size > size - at - sizeof(*record)) {
+            break;                                                      // Cut off while it was written
+        }
+        switch (record->type) {
+            case MINIDUMP_THREAD:
+                dump.threads = grow(dump.threads, dump.nthreads, sizeof(*dump.threads));
+                dump.threads[dump.nthreads++] = (struct thread){
+                    record->tid,
+                    record->size == sizeof(struct user_regs_struct) ? (const void *)body : NULL };
+                break;
+            case MINIDUMP_MEMORY:
+                if (record->size > 0) {
+                    dump.memory = grow(dump.memory, dump.nmemory, sizeof(*dump.memory));
+                    dump.memory[dump.nmemory++] = (struct memory){ record->addr, record->size, body };
+                }
+                break;
+            case MINIDUMP_MAPS:
+                parse_maps((const char *)body, record->size);
+                break;
+            case MINIDUMP_AUXV:
+                dump.auxv = body;
+                dump.auxvSize = record->size;
+                break;
+            case MINIDUMP_END:
+                dump.complete = 1;
+                break;
+        }
+        at += sizeof(*record) + ((record->size + 7) & ~(uint64_t)7);
+    }
+    if (!dump.complete) {
+        fprintf(stderr, "%s: the dump is cut off, reading what is there\n", path);
+    }
+    return data;
+}
+
+static int peek(uint64_t addr, void *out, size_t len) {
+    for (size_t i = 0; i < dump.nmemory; i++) {
+        const struct memory *m = &dump.memory[i];
+
+        if (addr >= m->addr && addr - m->addr + len <= m->size) {
+            memcpy(out, m->data + (addr - m->addr), len);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// The mapped code file addr is in
+static struct module *module_of(uint64_t addr) {
+    for (size_t i = 0; i < dump.nmodules; i++) {
+        const struct module *m = &dump.modules[i];
+
+        if (addr >= m->start && addr < m->end && m->code && m->path[0] == '/') {
+            return &dump.modules[i];
+        }
+    }
+    return NULL;
+}
+
+// The module's own address of a file offset, from its PT_LOAD headers
+static uint64_t file_address(const char *path, uint64_t offset) {
+    FILE *file = fopen(path, "rb");
+    uint64_t address = offset;
+    Elf64_Ehdr ehdr;
+    Elf64_Phdr phdr;
+
+    if (file == NULL) {
+        return address;
+    }
+    if (fread(&ehdr, sizeof(ehdr), 1, file) == 1 && memcmp(ehdr.e_ident, ELFMAG, SELFMAG) == 0 &&
+        ehdr.e_ident[EI_CLASS] == ELFCLASS64) {
+        for (int i = 0; i < ehdr.e_phnum; i++) {
+            if (fseek(file, ehdr.e_phoff + (uint64_t)i * ehdr.e_phentsize, SEEK_SET) < 0 ||
+                fread(&phdr, sizeof(phdr), 1, file) != 1) {
+                break;
+            }
+            if (phdr.p_type == PT_LOAD && offset >= phdr.p_offset && offset < phdr.p_offset + phdr.p_filesz) {
+                address = offset - phdr.p_offset + phdr.p_vaddr;
+                break;
+            }
+        }
+    }
+    fclose(file);
+    return address;
+}
+
+/* Code without frame pointers (libc) leaves anything in the fp register. Where the
+ * chain breaks, the walk goes on from the next frame record a little further up the
+ * stack: a pointer higher up next to a return address into code. Frames in between
+ * are lost. */
+static uint64_t scan_frame(uint64_t from) {
+    uint64_t record[2];
+
+    for (uint64_t at = from & ~(uint64_t)7; at < from + SCAN_BYTES; at += 8) {
+        if (peek(at, record, sizeof(record)) < 0) {
+            break;
+        }
+        if (record[0] > at && record[0] - at < MINIDUMP_STACK_MAX && module_of(record[1]) != NULL) {
+            return at;
+        }
+    }
+    return 0;
+}
+
+static size_t unwind(const struct user_regs_struct *regs, struct frame *frames) {
+    uint64_t fp = MINIDUMP_FP(regs), pc = MINIDUMP_PC(regs), sp = MINIDUMP_SP(regs);
+    size_t depth = 0;
+
+    frames[depth++].pc = pc;
+    if (fp < sp || fp - sp >= MINIDUMP_STACK_MAX) {
+        fp = scan_frame(sp);
+    }
+    while (depth < MAX_DEPTH && fp != 0) {
+        uint64_t record[2];                                             // The caller's fp and the return address
+
+        if (peek(fp, record, sizeof(record)) < 0) {
+            break;
+        }
+        if (record[0] <= fp || module_of(record[1]) == NULL) {
+            fp = scan_frame(fp + 8);                                    // Not a frame record after all
+            continue;
+        }
+        frames[depth++].pc = record[1];
+        fp = record[0];
+    }
+    for (size_t i = 0; i < depth; i++) {
+        struct module *module = module_of(frames[i].pc);
+        uint64_t pc = i > 0 ? frames[i].pc - 1 : frames[i].pc;          // The call, not the instruction after it
+
+        frames[i].module = module;
+        frames[i].name = NULL;
+        if (module != NULL) {
+            frames[i].lookup = file_address(module->path, pc - module->start + module->offset);
+        }
+    }
+    return depth;
+}
+
+// One addr2line per module, for all its frames
+static void symbolize(struct frame *frames, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        const char *path = frames[i].module != NULL ? frames[i].module->path : NULL;
+        size_t len, j;
+        char *command, line[4096];
+        FILE *pipe;
+
+        if (path == NULL || frames[i].name != NULL || strchr(path, '\'') != NULL) {
+            continue;
+        }
+        len = strlen(path) + 64;
+        for (j = i; j < count; j++) {
+            len += frames[j].module == frames[i].module ? 20 : 0;
+        }
+        command = malloc(len);
+        len = sprintf(command, "addr2line -C -f -p -e '%s'", path);
+        for (j = i; j < count; j++) {
+            if (frames[j].module == frames[i].module) {
+                len += sprintf(command + len, " 0x%" PRIx64, frames[j].lookup);
+            }
+        }
+        pipe = popen(command, "r");
+        free(command);
+        for (j = i; pipe != NULL && j < count; j++) {
+            if (frames[j].module != frames[i].module) {
+                continue;
+            }
+            if (fgets(line, sizeof(line), pipe) == NULL) {
+                break;
+            }
+            line[strcspn(line, "\n")] = '\0';
+            frames[j].name = strdup(line);
+        }
+        if (pipe != NULL) {
+            pclose(pipe);
+        }
+        for (j = i; j < count; j++) {
+            if (frames[j].module == frames[i].module && frames[j].name == NULL) {
+                frames[j].name = strdup("??");                          // No addr2line: the offset is still printed
+            }
+        }
+    }
+}
+
+static void print_backtraces(void) {
+    const struct minidump_header *h = dump.header;
+    time_t when = h->time;
+    char date[64];
+
+    strftime(date, sizeof(date), "%F %T", localtime(&when));
+    printf("pid %d, %s, thread %d: signal %d (%s), code %d", h->pid, date, h->tid,
+           h->signo, strsignal(h->signo), h->code);
+    if (h->code > 0) {
+        printf(", address 0x%" PRIx64, h->addr);                        // Sent signals carry a pid and uid there
+    }
+    printf("\n");
+    for (size_t t = 0; t < dump.nthreads; t++) {
+        struct frame frames[MAX_DEPTH];
+        size_t depth;
+
+        printf("\nThread %d%s\n", dump.threads[t].tid, dump.threads[t].tid == h->tid ? " (crashed)" : "");
+        if (dump.threads[t].regs == NULL) {
+            printf("  no registers, the thread did not answer\n");
+            continue;
+        }
+        depth = unwind(dump.threads[t].regs, frames);
+        symbolize(frames, depth);
+        for (size_t i = 0; i < depth; i++) {
+            const struct module *module = frames[i].module;
+
+            printf("  #%-2zu 0x%016" PRIx64, i, frames[i].pc);
+            if (module == NULL) {
+                printf("\n");
+                continue;
+            }
+            printf(" %s (%s+0x%" PRIx64 ")\n", frames[i].name, strrchr(module->path, '/') + 1, frames[i].lookup);
+            free(frames[i].name);
+        }
+    }
+}
+
+static void note(FILE *out, uint32_t type, const void *desc, uint32_t size) {
+    static const char zeros[4];
+    Elf64_Nhdr nhdr = { sizeof("CORE"), size, type };
+
+    fwrite(&nhdr, sizeof(nhdr), 1, out);
+    fwrite("CORE\0\0\0", 8, 1, out);                                    // The name, padded to 4
+    fwrite(desc, size, 1, out);
+    fwrite(zeros, -size & 3, 1, out);
+}
+
+static uint64_t note_size(uint32_t size) {
+    return sizeof(Elf64_Nhdr) + 8 + ((size + 3) & ~3U);
+}
+
+static void thread_note(FILE *out, const struct thread *thread) {
+    prstatus_t status;
+
+    memset(&status, 0, sizeof(status));
+    status.pr_pid = thread->tid;
+    status.pr_pgrp = dump.header->pid;
+    status.pr_cursig = dump.header->signo;
+    status.pr_info.si_signo = dump.header->signo;
+    memcpy(&status.pr_reg, thread->regs, sizeof(status.pr_reg));
+    note(out, NT_PRSTATUS, &status, sizeof(status));
+}
+
+static int compare_memory(const void *a, const void *b) {
+    const struct memory *x = a, *y = b;
+
+    return x->addr < y->addr ? -1 : x->addr > y->addr;
+}
+
+/* NT_FILE: count, page size, then start, end and offset in pages for every mapped
+ * file, then their names. gdb finds the executable and the libraries with it. */
+static uint8_t *file_note(size_t *size) {
+    size_t count = 0, names = 0, at, i;
+    uint64_t *words;
+    uint8_t *desc;
+
+    for (i = 0; i < dump.nmodules; i++) {
+        if (dump.modules[i].path[0] == '/') {
+            count++;
+            names += strlen(dump.modules[i].path) + 1;
+        }
+    }
+    *size = (2 + 3 * count) * sizeof(uint64_t) + names;
+    desc = calloc(1, *size);
+    words = (uint64_t *)desc;
+    words[0] = count;
+    words[1] = 4096;
+    at = (2 + 3 * count) * sizeof(uint64_t);
+    for (i = 0, count = 0; i < dump.nmodules; i++) {
+        const struct module *m = &dump.modules[i];
+
+        if (m->path[0] != '/') {
+            continue;
+        }
+        words[2 + 3 * count] = m->start;
+        words[3 + 3 * count] = m->end;
+        words[4 + 3 * count] = m->offset / 4096;
+        count++;
+        strcpy((char *)desc + at, m->path);
+        at += strlen(m->path) + 1;
+    }
+    return desc;
+}
+
+static int write_core(const char *path) {
+    const struct minidump_header *h = dump.header;
+    const struct thread *crashed = NULL;
+    size_t fileSize, segments = 0, i;
+    uint64_t notesSize = 0, offset, end = 0;
+    prpsinfo_t info;
+    siginfo_t signal;
+    uint8_t *files;
+    Elf64_Ehdr ehdr;
+    FILE *out;
+
+    // Pieces in address order without overlaps: a segment for each
+    qsort(dump.memory, dump.nmemory, sizeof(*dump.memory), compare_memory);
+    for (i = 0; i < dump.nmemory; i++) {
+        struct memory m = dump.memory[i];
+
+        if (m.addr + m.size <= end) {
+            continue;
+        }
+        if (m.addr < end) {
+            m.data += end - m.addr;
+            m.size -= end - m.addr;
+            m.addr = end;
+        }
+        end = m.addr + m.size;
+        dump.memory[segments++] = m;
+    }
+
+    memset(&info, 0, sizeof(info));
+    info.pr_pid = h->pid;
+    info.pr_state = 'R';
+    memset(&signal, 0, sizeof(signal));
+    signal.si_signo = h->signo;
+    signal.si_code = h->code;
+    signal.si_addr = (void *)(uintptr_t)h->addr;
+    for (i = 0; i < dump.nmodules; i++) {
+        if (dump.modules[i].path[0] == '/') {                           // The executable is mapped first
+            const char *name = strrchr(dump.modules[i].path, '/') + 1;
+
+            snprintf(info.pr_fname, sizeof(info.pr_fname), "%s", name);
+            snprintf(info.pr_psargs, sizeof(info.pr_psargs), "%s", dump.modules[i].path);
+            break;
+        }
+    }
+    files = file_note(&fileSize);
+
+    // The crashed thread first: gdb starts in it; the notes of the process follow it
+    for (i = 0; i < dump.nthreads; i++) {
+        if (dump.threads[i].regs != NULL) {
+            notesSize += note_size(sizeof(prstatus_t));
+            if (dump.threads[i].tid == h->tid) {
+                crashed = &dump.threads[i];
+            }
+        }
+    }
+    if (crashed == NULL) {
+        fprintf(stderr, "The crashed thread has no registers, no core to write\n");
+        return 1;
+    }
+    notesSize += note_size(sizeof(info)) + note_size(sizeof(signal)) + note_size(dump.auxvSize) +
+                 note_size(fileSize);
+
+    out = fopen(path, "wb");
+    if (out == NULL) {
+        perror(path);
+        return 1;
+    }
+    memset(&ehdr, 0, sizeof(ehdr));
+    memcpy(ehdr.e_ident, ELFMAG, SELFMAG);
+    ehdr.e_ident[EI_CLASS] = ELFCLASS64;
+    ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+    ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+    ehdr.e_type = ET_CORE;
+    ehdr.e_machine = h->machine;
+    ehdr.e_version = EV_CURRENT;
+    ehdr.e_phoff = sizeof(ehdr);
+    ehdr.e_ehsize = sizeof(ehdr);
+    ehdr.e_phentsize = sizeof(Elf64_Phdr);
+    ehdr.e_phnum = 1 + segments;
+    fwrite(&ehdr, sizeof(ehdr), 1, out);
+
+    offset = sizeof(ehdr) + ehdr.e_phnum * sizeof(Elf64_Phdr);
+    Elf64_Phdr phdr = { PT_NOTE, 0, offset, 0, 0, notesSize, 0, 1 };
+    fwrite(&phdr, sizeof(phdr), 1, out);
+    offset += notesSize;
+    for (i = 0; i < segments; i++) {
+        phdr = (Elf64_Phdr){ PT_LOAD, PF_R | PF_W, offset, dump.memory[i].addr, 0, dump.memory[i].size,
+                             dump.memory[i].size, 1 };
+        fwrite(&phdr, sizeof(phdr), 1, out);
+        offset += dump.memory[i].size;
+    }
+
+    thread_note(out, crashed);
+    note(out, NT_PRPSINFO, &info, sizeof(info));
+    note(out, NT_SIGINFO, &signal, sizeof(signal));
+    note(out, NT_AUXV, dump.auxv, dump.auxvSize);
+    note(out, NT_FILE, files, fileSize);
+    for (i = 0; i < dump.nthreads; i++) {
+        if (dump.threads[i].regs != NULL && &dump.threads[i] != crashed) {
+            thread_note(out, &dump.threads[i]);
+        }
+    }
+    for (i = 0; i < segments; i++) {
+        fwrite(dump.memory[i].data, dump.memory[i].size, 1, out);
+    }
+    free(files);
+    if (fclose(out) != 0) {
+        perror(path);
+        return 1;
+    }
+    printf("%s: %zu threads, %zu segments; gdb %s %s\n", path, dump.nthreads, segments,
+           info.pr_psargs[0] != '\0' ? info.pr_psargs : "<executable>", path);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    const char *core = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:")) != -1) {
+        switch (opt) {
+            case 'c':
+                core = optarg;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-c core] dump\n", argv[0]);
+                return 2;
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "Usage: %s [-c core] dump\n", argv[0]);
+        return 2;
+    }
+    load(argv[optind]);
+    if (core != NULL) {
+        return write_core(core);
+    }
+    print_backtraces();
+    return 0;
+}
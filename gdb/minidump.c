@@ -0,0 +1,507 @@
+// Copyright [2020] <Puchkov Kyryll>
+/*  Crash handler behind minidump.h. Memory is copied with write(2) straight from its
+ *  address: the kernel stops at the first page that cannot be read and returns what
+ *  it wrote, where a plain copy would fault again inside the handler.
+ */
+#define _GNU_SOURCE                                                     // pthread_getattr_np, process_vm_readv
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <link.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#if defined(__x86_64__)
+#include <asm/prctl.h>
+#endif
+
+#include "minidump.h"
+
+#define ALT_STACK_SIZE      (64 * 1024)
+#define GUARD_SIZE          4096
+#define ANSWER_MS           50                                          ///< A thread has this long to give its registers
+#define WINDOWS_MAX         40
+#define LIBRARIES_MAX       512
+#define REQUEST_SIGNAL      (SIGRTMIN + 4)
+
+#if defined(__x86_64__)
+#define MACHINE             EM_X86_64
+#else
+#define MACHINE             EM_AARCH64
+#endif
+
+static const int crashSignals[] = { SIGSEGV, SIGBUS, SIGABRT };
+
+static struct {
+    char                    path[PATH_MAX];                             ///< dir/minidump., the pid goes after
+    size_t                  pathLen;
+    int                     installed;
+    pthread_key_t           key;
+    struct sigaction        old[sizeof(crashSignals) / sizeof(crashSignals[0])];
+    _Atomic pid_t           crashing;                                   ///< The thread writing the dump, or 0
+    _Atomic pid_t           asked;                                      ///< The thread to answer, -tid once it does
+    _Atomic int             answered;
+    struct user_regs_struct answer;
+    uintptr_t               answerHi;
+    // Below only the crashed thread
+    int                     fd;
+    uint64_t                offset;
+    char                    copy[4096];
+} md;
+
+// Set while a thread waits out a crash of another thread: its own registers are there
+static __thread const ucontext_t *parked __attribute__((tls_model("initial-exec")));
+// Top of the thread's stack, 0 for a thread that never called minidump_thread_init()
+static __thread uintptr_t stackHi __attribute__((tls_model("initial-exec")));
+
+static pid_t gettid_raw(void) {
+    return syscall(SYS_gettid);
+}
+
+static void sleep_ms(long ms) {
+    struct timespec delay = { ms / 1000, (ms % 1000) * 1000000 };
+
+    nanosleep(&delay, NULL);
+}
+
+static void regs_from(const ucontext_t *uc, struct user_regs_struct *regs) {
+    memset(regs, 0, sizeof(*regs));
+#if defined(__x86_64__)
+    const greg_t *g = uc->uc_mcontext.gregs;
+
+    regs->r8 = g[REG_R8];
+    regs->r9 = g[REG_R9];
+    regs->r10 = g[REG_R10];
+    regs->r11 = g[REG_R11];
+    regs->r12 = g[REG_R12];
+    regs->r13 = g[REG_R13];
+    regs->r14 = g[REG_R14];
+    regs->r15 = g[REG_R15];
+    regs->rdi = g[REG_RDI];
+    regs->rsi = g[REG_RSI];
+    regs->rbp = g[REG_RBP];
+    regs->rbx = g[REG_RBX];
+    regs->rdx = g[REG_RDX];
+    regs->rax = g[REG_RAX];
+    regs->rcx = g[REG_RCX];
+    regs->rsp = g[REG_RSP];
+    regs->rip = g[REG_RIP];
+    regs->eflags = g[REG_EFL];
+    regs->orig_rax = -1;
+    regs->cs = g[REG_CSGSFS] & 0xffff;
+    regs->ss = 0x2b;                                                    // The user data segment
+    syscall(SYS_arch_prctl, ARCH_GET_FS, &regs->fs_base);               // Of the calling thread: gdb finds TLS with it
+#else
+    memcpy(regs->regs, uc->uc_mcontext.regs, sizeof(regs->regs));
+    regs->sp = uc->uc_mcontext.sp;
+    regs->pc = uc->uc_mcontext.pc;
+    regs->pstate = uc->uc_mcontext.pstate;
+#endif
+}
+
+static void put(const void *data, size_t len) {
+    const char *p = data;
+
+    while (len > 0) {
+        ssize_t n = write(md.fd, p, len);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return;
+        }
+        p += n;
+        len -= n;
+        md.offset += n;
+    }
+}
+
+// Writes the record with an unknown size; record_end() puts the size in
+static uint64_t record_begin(uint32_t type, pid_t tid, uint64_t addr) {
+    struct minidump_record record = { type, tid, addr, 0 };
+    uint64_t at = md.offset;
+
+    put(&record, sizeof(record));
+    return at;
+}
+
+static void record_end(uint64_t at) {
+    static const char zeros[8];
+    uint64_t size = md.offset - at - sizeof(struct minidump_record);
+
+    if (pwrite(md.fd, &size, sizeof(size), at + offsetof(struct minidump_record, size)) < 0) {
+        return;
+    }
+    put(zeros, -size & 7);
+}
+
+// Copies what can be read of [addr, addr + len), up to the first page that cannot
+static uint64_t copy_memory(uintptr_t addr, size_t len) {
+    uint64_t start = md.offset;
+
+    while (len > 0) {
+        ssize_t n = write(md.fd, (const void *)addr, len);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        addr += n;
+        len -= n;
+        md.offset += n;
+    }
+    return md.offset - start;
+}
+
+static void put_memory(pid_t tid, uintptr_t addr, size_t len) {
+    uint64_t at = record_begin(MINIDUMP_MEMORY, tid, addr);
+
+    copy_memory(addr, len);
+    record_end(at);
+}
+
+static void put_file(uint32_t type, const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    uint64_t at;
+    ssize_t n;
+
+    if (fd < 0) {
+        return;
+    }
+    at = record_begin(type, 0, 0);
+    while ((n = read(fd, md.copy, sizeof(md.copy))) > 0 || (n < 0 && errno == EINTR)) {
+        put(md.copy, n > 0 ? n : 0);
+    }
+    close(fd);
+    record_end(at);
+}
+
+/* The stack from just below sp, where leaf functions keep data, to its top, at most
+ * MINIDUMP_STACK_MAX. Without a known top the copy also stops at the end of the mapping,
+ * but the kernel may have merged the mapping with the one above. */
+static void put_stack(pid_t tid, uintptr_t sp, uintptr_t hi) {
+    uintptr_t from = sp - 128;
+    size_t len = hi > from && hi - from < MINIDUMP_STACK_MAX ? hi - from : MINIDUMP_STACK_MAX;
+    uint64_t at = record_begin(MINIDUMP_MEMORY, tid, from);
+
+    if (copy_memory(from, len) == 0) {
+        // sp is in the guard page after a stack overflow: the stack starts at the next page
+        from = (sp + 4095) & ~(uintptr_t)4095;
+        len = hi > from && hi - from < MINIDUMP_STACK_MAX ? hi - from : MINIDUMP_STACK_MAX;
+        if (pwrite(md.fd, &from, sizeof(from), at + offsetof(struct minidump_record, addr)) == sizeof(from)) {
+            copy_memory(from, len);
+        }
+    }
+    record_end(at);
+}
+
+static void put_thread(pid_t tid, const struct user_regs_struct *regs, uintptr_t hi) {
+    uint64_t at = record_begin(MINIDUMP_THREAD, tid, 0);
+
+    if (regs != NULL) {
+        put(regs, sizeof(*regs));
+    }
+    record_end(at);
+    if (regs != NULL) {
+        put_stack(tid, MINIDUMP_SP(regs), hi);
+    }
+}
+
+// Windows around the faulting address and every register that may point to memory
+static void put_windows(const siginfo_t *info, const struct user_regs_struct *regs) {
+    const unsigned long *values = (const unsigned long *)regs;
+    uintptr_t starts[WINDOWS_MAX];
+    size_t count = 0, i, j;
+
+    for (i = 0; i <= sizeof(*regs) / sizeof(*values) && count < WINDOWS_MAX; i++) {
+        uintptr_t value = i == 0 ? (uintptr_t)info->si_addr : values[i - 1];
+        uintptr_t start = (value - MINIDUMP_WINDOW / 2) & ~(uintptr_t)7;
+
+        if (value < 4096 || (i == 0 && (info->si_signo == SIGABRT || info->si_code <= 0))) {
+            continue;
+        }
+        for (j = 0; j < count && starts[j] != start; j++) {
+        }
+        if (j == count) {
+            starts[count++] = start;
+            put_memory(0, start, MINIDUMP_WINDOW);
+        }
+    }
+}
+
+// Reads memory that may not be there; 0 if it is all there
+static int peek(const void *addr, void *out, size_t len) {
+    struct iovec local = { out, len }, remote = { (void *)addr, len };
+
+    return process_vm_readv(getpid(), &local, 1, &remote, 1, 0) == (ssize_t)len ? 0 : -1;
+}
+
+/* gdb finds the libraries through DT_DEBUG of the executable, _r_debug and the
+ * link_map list, so those are saved with the names and the dynamic sections. */
+static void put_libraries(void) {
+    struct link_map *map = _r_debug.r_map, entry;
+    size_t count;
+
+    put_memory(0, (uintptr_t)&_r_debug, sizeof(_r_debug));
+    for (count = 0; map != NULL && count < LIBRARIES_MAX; count++, map = entry.l_next) {
+        if (peek(map, &entry, sizeof(entry)) < 0) {
+            break;
+        }
+        put_memory(0, (uintptr_t)map, sizeof(entry));
+        if (entry.l_name != NULL) {
+            put_memory(0, (uintptr_t)entry.l_name, 256);
+        }
+        if (entry.l_ld != NULL) {
+            put_memory(0, (uintptr_t)entry.l_ld, MINIDUMP_WINDOW);
+        }
+    }
+}
+
+// Asks one thread for its registers; 0 if it did not answer in time
+static int ask(pid_t pid, pid_t tid) {
+    pid_t expected = tid;
+    long waited;
+
+    atomic_store(&md.answered, 0);
+    atomic_store(&md.asked, tid);
+    if (syscall(SYS_tgkill, pid, tid, REQUEST_SIGNAL) < 0) {
+        atomic_store(&md.asked, 0);
+        return 0;
+    }
+    for (waited = 0; waited < ANSWER_MS && !atomic_load(&md.answered); waited++) {
+        sleep_ms(1);
+    }
+    if (atomic_compare_exchange_strong(&md.asked, &expected, 0)) {
+        return 0;                                                       // Not even started, it will not now
+    }
+    while (!atomic_load(&md.answered)) {
+        sleep_ms(1);                                                    // Started, the copy is almost done
+    }
+    return 1;
+}
+
+struct dirent64_raw {
+    uint64_t       ino;
+    int64_t        off;
+    unsigned short reclen;
+    unsigned char  type;
+    char           name[];
+};
+
+static void put_other_threads(pid_t pid, pid_t self) {
+    int fd = open("/proc/self/task", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    char entries[4096];
+    long n;
+
+    if (fd < 0) {
+        return;
+    }
+    while ((n = syscall(SYS_getdents64, fd, entries, sizeof(entries))) > 0) {
+        for (long at = 0; at < n; at += ((struct dirent64_raw *)(entries + at))->reclen) {
+            const char *name = ((struct dirent64_raw *)(entries + at))->name;
+            pid_t tid = 0;
+
+            for (; *name >= '0' && *name <= '9'; name++) {
+                tid = tid * 10 + *name - '0';
+            }
+            if (tid == 0 || *name != '\0' || tid == self) {
+                continue;
+            }
+            if (ask(pid, tid)) {
+                put_thread(tid, &md.answer, md.answerHi);
+            } else {
+                put_thread(tid, NULL, 0);
+            }
+        }
+    }
+    close(fd);
+}
+
+static size_t format_pid(char *out, pid_t pid) {
+    char digits[16];
+    size_t n = 0, i;
+
+    do {
+        digits[n++] = '0' + pid % 10;
+        pid /= 10;
+    } while (pid > 0);
+    for (i = 0; i < n; i++) {
+        out[i] = digits[n - 1 - i];
+    }
+    return n;
+}
+
+static void say(const char *text) {
+    if (write(STDERR_FILENO, text, strlen(text)) < 0) {
+        return;
+    }
+}
+
+static void dump(const siginfo_t *info, const ucontext_t *context, pid_t self) {
+    struct minidump_header header;
+    struct user_regs_struct regs;
+    pid_t pid = getpid();
+    size_t len = md.pathLen;
+
+    len += format_pid(md.path + len, pid);
+    memcpy(md.path + len, ".dmp", sizeof(".dmp"));
+    md.fd = open(md.path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (md.fd < 0) {
+        say("minidump: cannot create the dump\n");
+        return;
+    }
+    md.offset = 0;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MINIDUMP_MAGIC, sizeof(header.magic));
+    header.machine = MACHINE;
+    header.pid = pid;
+    header.tid = self;
+    header.signo = info->si_signo;
+    header.code = info->si_code;
+    header.addr = (uintptr_t)info->si_addr;
+    header.time = time(NULL);
+    put(&header, sizeof(header));
+
+    regs_from(context, &regs);
+    put_thread(self, &regs, stackHi);                                   // The crashed thread goes first
+    put_other_threads(pid, self);
+    put_windows(info, &regs);
+    put_file(MINIDUMP_MAPS, "/proc/self/maps");
+    put_file(MINIDUMP_AUXV, "/proc/self/auxv");
+    put_libraries();
+    record_end(record_begin(MINIDUMP_END, 0, 0));
+    close(md.fd);
+
+    say("minidump: written to ");
+    say(md.path);
+    say("\n");
+}
+
+static void on_request(int signo, siginfo_t *info, void *context) {
+    pid_t self = gettid_raw(), expected = self;
+    int saved = errno;
+
+    (void)signo;
+    (void)info;
+    if (atomic_compare_exchange_strong(&md.asked, &expected, -self)) {
+        regs_from(parked != NULL ? parked : context, &md.answer);
+        md.answerHi = stackHi;
+        atomic_store(&md.answered, 1);
+        while (atomic_load(&md.crashing) != 0) {
+            sleep_ms(1);                                                // Stays still while its stack is copied
+        }
+    }
+    errno = saved;
+}
+
+static void on_crash(int signo, siginfo_t *info, void *context) {
+    pid_t self = gettid_raw(), expected = 0;
+    size_t i;
+
+    if (!atomic_compare_exchange_strong(&md.crashing, &expected, self)) {
+        parked = context;                                               // Another thread is writing the dump
+        while (atomic_load(&md.crashing) != 0) {
+            sleep_ms(1);
+        }
+        parked = NULL;
+        return;                                                         // The fault happens again, for the old handler
+    }
+    for (i = 0; i < sizeof(crashSignals) / sizeof(crashSignals[0]); i++) {
+        if (crashSignals[i] == signo) {
+            dump(info, context, self);
+            if (md.old[i].sa_handler == SIG_IGN) {
+                md.old[i].sa_handler = SIG_DFL;                         // Else the fault would repeat forever
+            }
+            sigaction(signo, &md.old[i], NULL);
+        }
+    }
+    atomic_store(&md.crashing, 0);
+    if (info->si_code <= 0) {
+        raise(signo);                                                   // Sent, not a fault: it would not happen again
+    }
+}
+
+static void alt_stack_free(void *arg) {
+    stack_t none = { .ss_flags = SS_DISABLE };
+
+    sigaltstack(&none, NULL);
+    munmap(arg, ALT_STACK_SIZE + GUARD_SIZE);
+}
+
+int minidump_thread_init(void) {
+    stack_t stack = { .ss_size = ALT_STACK_SIZE };
+    pthread_attr_t attr;
+    size_t stackSize;
+    void *stackLo;
+    char *area;
+
+    if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+        if (pthread_attr_getstack(&attr, &stackLo, &stackSize) == 0) {
+            stackHi = (uintptr_t)stackLo + stackSize;
+        }
+        pthread_attr_destroy(&attr);
+    }
+
+    // The guard keeps the mapping apart from a stack below it, where a stack copy ends
+    area = mmap(NULL, ALT_STACK_SIZE + GUARD_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (area == MAP_FAILED) {
+        return -1;
+    }
+    stack.ss_sp = area + GUARD_SIZE;
+    if (mprotect(area, GUARD_SIZE, PROT_NONE) < 0 || sigaltstack(&stack, NULL) < 0) {
+        munmap(area, ALT_STACK_SIZE + GUARD_SIZE);
+        return -1;
+    }
+    pthread_setspecific(md.key, area);                                  // Freed when the thread exits
+    return 0;
+}
+
+int minidump_install(const char *dir) {
+    struct sigaction action;
+    size_t len = strlen(dir), i;
+
+    if (md.installed) {
+        errno = EBUSY;
+        return -1;
+    }
+    if (len + sizeof("/minidump.") + 16 + sizeof(".dmp") > sizeof(md.path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memcpy(md.path, dir, len);
+    memcpy(md.path + len, "/minidump.", sizeof("/minidump."));
+    md.pathLen = len + sizeof("/minidump.") - 1;
+    if (pthread_key_create(&md.key, alt_stack_free) != 0 || minidump_thread_init() < 0) {
+        return -1;
+    }
+
+    memset(&action, 0, sizeof(action));
+    action.sa_flags = SA_SIGINFO | SA_ONSTACK | SA_RESTART;
+    action.sa_sigaction = on_request;
+    if (sigaction(REQUEST_SIGNAL, &action, NULL) < 0) {
+        return -1;
+    }
+    action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+    action.sa_sigaction = on_crash;
+    for (i = 0; i < sizeof(crashSignals) / sizeof(crashSignals[0]); i++) {
+        if (sigaction(crashSignals[i], &action, &md.old[i]) < 0) {
+            return -1;
+        }
+    }
+    md.installed = 1;
+    return 0;
+}
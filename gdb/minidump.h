@@ -0,0 +1,72 @@
+// Copyright [2020] <Puchkov Kyryll>
+/*  Crash reporter that lives in the process. On SIGSEGV, SIGBUS or SIGABRT the handler
+ *  runs on an alternate stack, so a stack overflow is reported too, and writes a
+ *  minidump instead of the whole address space: the registers and the stack of every
+ *  thread, a window of memory around the faulting address and the pointers in the
+ *  registers of the crashed thread, the module map, the auxiliary vector and the
+ *  dynamic linker's list of libraries. Then the previous handler runs again and the
+ *  process exits as it would have. The dump takes milliseconds and tens of KB,
+ *  whatever the size of the heap.
+ *
+ *  The other threads are asked for their registers with SIGRTMIN + 4; a thread that
+ *  blocks it is listed without registers and stack after a timeout.
+ *  The handler only makes system calls: it does not allocate, lock or use stdio.
+ *
+ *  minidump-read prints symbolized backtraces of a dump or turns it into a core file
+ *  for gdb. The file is a header and then records, each one aligned to 8 bytes.
+ */
+#ifndef GDB_MINIDUMP_H_
+#define GDB_MINIDUMP_H_
+
+#include <stdint.h>
+#include <sys/user.h>
+
+#define MINIDUMP_MAGIC      "MINIDMP1"
+#define MINIDUMP_STACK_MAX  (256 * 1024)                                ///< Per thread, from sp up
+#define MINIDUMP_WINDOW     1024                                        ///< Around each faulting address
+
+enum minidump_type {
+    MINIDUMP_THREAD = 1,                                                ///< tid; struct user_regs_struct, empty if not given
+    MINIDUMP_MEMORY,                                                    ///< addr; the bytes that could be read there
+    MINIDUMP_MAPS,                                                      ///< /proc/self/maps
+    MINIDUMP_AUXV,                                                      ///< /proc/self/auxv
+    MINIDUMP_END,
+};
+
+struct minidump_header {
+    char     magic[8];
+    uint32_t machine;                                                   ///< ELF e_machine of the process
+    int32_t  pid;
+    int32_t  tid;                                                       ///< The thread that crashed
+    int32_t  signo;
+    int32_t  code;                                                      ///< si_code
+    uint64_t addr;                                                      ///< si_addr
+    uint64_t time;                                                      ///< CLOCK_REALTIME, seconds
+};
+
+struct minidump_record {
+    uint32_t type;
+    int32_t  tid;
+    uint64_t addr;
+    uint64_t size;                                                      ///< Of the data after the record
+};
+
+#if defined(__x86_64__)
+#define MINIDUMP_PC(regs)   ((regs)->rip)
+#define MINIDUMP_SP(regs)   ((regs)->rsp)
+#define MINIDUMP_FP(regs)   ((regs)->rbp)
+#elif defined(__aarch64__)
+#define MINIDUMP_PC(regs)   ((regs)->pc)
+#define MINIDUMP_SP(regs)   ((regs)->sp)
+#define MINIDUMP_FP(regs)   ((regs)->regs[29])
+#else
+#error "minidump knows the registers of x86_64 and aarch64 only"
+#endif
+
+// Writes dir/minidump.<pid>.dmp on a crash; the calling thread gets an alternate stack
+int minidump_install(const char *dir);
+
+// An alternate stack for a thread created later; without one its stack overflow is lost
+int minidump_thread_init(void);
+
+#endif  // GDB_MINIDUMP_H_
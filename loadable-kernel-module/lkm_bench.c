@@ -0,0 +1,610 @@
+// Copyright [2020] <Puchkov Kyryll>
+/*  Microbenchmarks of the kernel primitives our drivers are built from, on the skeleton
+ *  of lkm_example.c. A line written to /sys/kernel/debug/lkm_bench/control runs one
+ *  test and returns when it is done; /sys/kernel/debug/lkm_bench/results lists every
+ *  run since the load (or since "reset") as CSV with ns/op percentiles.
+ *
+ *  echo "test=kmalloc size=256 iters=100000 batch=64 threads=2 cpus=0-1" > control
+ *
+ *  kmalloc, kmem_cache, alloc_pages and vmalloc report the allocation and the free
+ *  as two rows; spinlock and mutex time a lock and unlock around a shared counter,
+ *  so threads > 1 measures them contended; copy_to_user and copy_from_user copy size
+ *  bytes between a kernel buffer and an anonymous mapping of the writing process.
+ *
+ *  Tests other than the copies run in kthreads bound to the CPUs of cpus in turn
+ *  (all online CPUs by default); they start together from a wait queue. The copies
+ *  need the writer's address space and run in its context: pin it with taskset.
+ *  One clock read per batch of operations keeps its cost out of the figures, so every
+ *  sample is the mean of a batch; batch=1 times operations one by one.
+ */
+#include <linux/init.h>                                                 // Macros used to mark up functions e.g., __init __exit
+#include <linux/module.h>                                               // Core header for loading LKMs into the kernel
+#include <linux/kernel.h>                                               // Contains types, macros, functions for the kernel
+#include <linux/debugfs.h>                                              // control and results
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/gfp.h>
+#include <linux/mm.h>                                                   // vm_mmap for the user buffer of the copies
+#include <linux/mman.h>
+#include <linux/vmalloc.h>
+#include <linux/uaccess.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/wait.h>
+#include <linux/completion.h>
+#include <linux/cpumask.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/ktime.h>
+#include <linux/sort.h>
+#include <linux/string.h>
+#include <linux/list.h>
+#include <linux/math64.h>
+
+#define CONTROL_MAX         256                                         ///< Bytes of one control line
+#define MAX_BATCH           4096
+#define MAX_SAMPLES         (1U << 20)                                  ///< Per row: iters / batch * threads
+#define MAX_THREADS         256
+#define MAX_SIZE            (64UL << 20)
+#define MAX_BATCH_BYTES     (256UL << 20)                               ///< Memory one batch may hold per thread
+#define MAX_ROWS            4096
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Puchkov Kyryll");
+MODULE_DESCRIPTION("Allocator, user copy and lock microbenchmarks behind debugfs.");
+MODULE_VERSION("0.1");
+
+enum bench_test {
+    BENCH_KMALLOC,
+    BENCH_KMEM_CACHE,
+    BENCH_ALLOC_PAGES,
+    BENCH_VMALLOC,
+    BENCH_COPY_TO_USER,
+    BENCH_COPY_FROM_USER,
+    BENCH_SPINLOCK,
+    BENCH_MUTEX,
+};
+
+static const char * const testNames[] = {
+    "kmalloc", "kmem_cache", "alloc_pages", "vmalloc",
+    "copy_to_user", "copy_from_user", "spinlock", "mutex",
+};
+
+// Row names: the allocation, then the free
+static const char * const rowNames[][2] = {
+    { "kmalloc", "kfree" },
+    { "kmem_cache_alloc", "kmem_cache_free" },
+    { "alloc_pages", "__free_pages" },
+    { "vmalloc", "vfree" },
+    { "copy_to_user", NULL },
+    { "copy_from_user", NULL },
+    { "spin_lock+unlock", NULL },
+    { "mutex_lock+unlock", NULL },
+};
+
+struct bench_params {
+    enum bench_test test;
+    unsigned long size;
+    unsigned int  iters;                                                ///< Operations per thread
+    unsigned int  batch;
+    unsigned int  threads;
+    cpumask_var_t cpus;
+};
+
+/*  One test being run. Samples are picoseconds per operation, one per batch; thread i
+ *  fills [i * batches, (i + 1) * batches) of each array.
+ */
+struct bench_run {
+    const struct bench_params *params;
+    unsigned int       batches;
+    u64               *samples[2];                                      ///< Allocations or the only row, frees
+    struct kmem_cache *cache;
+    wait_queue_head_t  start;
+    bool               go;
+    bool               abort;
+    spinlock_t         spin;
+    struct mutex       mutex;
+    u64                counter;                                         ///< What the locks protect
+};
+
+struct bench_worker {
+    struct bench_run   *run;
+    unsigned int        index;
+    int                 error;
+    struct task_struct *task;
+    struct completion   done;                                           ///< The samples of the thread are in
+};
+
+/*  One line of results, in picoseconds per operation.
+ */
+struct bench_row {
+    struct list_head list;
+    const char      *name;
+    unsigned long    size;
+    unsigned int     threads;
+    unsigned int     batch;
+    u64              ops;
+    u64              mean;
+    u64              p50, p90, p99, p999, max;
+    bool             copy;                                              ///< Prints MB/s
+};
+
+static struct dentry *debugDir;
+static DEFINE_MUTEX(runLock);                                           ///< One test at a time
+static DEFINE_MUTEX(rowsLock);
+static LIST_HEAD(rows);
+static unsigned int rowCount;
+
+static inline u64 per_op(u64 startNs, u64 endNs, unsigned int batch) {
+    return div_u64((endNs - startNs) * 1000, batch);
+}
+
+// Allocates a batch and frees it, both timed; objects hold the batch in between
+static int alloc_batch(struct bench_run *run, void **objects, u64 *allocPs, u64 *freePs) {
+    const struct bench_params *p = run->params;
+    unsigned int order = get_order(p->size), i, done = 0;
+    u64 start, middle, end;
+    int error = 0;
+
+    start = ktime_get_ns();
+    switch (p->test) {
+        case BENCH_KMALLOC:
+            for (; done < p->batch && (objects[done] = kmalloc(p->size, GFP_KERNEL | __GFP_NOWARN)); done++) {
+            }
+            break;
+        case BENCH_KMEM_CACHE:
+            for (; done < p->batch && (objects[done] = kmem_cache_alloc(run->cache, GFP_KERNEL)); done++) {
+            }
+            break;
+        case BENCH_ALLOC_PAGES:
+            for (; done < p->batch && (objects[done] = alloc_pages(GFP_KERNEL | __GFP_NOWARN, order)); done++) {
+            }
+            break;
+        case BENCH_VMALLOC:
+            for (; done < p->batch && (objects[done] = vmalloc(p->size)); done++) {
+            }
+            break;
+        default:
+            break;
+    }
+    middle = ktime_get_ns();
+    if (done < p->batch) {
+        error = -ENOMEM;
+    }
+
+    for (i = 0; i < done; i++) {
+        switch (p->test) {
+            case BENCH_KMALLOC:
+                kfree(objects[i]);
+                break;
+            case BENCH_KMEM_CACHE:
+                kmem_cache_free(run->cache, objects[i]);
+                break;
+            case BENCH_ALLOC_PAGES:
+                __free_pages(objects[i], order);
+                break;
+            case BENCH_VMALLOC:
+                vfree(objects[i]);
+                break;
+            default:
+                break;
+        }
+    }
+    end = ktime_get_ns();
+
+    *allocPs = per_op(start, middle, p->batch);
+    *freePs = per_op(middle, end, p->batch);
+    return error;
+}
+
+static u64 lock_batch(struct bench_run *run) {
+    unsigned int i, batch = run->params->batch;
+    u64 start = ktime_get_ns();
+
+    if (run->params->test == BENCH_SPINLOCK) {
+        for (i = 0; i < batch; i++) {
+            spin_lock(&run->spin);
+            run->counter++;
+            spin_unlock(&run->spin);
+        }
+    } else {
+        for (i = 0; i < batch; i++) {
+            mutex_lock(&run->mutex);
+            run->counter++;
+            mutex_unlock(&run->mutex);
+        }
+    }
+    return per_op(start, ktime_get_ns(), batch);
+}
+
+static int bench_thread(void *arg) {
+    struct bench_worker *worker = arg;
+    struct bench_run *run = worker->run;
+    const struct bench_params *p = run->params;
+    size_t first = (size_t)worker->index * run->batches;
+    void **objects = NULL;
+    unsigned int b;
+
+    if (p->test != BENCH_SPINLOCK && p->test != BENCH_MUTEX) {
+        objects = kmalloc_array(p->batch, sizeof(*objects), GFP_KERNEL);
+        if (objects == NULL) {
+            worker->error = -ENOMEM;
+        }
+    }
+    wait_event(run->start, READ_ONCE(run->go));
+
+    for (b = 0; b < run->batches && worker->error == 0 && !READ_ONCE(run->abort); b++) {
+        if (objects != NULL) {
+            worker->error = alloc_batch(run, objects, &run->samples[0][first + b], &run->samples[1][first + b]);
+        } else {
+            run->samples[0][first + b] = lock_batch(run);
+        }
+        cond_resched();                                                 // Between batches, never inside one
+    }
+    kfree(objects);
+    complete(&worker->done);
+
+    // Waits for kthread_stop(): a thread that returned by itself could not be joined
+    set_current_state(TASK_INTERRUPTIBLE);
+    while (!kthread_should_stop()) {
+        schedule();
+        set_current_state(TASK_INTERRUPTIBLE);
+    }
+    __set_current_state(TASK_RUNNING);
+    return 0;
+}
+
+static int run_threads(struct bench_run *run) {
+    const struct bench_params *p = run->params;
+    struct bench_worker *workers;
+    unsigned int i;
+    int cpu = -1, error = 0;
+
+    workers = kcalloc(p->threads, sizeof(*workers), GFP_KERNEL);
+    if (workers == NULL) {
+        return -ENOMEM;
+    }
+    for (i = 0; i < p->threads; i++) {
+        cpu = cpumask_next(cpu, p->cpus);                               // The CPUs of the mask in turn
+        if (cpu >= nr_cpu_ids) {
+            cpu = cpumask_first(p->cpus);
+        }
+        workers[i].run = run;
+        workers[i].index = i;
+        init_completion(&workers[i].done);
+        workers[i].task = kthread_create(bench_thread, &workers[i], "lkm_bench/%u", i);
+        if (IS_ERR(workers[i].task)) {
+            error = PTR_ERR(workers[i].task);
+            workers[i].task = NULL;
+            WRITE_ONCE(run->abort, true);
+            break;
+        }
+        kthread_bind(workers[i].task, cpu);
+        wake_up_process(workers[i].task);
+    }
+
+    WRITE_ONCE(run->go, true);
+    wake_up_all(&run->start);
+    for (i = 0; i < p->threads && workers[i].task != NULL; i++) {
+        // kthread_stop() of a thread not started yet would never run its function
+        wait_for_completion(&workers[i].done);
+        kthread_stop(workers[i].task);
+        if (error == 0) {
+            error = workers[i].error;
+        }
+    }
+    kfree(workers);
+    return error;
+}
+
+// Copies in the writer's context, to or from an anonymous mapping of its own
+static int run_copy(struct bench_run *run) {
+    const struct bench_params *p = run->params;
+    unsigned long user;
+    unsigned int b, i;
+    void *buffer;
+    int error = 0;
+
+    buffer = kvmalloc(p->size, GFP_KERNEL);
+    if (buffer == NULL) {
+        return -ENOMEM;
+    }
+    memset(buffer, 0x5a, p->size);
+    user = vm_mmap(NULL, 0, p->size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, 0);
+    if (IS_ERR_VALUE(user)) {
+        kvfree(buffer);
+        return (int)user;
+    }
+    if (copy_to_user((void __user *)user, buffer, p->size) != 0) {      // Faults the pages in before the clock runs
+        error = -EFAULT;
+    }
+
+    for (b = 0; b < run->batches && error == 0; b++) {
+        u64 start = ktime_get_ns();
+
+        for (i = 0; i < p->batch; i++) {
+            unsigned long left = p->test == BENCH_COPY_TO_USER ?
+                                 copy_to_user((void __user *)user, buffer, p->size) :
+                                 copy_from_user(buffer, (const void __user *)user, p->size);
+
+            if (left != 0) {
+                error = -EFAULT;
+                break;
+            }
+        }
+        run->samples[0][b] = per_op(start, ktime_get_ns(), p->batch);
+        if (fatal_signal_pending(current)) {
+            error = -EINTR;
+        }
+        cond_resched();
+    }
+    vm_munmap(user, p->size);
+    kvfree(buffer);
+    return error;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    u64 x = *(const u64 *)a, y = *(const u64 *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void add_row(const struct bench_run *run, const char *name, u64 *samples) {
+    const struct bench_params *p = run->params;
+    size_t count = (size_t)run->batches * p->threads, i;
+    struct bench_row *row;
+    u64 total = 0;
+
+    row = kzalloc(sizeof(*row), GFP_KERNEL);
+    if (row == NULL) {
+        return;
+    }
+    sort(samples, count, sizeof(*samples), compare_u64, NULL);
+    for (i = 0; i < count; i++) {
+        total += samples[i];
+    }
+    row->name = name;
+    row->size = p->size;
+    row->threads = p->threads;
+    row->batch = p->batch;
+    row->ops = (u64)count * p->batch;
+    row->mean = div64_u64(total, count);
+    row->p50 = samples[(count - 1) * 500 / 1000];
+    row->p90 = samples[(count - 1) * 900 / 1000];
+    row->p99 = samples[(count - 1) * 990 / 1000];
+    row->p999 = samples[(count - 1) * 999 / 1000];
+    row->max = samples[count - 1];
+    row->copy = p->test == BENCH_COPY_TO_USER || p->test == BENCH_COPY_FROM_USER;
+
+    mutex_lock(&rowsLock);
+    if (rowCount == MAX_ROWS) {                                         // The oldest goes
+        struct bench_row *old = list_first_entry(&rows, struct bench_row, list);
+
+        list_del(&old->list);
+        kfree(old);
+        rowCount--;
+    }
+    list_add_tail(&row->list, &rows);
+    rowCount++;
+    mutex_unlock(&rowsLock);
+}
+
+static int bench_run(const struct bench_params *p) {
+    bool copy = p->test == BENCH_COPY_TO_USER || p->test == BENCH_COPY_FROM_USER;
+    bool twoRows = rowNames[p->test][1] != NULL;
+    struct bench_run run = { .params = p };
+    size_t count;
+    int error;
+
+    run.batches = p->iters / p->batch;
+    count = (size_t)run.batches * p->threads;
+    if (run.batches == 0 || count > MAX_SAMPLES) {
+        return -E2BIG;                                                  // Fewer iters or a bigger batch
+    }
+    init_waitqueue_head(&run.start);
+    spin_lock_init(&run.spin);
+    mutex_init(&run.mutex);
+    run.samples[0] = vmalloc(array_size(count, sizeof(u64)));
+    run.samples[1] = twoRows ? vmalloc(array_size(count, sizeof(u64))) : NULL;
+    if (run.samples[0] == NULL || (twoRows && run.samples[1] == NULL)) {
+        error = -ENOMEM;
+        goto out;
+    }
+    if (p->test == BENCH_KMEM_CACHE) {
+        run.cache = kmem_cache_create("lkm_bench", p->size, 0, 0, NULL);
+        if (run.cache == NULL) {
+            error = -ENOMEM;
+            goto out;
+        }
+    }
+
+    error = copy ? run_copy(&run) : run_threads(&run);
+    if (error == 0) {
+        add_row(&run, rowNames[p->test][0], run.samples[0]);
+        if (twoRows) {
+            add_row(&run, rowNames[p->test][1], run.samples[1]);
+        }
+    }
+out:
+    if (run.cache != NULL) {
+        kmem_cache_destroy(run.cache);
+    }
+    vfree(run.samples[1]);
+    vfree(run.samples[0]);
+    mutex_destroy(&run.mutex);
+    return error;
+}
+
+static void rows_clear(void) {
+    struct bench_row *row, *next;
+
+    mutex_lock(&rowsLock);
+    list_for_each_entry_safe(row, next, &rows, list) {
+        list_del(&row->list);
+        kfree(row);
+    }
+    rowCount = 0;
+    mutex_unlock(&rowsLock);
+}
+
+// "key=value ..." into p, or "reset"; the defaults are already in p
+static int parse_control(char *line, struct bench_params *p) {
+    char *token, *value, *end;
+    int index, error = 0;
+
+    while ((token = strsep(&line, " \t\n")) != NULL && error == 0) {
+        if (*token == '\0') {
+            continue;
+        }
+        value = strchr(token, '=');
+        if (value == NULL) {
+            return -EINVAL;
+        }
+        *value++ = '\0';
+        if (strcmp(token, "test") == 0) {
+            index = match_string(testNames, ARRAY_SIZE(testNames), value);
+            error = index < 0 ? index : 0;
+            p->test = index;
+        } else if (strcmp(token, "size") == 0) {
+            p->size = memparse(value, &end);                            // 4K, 1M
+            error = *end != '\0' ? -EINVAL : 0;
+        } else if (strcmp(token, "iters") == 0) {
+            error = kstrtouint(value, 0, &p->iters);
+        } else if (strcmp(token, "batch") == 0) {
+            error = kstrtouint(value, 0, &p->batch);
+        } else if (strcmp(token, "threads") == 0) {
+            error = kstrtouint(value, 0, &p->threads);
+        } else if (strcmp(token, "cpus") == 0) {
+            error = cpulist_parse(value, p->cpus);
+        } else {
+            error = -EINVAL;
+        }
+    }
+    if (error) {
+        return error;
+    }
+
+    if (p->batch == 0 || p->batch > MAX_BATCH || p->threads == 0 || p->threads > MAX_THREADS) {
+        return -EINVAL;
+    }
+    if (p->test <= BENCH_COPY_FROM_USER && (p->size == 0 || p->size > MAX_SIZE)) {
+        return -EINVAL;
+    }
+    if (p->test <= BENCH_VMALLOC && p->size * p->batch > MAX_BATCH_BYTES) {
+        return -E2BIG;
+    }
+    if ((p->test == BENCH_COPY_TO_USER || p->test == BENCH_COPY_FROM_USER) && p->threads != 1) {
+        return -EINVAL;                                                 // They run in the writer
+    }
+    if (p->test == BENCH_SPINLOCK || p->test == BENCH_MUTEX) {
+        p->size = 0;
+    }
+    if (cpumask_empty(p->cpus) || !cpumask_subset(p->cpus, cpu_online_mask)) {
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static ssize_t control_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos) {
+    struct bench_params params = { BENCH_KMALLOC, 64, 100000, 64, 1 };
+    char line[CONTROL_MAX];
+    int error;
+
+    if (count >= sizeof(line)) {
+        return -EINVAL;
+    }
+    if (copy_from_user(line, buf, count) != 0) {
+        return -EFAULT;
+    }
+    line[count] = '\0';
+    if (strcmp(strim(line), "reset") == 0) {
+        rows_clear();
+        return count;
+    }
+
+    if (!zalloc_cpumask_var(&params.cpus, GFP_KERNEL)) {
+        return -ENOMEM;
+    }
+    cpumask_copy(params.cpus, cpu_online_mask);
+    error = parse_control(line, &params);
+    if (error == 0) {
+        if (mutex_lock_interruptible(&runLock)) {
+            error = -EINTR;
+        } else {
+            error = bench_run(&params);
+            mutex_unlock(&runLock);
+        }
+    }
+    free_cpumask_var(params.cpus);
+    return error ? error : count;
+}
+
+static ssize_t control_read(struct file *file, char __user *buf, size_t count, loff_t *ppos) {
+    static const char usage[] =
+        "test=kmalloc|kmem_cache|alloc_pages|vmalloc|copy_to_user|copy_from_user|spinlock|mutex "
+        "size=64 iters=100000 batch=64 threads=1 cpus=<online>\n"
+        "reset\n";
+
+    return simple_read_from_buffer(buf, count, ppos, usage, sizeof(usage) - 1);
+}
+
+static const struct file_operations control_fops = {
+    .owner  = THIS_MODULE,
+    .read   = control_read,
+    .write  = control_write,
+    .llseek = default_llseek,
+};
+
+static void print_ns(struct seq_file *m, u64 ps) {
+    u32 rest;
+    u64 ns = div_u64_rem(ps, 1000, &rest);
+
+    seq_printf(m, ",%llu.%u", ns, rest / 100);
+}
+
+/*  /sys/kernel/debug/lkm_bench/results: a row per timed operation of every run. ns
+ *  columns are nanoseconds per operation over the batches of all threads.
+ */
+static int results_show(struct seq_file *m, void *v) {
+    struct bench_row *row;
+
+    seq_puts(m, "test,size,threads,batch,ops,mean_ns,p50_ns,p90_ns,p99_ns,p999_ns,max_ns,mb_s\n");
+    mutex_lock(&rowsLock);
+    list_for_each_entry(row, &rows, list) {
+        seq_printf(m, "%s,%lu,%u,%u,%llu", row->name, row->size, row->threads, row->batch, row->ops);
+        print_ns(m, row->mean);
+        print_ns(m, row->p50);
+        print_ns(m, row->p90);
+        print_ns(m, row->p99);
+        print_ns(m, row->p999);
+        print_ns(m, row->max);
+        if (row->copy && row->mean != 0) {
+            seq_printf(m, ",%llu\n", div64_u64((u64)row->size * 1000000, row->mean));
+        } else {
+            seq_puts(m, ",\n");
+        }
+    }
+    mutex_unlock(&rowsLock);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(results);
+
+// Загрузка
+static int __init lkm_bench_init(void) {
+    // debugfs is optional, errors are ignored like everywhere else in the kernel
+    debugDir = debugfs_create_dir("lkm_bench", NULL);
+    debugfs_create_file("control", 0600, debugDir, NULL, &control_fops);
+    debugfs_create_file("results", 0444, debugDir, NULL, &results_fops);
+    printk(KERN_INFO "lkm_bench: write tests to /sys/kernel/debug/lkm_bench/control\n");
+    return 0;
+}
+
+// Выгрузка
+static void __exit lkm_bench_exit(void) {
+    debugfs_remove_recursive(debugDir);
+    rows_clear();
+    printk(KERN_INFO "lkm_bench: Goodbye!\n");
+}
+
+module_init(lkm_bench_init);
+module_exit(lkm_bench_exit);
@@ -0,0 +1,302 @@
+// Copyright [2020] <Puchkov Kyryll>
+/*  Producer and consumer threads around the queues of queue.h. Producers push random
+ *  numbers stamped with the time of the push, consumers pop them; both spin in a busy
+ *  loop for a random number of iterations per item to simulate work. Every run checks
+ *  that the sum of consumed numbers equals the sum of produced ones.
+ *
+ *  Usage: ./bench-queue [-q mutex,mpmc,sharded,steal] [-p producers] [-c consumers]
+ *                       [-n items] [-s capacity] [-b batch] [-w max work] [-a]
+ *  mutex, mpmc and sharded are central queues, steal is the work-stealing executor of
+ *  steal.h that hands off -b items at a time. -p and -c take comma separated lists,
+ *  every combination is run. -a pins thread i to CPU i.
+ *  Output: queue,producers,consumers,items,seconds,items_s,p50_ns,p99_ns,p999_ns,
+ *          steals,steal_attempts,idle_ms,check
+ *  idle_ms is the time consumers spent finding no item, summed over consumers.
+ */
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "queue.h"
+#include "steal.h"
+
+namespace {
+
+struct Item {
+    uint64_t value;
+    uint64_t stamp;                                                     ///< Push time in ns
+};
+
+struct Options {
+    std::vector<std::string> queues{"mutex", "mpmc", "sharded", "steal"};
+    std::vector<size_t> producers{1, 2, 4};
+    std::vector<size_t> consumers{1, 2, 4};
+    uint64_t items = 1000000;
+    size_t capacity = 4096;
+    size_t batch = 64;
+    unsigned work = 100;                                                ///< Busy loop iterations are random in [0, work)
+    bool pin = false;
+};
+
+constexpr unsigned kSampleEvery = 16;                                   ///< Latency of every 16th item is kept
+
+using pc::now_ns;
+
+// xorshift64, one per thread
+uint64_t next_random(uint64_t *state) {
+    uint64_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+void busy_loop(uint64_t *state, unsigned work) {
+    unsigned n = work > 0 ? next_random(state) % work : 0;
+
+    for (unsigned i = 0; i < n; i++) {
+        asm volatile("" ::: "memory");
+    }
+}
+
+void pin_thread(std::thread &thread, unsigned index) {
+    unsigned cpus = std::thread::hardware_concurrency();
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(index % (cpus > 0 ? cpus : 1), &set);
+    pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set);
+}
+
+struct Result {
+    double seconds;
+    uint64_t consumed;
+    uint64_t steals = 0;
+    uint64_t stealAttempts = 0;
+    uint64_t idleNs;
+    bool ok;
+    std::vector<uint64_t> latency;
+};
+
+// Only the work-stealing queue steals
+template <typename Queue>
+void steal_stats(const Queue &, Result *) {}
+
+template <typename T>
+void steal_stats(const pc::StealingQueue<T> &queue, Result *result) {
+    result->steals = queue.steals();
+    result->stealAttempts = queue.steal_attempts();
+}
+
+template <typename Queue>
+Result run(const Options &opt, size_t producers, size_t consumers) {
+    pc::Config config;
+
+    config.capacity = opt.capacity;
+    config.producers = producers;
+    config.consumers = consumers;
+    config.batch = opt.batch;
+
+    Queue queue(config);
+    std::vector<uint64_t> produced(producers), consumed(consumers), counts(consumers);
+    std::vector<std::vector<uint64_t>> samples(consumers);
+    std::vector<std::thread> threads;
+    Result result;
+    uint64_t start;
+
+    start = now_ns();
+    for (size_t c = 0; c < consumers; c++) {
+        threads.emplace_back([&, c] {
+            uint64_t state = 0x9e3779b97f4a7c15ULL * (c + 1) | 1;
+            uint64_t sum = 0, count = 0;
+            Item item;
+
+            samples[c].reserve(opt.items / consumers / kSampleEvery + 1);
+            while (queue.pop(c, item)) {
+                if (count++ % kSampleEvery == 0) {
+                    samples[c].push_back(now_ns() - item.stamp);
+                }
+                sum += item.value;
+                busy_loop(&state, opt.work);
+            }
+            consumed[c] = sum;
+            counts[c] = count;
+        });
+    }
+    for (size_t p = 0; p < producers; p++) {
+        threads.emplace_back([&, p] {
+            uint64_t state = 0x2545f4914f6cdd1dULL * (p + 1) | 1;
+            uint64_t share = opt.items / producers + (p < opt.items % producers);
+            uint64_t sum = 0;
+
+            for (uint64_t i = 0; i < share; i++) {
+                Item item{next_random(&state) >> 16, 0};
+
+                busy_loop(&state, opt.work);
+                sum += item.value;
+                item.stamp = now_ns();
+                queue.push(p, item);
+            }
+            produced[p] = sum;
+        });
+    }
+    if (opt.pin) {
+        for (size_t i = 0; i < threads.size(); i++) {
+            pin_thread(threads[i], i);
+        }
+    }
+
+    for (size_t i = consumers; i < threads.size(); i++) {
+        threads[i].join();
+    }
+    queue.close();
+    for (size_t i = 0; i < consumers; i++) {
+        threads[i].join();
+    }
+    result.seconds = (now_ns() - start) / 1e9;
+
+    uint64_t in = 0, out = 0;
+    result.consumed = 0;
+    for (uint64_t sum : produced) {
+        in += sum;
+    }
+    for (size_t c = 0; c < consumers; c++) {
+        out += consumed[c];
+        result.consumed += counts[c];
+        result.latency.insert(result.latency.end(), samples[c].begin(), samples[c].end());
+    }
+    result.ok = in == out && result.consumed == opt.items;
+    result.idleNs = queue.idle_ns();
+    steal_stats(queue, &result);
+    return result;
+}
+
+uint64_t percentile(const std::vector<uint64_t> &sorted, double p) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    return sorted[std::min(sorted.size() - 1, (size_t)(p * sorted.size()))];
+}
+
+template <typename T>
+std::vector<T> parse_list(const char *arg) {
+    std::vector<T> list;
+    std::stringstream in(arg);
+    std::string field;
+
+    while (std::getline(in, field, ',')) {
+        if (field.empty()) {
+            continue;
+        }
+        if constexpr (std::is_same<T, std::string>::value) {
+            list.push_back(field);
+        } else {
+            list.push_back(std::strtoull(field.c_str(), nullptr, 0));
+        }
+    }
+    return list;
+}
+
+void usage(const char *name) {
+    std::fprintf(stderr, "Usage: %s [-q mutex,mpmc,sharded,steal] [-p producers] [-c consumers] "
+                 "[-n items] [-s capacity] [-b batch] [-w max work] [-a]\n", name);
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+    Options opt;
+    int failed = 0;
+    int c;
+
+    while ((c = getopt(argc, argv, "q:p:c:n:s:b:w:a")) != -1) {
+        switch (c) {
+            case 'q':
+                opt.queues = parse_list<std::string>(optarg);
+                break;
+            case 'p':
+                opt.producers = parse_list<size_t>(optarg);
+                break;
+            case 'c':
+                opt.consumers = parse_list<size_t>(optarg);
+                break;
+            case 'n':
+                opt.items = std::strtoull(optarg, nullptr, 0);
+                break;
+            case 's':
+                opt.capacity = std::strtoull(optarg, nullptr, 0);
+                break;
+            case 'b':
+                opt.batch = std::strtoull(optarg, nullptr, 0);
+                break;
+            case 'w':
+                opt.work = std::strtoul(optarg, nullptr, 0);
+                break;
+            case 'a':
+                opt.pin = true;
+                break;
+            default:
+                usage(argv[0]);
+                return 2;
+        }
+    }
+    for (size_t n : opt.producers) {
+        failed |= n == 0;
+    }
+    for (size_t n : opt.consumers) {
+        failed |= n == 0;
+    }
+    if (failed || opt.capacity == 0 || opt.batch == 0) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    std::printf("queue,producers,consumers,items,seconds,items_s,p50_ns,p99_ns,p999_ns,"
+                "steals,steal_attempts,idle_ms,check\n");
+    for (const std::string &name : opt.queues) {
+        for (size_t producers : opt.producers) {
+            for (size_t consumers : opt.consumers) {
+                Result r;
+
+                if (name == "mutex") {
+                    r = run<pc::MutexQueue<Item>>(opt, producers, consumers);
+                } else if (name == "mpmc") {
+                    r = run<pc::MpmcQueue<Item>>(opt, producers, consumers);
+                } else if (name == "sharded") {
+                    r = run<pc::ShardedQueue<Item>>(opt, producers, consumers);
+                } else if (name == "steal") {
+                    r = run<pc::StealingQueue<Item>>(opt, producers, consumers);
+                } else {
+                    std::fprintf(stderr, "Unknown queue %s\n", name.c_str());
+                    return 2;
+                }
+                std::sort(r.latency.begin(), r.latency.end());
+                std::printf("%s,%zu,%zu,%llu,%.6f,%.0f,%llu,%llu,%llu,%llu,%llu,%.3f,%s\n", name.c_str(),
+                            producers, consumers, (unsigned long long)r.consumed, r.seconds,
+                            r.consumed / r.seconds,
+                            (unsigned long long)percentile(r.latency, 0.50),
+                            (unsigned long long)percentile(r.latency, 0.99),
+                            (unsigned long long)percentile(r.latency, 0.999),
+                            (unsigned long long)r.steals, (unsigned long long)r.stealAttempts,
+                            r.idleNs / 1e6, r.ok ? "ok" : "fail");
+                std::fflush(stdout);
+                failed |= !r.ok;
+            }
+        }
+    }
+    return failed;
+}
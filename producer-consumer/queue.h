@@ -0,0 +1,364 @@
+// Copyright [2020] <Puchkov Kyryll>
+/*  Bounded queues for producer and consumer threads, all with the same interface so a
+ *  program picks the backend with a template argument:
+ *
+ *      Queue(const Config &config);
+ *      void push(size_t producer, T item);     // Blocks while the queue is full
+ *      bool pop(size_t consumer, T &item);     // Blocks while empty, false once closed and drained
+ *      void close();                           // After the last push, wakes everybody up
+ *      uint64_t idle_ns() const;               // Time consumers spent waiting for items
+ *
+ *  MutexQueue   - ring under one mutex with two condition variables. Simple, sleeps
+ *                 instead of spinning, but every operation takes the same lock.
+ *  MpmcQueue    - lock-free ring where every slot carries a sequence number (Vyukov),
+ *                 producers and consumers only contend on their own index.
+ *  ShardedQueue - one single-producer ring per producer, consumers fan in by scanning
+ *                 the shards. Producers never share a cache line; order is kept per producer.
+ *
+ *  The lock-free queues spin and then yield while they wait, they are meant for
+ *  threads that have a core each. StealingQueue (steal.h) is the work-stealing variant.
+ */
+#ifndef PRODUCER_CONSUMER_QUEUE_H_
+#define PRODUCER_CONSUMER_QUEUE_H_
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace pc {
+
+constexpr size_t kCacheLine = 64;                                       ///< Padding between fields written by different threads
+
+struct Config {
+    size_t capacity = 4096;                                             ///< Items the queue holds
+    size_t producers = 1;                                               ///< Producer ids are 0 .. producers - 1
+    size_t consumers = 1;                                               ///< Consumer ids are 0 .. consumers - 1
+    size_t batch = 64;                                                  ///< Items moved per hand-off, where the queue batches
+};
+
+inline uint64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Adds the time since the first wait() to a counter when it goes out of scope
+class IdleTimer {
+ public:
+    explicit IdleTimer(std::atomic<uint64_t> *total) : total_(total) {}
+    ~IdleTimer() {
+        if (start_ != 0) {
+            total_->fetch_add(now_ns() - start_, std::memory_order_relaxed);
+        }
+    }
+    void wait() {
+        if (start_ == 0) {
+            start_ = now_ns();
+        }
+    }
+
+ private:
+    std::atomic<uint64_t> *total_;
+    uint64_t start_ = 0;
+};
+
+inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+// Spins a little, then gives the core away; reset() after progress
+class Backoff {
+ public:
+    void wait() {
+        if (spins_ < 64) {
+            spins_++;
+            cpu_relax();
+        } else {
+            std::this_thread::yield();
+        }
+    }
+    void reset() { spins_ = 0; }
+
+ private:
+    unsigned spins_ = 0;
+};
+
+inline size_t round_up_pow2(size_t n) {
+    size_t size = 2;
+
+    while (size < n) {
+        size <<= 1;
+    }
+    return size;
+}
+
+template <typename T>
+class MutexQueue {
+ public:
+    explicit MutexQueue(const Config &config) : slots_(config.capacity > 0 ? config.capacity : 1) {}
+
+    void push(size_t /*producer*/, T item) {
+        std::unique_lock<std::mutex> lock(lock_);
+
+        notFull_.wait(lock, [this] { return count_ < slots_.size(); });
+        slots_[(head_ + count_) % slots_.size()] = std::move(item);
+        count_++;
+        lock.unlock();
+        notEmpty_.notify_one();
+    }
+
+    bool pop(size_t /*consumer*/, T &item) {
+        std::unique_lock<std::mutex> lock(lock_);
+
+        if (count_ == 0 && !closed_) {
+            IdleTimer idle(&idleNs_);
+
+            idle.wait();
+            notEmpty_.wait(lock, [this] { return count_ > 0 || closed_; });
+        }
+        if (count_ == 0) {
+            return false;                                               // Closed and drained
+        }
+        item = std::move(slots_[head_]);
+        head_ = (head_ + 1) % slots_.size();
+        count_--;
+        lock.unlock();
+        notFull_.notify_one();
+        return true;
+    }
+
+    void close() {
+        {
+            std::lock_guard<std::mutex> lock(lock_);
+            closed_ = true;
+        }
+        notEmpty_.notify_all();
+    }
+
+    uint64_t idle_ns() const { return idleNs_.load(std::memory_order_relaxed); }
+
+ private:
+    std::vector<T> slots_;
+    size_t head_ = 0;                                                   ///< Oldest item
+    size_t count_ = 0;
+    bool closed_ = false;
+    std::mutex lock_;
+    std::condition_variable notFull_;
+    std::condition_variable notEmpty_;
+    std::atomic<uint64_t> idleNs_{0};
+};
+
+/*  Slot i is free for the producer that claims position pos when seq == pos, and holds
+ *  an item for the consumer that claims pos when seq == pos + 1. The consumer then sets
+ *  seq = pos + size, which frees the slot for the next lap.
+ */
+template <typename T>
+class MpmcQueue {
+ public:
+    explicit MpmcQueue(const Config &config)
+        : mask_(round_up_pow2(config.capacity) - 1), slots_(new Slot[mask_ + 1]) {
+        for (size_t i = 0; i <= mask_; i++) {
+            slots_[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    bool try_push(T &item) {
+        size_t pos = head_.load(std::memory_order_relaxed);
+
+        for (;;) {
+            Slot &slot = slots_[pos & mask_];
+            size_t seq = slot.seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+            if (diff == 0) {
+                if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    slot.item = std::move(item);
+                    slot.seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;                                           // The slot of the previous lap is still full
+            } else {
+                pos = head_.load(std::memory_order_relaxed);            // Another producer took pos
+            }
+        }
+    }
+
+    bool try_pop(T &item) {
+        size_t pos = tail_.load(std::memory_order_relaxed);
+
+        for (;;) {
+            Slot &slot = slots_[pos & mask_];
+            size_t seq = slot.seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+
+            if (diff == 0) {
+                if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    item = std::move(slot.item);
+                    slot.seq.store(pos + mask_ + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;                                           // Empty
+            } else {
+                pos = tail_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    void push(size_t /*producer*/, T item) {
+        Backoff backoff;
+
+        while (!try_push(item)) {
+            backoff.wait();
+        }
+    }
+
+    bool pop(size_t /*consumer*/, T &item) {
+        IdleTimer idle(&idleNs_);
+        Backoff backoff;
+
+        while (!try_pop(item)) {
+            if (closed_.load(std::memory_order_acquire)) {
+                return try_pop(item);                                   // Pushes happen before close()
+            }
+            idle.wait();
+            backoff.wait();
+        }
+        return true;
+    }
+
+    void close() { closed_.store(true, std::memory_order_release); }
+
+    uint64_t idle_ns() const { return idleNs_.load(std::memory_order_relaxed); }
+
+ private:
+    struct alignas(kCacheLine) Slot {
+        std::atomic<size_t> seq;
+        T item;
+    };
+
+    const size_t mask_;
+    std::unique_ptr<Slot[]> slots_;
+    alignas(kCacheLine) std::atomic<size_t> head_{0};                   ///< Next position to push
+    alignas(kCacheLine) std::atomic<size_t> tail_{0};                   ///< Next position to pop
+    alignas(kCacheLine) std::atomic<bool> closed_{false};
+    std::atomic<uint64_t> idleNs_{0};
+};
+
+/*  Producer p owns shard p. A shard is a single-producer single-consumer ring; any
+ *  consumer may drain it, but only while it holds the shard's consumer flag, so the
+ *  consumer side stays single too. Consumers start their scan at different shards.
+ */
+template <typename T>
+class ShardedQueue {
+ public:
+    explicit ShardedQueue(const Config &config) {
+        size_t shards = config.producers > 0 ? config.producers : 1;
+        size_t size = round_up_pow2((config.capacity + shards - 1) / shards);
+
+        for (size_t i = 0; i < shards; i++) {
+            shards_.emplace_back(new Shard(size));
+        }
+    }
+
+    void push(size_t producer, T item) {
+        Shard &shard = *shards_[producer % shards_.size()];
+        size_t head = shard.head.load(std::memory_order_relaxed);
+        Backoff backoff;
+
+        while (head - shard.tailCache > shard.mask) {                   // Looks full, refresh the cached tail
+            shard.tailCache = shard.tail.load(std::memory_order_acquire);
+            if (head - shard.tailCache > shard.mask) {
+                backoff.wait();
+            }
+        }
+        shard.slots[head & shard.mask] = std::move(item);
+        shard.head.store(head + 1, std::memory_order_release);
+    }
+
+    bool pop(size_t consumer, T &item) {
+        IdleTimer idle(&idleNs_);
+        Backoff backoff;
+
+        for (;;) {
+            if (scan(consumer, item, false)) {
+                return true;
+            }
+            if (closed_.load(std::memory_order_acquire)) {
+                return scan(consumer, item, true);                      // Waits for the flags, nothing is skipped
+            }
+            idle.wait();
+            backoff.wait();
+        }
+    }
+
+    void close() { closed_.store(true, std::memory_order_release); }
+
+    uint64_t idle_ns() const { return idleNs_.load(std::memory_order_relaxed); }
+
+ private:
+    struct alignas(kCacheLine) Shard {
+        explicit Shard(size_t size) : mask(size - 1), slots(new T[size]) {}
+
+        const size_t mask;
+        std::unique_ptr<T[]> slots;
+        alignas(kCacheLine) std::atomic<size_t> head{0};                ///< Written by the producer
+        size_t tailCache = 0;                                           ///< Producer's last view of tail
+        alignas(kCacheLine) std::atomic<size_t> tail{0};                ///< Written by the flag holder
+        std::atomic<bool> busy{false};                                  ///< Consumer flag
+    };
+
+    static bool acquire(Shard &shard, bool wait) {
+        while (shard.busy.exchange(true, std::memory_order_acquire)) {
+            if (!wait) {
+                return false;
+            }
+            cpu_relax();
+        }
+        return true;
+    }
+
+    bool scan(size_t consumer, T &item, bool wait) {
+        size_t count = shards_.size();
+
+        for (size_t i = 0; i < count; i++) {
+            Shard &shard = *shards_[(consumer + i) % count];
+            size_t tail;
+
+            if (shard.tail.load(std::memory_order_relaxed) == shard.head.load(std::memory_order_acquire)) {
+                continue;                                               // Empty, do not touch the flag
+            }
+            if (!acquire(shard, wait)) {
+                continue;                                               // Another consumer drains it
+            }
+            tail = shard.tail.load(std::memory_order_relaxed);
+            if (tail != shard.head.load(std::memory_order_acquire)) {
+                item = std::move(shard.slots[tail & shard.mask]);
+                shard.tail.store(tail + 1, std::memory_order_release);
+                shard.busy.store(false, std::memory_order_release);
+                return true;
+            }
+            shard.busy.store(false, std::memory_order_release);
+        }
+        return false;
+    }
+
+    std::vector<std::unique_ptr<Shard>> shards_;
+    alignas(kCacheLine) std::atomic<bool> closed_{false};
+    std::atomic<uint64_t> idleNs_{0};
+};
+
+}  // namespace pc
+
+#endif  // PRODUCER_CONSUMER_QUEUE_H_
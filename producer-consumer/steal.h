@@ -0,0 +1,300 @@
+// Copyright [2020] <Puchkov Kyryll>
+/*  Work-stealing variant of the queues in queue.h, with the same interface.
+ *
+ *  Items travel in batches of Config::batch, so one synchronization moves a whole batch.
+ *  A producer fills its own open batch without any synchronization and hands it off
+ *  to the inbox of a consumer (round-robin, the next one when an inbox is full). Each
+ *  consumer owns a Chase-Lev deque: it moves batches from its inbox to the bottom of
+ *  the deque and takes them from there, idle consumers steal from the top of the deque
+ *  (and then the inbox) of random victims. Items keep their order only within a batch.
+ *
+ *  close() also hands off the partial batches, so it must run after the producers are
+ *  done (joined), as with the other queues.
+ */
+#ifndef PRODUCER_CONSUMER_STEAL_H_
+#define PRODUCER_CONSUMER_STEAL_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "queue.h"
+
+namespace pc {
+
+/*  Bounded Chase-Lev deque of pointers (Le, Pop, Cohen, Zappa Nardelli, PPoPP 2013).
+ *  The owner pushes and pops at the bottom, any thread steals at the top. The only
+ *  contended case is the last element, which the owner and a thief race for with a
+ *  CAS on top. The paper's fences are folded into seq_cst accesses of top and bottom,
+ *  which costs the same on x86 and keeps the deque checkable by ThreadSanitizer.
+ */
+template <typename T>
+class ChaseLevDeque {
+ public:
+    explicit ChaseLevDeque(size_t capacity)
+        : mask_(round_up_pow2(capacity) - 1), slots_(new std::atomic<T *>[mask_ + 1]) {}
+
+    // Owner only, false when full
+    bool push(T *item) {
+        int64_t bottom = bottom_.load(std::memory_order_relaxed);
+        int64_t top = top_.load(std::memory_order_acquire);
+
+        if (bottom - top > (int64_t)mask_) {
+            return false;
+        }
+        slots_[bottom & mask_].store(item, std::memory_order_relaxed);
+        bottom_.store(bottom + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Owner only, newest first
+    T *pop() {
+        int64_t bottom = bottom_.load(std::memory_order_relaxed) - 1;
+        int64_t top;
+        T *item;
+
+        bottom_.store(bottom, std::memory_order_seq_cst);               // Thieves see the claim before we look at top
+        top = top_.load(std::memory_order_seq_cst);
+        if (top > bottom) {
+            bottom_.store(bottom + 1, std::memory_order_relaxed);       // Empty
+            return nullptr;
+        }
+        item = slots_[bottom & mask_].load(std::memory_order_relaxed);
+        if (top == bottom) {
+            if (!top_.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst,
+                                              std::memory_order_relaxed)) {
+                item = nullptr;                                         // A thief took the last one
+            }
+            bottom_.store(bottom + 1, std::memory_order_relaxed);
+        }
+        return item;
+    }
+
+    // Any thread, oldest first; nullptr when empty or when another thread won the race
+    T *steal() {
+        int64_t top = top_.load(std::memory_order_seq_cst);
+        int64_t bottom = bottom_.load(std::memory_order_seq_cst);
+        T *item;
+
+        if (top >= bottom) {
+            return nullptr;
+        }
+        item = slots_[top & mask_].load(std::memory_order_relaxed);
+        if (!top_.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst,
+                                          std::memory_order_relaxed)) {
+            return nullptr;
+        }
+        return item;
+    }
+
+ private:
+    const size_t mask_;
+    std::unique_ptr<std::atomic<T *>[]> slots_;
+    alignas(kCacheLine) std::atomic<int64_t> top_{0};                   ///< Next to steal
+    alignas(kCacheLine) std::atomic<int64_t> bottom_{0};                ///< Next free slot, written by the owner
+};
+
+template <typename T>
+class StealingQueue {
+ public:
+    explicit StealingQueue(const Config &config) : batch_(config.batch > 0 ? config.batch : 1) {
+        size_t consumers = config.consumers > 0 ? config.consumers : 1;
+        size_t batches = (config.capacity + batch_ - 1) / batch_;
+        Config inbox = config;
+
+        inbox.capacity = (batches + consumers - 1) / consumers;         // Inboxes hold the capacity together
+        for (size_t i = 0; i < (config.producers > 0 ? config.producers : 1); i++) {
+            producers_.emplace_back(new Producer(i % consumers));
+        }
+        for (size_t i = 0; i < consumers; i++) {
+            consumers_.emplace_back(new Consumer(inbox, i));
+        }
+    }
+
+    ~StealingQueue() {
+        for (auto &producer : producers_) {
+            delete producer->open;
+        }
+        for (auto &consumer : consumers_) {
+            Batch *batch;
+
+            delete consumer->current;
+            while ((batch = consumer->deque.pop()) != nullptr) {
+                delete batch;
+            }
+            while (consumer->inbox.try_pop(batch)) {
+                delete batch;
+            }
+        }
+    }
+
+    void push(size_t producer, T item) {
+        Producer &p = *producers_[producer % producers_.size()];
+
+        if (p.open == nullptr) {
+            p.open = new Batch;
+            p.open->items.reserve(batch_);
+        }
+        p.open->items.push_back(std::move(item));
+        if (p.open->items.size() == batch_) {
+            hand_off(p);
+        }
+    }
+
+    bool pop(size_t consumer, T &item) {
+        Consumer &c = *consumers_[consumer % consumers_.size()];
+        IdleTimer idle(&idleNs_);
+        Backoff backoff;
+
+        for (;;) {
+            if (c.current != nullptr) {
+                if (c.next < c.current->items.size()) {
+                    item = std::move(c.current->items[c.next++]);
+                    return true;
+                }
+                delete c.current;
+                c.current = nullptr;
+                pending_.fetch_sub(1, std::memory_order_release);
+            }
+            c.current = take(c);
+            if (c.current != nullptr) {
+                c.next = 0;
+                continue;
+            }
+            if (closed_.load(std::memory_order_acquire) &&
+                pending_.load(std::memory_order_acquire) == 0) {
+                return false;                                           // Every batch handed off is consumed
+            }
+            idle.wait();
+            backoff.wait();
+        }
+    }
+
+    void close() {
+        for (auto &producer : producers_) {
+            if (producer->open != nullptr && !producer->open->items.empty()) {
+                hand_off(*producer);
+            }
+        }
+        closed_.store(true, std::memory_order_release);
+    }
+
+    uint64_t idle_ns() const { return idleNs_.load(std::memory_order_relaxed); }
+
+    // Batches taken from another consumer and attempts to, summed over consumers
+    uint64_t steals() const {
+        uint64_t total = 0;
+
+        for (auto &consumer : consumers_) {
+            total += consumer->steals.load(std::memory_order_relaxed);
+        }
+        return total;
+    }
+
+    uint64_t steal_attempts() const {
+        uint64_t total = 0;
+
+        for (auto &consumer : consumers_) {
+            total += consumer->attempts.load(std::memory_order_relaxed);
+        }
+        return total;
+    }
+
+ private:
+    struct Batch {
+        std::vector<T> items;
+    };
+
+    struct alignas(kCacheLine) Producer {
+        explicit Producer(size_t first) : target(first) {}
+
+        Batch *open = nullptr;                                          ///< Filled by the producer alone
+        size_t target;                                                  ///< Consumer that gets the next batch
+    };
+
+    struct alignas(kCacheLine) Consumer {
+        Consumer(const Config &inboxConfig, size_t index)
+            : inbox(inboxConfig), deque(inboxConfig.capacity * 2), random(0x9e3779b97f4a7c15ULL * (index + 1)) {}
+
+        MpmcQueue<Batch *> inbox;                                       ///< Batches handed off by producers
+        ChaseLevDeque<Batch> deque;                                     ///< Owned by this consumer, stolen from by the others
+        Batch *current = nullptr;                                       ///< Batch being consumed
+        size_t next = 0;                                                ///< Next item of current
+        uint64_t random;                                                ///< xorshift state for picking victims
+        std::atomic<uint64_t> steals{0};                                ///< Written by the owner, read by steals()
+        std::atomic<uint64_t> attempts{0};
+    };
+
+    void hand_off(Producer &p) {
+        Batch *batch = p.open;
+        Backoff backoff;
+
+        p.open = nullptr;
+        pending_.fetch_add(1, std::memory_order_relaxed);               // Before the push, so no consumer sees it negative
+        for (;;) {
+            for (size_t i = 0; i < consumers_.size(); i++) {
+                Consumer &c = *consumers_[p.target];
+
+                p.target = (p.target + 1) % consumers_.size();
+                if (c.inbox.try_push(batch)) {
+                    return;
+                }
+            }
+            backoff.wait();                                             // Every inbox is full
+        }
+    }
+
+    Batch *take(Consumer &c) {
+        Batch *batch = c.deque.pop();
+
+        if (batch != nullptr) {
+            return batch;
+        }
+        while (c.inbox.try_pop(batch)) {                                // Refill the deque, so others can steal from it
+            if (!c.deque.push(batch)) {
+                return batch;
+            }
+        }
+        batch = c.deque.pop();
+        return batch != nullptr ? batch : steal(c);
+    }
+
+    Batch *steal(Consumer &c) {
+        size_t count = consumers_.size();
+        Batch *batch;
+
+        for (size_t i = 0; i < count - 1; i++) {
+            uint64_t x = c.random;
+            Consumer *victim;
+
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            c.random = x;
+            victim = consumers_[x % count].get();
+            if (victim == &c) {
+                continue;
+            }
+            c.attempts.store(c.attempts.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            batch = victim->deque.steal();
+            if (batch != nullptr || victim->inbox.try_pop(batch)) {
+                c.steals.store(c.steals.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+                return batch;
+            }
+        }
+        return nullptr;
+    }
+
+    const size_t batch_;
+    std::vector<std::unique_ptr<Producer>> producers_;
+    std::vector<std::unique_ptr<Consumer>> consumers_;
+    alignas(kCacheLine) std::atomic<int64_t> pending_{0};               ///< Batches handed off and not consumed yet
+    std::atomic<bool> closed_{false};
+    std::atomic<uint64_t> idleNs_{0};
+};
+
+}  // namespace pc
+
+#endif  // PRODUCER_CONSUMER_STEAL_H_
@@ -0,0 +1,97 @@
+// Copyright [2020] <Puchkov Kyryll>
+/*  Cost of one call into libhello.so by the ways the dl loader and hello can reach it:
+ *
+ *  plt       hello_increment linked with -lhello, called through the PLT stub (or straight
+ *            through the GOT when this file is built with -fno-plt, bench-call-noplt);
+ *  dlsym     the pointer dlsym returned, the way dl calls a bare symbol;
+ *  table     plugin_descriptor->methods[i].call, the way dl calls a plugin method, with
+ *            the argument and the result packed in union plugin_value.
+ *
+ *  Every call depends on the result of the previous one, so calls cannot overlap.
+ *
+ *  Usage: ./bench-call [calls]
+ *  Output: path,calls,ns_per_call
+ */
+#include <dlfcn.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libhello.h"
+#include "plugin.h"
+
+#ifndef BENCH_PLT_PATH
+#define BENCH_PLT_PATH      "plt"                                       ///< "got" in the -fno-plt build
+#endif
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void report(const char *path, long calls, uint64_t ns, int64_t x) {
+    if (x != calls) {
+        fprintf(stderr, "%s: %lld instead of %ld\n", path, (long long)x, calls);
+        exit(1);
+    }
+    printf("%s,%ld,%.2f\n", path, calls, (double)ns / calls);
+}
+
+int main(int argc, char *argv[]) {
+    long calls = argc > 1 ? strtol(argv[1], NULL, 0) : 100000000;
+    const struct plugin_descriptor *plugin;
+    int64_t (*increment)(int64_t);
+    union plugin_value (*method)(union plugin_value);
+    union plugin_value value;
+    uint64_t start;
+    int64_t x;
+    long i;
+    uint32_t m;
+    void *handle;
+
+    handle = dlopen("libhello.so", RTLD_NOW);                           // The same copy -lhello loaded
+    if (handle == NULL) {
+        fprintf(stderr, "%s\n", dlerror());
+        return 1;
+    }
+    increment = (int64_t (*)(int64_t))dlsym(handle, "hello_increment");
+    plugin = dlsym(handle, PLUGIN_DESCRIPTOR_SYMBOL);
+    if (increment == NULL || plugin == NULL || plugin->abiVersion != PLUGIN_ABI_VERSION) {
+        fprintf(stderr, "libhello.so is not a plugin of ABI %d\n", PLUGIN_ABI_VERSION);
+        return 1;
+    }
+    for (m = 0; m < plugin->count; m++) {
+        if (strcmp(plugin->methods[m].name, "increment") == 0) {
+            break;
+        }
+    }
+    if (m == plugin->count) {
+        fprintf(stderr, "libhello.so has no increment method\n");
+        return 1;
+    }
+
+    printf("path,calls,ns_per_call\n");
+    for (x = 0, i = 0, start = now_ns(); i < calls; i++) {
+        x = hello_increment(x);
+    }
+    report(BENCH_PLT_PATH, calls, now_ns() - start, x);
+
+    for (x = 0, i = 0, start = now_ns(); i < calls; i++) {
+        x = increment(x);
+    }
+    report("dlsym", calls, now_ns() - start, x);
+
+    for (x = 0, i = 0, start = now_ns(); i < calls; i++) {
+        method = plugin->methods[m].call;                               // Indexed on every call, as dl does
+        value.i = x;
+        x = method(value).i;
+    }
+    report("table", calls, now_ns() - start, x);
+
+    dlclose(handle);
+    return 0;
+}
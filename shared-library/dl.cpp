@@ -1,44 +1,368 @@
 // Copyright [2020] <Puchkov Kyryll>
+/*  Вызывает функции из библиотек, загружаемых во время работы (dlopen/dlsym).
+ *
+ *  ./dl libhello.so print_hello [arg]              один вызов
+ *  ./dl [-c N] [-p lib]... [-t] -b [file]          пакет строк "lib func [arg]" из файла или stdin
+ *
+ *  Библиотека с дескриптором plugin.h вызывается через его таблицу: дескриптор ищется
+ *  один раз при открытии, версия ABI проверяется сразу, метод находится по индексу, а
+ *  аргумент и результат имеют объявленные в таблице типы. В остальных библиотеках
+ *  функция ищется как символ void() без аргумента.
+ *
+ *  Открытые библиотеки и найденные в них символы хранятся в LRU-кэше на N библиотек
+ *  (-c, по умолчанию 16), поэтому повторный вызов не загружает и не перемещает
+ *  библиотеку заново; -c 0 закрывает библиотеку после каждого вызова, как раньше.
+ *  -p заранее открывает библиотеку с RTLD_NOW, все перемещения делаются при старте.
+ *  -t печатает в stderr время каждого вызова (CSV) и итог по холодным вызовам, которым
+ *  пришлось открыть библиотеку, и тёплым, которые нашли её в кэше.
+ */
 #include <dlfcn.h>
-#include <string>
+#include <unistd.h>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
+#include <fstream>
 #include <iostream>
+#include <list>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "plugin.h"
+
+typedef void (*method_t)();
+
+static uint64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/* Время одного вызова по этапам */
+struct CallTiming {
+    bool     cold = false;                                              ///< Библиотеку пришлось открыть
+    uint64_t openNs = 0;
+    uint64_t symNs = 0;
+    uint64_t callNs = 0;
+};
+
+/* LRU-кэш открытых библиотек и найденных в них символов */
+class LibraryCache {
+ public:
+    explicit LibraryCache(size_t capacity) : capacity_(capacity) {}
+
+    ~LibraryCache() {
+        while (!lru_.empty()) {
+            evict();
+        }
+    }
+
+    LibraryCache(const LibraryCache &) = delete;
+    LibraryCache &operator=(const LibraryCache &) = delete;
+
+    /* Открывает библиотеку заранее, с перемещением всех символов сразу */
+    bool preload(const std::string &lib) {
+        return open(lib, RTLD_NOW) != nullptr;
+    }
+
+    /* Находит функцию и вызывает её. Библиотека остаётся в кэше, если он не нулевой */
+    bool invoke(const std::string &lib, const std::string &method, const std::string &arg,
+                CallTiming *timing) {
+        uint64_t start = now_ns();
+        auto found = index_.find(lib);
+        Library *library;
+
+        if (found != index_.end()) {
+            lru_.splice(lru_.begin(), lru_, found->second);             // Самая свежая в начале списка
+            library = &*found->second;
+        } else {
+            timing->cold = true;
+            library = open(lib, RTLD_LAZY);
+            if (library == nullptr) {
+                return false;
+            }
+        }
+        timing->openNs = now_ns() - start;
+
+        if (library->plugin != nullptr) {
+            bool done = dispatch(library, method, arg, timing);
+            trim(capacity_);
+            return done;
+        }
+        if (!arg.empty()) {
+            printf("!!! %s: %s takes no argument\n", lib.c_str(), method.c_str());
+            trim(capacity_);
+            return false;
+        }
+        start = now_ns();
+        method_t func = symbol(library, method);
+        timing->symNs = now_ns() - start;
+        if (func == nullptr) {
+            trim(capacity_);
+            return false;
+        }
+
+        start = now_ns();
+        /* Вызываем функцию по найденному адресу */
+        (*func)();
+        timing->callNs = now_ns() - start;
+
+        trim(capacity_);
+        return true;
+    }
+
+ private:
+    struct Library {
+        std::string                                name;
+        void                                      *handle;
+        std::unordered_map<std::string, method_t>  symbols;
+        const plugin_descriptor                   *plugin;
+        std::unordered_map<std::string, uint32_t>  methods;              ///< Индексы в plugin->methods
+    };
+
+    Library *open(const std::string &lib, int mode) {
+        auto found = index_.find(lib);
+
+        if (found != index_.end()) {
+            return &*found->second;
+        }
+        /* Открываем совместно используемую библиотеку */
+        void *handle = dlopen(lib.c_str(), mode);
+        if (handle == nullptr) {
+            printf("!!! %s\n", dlerror());
+            return nullptr;
+        }
+
+        /* Дескриптор плагина, если он есть; чужая версия ABI отвергается до любого вызова */
+        auto plugin = static_cast<const plugin_descriptor *>(dlsym(handle, PLUGIN_DESCRIPTOR_SYMBOL));
+        if (plugin != nullptr && plugin->abiVersion != PLUGIN_ABI_VERSION) {
+            printf("!!! %s: plugin ABI version %u, the loader needs %d\n", lib.c_str(), plugin->abiVersion,
+                   PLUGIN_ABI_VERSION);
+            dlclose(handle);
+            return nullptr;
+        }
+        lru_.push_front(Library{lib, handle, {}, plugin, {}});
+        index_[lib] = lru_.begin();
+        if (plugin != nullptr) {
+            for (uint32_t i = 0; i < plugin->count; i++) {
+                lru_.front().methods.emplace(plugin->methods[i].name, i);
+            }
+        }
+        trim(capacity_ > 0 ? capacity_ : 1);                            // Текущая живёт до конца вызова
+        return &lru_.front();
+    }
+
+    method_t symbol(Library *library, const std::string &method) {
+        auto found = library->symbols.find(method);
 
-void invoke_method(const char *lib, const char *method) {
-    /* Открываем совместно используемую библиотеку */
-    void *dl_handle = dlopen(lib, RTLD_LAZY);
-    if (dl_handle == NULL) {
-        printf("!!! %s\n", dlerror());
-        return;
+        if (found != library->symbols.end()) {
+            return found->second;
+        }
+        /* Находим адрес функции в библиотеке */
+        dlerror();
+        method_t func = reinterpret_cast<method_t>(dlsym(library->handle, method.c_str()));
+        char *error = dlerror();
+        if (error != nullptr) {
+            printf("!!! %s\n", error);
+            return nullptr;
+        }
+        library->symbols.emplace(method, func);
+        return func;
     }
 
-    /* Находим адрес функции в библиотеке */
-    void(*func)() = (void(*) ()) dlsym(dl_handle, method);
-    char* error = dlerror();
-    if (error != NULL) {
-        printf("!!! %s\n", error);
-        return;
+    /* Вызывает метод плагина по индексу в таблице */
+    static bool dispatch(Library *library, const std::string &method, const std::string &arg,
+                         CallTiming *timing) {
+        uint64_t start = now_ns();
+        auto found = library->methods.find(method);
+        timing->symNs = now_ns() - start;
+        if (found == library->methods.end()) {
+            printf("!!! %s: no method %s\n", library->name.c_str(), method.c_str());
+            return false;
+        }
+        const plugin_method &entry = library->plugin->methods[found->second];
+
+        plugin_value value = {};
+        if (!parse_value(entry.arg, arg, &value)) {
+            printf("!!! %s: bad argument '%s' of %s\n", library->name.c_str(), arg.c_str(), method.c_str());
+            return false;
+        }
+        start = now_ns();
+        plugin_value result = entry.call(value);
+        timing->callNs = now_ns() - start;
+        print_value(entry.ret, result);
+        return true;
+    }
+
+    static bool parse_value(plugin_type type, const std::string &text, plugin_value *value) {
+        char *end = nullptr;
+
+        switch (type) {
+            case PLUGIN_VOID:
+                return text.empty();
+            case PLUGIN_INT:
+                value->i = strtoll(text.c_str(), &end, 0);
+                break;
+            case PLUGIN_DOUBLE:
+                value->d = strtod(text.c_str(), &end);
+                break;
+            case PLUGIN_STRING:
+                value->s = text.c_str();
+                return !text.empty();
+        }
+        return !text.empty() && end != nullptr && *end == '\0';
     }
 
-    /* Вызываем функцию по найденному адресу */
-    (*func)();
+    static void print_value(plugin_type type, plugin_value value) {
+        switch (type) {
+            case PLUGIN_VOID:
+                break;
+            case PLUGIN_INT:
+                printf("%lld\n", static_cast<long long>(value.i));
+                break;
+            case PLUGIN_DOUBLE:
+                printf("%g\n", value.d);
+                break;
+            case PLUGIN_STRING:
+                printf("%s\n", value.s);
+                break;
+        }
+    }
+
+    void trim(size_t keep) {
+        while (lru_.size() > keep) {
+            evict();
+        }
+    }
 
-    /* Закрываем объект */
-    dlclose(dl_handle);
+    /* Закрываем самую давно использованную библиотеку, её символы больше недействительны */
+    void evict() {
+        Library &last = lru_.back();
+
+        dlclose(last.handle);
+        index_.erase(last.name);
+        lru_.pop_back();
+    }
+
+    size_t                                                       capacity_;
+    std::list<Library>                                           lru_;
+    std::unordered_map<std::string, std::list<Library>::iterator> index_;
+};
+
+/* Итог по вызовам одного вида */
+struct Summary {
+    uint64_t calls = 0;
+    uint64_t totalNs = 0;
+
+    void add(const CallTiming &timing) {
+        calls++;
+        totalNs += timing.openNs + timing.symNs + timing.callNs;
+    }
 
-    return;
+    void print(const char *name) const {
+        fprintf(stderr, "# %s: %llu calls, %.0f ns per call\n", name, (unsigned long long)calls,
+                calls > 0 ? static_cast<double>(totalNs) / calls : 0.0);
+    }
+};
+
+/* Выполняет строки "lib func [arg]" по одной; пустые строки и строки с # пропускаются.
+ * Аргумент — остаток строки после имени функции. */
+static int run_batch(std::istream &input, LibraryCache *cache, bool timed) {
+    Summary cold, warm;
+    std::string line, lib, method, arg;
+    int failed = 0;
+
+    if (timed) {
+        fprintf(stderr, "lib,func,state,open_ns,sym_ns,call_ns\n");
+    }
+    while (std::getline(input, line)) {
+        std::istringstream words(line);
+        CallTiming timing;
+
+        if (!(words >> lib) || lib[0] == '#') {
+            continue;
+        }
+        if (!(words >> method)) {
+            printf("!!! %s: no function\n", lib.c_str());
+            failed++;
+            continue;
+        }
+        arg.clear();
+        std::getline(words >> std::ws, arg);
+        if (!cache->invoke(lib, method, arg, &timing)) {
+            failed++;
+            continue;
+        }
+        if (timed) {
+            fflush(stdout);                                             // Вывод функции раньше её строки времени
+            fprintf(stderr, "%s,%s,%s,%llu,%llu,%llu\n", lib.c_str(), method.c_str(),
+                    timing.cold ? "cold" : "warm", (unsigned long long)timing.openNs,
+                    (unsigned long long)timing.symNs, (unsigned long long)timing.callNs);
+            (timing.cold ? cold : warm).add(timing);
+        }
+    }
+    if (timed) {
+        cold.print("cold");
+        warm.print("warm");
+    }
+    return failed;
 }
 
 int main(int argc, char *argv[]) {
-    if (argc < 3) {
+    std::vector<std::string> preload;
+    size_t capacity = 16;
+    bool batch = false, timed = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "+bc:p:t")) != -1) {
+        switch (opt) {
+            case 'b':
+                batch = true;
+                break;
+            case 'c':
+                capacity = std::stoul(optarg);
+                break;
+            case 'p':
+                preload.push_back(optarg);
+                break;
+            case 't':
+                timed = true;
+                break;
+            default:
+                std::cout << "Usage: " << argv[0] << " lib func [arg] | [-c cache] [-p lib]... [-t] -b [file]" << std::endl;
+                return 1;
+        }
+    }
+    if (!batch && argc - optind < 2) {
         std::cout << "Not enough arguments!" << std::endl;
         return 1;
     }
 
-    // Имя библиотеки
-    std::string libName = argv[1];
-    // Имя функции
-    std::string funcName = argv[2];
-    invoke_method(libName.c_str(), funcName.c_str());
+    LibraryCache cache(capacity > preload.size() ? capacity : preload.size());
+    for (const std::string &lib : preload) {
+        if (!cache.preload(lib)) {
+            return 1;
+        }
+    }
 
-    return 0;
+    if (!batch) {
+        // Имя библиотеки, имя функции и аргумент
+        std::string line = argv[optind];
+        for (int i = optind + 1; i < argc; i++) {
+            line += std::string(" ") + argv[i];
+        }
+        std::istringstream call(line);
+        return run_batch(call, &cache, timed) != 0;
+    }
+    if (optind < argc) {
+        std::ifstream file(argv[optind]);
+        if (!file) {
+            std::cout << "Cannot open " << argv[optind] << std::endl;
+            return 1;
+        }
+        return run_batch(file, &cache, timed) != 0;
+    }
+    return run_batch(std::cin, &cache, timed) != 0;
 }
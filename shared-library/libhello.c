@@ -2,6 +2,54 @@
 #include <stdio.h>
 #include "libhello.h"
 
+#ifndef HELLO_STEP
+#define HELLO_STEP  1                                                   // 2 in libhello-step2.so, see reload-stress.cpp
+#endif
+
 void print_hello() {
     printf("Hello, World!\n");
 }
+
+// Exported symbols can be interposed, so the table calls this one and not hello_increment
+static int64_t increment(int64_t x) {
+    return x + HELLO_STEP;
+}
+
+int64_t hello_increment(int64_t x) {
+    return increment(x);
+}
+
+static union plugin_value method_print_hello(union plugin_value arg) {
+    union plugin_value none = { 0 };
+
+    (void)arg;
+    print_hello();
+    return none;
+}
+
+static union plugin_value method_greet(union plugin_value arg) {
+    union plugin_value none = { 0 };
+
+    printf("Hello, %s!\n", arg.s);
+    return none;
+}
+
+static union plugin_value method_increment(union plugin_value arg) {
+    union plugin_value result;
+
+    result.i = increment(arg.i);
+    return result;
+}
+
+static const struct plugin_method methods[] = {
+    { "print_hello", PLUGIN_VOID,   PLUGIN_VOID, method_print_hello },
+    { "greet",       PLUGIN_STRING, PLUGIN_VOID, method_greet },
+    { "increment",   PLUGIN_INT,    PLUGIN_INT,  method_increment },
+};
+
+PLUGIN_EXPORT const struct plugin_descriptor plugin_descriptor = {
+    PLUGIN_ABI_VERSION,
+    sizeof(methods) / sizeof(methods[0]),
+    "hello",
+    methods,
+};
@@ -2,6 +2,12 @@
 #ifndef SHARED_LIBRARY_LIBHELLO_H_
 #define SHARED_LIBRARY_LIBHELLO_H_
 
-void print_hello();
+#include <stdint.h>
+#include "plugin.h"
+
+PLUGIN_EXPORT void print_hello();
+
+// x + 1, cheap enough to time the call itself (bench-call.c)
+PLUGIN_EXPORT int64_t hello_increment(int64_t x);
 
 #endif  // SHARED_LIBRARY_LIBHELLO_H_
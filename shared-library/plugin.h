@@ -0,0 +1,60 @@
+// Copyright [2020] <Puchkov Kyryll>
+/*  Plugin ABI of the dl loader. A plugin library exports exactly one symbol,
+ *  PLUGIN_DESCRIPTOR_SYMBOL, with a table of typed methods. The loader finds it with one
+ *  dlsym when it opens the library, checks the ABI version and then calls methods by
+ *  their index in the table, without looking any symbol up by name again.
+ *
+ *  Every method has the same C signature and declares the types it really takes and
+ *  returns, so the loader can turn a command line argument into a value and print the
+ *  result. Plugins are built with -fvisibility=hidden: everything but the descriptor
+ *  (and what is marked PLUGIN_EXPORT) stays out of the dynamic symbol table, and calls
+ *  inside the library do not go through the PLT.
+ *
+ *  PLUGIN_ABI_VERSION changes with any change of these structures; the loader refuses a
+ *  plugin built for another version before it touches its table.
+ */
+#ifndef SHARED_LIBRARY_PLUGIN_H_
+#define SHARED_LIBRARY_PLUGIN_H_
+
+#include <stdint.h>
+
+#define PLUGIN_ABI_VERSION          1
+#define PLUGIN_DESCRIPTOR_SYMBOL    "plugin_descriptor"
+#define PLUGIN_EXPORT               __attribute__((visibility("default")))
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum plugin_type {
+    PLUGIN_VOID,
+    PLUGIN_INT,
+    PLUGIN_DOUBLE,
+    PLUGIN_STRING,
+};
+
+union plugin_value {
+    int64_t     i;
+    double      d;
+    const char *s;
+};
+
+struct plugin_method {
+    const char        *name;
+    enum plugin_type   arg;
+    enum plugin_type   ret;
+    union plugin_value (*call)(union plugin_value arg);
+};
+
+struct plugin_descriptor {
+    uint32_t                    abiVersion;                             ///< PLUGIN_ABI_VERSION the plugin was built with
+    uint32_t                    count;                                  ///< Entries in methods
+    const char                 *name;
+    const struct plugin_method *methods;
+};
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // SHARED_LIBRARY_PLUGIN_H_
@@ -0,0 +1,376 @@
+// Copyright [2020] <Puchkov Kyryll>
+/*  Registry of plugins (plugin.h) that are replaced while they are being called.
+ *
+ *      PluginRegistry registry;
+ *      Plugin *hello = registry.add("./libhello.so", &error);     // Setup, before calls
+ *      int increment = registry.method(hello, "increment");        // Stable across versions
+ *      registry.start();                                           // Watch the files
+ *      registry.call(hello, increment, arg, &result);              // Any thread, no locks
+ *
+ *  A watcher thread follows the directories of the library files with inotify. When a
+ *  file is rewritten or renamed over, the new version is loaded next to the old one:
+ *  dlopen returns the handle it already has for a path, so every version is dlopen'ed
+ *  from its own private copy. The new version is published with one atomic pointer
+ *  swap; a version that fails to load or has another ABI version never gets published.
+ *
+ *  Old versions are reclaimed by epochs. A caller announces the global epoch in its own
+ *  slot before it reads the current version and clears the slot when the call returns.
+ *  A replaced version is stamped with the epoch that follows the swap and dlclose'd
+ *  once no slot holds an older epoch, that is once every call that could have seen it
+ *  has returned. Callers never wait for the reloader and the reloader never waits for
+ *  callers, it looks again a little later.
+ *
+ *  Method ids are taken from the first version. A later version that lacks a method
+ *  makes its calls fail until a version with the method is loaded again.
+ */
+#ifndef SHARED_LIBRARY_REGISTRY_H_
+#define SHARED_LIBRARY_REGISTRY_H_
+
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "plugin.h"
+
+class PluginRegistry {
+ public:
+    static constexpr unsigned kMaxReaders = 256;                        ///< Threads calling at the same time
+
+    struct Plugin;
+
+    PluginRegistry() {
+        char dir[] = "/tmp/plugins.XXXXXX";
+
+        if (mkdtemp(dir) != nullptr) {
+            copies_ = dir;
+        }
+        inotify_ = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+        stop_ = eventfd(0, EFD_CLOEXEC);
+    }
+
+    ~PluginRegistry() {
+        stop();
+        for (auto &plugin : plugins_) {
+            retire(plugin.get(), nullptr);
+        }
+        for (Version *version : retired_) {
+            unload(version);                                            // No caller is left
+        }
+        if (!copies_.empty()) {
+            rmdir(copies_.c_str());
+        }
+        close(inotify_);
+        close(stop_);
+    }
+
+    PluginRegistry(const PluginRegistry &) = delete;
+    PluginRegistry &operator=(const PluginRegistry &) = delete;
+
+    // Loads the first version and watches the file, nullptr with the reason in error
+    Plugin *add(const std::string &path, std::string *error) {
+        auto plugin = std::make_unique<Plugin>();
+        size_t slash = path.rfind('/');
+
+        plugin->path = path;
+        plugin->file = slash == std::string::npos ? path : path.substr(slash + 1);
+        plugin->wd = inotify_add_watch(inotify_, slash == std::string::npos ? "." : path.substr(0, slash + 1).c_str(),
+                                       IN_CLOSE_WRITE | IN_MOVED_TO);
+        if (plugin->wd < 0) {
+            *error = path + ": inotify_add_watch: " + strerror(errno);
+            return nullptr;
+        }
+        Version *version = load(plugin.get(), error);
+        if (version == nullptr) {
+            return nullptr;
+        }
+        for (uint32_t i = 0; i < version->descriptor->count; i++) {
+            plugin->names.push_back(version->descriptor->methods[i].name);
+            version->methods.push_back(&version->descriptor->methods[i]);
+        }
+        plugin->current.store(version, std::memory_order_release);
+        plugins_.push_back(std::move(plugin));
+        return plugins_.back().get();
+    }
+
+    // Id of a method for call(), -1 when the first version has none of that name
+    int method(const Plugin *plugin, const std::string &name) const {
+        for (size_t i = 0; i < plugin->names.size(); i++) {
+            if (plugin->names[i] == name) {
+                return static_cast<int>(i);
+            }
+        }
+        return -1;
+    }
+
+    /*  Calls a method of the current version. Lock-free: two stores to the slot of this
+     *  thread around the call. False when the current version has no such method or
+     *  more than kMaxReaders threads call at once.
+     */
+    bool call(Plugin *plugin, int method, plugin_value arg, plugin_value *result) {
+        Reader *reader = this_reader();
+        bool outer;
+
+        if (reader == nullptr) {
+            return false;
+        }
+        outer = reader->epoch.load(std::memory_order_relaxed) == 0;     // A plugin may call back into us
+        if (outer) {
+            reader->epoch.store(epoch_.load(std::memory_order_seq_cst), std::memory_order_seq_cst);
+        }
+        Version *version = plugin->current.load(std::memory_order_seq_cst);
+        const plugin_method *entry = static_cast<size_t>(method) < version->methods.size() ?
+                                     version->methods[method] : nullptr;
+        if (entry != nullptr) {
+            *result = entry->call(arg);
+        }
+        if (outer) {
+            reader->epoch.store(0, std::memory_order_release);
+        }
+        return entry != nullptr;
+    }
+
+    // Loads the file again and publishes it, the old version is reclaimed later
+    bool reload(Plugin *plugin, std::string *error) {
+        std::lock_guard<std::mutex> lock(reloadLock_);
+        Version *version = load(plugin, error);
+
+        if (version == nullptr) {
+            failed_.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        for (const std::string &name : plugin->names) {
+            const plugin_method *entry = nullptr;
+
+            for (uint32_t i = 0; i < version->descriptor->count; i++) {
+                if (name == version->descriptor->methods[i].name) {
+                    entry = &version->descriptor->methods[i];
+                }
+            }
+            version->methods.push_back(entry);
+        }
+        retire(plugin, version);
+        reloads_.fetch_add(1, std::memory_order_relaxed);
+        reclaim();
+        return true;
+    }
+
+    void start() {
+        watcher_ = std::thread([this] { watch(); });
+    }
+
+    void stop() {
+        uint64_t one = 1;
+
+        if (watcher_.joinable()) {
+            if (write(stop_, &one, sizeof(one)) < 0) {
+                return;
+            }
+            watcher_.join();
+        }
+    }
+
+    uint64_t reloads() const { return reloads_.load(std::memory_order_relaxed); }
+    uint64_t failed() const { return failed_.load(std::memory_order_relaxed); }
+    uint64_t reclaimed() const { return reclaimed_.load(std::memory_order_relaxed); }
+
+    struct Version {
+        void                              *handle;
+        const plugin_descriptor           *descriptor;
+        std::vector<const plugin_method *> methods;                     ///< By method id, nullptr for missing ones
+        uint64_t                           retired = 0;                 ///< First epoch that cannot see it
+    };
+
+    struct Plugin {
+        std::string              path;
+        std::string              file;                                  ///< Name in the watched directory
+        int                      wd;
+        std::vector<std::string> names;                                 ///< Method ids
+        std::atomic<Version *>   current{nullptr};
+        unsigned                 generation = 0;                        ///< Names the private copies
+    };
+
+ private:
+    struct alignas(64) Reader {
+        std::atomic<uint64_t> epoch{0};                                 ///< Epoch of the running call, 0 outside calls
+    };
+
+    // A reader slot per thread, given back when the thread exits
+    class ReaderId {
+     public:
+        ReaderId() {
+            std::lock_guard<std::mutex> lock(mutex());
+            if (!free().empty()) {
+                id_ = free().back();
+                free().pop_back();
+            } else {
+                id_ = next()++;
+            }
+        }
+        ~ReaderId() {
+            std::lock_guard<std::mutex> lock(mutex());
+            free().push_back(id_);
+        }
+        unsigned id() const { return id_; }
+
+     private:
+        static std::mutex &mutex() { static std::mutex m; return m; }
+        static std::vector<unsigned> &free() { static std::vector<unsigned> f; return f; }
+        static unsigned &next() { static unsigned n = 0; return n; }
+
+        unsigned id_;
+    };
+
+    Reader *this_reader() {
+        static thread_local ReaderId id;
+
+        return id.id() < kMaxReaders ? &readers_[id.id()] : nullptr;
+    }
+
+    // dlopen of a private copy, so an older version of the same file stays loaded
+    Version *load(Plugin *plugin, std::string *error) {
+        std::string copy = copies_ + "/" + plugin->file + "." + std::to_string(plugin->generation++);
+        int in = open(plugin->path.c_str(), O_RDONLY | O_CLOEXEC);
+        int out = open(copy.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0700);
+        struct stat st;
+        bool copied = in >= 0 && out >= 0 && fstat(in, &st) == 0;
+
+        for (off_t done = 0; copied && done < st.st_size;) {
+            ssize_t n = sendfile(out, in, &done, st.st_size - done);
+            copied = n > 0;
+        }
+        if (in >= 0) {
+            close(in);
+        }
+        if (out >= 0) {
+            close(out);
+        }
+        if (!copied) {
+            *error = plugin->path + ": cannot copy: " + strerror(errno);
+            unlink(copy.c_str());
+            return nullptr;
+        }
+        void *handle = dlopen(copy.c_str(), RTLD_NOW | RTLD_LOCAL);
+        unlink(copy.c_str());                                           // The mapping keeps the file
+        if (handle == nullptr) {
+            *error = dlerror();
+            return nullptr;
+        }
+        auto descriptor = static_cast<const plugin_descriptor *>(dlsym(handle, PLUGIN_DESCRIPTOR_SYMBOL));
+        if (descriptor == nullptr || descriptor->abiVersion != PLUGIN_ABI_VERSION) {
+            *error = plugin->path + (descriptor == nullptr ? ": not a plugin" : ": plugin ABI version " +
+                     std::to_string(descriptor->abiVersion) + ", need " + std::to_string(PLUGIN_ABI_VERSION));
+            dlclose(handle);
+            return nullptr;
+        }
+        Version *version = new Version;
+        version->handle = handle;
+        version->descriptor = descriptor;
+        return version;
+    }
+
+    void unload(Version *version) {
+        dlclose(version->handle);
+        delete version;
+        reclaimed_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Swaps in next and stamps the old version, a caller that announces a later epoch sees next
+    void retire(Plugin *plugin, Version *next) {
+        Version *old = plugin->current.exchange(next, std::memory_order_seq_cst);
+
+        if (old != nullptr) {
+            old->retired = epoch_.fetch_add(1, std::memory_order_seq_cst) + 1;
+            retired_.push_back(old);
+        }
+    }
+
+    // dlclose's what no running call can use any more
+    void reclaim() {
+        uint64_t oldest = UINT64_MAX;
+
+        for (const Reader &reader : readers_) {
+            uint64_t epoch = reader.epoch.load(std::memory_order_seq_cst);
+
+            if (epoch != 0 && epoch < oldest) {
+                oldest = epoch;
+            }
+        }
+        for (size_t i = 0; i < retired_.size();) {
+            if (retired_[i]->retired <= oldest) {
+                unload(retired_[i]);
+                retired_[i] = retired_.back();
+                retired_.pop_back();
+            } else {
+                i++;
+            }
+        }
+    }
+
+    void watch() {
+        alignas(struct inotify_event) char events[4096];
+        struct pollfd fds[2] = { { inotify_, POLLIN, 0 }, { stop_, POLLIN, 0 } };
+
+        for (;;) {
+            int timeout;
+            {
+                std::lock_guard<std::mutex> lock(reloadLock_);
+                reclaim();
+                timeout = retired_.empty() ? -1 : 10;                   // Sleeps for good once all is reclaimed
+            }
+            if (poll(fds, 2, timeout) < 0 && errno != EINTR) {
+                return;
+            }
+            if (fds[1].revents & POLLIN) {
+                return;
+            }
+            ssize_t n = read(inotify_, events, sizeof(events));
+            for (char *p = events; n > 0 && p < events + n;) {
+                auto event = reinterpret_cast<struct inotify_event *>(p);
+
+                for (auto &plugin : plugins_) {
+                    if (event->wd == plugin->wd && event->len > 0 && plugin->file == event->name) {
+                        std::string error;
+
+                        if (!reload(plugin.get(), &error)) {
+                            fprintf(stderr, "%s\n", error.c_str());     // The old version stays
+                        }
+                    }
+                }
+                p += sizeof(*event) + event->len;
+            }
+        }
+    }
+
+    std::string                          copies_;                       ///< Private directory of the copies
+    int                                  inotify_;
+    int                                  stop_;
+    std::thread                          watcher_;
+    std::vector<std::unique_ptr<Plugin>> plugins_;
+    std::mutex                           reloadLock_;                   ///< Reloads and the retired list, never calls
+    std::vector<Version *>               retired_;
+    std::atomic<uint64_t>                epoch_{1};
+    std::atomic<uint64_t>                reloads_{0};
+    std::atomic<uint64_t>                failed_{0};
+    std::atomic<uint64_t>                reclaimed_{0};
+    Reader                               readers_[kMaxReaders];
+};
+
+typedef PluginRegistry::Plugin Plugin;
+
+#endif  // SHARED_LIBRARY_REGISTRY_H_
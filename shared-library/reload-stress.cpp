@@ -0,0 +1,152 @@
+// Copyright [2020] <Puchkov Kyryll>
+/*  Stress test of PluginRegistry (registry.h). T threads call increment of a watched
+ *  copy of libhello.so as fast as they can while the main thread renames libhello.so
+ *  and libhello-step2.so over it in turn, every R milliseconds. Each result must be
+ *  x + 1 or x + 2, and any call into an unloaded version would crash the test. Counts of
+ *  both results show that the callers really moved from version to version.
+ *
+ *  Usage: ./reload-stress [-t threads] [-d seconds] [-r reload ms]
+ *  Output: threads,seconds,calls,calls_s,reloads,failed,reclaimed,step1,step2,errors
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "registry.h"
+
+struct Counts {
+    uint64_t calls = 0;
+    uint64_t step1 = 0;
+    uint64_t step2 = 0;
+    uint64_t errors = 0;
+};
+
+// Writes a copy next to the target and renames it over, as a deployment would
+static bool install(const std::string &from, const std::string &to) {
+    std::string temp = to + ".new";
+    {
+        std::ifstream in(from, std::ios::binary);
+        std::ofstream out(temp, std::ios::binary | std::ios::trunc);
+
+        if (!in || !out || !(out << in.rdbuf())) {
+            return false;
+        }
+    }
+    return rename(temp.c_str(), to.c_str()) == 0;
+}
+
+int main(int argc, char *argv[]) {
+    unsigned threads = 8;
+    double seconds = 5;
+    unsigned interval = 10;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:d:r:")) != -1) {
+        switch (opt) {
+            case 't':
+                threads = strtoul(optarg, nullptr, 0);
+                break;
+            case 'd':
+                seconds = strtod(optarg, nullptr);
+                break;
+            case 'r':
+                interval = strtoul(optarg, nullptr, 0);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-t threads] [-d seconds] [-r reload ms]\n", argv[0]);
+                return 2;
+        }
+    }
+    if (threads < 1 || threads > PluginRegistry::kMaxReaders || seconds <= 0) {
+        fprintf(stderr, "threads must be in 1..%u\n", PluginRegistry::kMaxReaders);
+        return 2;
+    }
+
+    char dir[] = "/tmp/reload-stress.XXXXXX";
+    if (mkdtemp(dir) == nullptr) {
+        perror("mkdtemp");
+        return 1;
+    }
+    std::string target = std::string(dir) + "/libhello.so";
+    if (!install("libhello.so", target)) {
+        fprintf(stderr, "Cannot copy libhello.so, run make first\n");
+        return 1;
+    }
+
+    PluginRegistry registry;
+    std::string error;
+    Plugin *hello = registry.add(target, &error);
+    int increment = hello != nullptr ? registry.method(hello, "increment") : -1;
+    if (increment < 0) {
+        fprintf(stderr, "%s\n", hello == nullptr ? error.c_str() : "libhello.so has no increment");
+        return 1;
+    }
+    registry.start();
+
+    std::atomic<bool> done{false};
+    std::vector<Counts> counts(threads);
+    std::vector<std::thread> callers;
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned t = 0; t < threads; t++) {
+        callers.emplace_back([&, t] {
+            Counts local;
+            plugin_value arg, result;
+
+            for (int64_t x = 0; !done.load(std::memory_order_relaxed); x++) {
+                arg.i = x;
+                if (!registry.call(hello, increment, arg, &result)) {
+                    local.errors++;
+                } else if (result.i == x + 1) {
+                    local.step1++;
+                } else if (result.i == x + 2) {
+                    local.step2++;
+                } else {
+                    local.errors++;
+                }
+                local.calls++;
+            }
+            counts[t] = local;
+        });
+    }
+
+    auto deadline = start + std::chrono::duration<double>(seconds);
+    for (unsigned i = 1; std::chrono::steady_clock::now() < deadline; i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(interval));
+        if (!install(i % 2 ? "libhello-step2.so" : "libhello.so", target)) {
+            fprintf(stderr, "Cannot install a new version\n");
+            break;
+        }
+    }
+    done = true;
+    for (std::thread &caller : callers) {
+        caller.join();
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    registry.stop();
+
+    Counts total;
+    for (const Counts &c : counts) {
+        total.calls += c.calls;
+        total.step1 += c.step1;
+        total.step2 += c.step2;
+        total.errors += c.errors;
+    }
+    printf("threads,seconds,calls,calls_s,reloads,failed,reclaimed,step1,step2,errors\n");
+    printf("%u,%.3f,%llu,%.0f,%llu,%llu,%llu,%llu,%llu,%llu\n", threads, elapsed,
+           (unsigned long long)total.calls, total.calls / elapsed, (unsigned long long)registry.reloads(),
+           (unsigned long long)registry.failed(), (unsigned long long)registry.reclaimed(),
+           (unsigned long long)total.step1, (unsigned long long)total.step2,
+           (unsigned long long)total.errors);
+
+    unlink(target.c_str());
+    rmdir(dir);
+    return total.errors != 0 || total.step1 == 0 || total.step2 == 0;
+}
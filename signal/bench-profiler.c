@@ -0,0 +1,151 @@
+// Copyright [2020] <Puchkov Kyryll>
+/*  Overhead of the sampler (profiler.h). T threads run the same CPU-bound work, a few
+ *  levels of calls deep so the stacks are worth folding, with and without sampling in
+ *  turns, for each rate of -r. Each setting runs -n times and the fastest run counts,
+ *  which keeps noise from other processes out of the comparison.
+ *
+ *  Usage: ./bench-profiler [-t threads] [-w work] [-n runs] [-r hz,hz,...] [-o folded file]
+ *  Output: hz,threads,plain_s,sampled_s,overhead_pct,samples,dropped,stacks
+ */
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "profiler.h"
+
+#define MAX_THREADS         64
+
+static long work = 200000000;
+
+static double now_s(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Three levels of calls, noinline so each keeps its frame
+__attribute__((noinline)) uint64_t bench_leaf(uint64_t x, long n) {
+    long i;
+
+    for (i = 0; i < n; i++) {
+        x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+        x ^= x >> 29;
+    }
+    return x;
+}
+
+__attribute__((noinline)) uint64_t bench_middle(uint64_t x, long n) {
+    return bench_leaf(x, n / 2) + bench_leaf(x + 1, n - n / 2);
+}
+
+__attribute__((noinline)) uint64_t bench_outer(uint64_t x, long n) {
+    long chunk = 100000, done;
+
+    for (done = 0; done < n; done += chunk) {
+        x = bench_middle(x, chunk);
+    }
+    return x;
+}
+
+static void *bench_thread(void *arg) {
+    int profiled = *(int *)arg;
+    static volatile uint64_t sink;
+
+    if (profiled) {
+        prof_thread_register();
+    }
+    sink = bench_outer(sink + 1, work);
+    if (profiled) {
+        prof_thread_unregister();
+    }
+    return NULL;
+}
+
+static double run(int threads, int profiled) {
+    pthread_t thread[MAX_THREADS];
+    double start = now_s();
+    int t;
+
+    for (t = 0; t < threads; t++) {
+        pthread_create(&thread[t], NULL, bench_thread, &profiled);
+    }
+    for (t = 0; t < threads; t++) {
+        pthread_join(thread[t], NULL);
+    }
+    return now_s() - start;
+}
+
+// Fastest of runs without and with sampling, taken in turns so drift hits both alike
+static void best(int threads, int runs, double *plain, double *sampled) {
+    int i;
+
+    for (i = 0; i < runs; i++) {
+        double seconds = run(threads, 0);
+
+        *plain = i == 0 || seconds < *plain ? seconds : *plain;
+        seconds = run(threads, 1);
+        *sampled = i == 0 || seconds < *sampled ? seconds : *sampled;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    const char *rates = "100,1000";
+    const char *path = "/tmp/bench-profiler.folded";
+    int threads = 1, runs = 5, opt;
+    char *list, *rate;
+
+    while ((opt = getopt(argc, argv, "t:w:n:r:o:")) != -1) {
+        switch (opt) {
+            case 't':
+                threads = strtol(optarg, NULL, 0);
+                break;
+            case 'w':
+                work = strtol(optarg, NULL, 0);
+                break;
+            case 'n':
+                runs = strtol(optarg, NULL, 0);
+                break;
+            case 'r':
+                rates = optarg;
+                break;
+            case 'o':
+                path = optarg;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-t threads] [-w work] [-n runs] [-r hz,hz,...] [-o folded file]\n",
+                        argv[0]);
+                return 2;
+        }
+    }
+    if (threads < 1 || threads > MAX_THREADS || runs < 1 || work < 1) {
+        fprintf(stderr, "Bad arguments, up to %d threads\n", MAX_THREADS);
+        return 2;
+    }
+
+    printf("hz,threads,plain_s,sampled_s,overhead_pct,samples,dropped,stacks\n");
+    list = strdup(rates);
+    for (rate = strtok(list, ","); rate != NULL; rate = strtok(NULL, ",")) {
+        struct prof_stats stats;
+        int hz = strtol(rate, NULL, 0);
+        double plain, sampled;
+
+        if (prof_start(path, hz) < 0) {
+            perror("prof_start");
+            return 1;
+        }
+        prof_thread_unregister();                                       // Only the bench threads are sampled
+        best(threads, runs, &plain, &sampled);
+        prof_stop(&stats);
+        printf("%d,%d,%.3f,%.3f,%.2f,%llu,%llu,%llu\n", hz, threads, plain, sampled,
+               (sampled - plain) / plain * 100, (unsigned long long)stats.samples,
+               (unsigned long long)stats.dropped, (unsigned long long)stats.stacks);
+        fflush(stdout);
+    }
+    free(list);
+    return 0;
+}
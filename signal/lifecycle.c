@@ -0,0 +1,186 @@
+// Copyright [2020] <Puchkov Kyryll>
+/*  signalfd and epoll loop behind lifecycle.h */
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+
+#include "lifecycle.h"
+
+#define ID_SIGNAL           LIFECYCLE_MAX_WATCHES                       ///< epoll ids past the watches
+#define ID_TIMER            (LIFECYCLE_MAX_WATCHES + 1)
+#define MAX_EVENTS          16
+
+static int watch_fd(struct lifecycle *lc, int fd, uint64_t id) {
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u64 = id;
+    return epoll_ctl(lc->epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+int lifecycle_init(struct lifecycle *lc, const struct lifecycle_ops *ops, void *ctx, long drainMs) {
+    int i;
+
+    memset(lc, 0, sizeof(*lc));
+    lc->ops = ops;
+    lc->ctx = ctx;
+    lc->drainMs = drainMs;
+    lc->epfd = lc->sigfd = lc->timerfd = -1;
+    for (i = 0; i < LIFECYCLE_MAX_WATCHES; i++) {
+        lc->watches[i].fd = -1;
+    }
+
+    sigemptyset(&lc->mask);
+    sigaddset(&lc->mask, SIGINT);
+    sigaddset(&lc->mask, SIGTERM);
+    sigaddset(&lc->mask, SIGHUP);
+    if (sigprocmask(SIG_BLOCK, &lc->mask, &lc->oldMask) < 0) {
+        return -1;
+    }
+    lc->epfd = epoll_create1(EPOLL_CLOEXEC);
+    lc->sigfd = signalfd(-1, &lc->mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    lc->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (lc->epfd < 0 || lc->sigfd < 0 || lc->timerfd < 0 ||
+        watch_fd(lc, lc->sigfd, ID_SIGNAL) < 0 || watch_fd(lc, lc->timerfd, ID_TIMER) < 0) {
+        int error = errno;
+
+        lifecycle_destroy(lc);
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+int lifecycle_add(struct lifecycle *lc, int fd, uint32_t events, lifecycle_handler handler, void *arg) {
+    struct epoll_event ev;
+    int i;
+
+    for (i = 0; i < LIFECYCLE_MAX_WATCHES && lc->watches[i].fd >= 0; i++) {
+    }
+    if (i == LIFECYCLE_MAX_WATCHES) {
+        errno = ENOSPC;
+        return -1;
+    }
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.u64 = i;
+    if (epoll_ctl(lc->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        return -1;
+    }
+    lc->watches[i].fd = fd;
+    lc->watches[i].handler = handler;
+    lc->watches[i].arg = arg;
+    return 0;
+}
+
+int lifecycle_remove(struct lifecycle *lc, int fd) {
+    int i;
+
+    for (i = 0; i < LIFECYCLE_MAX_WATCHES; i++) {
+        if (lc->watches[i].fd == fd) {
+            lc->watches[i].fd = -1;                                     // Events already fetched for it are skipped
+            return epoll_ctl(lc->epfd, EPOLL_CTL_DEL, fd, NULL);
+        }
+    }
+    errno = ENOENT;
+    return -1;
+}
+
+static void drain_start(struct lifecycle *lc) {
+    struct itimerspec deadline;
+
+    lc->draining = 1;
+    if (lc->ops->stop_intake != NULL) {
+        lc->ops->stop_intake(lc->ctx);
+    }
+    if (lc->drainMs > 0) {
+        memset(&deadline, 0, sizeof(deadline));
+        deadline.it_value.tv_sec = lc->drainMs / 1000;
+        deadline.it_value.tv_nsec = lc->drainMs % 1000 * 1000000;
+        timerfd_settime(lc->timerfd, 0, &deadline, NULL);
+    }
+}
+
+// Handles every queued signal, returns LIFECYCLE_FORCED on a second stop signal
+static int signals_read(struct lifecycle *lc) {
+    struct signalfd_siginfo info;
+
+    while (read(lc->sigfd, &info, sizeof(info)) == sizeof(info)) {
+        switch (info.ssi_signo) {
+            case SIGHUP:
+                if (lc->ops->reload != NULL && lc->ops->reload(lc->ctx) < 0) {
+                    fprintf(stderr, "Reload failed, the old configuration stays\n");
+                }
+                break;
+            case SIGINT:
+            case SIGTERM:
+                if (lc->draining) {
+                    return LIFECYCLE_FORCED;
+                }
+                drain_start(lc);
+                break;
+            default:
+                break;
+        }
+    }
+    return LIFECYCLE_DRAINED;
+}
+
+enum lifecycle_status lifecycle_run(struct lifecycle *lc) {
+    struct epoll_event events[MAX_EVENTS];
+    enum lifecycle_status status = LIFECYCLE_DRAINED;
+    int n, i;
+
+    for (;;) {
+        if (lc->draining && (lc->ops->pending == NULL || lc->ops->pending(lc->ctx) == 0)) {
+            break;
+        }
+        n = epoll_wait(lc->epfd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            status = LIFECYCLE_ERROR;
+            break;
+        }
+        for (i = 0; i < n; i++) {
+            uint64_t id = events[i].data.u64;
+
+            if (id == ID_SIGNAL) {
+                status = signals_read(lc);
+            } else if (id == ID_TIMER) {
+                status = LIFECYCLE_DEADLINE;
+            } else if (lc->watches[id].fd >= 0) {
+                lc->watches[id].handler(lc->watches[id].arg, events[i].events);
+            }
+            if (status != LIFECYCLE_DRAINED) {
+                goto out;
+            }
+        }
+    }
+out:
+    if (lc->ops->flush != NULL) {
+        lc->ops->flush(lc->ctx, status);
+    }
+    return status;
+}
+
+void lifecycle_destroy(struct lifecycle *lc) {
+    if (lc->timerfd >= 0) {
+        close(lc->timerfd);
+    }
+    if (lc->sigfd >= 0) {
+        close(lc->sigfd);
+    }
+    if (lc->epfd >= 0) {
+        close(lc->epfd);
+    }
+    lc->epfd = lc->sigfd = lc->timerfd = -1;
+    sigprocmask(SIG_SETMASK, &lc->oldMask, NULL);
+}
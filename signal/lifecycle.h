@@ -0,0 +1,74 @@
+// Copyright [2020] <Puchkov Kyryll>
+/*  Lifecycle of a long-running process around one epoll loop. SIGINT, SIGTERM and SIGHUP
+ *  are blocked and read from a signalfd in the same loop as the process's own
+ *  descriptors, so nothing runs in signal context and an idle process sleeps in
+ *  epoll_wait without any timer.
+ *
+ *  SIGTERM or SIGINT starts a drain: stop_intake() is called, the loop keeps serving
+ *  the descriptors until pending() is 0 or the drain deadline passes, then flush() gets
+ *  to write out buffers and to save what is left, and lifecycle_run() returns. Another
+ *  SIGTERM or SIGINT during the drain ends it at once. SIGHUP calls reload().
+ *
+ *  lifecycle_init() must run before the process starts threads, they inherit the
+ *  blocked signals and so never take them instead of the signalfd.
+ */
+#ifndef SIGNAL_LIFECYCLE_H_
+#define SIGNAL_LIFECYCLE_H_
+
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define LIFECYCLE_MAX_WATCHES   32
+
+enum lifecycle_status {
+    LIFECYCLE_DRAINED = 0,                                              ///< Nothing was left in flight
+    LIFECYCLE_DEADLINE,                                                 ///< The deadline passed first
+    LIFECYCLE_FORCED,                                                   ///< A second signal cut the drain short
+    LIFECYCLE_ERROR,
+};
+
+struct lifecycle_ops {
+    void   (*stop_intake)(void *ctx);                                   ///< Take no new work
+    size_t (*pending)(void *ctx);                                       ///< Work in flight, the drain ends at 0
+    void   (*flush)(void *ctx, enum lifecycle_status status);           ///< Last call, also on the deadline
+    int    (*reload)(void *ctx);                                        ///< SIGHUP, -1 keeps the old config
+};
+
+typedef void (*lifecycle_handler)(void *arg, uint32_t events);
+
+struct lifecycle_watch {
+    int               fd;                                               ///< -1 for a free entry
+    lifecycle_handler handler;
+    void             *arg;
+};
+
+struct lifecycle {
+    int                         epfd;
+    int                         sigfd;
+    int                         timerfd;                                ///< Armed only while draining
+    sigset_t                    mask;
+    sigset_t                    oldMask;
+    const struct lifecycle_ops *ops;
+    void                       *ctx;
+    long                        drainMs;
+    int                         draining;
+    struct lifecycle_watch      watches[LIFECYCLE_MAX_WATCHES];
+};
+
+// Blocks the signals and sets up the loop, 0 or -1 with errno
+int lifecycle_init(struct lifecycle *lc, const struct lifecycle_ops *ops, void *ctx, long drainMs);
+
+// Calls handler from the loop whenever fd has events, 0 or -1 with errno
+int lifecycle_add(struct lifecycle *lc, int fd, uint32_t events, lifecycle_handler handler, void *arg);
+
+// Stops watching fd, safe from a handler; the caller closes it
+int lifecycle_remove(struct lifecycle *lc, int fd);
+
+// Serves the loop until the drain is over, returns how it ended
+enum lifecycle_status lifecycle_run(struct lifecycle *lc);
+
+// Closes the loop and unblocks the signals again
+void lifecycle_destroy(struct lifecycle *lc);
+
+#endif  // SIGNAL_LIFECYCLE_H_
@@ -0,0 +1,533 @@
+// Copyright [2020] <Puchkov Kyryll>
+/*  SIGPROF sampler behind profiler.h */
+#define _GNU_SOURCE                                                     // dladdr, pthread_getattr_np, gettid
+#include <dlfcn.h>
+#include <errno.h>
+#include <link.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "profiler.h"
+
+#define MAX_THREADS         256
+#define RING_SAMPLES        256                                         ///< Per thread, a power of 2
+#define MAX_DEPTH           64
+#define STACKS_MAX          (1 << 16)                                   ///< Distinct stacks kept, a power of 2
+#define SYMBOLS_MAX         (1 << 14)                                   ///< Resolved addresses kept, a power of 2
+#define CALLS_MAX           (1 << 10)                                   ///< Checked return addresses kept, a power of 2
+#define DRAIN_MS            100
+#define WRITE_EVERY         100                                         ///< Drains between two writes of the file
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id  _sigev_un._tid
+#endif
+
+struct sample {
+    uint32_t  depth;
+    uintptr_t pcs[MAX_DEPTH];                                           ///< The interrupted pc, then return addresses
+    uintptr_t leafRet;                                                  ///< [sp] or lr, see leaf_caller()
+};
+
+struct prof_thread {
+    timer_t           timer;
+    uintptr_t         stackHi;                                          ///< Frames lie between sp and this
+    _Atomic uint32_t  head;                                             ///< Written by the signal handler only
+    _Atomic uint32_t  tail;                                             ///< Written by the writer thread only
+    _Atomic uint64_t  dropped;
+    _Atomic int       exited;                                           ///< The writer frees it once drained
+    struct sample     ring[RING_SAMPLES];
+};
+
+struct stack {
+    uint64_t   hash;
+    uint64_t   count;
+    uint32_t   depth;                                                   ///< 0 for a free entry
+    uintptr_t *pcs;
+};
+
+struct symbol {
+    uintptr_t pc;
+    char     *name;
+};
+
+struct call {
+    uintptr_t ret;                                                      ///< 0 for a free entry
+    uintptr_t start;                                                    ///< Function called right before ret, up to end
+    uintptr_t end;                                                      ///< start when ret follows no direct call
+};
+
+static struct {
+    const char                   *path;
+    _Atomic int                   hz;
+    pthread_mutex_t               lock;                                 ///< Registration, rate changes, requests
+    pthread_cond_t                wake;
+    pthread_t                     writer;
+    pthread_key_t                 key;
+    int                           running;
+    int                           dump;                                 ///< Write requested
+    int                           stop;
+    struct prof_thread * _Atomic  threads[MAX_THREADS];
+    // Below only the writer thread
+    struct stack                  stacks[STACKS_MAX];
+    uint64_t                      nstacks;
+    uint64_t                      overflow;                             ///< Samples of stacks that did not fit
+    struct symbol                 symbols[SYMBOLS_MAX];
+    struct call                   calls[CALLS_MAX];
+    uint64_t                      samples;
+    uint64_t                      dropped;                              ///< Of threads already freed
+} prof = { .lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER };
+
+static __thread struct prof_thread *self __attribute__((tls_model("initial-exec")));
+
+// Frame pointer walk; only reads between the interrupted sp and the top of the stack
+static uint32_t unwind(const struct prof_thread *t, const ucontext_t *uc, uintptr_t *pcs, uintptr_t *leafRet) {
+    uintptr_t pc, fp, sp;
+    uint32_t n = 0;
+
+    *leafRet = 0;
+#if defined(__x86_64__)
+    pc = uc->uc_mcontext.gregs[REG_RIP];
+    fp = uc->uc_mcontext.gregs[REG_RBP];
+    sp = uc->uc_mcontext.gregs[REG_RSP];
+    if (sp + sizeof(uintptr_t) <= t->stackHi && sp % sizeof(uintptr_t) == 0) {
+        *leafRet = *(const uintptr_t *)sp;
+    }
+#elif defined(__aarch64__)
+    pc = uc->uc_mcontext.pc;
+    fp = uc->uc_mcontext.regs[29];
+    sp = uc->uc_mcontext.sp;
+    *leafRet = uc->uc_mcontext.regs[30];
+#else
+    return 0;
+#endif
+    pcs[n++] = pc;
+    while (n < MAX_DEPTH && fp >= sp && fp + 2 * sizeof(uintptr_t) <= t->stackHi && fp % sizeof(uintptr_t) == 0) {
+        uintptr_t next = ((const uintptr_t *)fp)[0];
+        uintptr_t ret = ((const uintptr_t *)fp)[1];
+
+        if (ret == 0) {
+            break;
+        }
+        pcs[n++] = ret;
+        if (next <= fp) {
+            break;                                                      // Frames only go up the stack
+        }
+        fp = next;
+    }
+    return n;
+}
+
+static void on_sigprof(int signo, siginfo_t *info, void *uc) {
+    struct prof_thread *t = self;
+    int error = errno;
+    uint32_t head, tail;
+
+    (void)signo;
+    (void)info;
+    if (t == NULL) {
+        return;
+    }
+    head = atomic_load_explicit(&t->head, memory_order_relaxed);
+    tail = atomic_load_explicit(&t->tail, memory_order_acquire);
+    if (head - tail >= RING_SAMPLES) {
+        atomic_fetch_add_explicit(&t->dropped, 1, memory_order_relaxed);
+    } else {
+        struct sample *s = &t->ring[head & (RING_SAMPLES - 1)];
+
+        s->depth = unwind(t, uc, s->pcs, &s->leafRet);
+        atomic_store_explicit(&t->head, head + 1, memory_order_release);
+    }
+    errno = error;
+}
+
+static void timer_arm(struct prof_thread *t, int hz) {
+    struct itimerspec period;
+
+    memset(&period, 0, sizeof(period));
+    if (hz > 0) {
+        period.it_interval.tv_sec = hz == 1;
+        period.it_interval.tv_nsec = hz == 1 ? 0 : 1000000000L / hz;
+        period.it_value = period.it_interval;
+    }
+    timer_settime(t->timer, 0, &period, NULL);
+}
+
+static uint64_t stack_hash(const struct sample *s) {
+    uint64_t hash = 1469598103934665603ULL;                             // FNV-1a over the pcs
+    uint32_t i;
+
+    for (i = 0; i < s->depth; i++) {
+        hash = (hash ^ s->pcs[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+static void stack_count(const struct sample *s) {
+    uint64_t hash = stack_hash(s);
+    size_t i, probe;
+
+    prof.samples++;
+    if (s->depth == 0) {
+        return;
+    }
+    for (probe = 0, i = hash & (STACKS_MAX - 1); probe < STACKS_MAX / 2; probe++, i = (i + 1) & (STACKS_MAX - 1)) {
+        struct stack *st = &prof.stacks[i];
+
+        if (st->depth == 0) {
+            st->pcs = malloc(s->depth * sizeof(*st->pcs));
+            if (st->pcs == NULL) {
+                break;
+            }
+            memcpy(st->pcs, s->pcs, s->depth * sizeof(*st->pcs));
+            st->hash = hash;
+            st->depth = s->depth;
+            st->count = 1;
+            prof.nstacks++;
+            return;
+        }
+        if (st->hash == hash && st->depth == s->depth && memcmp(st->pcs, s->pcs, s->depth * sizeof(*st->pcs)) == 0) {
+            st->count++;
+            return;
+        }
+    }
+    prof.overflow++;
+}
+
+// Forgets the stacks of an earlier session
+static void stacks_clear(void) {
+    size_t i;
+
+    for (i = 0; i < STACKS_MAX; i++) {
+        free(prof.stacks[i].pcs);
+    }
+    memset(prof.stacks, 0, sizeof(prof.stacks));
+    prof.nstacks = prof.overflow = prof.samples = prof.dropped = 0;
+}
+
+// The function that the instruction before ret calls directly, looked up once per ret
+static const struct call *call_before(uintptr_t ret) {
+    size_t i = (ret * 11400714819323198485ULL) >> (64 - 10);
+    struct call *call = &prof.calls[i & (CALLS_MAX - 1)];
+    uintptr_t target = 0;
+    ElfW(Sym) *sym;
+    Dl_info info;
+
+    if (call->ret == ret) {
+        return call;
+    }
+    call->ret = ret;
+    call->start = call->end = 0;
+    // Only read code inside a function symbol, the bytes before ret are then mapped
+    if (dladdr1((void *)ret, &info, (void **)&sym, RTLD_DL_SYMENT) == 0 || sym == NULL ||
+        ELF64_ST_TYPE(sym->st_info) != STT_FUNC) {
+        return call;
+    }
+#if defined(__x86_64__)
+    if (ret >= (uintptr_t)info.dli_saddr + 5 && *(const uint8_t *)(ret - 5) == 0xe8) {
+        int32_t rel;                                                    // call rel32
+
+        memcpy(&rel, (const void *)(ret - 4), sizeof(rel));
+        target = ret + rel;
+    }
+#elif defined(__aarch64__)
+    if (ret >= (uintptr_t)info.dli_saddr + 4) {
+        uint32_t insn = *(const uint32_t *)(ret - 4);
+
+        if ((insn & 0xfc000000) == 0x94000000) {                        // bl imm26
+            target = ret - 4 + (uintptr_t)((int64_t)((insn & 0x03ffffff) << 6) >> 4);
+        }
+    }
+#endif
+    if (target != 0 && dladdr1((void *)target, &info, (void **)&sym, RTLD_DL_SYMENT) != 0 && sym != NULL &&
+        (uintptr_t)info.dli_saddr == target) {
+        call->start = target;
+        call->end = target + sym->st_size;
+    }
+    return call;
+}
+
+/*  A sample taken in a function without a frame of its own (a leaf, when the compiler
+ *  ignores -mno-omit-leaf-frame-pointer as GCC before 14 does, or any function before
+ *  its prologue) walks from its caller's frame and misses that caller. Its return
+ *  address is then at [sp] (in lr on arm64) and is put back as the first return
+ *  address when the instruction before it directly calls the function of the pc.
+ */
+static void leaf_caller(struct sample *s) {
+    const struct call *call;
+
+    if (s->depth == 0 || s->depth >= MAX_DEPTH || s->leafRet == 0 || (s->depth > 1 && s->pcs[1] == s->leafRet)) {
+        return;
+    }
+    call = call_before(s->leafRet);
+    if (s->pcs[0] < call->start || s->pcs[0] >= call->end) {
+        return;
+    }
+    memmove(&s->pcs[2], &s->pcs[1], (s->depth - 1) * sizeof(s->pcs[0]));
+    s->pcs[1] = s->leafRet;
+    s->depth++;
+}
+
+// Moves the samples of every thread into the stack table, frees threads that are gone
+static void drain(void) {
+    size_t i;
+
+    for (i = 0; i < MAX_THREADS; i++) {
+        struct prof_thread *t = atomic_load_explicit(&prof.threads[i], memory_order_acquire);
+        uint32_t head, tail;
+        int exited;
+
+        if (t == NULL) {
+            continue;
+        }
+        exited = atomic_load_explicit(&t->exited, memory_order_acquire);
+        head = atomic_load_explicit(&t->head, memory_order_acquire);
+        for (tail = atomic_load_explicit(&t->tail, memory_order_relaxed); tail != head; tail++) {
+            struct sample *s = &t->ring[tail & (RING_SAMPLES - 1)];
+
+            leaf_caller(s);
+            stack_count(s);
+        }
+        atomic_store_explicit(&t->tail, tail, memory_order_release);
+        if (exited) {
+            prof.dropped += atomic_load_explicit(&t->dropped, memory_order_relaxed);
+            atomic_store_explicit(&prof.threads[i], NULL, memory_order_relaxed);
+            free(t);
+        }
+    }
+}
+
+// "function", or "module+0xoffset" when dladdr knows no symbol; return addresses point past the call
+static const char *symbolize(uintptr_t pc) {
+    size_t i = (pc * 11400714819323198485ULL) >> (64 - 14);
+    struct symbol *sym = &prof.symbols[i & (SYMBOLS_MAX - 1)];
+    char name[256];
+    Dl_info info;
+
+    if (sym->name != NULL && sym->pc == pc) {
+        return sym->name;
+    }
+    if (dladdr((void *)pc, &info) == 0) {
+        snprintf(name, sizeof(name), "0x%lx", (unsigned long)pc);
+    } else if (info.dli_sname != NULL) {
+        snprintf(name, sizeof(name), "%s", info.dli_sname);
+    } else if (info.dli_fname != NULL) {
+        const char *base = strrchr(info.dli_fname, '/');
+
+        snprintf(name, sizeof(name), "%s+0x%lx", base != NULL ? base + 1 : info.dli_fname,
+                 (unsigned long)(pc - (uintptr_t)info.dli_fbase));
+    } else {
+        snprintf(name, sizeof(name), "0x%lx", (unsigned long)pc);
+    }
+    free(sym->name);                                                    // A direct-mapped cache, the newest wins
+    sym->pc = pc;
+    sym->name = strdup(name);
+    return sym->name != NULL ? sym->name : "?";
+}
+
+// Folded stacks, root first; written next to path and renamed over it
+static void folded_write(void) {
+    char temp[4096];
+    FILE *file;
+    size_t i;
+
+    snprintf(temp, sizeof(temp), "%s.tmp", prof.path);
+    file = fopen(temp, "w");
+    if (file == NULL) {
+        perror(temp);
+        return;
+    }
+    for (i = 0; i < STACKS_MAX; i++) {
+        const struct stack *st = &prof.stacks[i];
+        uint32_t f;
+
+        if (st->depth == 0) {
+            continue;
+        }
+        for (f = st->depth; f-- > 0;) {
+            fprintf(file, "%s%s", symbolize(f == 0 ? st->pcs[f] : st->pcs[f] - 1), f > 0 ? ";" : "");
+        }
+        fprintf(file, " %llu\n", (unsigned long long)st->count);
+    }
+    if (prof.overflow > 0) {
+        fprintf(file, "[too many stacks] %llu\n", (unsigned long long)prof.overflow);
+    }
+    if (fclose(file) != 0 || rename(temp, prof.path) != 0) {
+        perror(prof.path);
+    }
+}
+
+static void *writer(void *arg) {
+    struct timespec deadline;
+    unsigned drains = 0;
+    int stop = 0, dump;
+
+    (void)arg;
+    while (!stop) {
+        pthread_mutex_lock(&prof.lock);
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += DRAIN_MS * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        while (!prof.stop && !prof.dump &&
+               pthread_cond_timedwait(&prof.wake, &prof.lock, &deadline) != ETIMEDOUT) {
+        }
+        stop = prof.stop;
+        dump = prof.dump;
+        prof.dump = 0;
+        pthread_mutex_unlock(&prof.lock);
+
+        drain();
+        if (stop || dump || ++drains % WRITE_EVERY == 0) {
+            folded_write();
+        }
+    }
+    return NULL;
+}
+
+static void thread_exit(void *arg) {
+    (void)arg;
+    prof_thread_unregister();
+}
+
+int prof_thread_register(void) {
+    struct prof_thread *t;
+    struct sigevent sev;
+    pthread_attr_t attr;
+    void *stackLo;
+    size_t stackSize, i;
+
+    if (self != NULL) {
+        return 0;
+    }
+    t = calloc(1, sizeof(*t));
+    if (t == NULL) {
+        return -1;
+    }
+    if (pthread_getattr_np(pthread_self(), &attr) != 0) {
+        free(t);
+        return -1;
+    }
+    pthread_attr_getstack(&attr, &stackLo, &stackSize);
+    pthread_attr_destroy(&attr);
+    t->stackHi = (uintptr_t)stackLo + stackSize;
+
+    memset(&sev, 0, sizeof(sev));
+    sev.sigev_notify = SIGEV_THREAD_ID;
+    sev.sigev_signo = SIGPROF;
+    sev.sigev_notify_thread_id = syscall(SYS_gettid);
+    if (timer_create(CLOCK_THREAD_CPUTIME_ID, &sev, &t->timer) < 0) {
+        free(t);
+        return -1;
+    }
+
+    pthread_mutex_lock(&prof.lock);
+    for (i = 0; i < MAX_THREADS && atomic_load(&prof.threads[i]) != NULL; i++) {
+    }
+    if (i == MAX_THREADS) {
+        pthread_mutex_unlock(&prof.lock);
+        timer_delete(t->timer);
+        free(t);
+        errno = ENOSPC;
+        return -1;
+    }
+    self = t;
+    atomic_store_explicit(&prof.threads[i], t, memory_order_release);
+    pthread_setspecific(prof.key, t);                                  // Unregisters at thread exit
+    timer_arm(t, atomic_load(&prof.hz));
+    pthread_mutex_unlock(&prof.lock);
+    return 0;
+}
+
+void prof_thread_unregister(void) {
+    struct prof_thread *t = self;
+
+    if (t == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&prof.lock);
+    self = NULL;                                                        // A late SIGPROF finds nothing to write to
+    timer_delete(t->timer);
+    pthread_setspecific(prof.key, NULL);
+    atomic_store_explicit(&t->exited, 1, memory_order_release);
+    pthread_mutex_unlock(&prof.lock);
+}
+
+void prof_set_hz(int hz) {
+    size_t i;
+
+    pthread_mutex_lock(&prof.lock);
+    atomic_store(&prof.hz, hz);
+    for (i = 0; i < MAX_THREADS; i++) {
+        struct prof_thread *t = atomic_load(&prof.threads[i]);
+
+        if (t != NULL && !atomic_load(&t->exited)) {
+            timer_arm(t, hz);
+        }
+    }
+    pthread_mutex_unlock(&prof.lock);
+}
+
+int prof_start(const char *path, int hz) {
+    struct sigaction action;
+
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = on_sigprof;
+    action.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGPROF, &action, NULL) < 0 || pthread_key_create(&prof.key, thread_exit) != 0) {
+        return -1;
+    }
+    stacks_clear();
+    prof.path = path;
+    prof.stop = prof.dump = 0;
+    atomic_store(&prof.hz, hz);
+    if (pthread_create(&prof.writer, NULL, writer, NULL) != 0) {
+        return -1;
+    }
+    prof.running = 1;
+    return prof_thread_register();
+}
+
+void prof_dump(void) {
+    pthread_mutex_lock(&prof.lock);
+    prof.dump = 1;
+    pthread_cond_signal(&prof.wake);
+    pthread_mutex_unlock(&prof.lock);
+}
+
+void prof_stop(struct prof_stats *stats) {
+    size_t i;
+
+    if (!prof.running) {
+        return;
+    }
+    prof_set_hz(0);
+    pthread_mutex_lock(&prof.lock);
+    prof.stop = 1;
+    pthread_cond_signal(&prof.wake);
+    pthread_mutex_unlock(&prof.lock);
+    pthread_join(prof.writer, NULL);
+    prof.running = 0;
+
+    if (stats != NULL) {
+        stats->samples = prof.samples;
+        stats->dropped = prof.dropped;
+        stats->stacks = prof.nstacks;
+        for (i = 0; i < MAX_THREADS; i++) {
+            struct prof_thread *t = atomic_load(&prof.threads[i]);
+
+            if (t != NULL) {
+                stats->dropped += atomic_load(&t->dropped);
+            }
+        }
+    }
+}
@@ -0,0 +1,43 @@
+// Copyright [2020] <Puchkov Kyryll>
+/*  Sampling profiler that lives in the process. Every registered thread gets its own
+ *  POSIX timer on its CPU-time clock (SIGEV_THREAD_ID), so a thread is sampled while it
+ *  runs and an idle thread never is. The SIGPROF handler walks the frame pointers of
+ *  the interrupted code and puts the return addresses into a single-producer ring of
+ *  its thread; it takes no lock, calls nothing and never allocates. A background
+ *  thread empties the rings, counts equal stacks, resolves the addresses with dladdr
+ *  and writes folded stacks ("main;work;leaf 42") for flamegraph.pl.
+ *
+ *  The stacks are as good as the frame pointers: build with -fno-omit-frame-pointer
+ *  and -mno-omit-leaf-frame-pointer, and with -rdynamic so dladdr sees the functions
+ *  of the executable. GCC before 14 ignores the leaf flag; a sample in a frameless
+ *  leaf then gets its caller back from [sp] when that follows a direct call. Frames
+ *  of code built without frame pointers (most of libc) end the walk early.
+ */
+#ifndef SIGNAL_PROFILER_H_
+#define SIGNAL_PROFILER_H_
+
+#include <stdint.h>
+
+struct prof_stats {
+    uint64_t samples;                                                   ///< Taken from the rings so far
+    uint64_t dropped;                                                   ///< Lost to full rings
+    uint64_t stacks;                                                    ///< Distinct stacks
+};
+
+// Installs the handler, starts the writer of path and registers the calling thread
+int prof_start(const char *path, int hz);
+
+// Samples the calling thread too, until it exits or calls prof_thread_unregister()
+int prof_thread_register(void);
+void prof_thread_unregister(void);
+
+// Samples per second of CPU time of every thread, 0 pauses; any thread, any time
+void prof_set_hz(int hz);
+
+// Writes the folded stacks now, the profiler keeps going
+void prof_dump(void);
+
+// Stops the timers and writes the folded stacks for the last time
+void prof_stop(struct prof_stats *stats);
+
+#endif  // SIGNAL_PROFILER_H_
@@ -1,37 +1,334 @@
 // Copyright [2020] <Puchkov Kyryll>
+/*  Catches SIGINT, SIGTERM and SIGHUP without a signal handler (lifecycle.h): the
+ *  signals come through a signalfd into the epoll loop, and the process sleeps in
+ *  epoll_wait until there is something to do.
+ *
+ *  Every line on stdin is a job; a worker thread takes delay_ms to do it and prints
+ *  "done: <line>". On SIGTERM or SIGINT stdin is no longer read, the queued jobs are
+ *  finished and the output is flushed. What is not done by the drain deadline goes to
+ *  the spool file, and the next start takes it first, so a restart loses no job. SIGHUP
+ *  reads the config file again.
+ *
+ *  With -p the process profiles itself (profiler.h) and writes folded stacks to that
+ *  file; profile_hz in the config changes the rate on the next SIGHUP.
+ *
+ *  Usage: ./sigint [-c config] [-d drain ms] [-s spool] [-p folded stacks]
+ *  Config: lines "delay_ms N" and "profile_hz N"
+ */
+#include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
-#include <unistd.h>
 #include <stdlib.h>
-#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+
+#include "lifecycle.h"
+#include "profiler.h"
+
+#define LINE_MAX_BYTES      4096
 
-void sighandler(int);
+struct job {
+    struct job *next;
+    char        line[];
+};
 
-int main(void) {
-    signal(SIGINT, sighandler);
-    signal(SIGTERM, sighandler);
+struct app {
+    struct lifecycle lc;
+    const char      *config;
+    const char      *spool;
+    pthread_mutex_t  lock;
+    pthread_cond_t   wake;
+    struct job      *head;                                              ///< Queued jobs, the first one is being done
+    struct job     **tail;
+    size_t           queued;
+    long             delayMs;                                           ///< Under lock, SIGHUP changes it
+    long             profileHz;
+    const char      *profile;                                           ///< Folded stacks file, or NULL
+    int              done;                                              ///< eventfd, the worker finished jobs
+    int              intake;                                            ///< stdin is still read
+    char             input[LINE_MAX_BYTES];                             ///< Start of a line not complete yet
+    size_t           inputLen;
+};
 
-    // Get the proccess id
-    pid_t pid = getpid();
-    while (1) {
-        printf("Proccess with pid %d to sleep for a second...\n", pid);
-        sleep(1);
+static void job_push(struct app *app, const char *line, size_t len) {
+    struct job *job = malloc(sizeof(*job) + len + 1);
+
+    if (job == NULL) {
+        return;
     }
-    return(0);
+    memcpy(job->line, line, len);
+    job->line[len] = '\0';
+    job->next = NULL;
+    pthread_mutex_lock(&app->lock);
+    *app->tail = job;
+    app->tail = &job->next;
+    app->queued++;
+    pthread_cond_signal(&app->wake);
+    pthread_mutex_unlock(&app->lock);
 }
 
-void sighandler(int signum) {
-    const char* signal_number;
-    switch (signum) {
-        case 2:
-            signal_number = "SIGINT";
-            break;
-        case 15:
-            signal_number = "SIGTERM";
+// Does the jobs in order; a job leaves the queue only once it is done
+static void *worker(void *arg) {
+    struct app *app = arg;
+    uint64_t one = 1;
+
+    if (app->profile != NULL) {
+        prof_thread_register();
+    }
+    pthread_mutex_lock(&app->lock);
+    for (;;) {
+        struct job *job;
+        long delay;
+
+        while (app->head == NULL) {
+            pthread_cond_wait(&app->wake, &app->lock);
+        }
+        job = app->head;
+        delay = app->delayMs;
+        pthread_mutex_unlock(&app->lock);
+
+        usleep(delay * 1000);
+        printf("done: %s\n", job->line);
+
+        pthread_mutex_lock(&app->lock);
+        app->head = job->next;
+        if (app->head == NULL) {
+            app->tail = &app->head;
+        }
+        app->queued--;
+        free(job);
+        if (write(app->done, &one, sizeof(one)) < 0) {
+            perror("eventfd");
+        }
+    }
+    return NULL;
+}
+
+static int config_load(struct app *app) {
+    long delay = app->delayMs, hz = app->profileHz, value;
+    char key[64];
+    FILE *file;
+    int n;
+
+    if (app->config == NULL) {
+        return 0;
+    }
+    file = fopen(app->config, "r");
+    if (file == NULL) {
+        perror(app->config);
+        return -1;
+    }
+    while ((n = fscanf(file, " %63s %ld", key, &value)) == 2 && value >= 0) {
+        if (strcmp(key, "delay_ms") == 0) {
+            delay = value;
+        } else if (strcmp(key, "profile_hz") == 0) {
+            hz = value;
+        } else {
             break;
-        default:
-            signal_number = "Did not know yet!";
+        }
+    }
+    fclose(file);
+    if (n != EOF) {
+        fprintf(stderr, "%s: expected lines \"delay_ms N\" or \"profile_hz N\"\n", app->config);
+        return -1;
+    }
+    pthread_mutex_lock(&app->lock);
+    app->delayMs = delay;
+    pthread_mutex_unlock(&app->lock);
+    if (app->profile != NULL && hz != app->profileHz) {
+        prof_set_hz(hz);
+    }
+    app->profileHz = hz;
+    fprintf(stderr, "Config: delay_ms %ld, profile_hz %ld\n", delay, hz);
+    return 0;
+}
+
+// Jobs a previous run could not finish go first
+static void spool_load(struct app *app) {
+    char line[LINE_MAX_BYTES];
+    FILE *file = fopen(app->spool, "r");
+    size_t count = 0;
+
+    if (file == NULL) {
+        return;
+    }
+    while (fgets(line, sizeof(line), file) != NULL) {
+        job_push(app, line, strcspn(line, "\n"));
+        count++;
+    }
+    fclose(file);
+    unlink(app->spool);
+    fprintf(stderr, "%zu jobs from %s\n", count, app->spool);
+}
+
+// Reads what stdin has, without stdio: lines left in its buffer would never wake epoll
+static void on_stdin(void *arg, uint32_t events) {
+    struct app *app = arg;
+    ssize_t n = read(STDIN_FILENO, app->input + app->inputLen, sizeof(app->input) - app->inputLen);
+    char *line, *end;
+
+    (void)events;
+    if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+        return;
+    }
+    if (n <= 0) {
+        if (app->inputLen > 0) {
+            job_push(app, app->input, app->inputLen);                   // The last line had no newline
+        }
+        lifecycle_remove(&app->lc, STDIN_FILENO);                       // EOF, the process idles until a signal
+        app->intake = 0;
+        app->inputLen = 0;
+        return;
+    }
+    app->inputLen += n;
+    line = app->input;
+    while ((end = memchr(line, '\n', app->input + app->inputLen - line)) != NULL) {
+        job_push(app, line, end - line);
+        line = end + 1;
+    }
+    app->inputLen -= line - app->input;
+    memmove(app->input, line, app->inputLen);
+    if (app->inputLen == sizeof(app->input)) {
+        job_push(app, app->input, app->inputLen);                       // Too long, cut in pieces
+        app->inputLen = 0;
+    }
+}
+
+static void on_done(void *arg, uint32_t events) {
+    struct app *app = arg;
+    uint64_t count;
+
+    (void)events;
+    if (read(app->done, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        perror("eventfd");
+    }
+}
+
+static size_t app_pending(void *ctx) {
+    struct app *app = ctx;
+    size_t queued;
+
+    pthread_mutex_lock(&app->lock);
+    queued = app->queued;
+    pthread_mutex_unlock(&app->lock);
+    return queued;
+}
+
+static void app_stop_intake(void *ctx) {
+    struct app *app = ctx;
+
+    if (app->intake) {
+        lifecycle_remove(&app->lc, STDIN_FILENO);
+        app->intake = 0;
+    }
+    fprintf(stderr, "Draining %zu jobs\n", app_pending(app));
+}
+
+// Saves the jobs left, the one being done too: it runs again rather than never
+static void app_flush(void *ctx, enum lifecycle_status status) {
+    struct app *app = ctx;
+    struct job *job;
+    FILE *file;
+    size_t count = 0;
+
+    pthread_mutex_lock(&app->lock);                                     // The worker stops at its next job
+    fflush(stdout);
+    if (app->head != NULL) {
+        file = fopen(app->spool, "w");
+        if (file == NULL) {
+            perror(app->spool);
+        } else {
+            for (job = app->head; job != NULL; job = job->next, count++) {
+                fprintf(file, "%s\n", job->line);
+            }
+            fclose(file);
+        }
+    }
+    fprintf(stderr, "%s, %zu jobs spooled\n", status == LIFECYCLE_DRAINED ? "Drained" :
+            status == LIFECYCLE_DEADLINE ? "Drain deadline" : "Stopped", count);
+}
+
+static int app_reload(void *ctx) {
+    return config_load(ctx);
+}
+
+static const struct lifecycle_ops appOps = {
+    app_stop_intake,
+    app_pending,
+    app_flush,
+    app_reload,
+};
+
+int main(int argc, char *argv[]) {
+    static struct app app;
+    long drainMs = 5000;
+    enum lifecycle_status status;
+    pthread_t thread;
+    int opt;
+
+    app.spool = "/tmp/sigint.spool";
+    app.delayMs = 200;
+    app.profileHz = 100;
+    while ((opt = getopt(argc, argv, "c:d:s:p:")) != -1) {
+        switch (opt) {
+            case 'c':
+                app.config = optarg;
+                break;
+            case 'd':
+                drainMs = strtol(optarg, NULL, 0);
+                break;
+            case 's':
+                app.spool = optarg;
+                break;
+            case 'p':
+                app.profile = optarg;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-c config] [-d drain ms] [-s spool] [-p folded stacks]\n", argv[0]);
+                return 2;
+        }
+    }
+
+    pthread_mutex_init(&app.lock, NULL);
+    pthread_cond_init(&app.wake, NULL);
+    app.tail = &app.head;
+    if (config_load(&app) < 0) {
+        return 1;
+    }
+    // Before the worker starts, so it inherits the blocked signals
+    if (lifecycle_init(&app.lc, &appOps, &app, drainMs) < 0) {
+        perror("lifecycle");
+        return 1;
+    }
+    if (app.profile != NULL && prof_start(app.profile, app.profileHz) < 0) {
+        perror("profiler");
+        return 1;
+    }
+    app.done = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (app.done < 0 || lifecycle_add(&app.lc, app.done, EPOLLIN, on_done, &app) < 0) {
+        perror("eventfd");
+        return 1;
+    }
+    spool_load(&app);
+    app.intake = 1;
+    if (lifecycle_add(&app.lc, STDIN_FILENO, EPOLLIN, on_stdin, &app) < 0) {
+        if (errno != EPERM) {
+            perror("stdin");
+            return 1;
+        }
+        while (app.intake) {
+            on_stdin(&app, EPOLLIN);                                    // A regular file, epoll does not take it
+        }
+    }
+    if (pthread_create(&thread, NULL, worker, &app) != 0) {
+        perror("pthread_create");
+        return 1;
     }
 
-    printf("Caught signal %d: %s\n", signum, signal_number);
-    exit(1);
+    fprintf(stderr, "Process with pid %d, SIGTERM drains, SIGHUP reloads\n", getpid());
+    status = lifecycle_run(&app.lc);
+    prof_stop(NULL);
+    return status != LIFECYCLE_DRAINED;                                 // The worker ends with the process
 }
@@ -0,0 +1,169 @@
+// Copyright [2020] <Puchkov Kyryll>
+/*  Interactive client of echo-server: what is typed on stdin goes to the socket, what
+ *  comes back from the socket goes to stdout. At the end of stdin the client shuts down
+ *  its sending side and prints the rest of the replies before it exits.
+ *
+ *  A regular file of -f bytes or more on stdin goes as one memfd instead (echo_fd.h),
+ *  and the reply is written to stdout from the mapping of the descriptor that comes back.
+ *
+ *  Usage: ./echo-client [-f threshold bytes] [socket path]
+ */
+#define _GNU_SOURCE                                                     // memfd_create
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "echo_fd.h"
+#include "echo_proto.h"
+
+#define BUFFER_SIZE         4096
+
+// Writes all of buf, the socket and stdout are blocking
+static int write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Sends size bytes of stdin as a memfd and writes what comes back to stdout
+static int echo_by_fd(int sock, size_t size) {
+    char *map, token;
+    struct stat st;
+    size_t done = 0;
+    ssize_t n;
+    int mfd = echo_memfd("echo-client", size), reply;
+
+    if (mfd < 0) {
+        perror("memfd");
+        return -1;
+    }
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, mfd, 0);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    while (done < size && (n = read(STDIN_FILENO, map + done, size - done)) > 0) {
+        done += n;
+    }
+    munmap(map, size);
+    if (done < size) {
+        fprintf(stderr, "stdin changed while it was read\n");
+        return -1;
+    }
+    if (echo_send_fd(sock, mfd) < 0) {
+        perror("sendmsg");
+        return -1;
+    }
+    close(mfd);
+
+    n = echo_recv(sock, &token, 1, &reply);
+    if (n < 0) {
+        perror("recvmsg");
+        return -1;
+    }
+    if (n == 0 || reply < 0) {
+        fprintf(stderr, "The server does not pass descriptors back\n");
+        return -1;
+    }
+    if (fstat(reply, &st) < 0 || (map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, reply, 0)) == MAP_FAILED) {
+        perror("reply");
+        return -1;
+    }
+    n = write_all(STDOUT_FILENO, map, st.st_size);
+    munmap(map, st.st_size);
+    close(reply);
+    return n;
+}
+
+int main(int argc, char *argv[]) {
+    const char *path = ECHO_SOCKET_PATH;
+    long long threshold = ECHO_FD_THRESHOLD;
+    struct sockaddr_un addr;
+    struct pollfd fds[2];
+    struct stat st;
+    char buf[BUFFER_SIZE];
+    int input = 1;
+    int fd, opt;
+
+    while ((opt = getopt(argc, argv, "f:")) != -1) {
+        if (opt != 'f') {
+            fprintf(stderr, "Usage: %s [-f threshold bytes] [socket path]\n", argv[0]);
+            return 2;
+        }
+        threshold = strtoll(optarg, NULL, 0);
+    }
+    if (optind < argc) {
+        path = argv[optind];
+    }
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path %s is too long\n", path);
+        return 2;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror(path);
+        return 1;
+    }
+    if (fstat(STDIN_FILENO, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 && st.st_size >= threshold) {
+        return echo_by_fd(fd, st.st_size) < 0;
+    }
+
+    fds[0].fd = STDIN_FILENO;
+    fds[1].fd = fd;
+    fds[1].events = POLLIN;
+    for (;;) {
+        ssize_t n;
+
+        fds[0].events = input ? POLLIN : 0;
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            return 1;
+        }
+        if (fds[0].revents & (POLLIN | POLLHUP)) {
+            n = read(STDIN_FILENO, buf, sizeof(buf));
+            if (n > 0) {
+                if (write_all(fd, buf, n) < 0) {
+                    perror("write");
+                    return 1;
+                }
+            } else if (n == 0) {
+                input = 0;
+                shutdown(fd, SHUT_WR);                                  // The server answers the rest and closes
+            }
+        }
+        if (fds[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+            n = read(fd, buf, sizeof(buf));
+            if (n <= 0) {
+                break;                                                  // The server is done
+            }
+            if (write_all(STDOUT_FILENO, buf, n) < 0) {
+                return 1;
+            }
+        }
+    }
+    close(fd);
+    return 0;
+}
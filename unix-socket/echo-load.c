@@ -0,0 +1,400 @@
+// Copyright [2020] <Puchkov Kyryll>
+/*  Load generator for echo-server. Opens C connections, spread over T threads that
+ *  each drive their share from one epoll set. Every connection keeps one message of
+ *  M bytes in flight: it sends it, waits until the whole upper-cased echo is back,
+ *  checks it, takes the round trip time and sends the next one.
+ *
+ *  Messages of -f bytes or more go by descriptor (echo_fd.h): every connection owns a
+ *  sealed memfd of the message size, writes the message into its mapping, passes the
+ *  descriptor and checks the mapping once the server hands it back. -f 1 sends every
+ *  message that way and -f 0 none, which is how `make crossover` finds the size where
+ *  the descriptor starts to win.
+ *
+ *  Usage: ./echo-load [-s socket path] [-c connections] [-t threads] [-m bytes] [-d seconds]
+ *                     [-f threshold bytes]
+ *  Output: connections,threads,msg_bytes,transport,messages,seconds,msgs_s,p50_us,p99_us,p999_us,check
+ */
+#define _GNU_SOURCE                                                     // memfd_create
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "echo_fd.h"
+#include "echo_proto.h"
+
+#define MAX_THREADS         256
+#define MAX_MESSAGE         (64 * 1024 * 1024)
+#define MAX_EVENTS          256
+#define LATENCY_CAP         (1 << 20)                                   ///< Round trips timed per thread
+
+struct options {
+    const char *path;
+    int         connections;
+    int         threads;
+    size_t      size;
+    double      seconds;
+    size_t      threshold;                                              ///< Message size sent by descriptor, 0 never
+    int         byFd;
+};
+
+struct client {
+    int       fd;
+    size_t    sent;                                                     ///< Bytes of the message written
+    size_t    received;                                                 ///< Bytes of the echo read
+    uint64_t  start;                                                    ///< When the message was sent
+    int       mfd;                                                      ///< The memfd of the message, or -1
+    char     *map;
+    ino_t     ino;                                                      ///< Of mfd, what the server must return
+};
+
+struct loader {
+    pthread_t            thread;
+    const struct options *opt;
+    int                  count;                                         ///< Connections of this thread
+    const char          *message;                                       ///< What every client sends
+    const char          *expected;                                      ///< And gets back
+    uint64_t             messages;
+    uint64_t            *lat;
+    uint64_t             nlat;
+    int                  errors;
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int connect_to(const char *path) {
+    struct sockaddr_un addr;
+    int fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||     // Blocking, waits for room in the backlog
+        fcntl(fd, F_SETFL, O_NONBLOCK) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Takes the round trip of a complete echo, 1 past the deadline
+static int client_done(struct loader *l, struct client *c, uint64_t deadline) {
+    uint64_t now = now_ns();
+
+    if (l->nlat < LATENCY_CAP) {
+        l->lat[l->nlat++] = now - c->start;
+    }
+    l->messages++;
+    if (now >= deadline) {
+        return 1;
+    }
+    c->sent = c->received = 0;
+    c->start = now;
+    return 0;
+}
+
+// client_step() of a client that passes its memfd instead of the bytes
+static int client_step_fd(struct loader *l, struct client *c, uint64_t deadline) {
+    struct stat st;
+    char token;
+    ssize_t n;
+    int reply;
+
+    for (;;) {
+        if (c->sent == 0) {
+            memcpy(c->map, l->message, l->opt->size);
+            if (echo_send_fd(c->fd, c->mfd) < 0) {
+                return errno == EAGAIN ? 0 : -1;
+            }
+            c->sent = l->opt->size;
+        }
+        n = echo_recv(c->fd, &token, 1, &reply);
+        if (n < 0) {
+            return errno == EAGAIN ? 0 : -1;
+        }
+        if (n == 0 || reply < 0) {
+            return -1;                                                  // Closed, or a server that takes no descriptors
+        }
+        n = fstat(reply, &st) == 0 && st.st_ino == c->ino;
+        close(reply);
+        if (!n || memcmp(c->map, l->expected, l->opt->size) != 0) {
+            return -1;
+        }
+        if (client_done(l, c, deadline)) {
+            return 1;
+        }
+    }
+}
+
+/*  Moves one client as far as the socket allows, until both directions would block.
+ *  Writing and reading alternate: a message larger than the socket buffers only gets
+ *  through if the echo is drained while the message is still being sent. Starts the
+ *  next message once the echo is complete. Returns 0 to wait for the next edge, 1 past
+ *  the deadline and -1 on an error.
+ */
+static int client_step(struct loader *l, struct client *c, uint64_t deadline) {
+    static __thread char buf[64 * 1024];
+    size_t size = l->opt->size;
+    ssize_t n;
+    int progress;
+
+    if (l->opt->byFd) {
+        return client_step_fd(l, c, deadline);
+    }
+    for (;;) {
+        progress = 0;
+        if (c->sent < size) {
+            n = send(c->fd, l->message + c->sent, size - c->sent, MSG_NOSIGNAL);
+            if (n < 0 && errno != EAGAIN) {
+                return -1;
+            }
+            if (n > 0) {
+                c->sent += n;
+                progress = 1;
+            }
+        }
+        if (c->received < c->sent) {
+            size_t want = c->sent - c->received < sizeof(buf) ? c->sent - c->received : sizeof(buf);
+
+            n = read(c->fd, buf, want);
+            if (n < 0 && errno != EAGAIN) {
+                return -1;
+            }
+            if (n == 0 || (n > 0 && memcmp(buf, l->expected + c->received, n) != 0)) {
+                return -1;                                              // Closed early, or not our text
+            }
+            if (n > 0) {
+                c->received += n;
+                progress = 1;
+            }
+        }
+        if (c->received < size) {
+            if (!progress) {
+                return 0;
+            }
+            continue;
+        }
+        if (client_done(l, c, deadline)) {
+            return 1;
+        }
+    }
+}
+
+static void *loader_run(void *arg) {
+    struct loader *l = arg;
+    struct epoll_event events[MAX_EVENTS];
+    struct client *clients = calloc(l->count, sizeof(*clients));
+    uint64_t deadline;
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    int i, n;
+
+    l->lat = malloc(LATENCY_CAP * sizeof(*l->lat));
+    if (clients == NULL || l->lat == NULL || epfd < 0) {
+        l->errors++;
+        goto out;
+    }
+    for (i = 0; i < l->count; i++) {
+        struct epoll_event ev;
+        struct client *c = &clients[i];
+
+        c->mfd = -1;
+        if (l->opt->byFd) {
+            struct stat st;
+
+            c->mfd = echo_memfd("echo-load", l->opt->size);
+            c->map = c->mfd < 0 ? MAP_FAILED :
+                     mmap(NULL, l->opt->size, PROT_READ | PROT_WRITE, MAP_SHARED, c->mfd, 0);
+            if (c->map == MAP_FAILED || fstat(c->mfd, &st) < 0) {
+                perror("memfd");
+                l->errors++;
+                l->count = i;
+                break;
+            }
+            c->ino = st.st_ino;
+        }
+        clients[i].fd = connect_to(l->opt->path);
+        if (clients[i].fd < 0) {
+            perror("connect");
+            l->errors++;
+            l->count = i;
+            break;
+        }
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+        ev.data.ptr = &clients[i];
+        epoll_ctl(epfd, EPOLL_CTL_ADD, clients[i].fd, &ev);
+    }
+
+    deadline = now_ns() + (uint64_t)(l->opt->seconds * 1e9);
+    for (i = 0; i < l->count; i++) {
+        clients[i].start = now_ns();
+    }
+    while (now_ns() < deadline) {
+        n = epoll_wait(epfd, events, MAX_EVENTS, 100);
+        for (i = 0; i < n; i++) {
+            struct client *c = events[i].data.ptr;
+            int state;
+
+            if (c->fd < 0) {
+                continue;
+            }
+            state = client_step(l, c, deadline);
+            if (state != 0) {
+                l->errors += state < 0;
+                close(c->fd);                                           // Failed, or past the deadline
+                c->fd = -1;
+            }
+        }
+    }
+
+out:
+    for (i = 0; i < l->count; i++) {
+        if (clients[i].fd >= 0) {
+            close(clients[i].fd);
+        }
+        if (clients[i].mfd >= 0) {
+            munmap(clients[i].map, l->opt->size);
+            close(clients[i].mfd);
+        }
+    }
+    free(clients);
+    if (epfd >= 0) {
+        close(epfd);
+    }
+    return NULL;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_us(const uint64_t *sorted, uint64_t n, double p) {
+    uint64_t i = (uint64_t)(p * n);
+
+    if (n == 0) {
+        return 0;
+    }
+    return sorted[i < n ? i : n - 1] / 1e3;
+}
+
+int main(int argc, char *argv[]) {
+    static struct loader loaders[MAX_THREADS];
+    struct options opt = { ECHO_SOCKET_PATH, 1000, 4, 64, 5, ECHO_FD_THRESHOLD, 0 };
+    struct rlimit limit;
+    uint64_t messages = 0, nlat = 0, *lat;
+    char *message, *expected;
+    size_t i;
+    int errors = 0, c, t;
+    double seconds, start;
+
+    while ((c = getopt(argc, argv, "s:c:t:m:d:f:")) != -1) {
+        switch (c) {
+            case 's':
+                opt.path = optarg;
+                break;
+            case 'c':
+                opt.connections = strtol(optarg, NULL, 0);
+                break;
+            case 't':
+                opt.threads = strtol(optarg, NULL, 0);
+                break;
+            case 'm':
+                opt.size = strtoull(optarg, NULL, 0);
+                break;
+            case 'd':
+                opt.seconds = strtod(optarg, NULL);
+                break;
+            case 'f':
+                opt.threshold = strtoull(optarg, NULL, 0);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-s socket path] [-c connections] [-t threads] "
+                        "[-m bytes] [-d seconds] [-f threshold bytes]\n", argv[0]);
+                return 2;
+        }
+    }
+    if (opt.connections < 1 || opt.threads < 1 || opt.threads > MAX_THREADS ||
+        opt.size == 0 || opt.size > MAX_MESSAGE || opt.seconds <= 0) {
+        fprintf(stderr, "Bad arguments, up to %d threads and %d byte messages\n", MAX_THREADS, MAX_MESSAGE);
+        return 2;
+    }
+    opt.byFd = opt.threshold > 0 && opt.size >= opt.threshold;
+    if (opt.threads > opt.connections) {
+        opt.threads = opt.connections;
+    }
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    message = malloc(opt.size);
+    expected = malloc(opt.size);
+    if (message == NULL || expected == NULL) {
+        return 1;
+    }
+    for (i = 0; i < opt.size; i++) {
+        message[i] = 'a' + i % 26;
+        expected[i] = echo_transform_byte(message[i]);
+    }
+
+    start = now_ns() / 1e9;
+    for (t = 0; t < opt.threads; t++) {
+        struct loader *l = &loaders[t];
+
+        l->opt = &opt;
+        l->count = (long)opt.connections * (t + 1) / opt.threads - (long)opt.connections * t / opt.threads;
+        l->message = message;
+        l->expected = expected;
+        if (pthread_create(&l->thread, NULL, loader_run, l) != 0) {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+    for (t = 0; t < opt.threads; t++) {
+        pthread_join(loaders[t].thread, NULL);
+        messages += loaders[t].messages;
+        nlat += loaders[t].nlat;
+        errors += loaders[t].errors;
+    }
+    seconds = now_ns() / 1e9 - start;
+
+    lat = malloc((nlat > 0 ? nlat : 1) * sizeof(*lat));
+    if (lat == NULL) {
+        return 1;
+    }
+    for (t = 0, nlat = 0; t < opt.threads; t++) {
+        memcpy(lat + nlat, loaders[t].lat, loaders[t].nlat * sizeof(*lat));
+        nlat += loaders[t].nlat;
+        free(loaders[t].lat);
+    }
+    qsort(lat, nlat, sizeof(*lat), compare_u64);
+
+    printf("connections,threads,msg_bytes,transport,messages,seconds,msgs_s,p50_us,p99_us,p999_us,check\n");
+    printf("%d,%d,%zu,%s,%llu,%.3f,%.0f,%.1f,%.1f,%.1f,%s\n", opt.connections, opt.threads, opt.size,
+           opt.byFd ? "memfd" : "inline", (unsigned long long)messages, seconds, messages / seconds, percentile_us(lat, nlat, 0.50),
+           percentile_us(lat, nlat, 0.99), percentile_us(lat, nlat, 0.999), errors ? "fail" : "ok");
+    free(lat);
+    free(message);
+    free(expected);
+    return errors != 0;
+}
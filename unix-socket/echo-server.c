@@ -0,0 +1,345 @@
+// Copyright [2020] <Puchkov Kyryll>
+/*  Echo server on a unix stream socket. Every byte a client sends comes back upper-cased
+ *  (echo_proto.h), so the client can see the text went through the server.
+ *
+ *  The main thread accepts connections and spreads them round-robin over N worker
+ *  loops. Each worker owns an epoll set and the connections registered in it, so no
+ *  connection is ever touched by two threads and nothing is locked. Sockets are
+ *  non-blocking and edge-triggered: a worker reads until EAGAIN and writes the reply
+ *  right away. What the peer does not take stays in a buffer and the connection stops
+ *  reading until EPOLLOUT, so a slow client cannot make the server buffer without bound.
+ *
+ *  Buffers come from a per-worker pool and are held only while a read is in progress
+ *  or a reply is pending, so thousands of idle connections cost a struct each.
+ *
+ *  A large message may come as a memfd instead (echo_fd.h): the worker maps it, transforms
+ *  it in place and passes the descriptor back after the inline bytes that came before it.
+ *
+ *  With -b uring the same workers run on io_uring instead (echo-uring.c); a kernel
+ *  without what that needs gets the epoll loops and a note on stderr.
+ *
+ *  Usage: ./echo-server [-s socket path] [-w workers] [-b epoll|uring]
+ */
+#define _GNU_SOURCE                                                     // accept4
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "echo_fd.h"
+#include "echo_proto.h"
+#include "echo_uring.h"
+
+#define BUFFER_SIZE         (16 * 1024)
+#define POOL_MAX            256                                         ///< Free buffers a worker keeps
+#define MAX_EVENTS          256
+#define MAX_WORKERS         256
+
+struct buffer {
+    struct buffer *next;                                                ///< Free list link
+    char           data[BUFFER_SIZE];
+};
+
+struct worker {
+    pthread_t      thread;
+    int            epfd;
+    struct buffer *pool;                                                ///< Free buffers, used by this worker only
+    unsigned       pooled;
+};
+
+struct conn {
+    int            fd;
+    struct buffer *out;                                                 ///< Reply not written yet, or NULL
+    size_t         off;                                                 ///< Written part of out
+    size_t         len;                                                 ///< Valid bytes in out
+    int            outFd;                                               ///< Memfd to pass back after out, or -1
+};
+
+static struct buffer *buffer_get(struct worker *w) {
+    struct buffer *buf = w->pool;
+
+    if (buf != NULL) {
+        w->pool = buf->next;
+        w->pooled--;
+        return buf;
+    }
+    return malloc(sizeof(*buf));
+}
+
+static void buffer_put(struct worker *w, struct buffer *buf) {
+    if (w->pooled >= POOL_MAX) {
+        free(buf);
+        return;
+    }
+    buf->next = w->pool;
+    w->pool = buf;
+    w->pooled++;
+}
+
+static void conn_close(struct worker *w, struct conn *c) {
+    if (c->out != NULL) {
+        buffer_put(w, c->out);
+    }
+    if (c->outFd >= 0) {
+        close(c->outFd);
+    }
+    close(c->fd);                                                       // Also removes it from the epoll set
+    free(c);
+}
+
+/*  Writes the pending reply and then passes the pending memfd. Returns 0 when all of it
+ *  is out, 1 when the socket is full and the rest waits for EPOLLOUT, -1 on an error.
+ */
+static int conn_flush(struct conn *c) {
+    while (c->off < c->len) {
+        ssize_t n = send(c->fd, c->out->data + c->off, c->len - c->off, MSG_NOSIGNAL);
+
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN ? 1 : -1;
+        }
+        c->off += n;
+    }
+    while (c->outFd >= 0) {
+        if (echo_send_fd(c->fd, c->outFd) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN ? 1 : -1;
+        }
+        close(c->outFd);
+        c->outFd = -1;
+    }
+    return 0;
+}
+
+/*  Handles one edge: finishes the pending reply, then reads and answers until the
+ *  socket is drained. The buffer goes back to the pool unless a reply is left over.
+ */
+static void conn_handle(struct worker *w, struct conn *c, uint32_t events) {
+    struct buffer *buf;
+    ssize_t n;
+    int state, fd;
+
+    if (events & EPOLLERR) {
+        conn_close(w, c);
+        return;
+    }
+    if (c->out != NULL) {
+        state = conn_flush(c);
+        if (state != 0) {
+            if (state < 0) {
+                conn_close(w, c);
+            }
+            return;
+        }
+    } else {
+        c->out = buffer_get(w);
+        if (c->out == NULL) {
+            conn_close(w, c);
+            return;
+        }
+    }
+    buf = c->out;
+
+    for (;;) {
+        n = echo_recv(c->fd, buf->data, BUFFER_SIZE, &fd);
+        if (n > 0) {
+            if (fd >= 0) {
+                n--;                                                    // The token goes back with the reply fd
+                if (echo_memfd_transform(fd) < 0) {
+                    close(fd);
+                    conn_close(w, c);
+                    return;
+                }
+                c->outFd = fd;
+            }
+            echo_transform(buf->data, n);
+            c->off = 0;
+            c->len = n;
+            state = conn_flush(c);
+            if (state < 0) {
+                conn_close(w, c);
+                return;
+            }
+            if (state > 0) {
+                return;                                                 // Keep the buffer, wait for EPOLLOUT
+            }
+            continue;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && errno == EAGAIN) {
+            break;
+        }
+        conn_close(w, c);                                               // EOF or an error
+        return;
+    }
+    c->out = NULL;
+    c->off = c->len = 0;
+    buffer_put(w, buf);
+}
+
+static void *worker_loop(void *arg) {
+    struct worker *w = arg;
+    struct epoll_event events[MAX_EVENTS];
+    int n, i;
+
+    for (;;) {
+        n = epoll_wait(w->epfd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            return NULL;
+        }
+        for (i = 0; i < n; i++) {
+            conn_handle(w, events[i].data.ptr, events[i].events);
+        }
+    }
+}
+
+// Thousands of clients need thousands of descriptors
+static void raise_nofile(void) {
+    struct rlimit limit;
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+static int listen_on(const char *path) {
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path %s is too long\n", path);
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, SOMAXCONN) < 0) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Accepts on this thread and hands connections round-robin to the epoll workers
+static int epoll_run(int lfd, long nworkers) {
+    static struct worker workers[MAX_WORKERS];
+    unsigned long next = 0;
+    long i;
+
+    for (i = 0; i < nworkers; i++) {
+        workers[i].epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (workers[i].epfd < 0 || pthread_create(&workers[i].thread, NULL, worker_loop, &workers[i]) != 0) {
+            perror("worker");
+            return -1;
+        }
+    }
+
+    for (;;) {
+        struct epoll_event ev;
+        struct conn *c;
+        struct worker *w;
+        int fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if (fd < 0) {
+            if (errno == EMFILE || errno == ENFILE) {
+                perror("accept");
+                usleep(10000);                                          // Let connections go away
+            }
+            continue;
+        }
+        c = calloc(1, sizeof(*c));
+        if (c == NULL) {
+            close(fd);
+            continue;
+        }
+        c->fd = fd;
+        c->outFd = -1;
+        w = &workers[next++ % nworkers];
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = c;
+        if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {          // From here on only w touches c
+            perror("epoll_ctl");
+            close(fd);
+            free(c);
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    const char *path = ECHO_SOCKET_PATH;
+    const char *backend = "epoll";
+    long nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+    char why[128];
+    int lfd, opt;
+
+    while ((opt = getopt(argc, argv, "s:w:b:")) != -1) {
+        switch (opt) {
+            case 's':
+                path = optarg;
+                break;
+            case 'w':
+                nworkers = strtol(optarg, NULL, 0);
+                break;
+            case 'b':
+                backend = optarg;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-s socket path] [-w workers] [-b epoll|uring]\n", argv[0]);
+                return 2;
+        }
+    }
+    if (nworkers < 1 || nworkers > MAX_WORKERS) {
+        fprintf(stderr, "workers must be in 1..%d\n", MAX_WORKERS);
+        return 2;
+    }
+    if (strcmp(backend, "epoll") != 0 && strcmp(backend, "uring") != 0) {
+        fprintf(stderr, "Unknown backend %s, epoll or uring\n", backend);
+        return 2;
+    }
+    if (strcmp(backend, "uring") == 0 && echo_uring_probe(why, sizeof(why)) < 0) {
+        fprintf(stderr, "io_uring is not usable (%s), falling back to epoll\n", why);
+        backend = "epoll";
+    }
+
+    raise_nofile();
+    lfd = listen_on(path);
+    if (lfd < 0) {
+        return 1;
+    }
+    printf("Listening on %s with %ld %s workers\n", path, nworkers, backend);
+    fflush(stdout);
+
+    if (strcmp(backend, "uring") == 0) {
+        if (echo_uring_run(lfd, nworkers) < 0) {
+            return 1;
+        }
+        fprintf(stderr, "io_uring workers could not be set up, falling back to epoll\n");
+    }
+    return epoll_run(lfd, nworkers) < 0;
+}
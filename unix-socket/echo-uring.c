@@ -0,0 +1,716 @@
+// Copyright [2020] <Puchkov Kyryll>
+/*  io_uring backend of echo-server. Every worker thread owns a ring and serves the
+ *  connections it accepts itself:
+ *
+ *  - one multishot accept on the listening socket installs every new connection
+ *    straight into the ring's registered file table (IORING_FILE_INDEX_ALLOC), so the
+ *    connection never gets a normal descriptor and the kernel skips the fd lookup;
+ *  - one multishot recvmsg per connection picks buffers from a provided buffer ring, so
+ *    no buffer is tied to an idle connection;
+ *  - the reply is sent from the very buffer it was received into, which goes back to
+ *    the buffer ring when the send completes.
+ *
+ *  Under load a worker makes one io_uring_enter per batch of completions, whatever
+ *  the number of messages in it.
+ *
+ *  A recv cannot be linked to its send, the length of the send is only known from the
+ *  recv completion; instead a connection keeps one send in flight and queues the rest
+ *  in order. When every buffer is queued for sending, multishot recvs end with ENOBUFS
+ *  and are armed again once sends give buffers back, which is the backpressure.
+ *
+ *  The recvmsg is there for memfds of large messages (echo_fd.h): a plain recv would
+ *  drop passed descriptors. Every buffer starts with the io_uring_recvmsg_out header
+ *  and room for one descriptor, the data follows at RECV_DATA. A memfd is transformed
+ *  in place and passed back with a sendmsg of its token once the bytes before it are out.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+
+#include "echo_fd.h"
+#include "echo_proto.h"
+#include "echo_uring.h"
+
+#define URING_ENTRIES       1024
+#define URING_FILES_MAX     16384                                       ///< Connections per worker, if RLIMIT_NOFILE allows
+#define BUF_COUNT           2048                                        ///< Provided buffers per worker, a power of 2
+#define BUF_SIZE            4096
+#define BUF_GROUP           0
+#define BUF_NONE            0xffff
+#define RECV_DATA           (sizeof(struct io_uring_recvmsg_out) + CMSG_SPACE(sizeof(int)))
+
+enum { OP_ACCEPT = 1, OP_RECV, OP_SEND, OP_CLOSE, OP_SHUTDOWN };
+
+#define USER_DATA(op, slot) ((uint64_t)(op) << 32 | (uint32_t)(slot))
+
+struct uring {
+    int                  fd;
+    unsigned            *sqHead;
+    unsigned            *sqTail;
+    unsigned             sqMask;
+    unsigned             sqEntries;
+    struct io_uring_sqe *sqes;
+    unsigned             sqLocal;                                       ///< Our tail, published on submit
+    unsigned             submitted;                                     ///< Part of sqLocal handed to the kernel
+    unsigned            *cqHead;
+    unsigned            *cqTail;
+    unsigned             cqMask;
+    struct io_uring_cqe *cqes;
+    void                *ringMem;
+    size_t               ringSize;
+    void                *sqeMem;
+    size_t               sqeSize;
+};
+
+struct uconn {
+    uint16_t head;                                                      ///< First buffer waiting to be sent, or BUF_NONE
+    uint16_t tail;
+    uint32_t off;                                                       ///< Sent part of head
+    uint8_t  open;
+    uint8_t  recving;                                                   ///< A multishot recv is armed
+    uint8_t  sending;                                                   ///< head or its descriptor is being sent
+    uint8_t  closing;                                                   ///< Close once recv and send are done
+    uint8_t  starved;                                                   ///< recv ended with ENOBUFS, on the starved list
+};
+
+// sendmsg of the token that passes a memfd back, one per buffer
+struct ufdsend {
+    struct msghdr         msg;
+    struct iovec          iov;
+    union echo_fd_control control;
+    char                  token;
+};
+
+struct uworker {
+    pthread_t                thread;
+    int                      lfd;
+    struct uring             ring;
+    struct io_uring_buf_ring *bufRing;
+    char                    *bufs;
+    uint16_t                 bufTail;
+    uint16_t                 bufNext[BUF_COUNT];                        ///< Send queues are linked through the buffers
+    uint16_t                 bufLen[BUF_COUNT];
+    int                      bufFd[BUF_COUNT];                          ///< Memfd to pass back after the bytes, or -1
+    struct ufdsend           fdSend[BUF_COUNT];
+    struct msghdr            recvMsg;                                   ///< Of every recvmsg: no name, one descriptor
+    unsigned                 nfiles;
+    struct uconn            *conns;                                     ///< Indexed by registered file slot
+    uint32_t                *starved;                                   ///< Slots waiting for buffers
+    unsigned                 nstarved;
+};
+
+static unsigned setupFlags;                                             ///< What echo_uring_probe() found to work
+
+/*  Start-up handshake of echo_uring_run(): a worker sets up its ring and waits for the
+ *  verdict, so the workers either all serve or none does, and a worker that stops
+ *  serving later wakes the run up instead of leaving its connections hanging.
+ */
+static pthread_mutex_t startLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  startCond = PTHREAD_COND_INITIALIZER;
+static long            startReady;                                     ///< Workers that are set up or failed to
+static long            startFailed;
+static long            workersDone;                                    ///< Workers that stopped serving
+static int             startGo;                                        ///< 0 waiting, 1 serve, -1 give up
+
+static int sys_setup(unsigned entries, struct io_uring_params *p) {
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned submit, unsigned wait, unsigned flags) {
+    return syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+static int sys_register(int fd, unsigned op, void *arg, unsigned nargs) {
+    return syscall(__NR_io_uring_register, fd, op, arg, nargs);
+}
+
+static void uring_exit(struct uring *r) {
+    if (r->sqeMem != NULL) {
+        munmap(r->sqeMem, r->sqeSize);
+    }
+    if (r->ringMem != NULL) {
+        munmap(r->ringMem, r->ringSize);
+    }
+    close(r->fd);
+}
+
+static int uring_init(struct uring *r, unsigned entries, unsigned flags) {
+    struct io_uring_params p;
+    unsigned *array;
+    size_t sqSize, cqSize;
+    char *ring;
+    unsigned i;
+
+    memset(r, 0, sizeof(*r));
+    memset(&p, 0, sizeof(p));
+    p.flags = flags;
+    r->fd = sys_setup(entries, &p);
+    if (r->fd < 0) {
+        return -errno;
+    }
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        close(r->fd);
+        return -ENOSYS;                                                 // Older than 5.4, not worth a second mapping
+    }
+    sqSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cqSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->ringSize = sqSize > cqSize ? sqSize : cqSize;
+    r->ringMem = mmap(NULL, r->ringSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      r->fd, IORING_OFF_SQ_RING);
+    r->sqeSize = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqeMem = mmap(NULL, r->sqeSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     r->fd, IORING_OFF_SQES);
+    if (r->ringMem == MAP_FAILED || r->sqeMem == MAP_FAILED) {
+        r->ringMem = r->ringMem == MAP_FAILED ? NULL : r->ringMem;
+        r->sqeMem = r->sqeMem == MAP_FAILED ? NULL : r->sqeMem;
+        uring_exit(r);
+        return -ENOMEM;
+    }
+
+    ring = r->ringMem;
+    r->sqHead = (unsigned *)(ring + p.sq_off.head);
+    r->sqTail = (unsigned *)(ring + p.sq_off.tail);
+    r->sqMask = *(unsigned *)(ring + p.sq_off.ring_mask);
+    r->sqEntries = p.sq_entries;
+    r->sqes = r->sqeMem;
+    array = (unsigned *)(ring + p.sq_off.array);
+    for (i = 0; i < p.sq_entries; i++) {
+        array[i] = i;                                                   // SQE i always sits in slot i
+    }
+    r->sqLocal = *r->sqTail;
+    r->submitted = r->sqLocal;
+    r->cqHead = (unsigned *)(ring + p.cq_off.head);
+    r->cqTail = (unsigned *)(ring + p.cq_off.tail);
+    r->cqMask = *(unsigned *)(ring + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+    return 0;
+}
+
+static int uring_submit(struct uring *r, unsigned wait) {
+    unsigned count = r->sqLocal - r->submitted;
+    int n;
+
+    __atomic_store_n(r->sqTail, r->sqLocal, __ATOMIC_RELEASE);
+    for (;;) {
+        n = sys_enter(r->fd, count, wait, wait > 0 ? IORING_ENTER_GETEVENTS : 0);
+        if (n >= 0) {
+            r->submitted += n;
+            return 0;
+        }
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            return -errno;
+        }
+        if (wait == 0) {
+            return 0;                                                   // Completions first, the SQEs stay queued
+        }
+    }
+}
+
+// A cleared SQE; submits what is queued when the ring is full
+static struct io_uring_sqe *uring_sqe(struct uring *r) {
+    struct io_uring_sqe *sqe;
+
+    while (r->sqLocal - __atomic_load_n(r->sqHead, __ATOMIC_ACQUIRE) >= r->sqEntries) {
+        if (uring_submit(r, 0) < 0) {
+            return NULL;
+        }
+    }
+    sqe = &r->sqes[r->sqLocal & r->sqMask];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sqLocal++;
+    return sqe;
+}
+
+static struct io_uring_buf_ring *buf_ring_register(int fd, unsigned entries) {
+    struct io_uring_buf_reg reg;
+    void *mem = mmap(NULL, entries * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (mem == MAP_FAILED) {
+        return NULL;
+    }
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t)mem;
+    reg.ring_entries = entries;
+    reg.bgid = BUF_GROUP;
+    if (sys_register(fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        munmap(mem, entries * sizeof(struct io_uring_buf));
+        return NULL;
+    }
+    return mem;
+}
+
+// A sparse table, as large as RLIMIT_NOFILE lets it be
+static unsigned files_register(int fd, unsigned want) {
+    int *fds = malloc(want * sizeof(*fds));
+    unsigned n;
+
+    if (fds == NULL) {
+        return 0;
+    }
+    memset(fds, 0xff, want * sizeof(*fds));                             // -1, an empty slot
+    for (n = want; n >= 16; n /= 2) {
+        if (sys_register(fd, IORING_REGISTER_FILES, fds, n) == 0) {
+            break;
+        }
+    }
+    free(fds);
+    return n >= 16 ? n : 0;
+}
+
+int echo_uring_probe(char *why, size_t len) {
+    static const unsigned tries[] = {
+        IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN,        // 6.1: no IPIs, completions run on enter
+        0,
+    };
+    struct io_uring_buf_ring *br;
+    struct utsname name;
+    struct uring r;
+    int major = 0, minor = 0;
+    int error = -ENOSYS;
+    size_t i;
+
+    if (uname(&name) == 0) {
+        sscanf(name.release, "%d.%d", &major, &minor);
+    }
+    if (major < 6) {
+        snprintf(why, len, "kernel %s has no multishot recv (6.0)", name.release);
+        return -1;
+    }
+    for (i = 0; i < sizeof(tries) / sizeof(tries[0]); i++) {
+        error = uring_init(&r, 8, tries[i]);
+        if (error == 0) {
+            setupFlags = tries[i];
+            break;
+        }
+    }
+    if (error < 0) {
+        snprintf(why, len, "io_uring_setup: %s", strerror(-error));
+        return -1;
+    }
+    br = buf_ring_register(r.fd, 8);
+    if (br == NULL) {
+        snprintf(why, len, "provided buffer rings: %s", strerror(errno));
+        uring_exit(&r);
+        return -1;
+    }
+    munmap(br, 8 * sizeof(struct io_uring_buf));
+    if (files_register(r.fd, 16) == 0) {
+        snprintf(why, len, "registered files: %s", strerror(errno));
+        uring_exit(&r);
+        return -1;
+    }
+    uring_exit(&r);
+    return 0;
+}
+
+static void buf_recycle(struct uworker *w, uint16_t bid) {
+    struct io_uring_buf *buf = &w->bufRing->bufs[w->bufTail & (BUF_COUNT - 1)];
+
+    buf->addr = (uintptr_t)(w->bufs + (size_t)bid * BUF_SIZE);
+    buf->len = BUF_SIZE;
+    buf->bid = bid;
+    w->bufTail++;
+    __atomic_store_n(&w->bufRing->tail, w->bufTail, __ATOMIC_RELEASE);
+}
+
+static void arm_accept(struct uworker *w) {
+    struct io_uring_sqe *sqe = uring_sqe(&w->ring);
+
+    if (sqe == NULL) {
+        return;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = w->lfd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->file_index = IORING_FILE_INDEX_ALLOC;
+    sqe->user_data = USER_DATA(OP_ACCEPT, 0);
+}
+
+static void arm_recv(struct uworker *w, uint32_t slot) {
+    struct io_uring_sqe *sqe = uring_sqe(&w->ring);
+
+    if (sqe == NULL) {
+        return;
+    }
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = slot;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+    sqe->addr = (uintptr_t)&w->recvMsg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_CMSG_CLOEXEC;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->buf_group = BUF_GROUP;
+    sqe->user_data = USER_DATA(OP_RECV, slot);
+    w->conns[slot].recving = 1;
+}
+
+// Sends the rest of the head buffer, or the token with its memfd once the bytes are out
+static void send_head(struct uworker *w, uint32_t slot) {
+    struct uconn *c = &w->conns[slot];
+    struct io_uring_sqe *sqe = uring_sqe(&w->ring);
+    struct ufdsend *fs = &w->fdSend[c->head];
+    struct cmsghdr *cmsg;
+
+    if (sqe == NULL) {
+        return;
+    }
+    sqe->fd = slot;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->user_data = USER_DATA(OP_SEND, slot);
+    c->sending = 1;
+    if (c->off < w->bufLen[c->head]) {
+        sqe->opcode = IORING_OP_SEND;
+        sqe->addr = (uintptr_t)(w->bufs + (size_t)c->head * BUF_SIZE + RECV_DATA + c->off);
+        sqe->len = w->bufLen[c->head] - c->off;
+        sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+        return;
+    }
+    memset(fs, 0, sizeof(*fs));                                         // As echo_send_fd() builds it
+    fs->token = ECHO_FD_TOKEN;
+    fs->iov.iov_base = &fs->token;
+    fs->iov.iov_len = 1;
+    fs->msg.msg_iov = &fs->iov;
+    fs->msg.msg_iovlen = 1;
+    fs->msg.msg_control = fs->control.buf;
+    fs->msg.msg_controllen = sizeof(fs->control.buf);
+    cmsg = CMSG_FIRSTHDR(&fs->msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &w->bufFd[c->head], sizeof(int));
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->addr = (uintptr_t)&fs->msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+}
+
+static void submit_simple(struct uworker *w, uint8_t opcode, uint32_t slot) {
+    struct io_uring_sqe *sqe = uring_sqe(&w->ring);
+
+    if (sqe == NULL) {
+        return;
+    }
+    sqe->opcode = opcode;
+    if (opcode == IORING_OP_CLOSE) {
+        sqe->file_index = slot + 1;                                     // Direct descriptors are closed by index + 1
+    } else {
+        sqe->fd = slot;
+        sqe->flags = IOSQE_FIXED_FILE;
+        sqe->len = SHUT_RDWR;
+    }
+    sqe->user_data = USER_DATA(opcode == IORING_OP_CLOSE ? OP_CLOSE : OP_SHUTDOWN, slot);
+}
+
+// Closes the slot once nothing of it is in flight, its queued buffers go back
+static void conn_maybe_close(struct uworker *w, uint32_t slot) {
+    struct uconn *c = &w->conns[slot];
+
+    if (!c->closing || c->recving || c->sending || !c->open) {
+        return;
+    }
+    while (c->head != BUF_NONE) {
+        uint16_t bid = c->head;
+
+        c->head = w->bufNext[bid];
+        if (w->bufFd[bid] >= 0) {
+            close(w->bufFd[bid]);
+            w->bufFd[bid] = -1;
+        }
+        buf_recycle(w, bid);
+    }
+    c->open = 0;
+    submit_simple(w, IORING_OP_CLOSE, slot);
+}
+
+// Stops taking data from a connection that broke, it closes once nothing is in flight
+static void conn_fail(struct uworker *w, uint32_t slot) {
+    struct uconn *c = &w->conns[slot];
+
+    if (!c->closing) {
+        c->closing = 1;
+        if (c->recving) {
+            submit_simple(w, IORING_OP_SHUTDOWN, slot);                 // Ends the multishot recvmsg
+        }
+    }
+}
+
+/*  Takes the data and the descriptor out of a recvmsg buffer. Returns 1 when there is
+ *  something to send back, 0 at EOF and -1 when the message is bad; in the last two
+ *  cases the buffer goes back to the ring.
+ */
+static int recv_take(struct uworker *w, uint16_t bid) {
+    struct io_uring_recvmsg_out *out = (void *)(w->bufs + (size_t)bid * BUF_SIZE);
+    struct msghdr msg;
+    unsigned len = out->payloadlen;
+    int fd;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = out + 1;                                          // The name is empty
+    msg.msg_controllen = out->controllen;
+    msg.msg_flags = out->flags;
+    if (echo_take_fd(&msg, &fd) < 0) {
+        buf_recycle(w, bid);
+        return -1;
+    }
+    if (fd < 0 && len == 0) {
+        buf_recycle(w, bid);
+        return 0;
+    }
+    if (len > BUF_SIZE - RECV_DATA || (fd >= 0 && (len == 0 || echo_memfd_transform(fd) < 0))) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        buf_recycle(w, bid);
+        return -1;
+    }
+    if (fd >= 0) {
+        len--;                                                          // The token goes back with the memfd
+    }
+    echo_transform((char *)out + RECV_DATA, len);
+    w->bufLen[bid] = len;
+    w->bufFd[bid] = fd;
+    return 1;
+}
+
+static void on_recv(struct uworker *w, uint32_t slot, struct io_uring_cqe *cqe) {
+    struct uconn *c = &w->conns[slot];
+    uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    int got = 0;
+
+    if (cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+        got = recv_take(w, bid);
+    }
+    if (got > 0) {
+        w->bufNext[bid] = BUF_NONE;
+        if (c->head == BUF_NONE) {
+            c->head = bid;
+        } else {
+            w->bufNext[c->tail] = bid;
+        }
+        c->tail = bid;
+        if (!c->sending && !c->closing) {
+            send_head(w, slot);
+        }
+    } else if (got < 0) {
+        conn_fail(w, slot);
+    }
+    if (cqe->flags & IORING_CQE_F_MORE) {
+        return;
+    }
+    c->recving = 0;
+    if (cqe->res == -ENOBUFS) {
+        if (!c->starved && !c->closing) {
+            c->starved = 1;
+            w->starved[w->nstarved++] = slot;
+        }
+    } else if (got > 0 && !c->closing) {
+        arm_recv(w, slot);                                              // The kernel may end a multishot at any time
+    } else {
+        c->closing = 1;                                                 // EOF or an error, replies still go out
+    }
+    conn_maybe_close(w, slot);
+}
+
+static void on_send(struct uworker *w, uint32_t slot, struct io_uring_cqe *cqe) {
+    struct uconn *c = &w->conns[slot];
+    uint16_t bid = c->head;
+
+    c->sending = 0;
+    if (cqe->res < 0) {
+        conn_fail(w, slot);
+        conn_maybe_close(w, slot);
+        return;
+    }
+    if (c->off < w->bufLen[bid]) {
+        c->off += cqe->res;
+    } else {
+        close(w->bufFd[bid]);                                           // The peer has its own copy now
+        w->bufFd[bid] = -1;
+    }
+    if (c->off >= w->bufLen[bid] && w->bufFd[bid] < 0) {
+        c->head = w->bufNext[bid];
+        c->off = 0;
+        buf_recycle(w, bid);
+    }
+    if (c->head != BUF_NONE && !(c->closing && cqe->res == 0)) {
+        send_head(w, slot);
+        return;
+    }
+    conn_maybe_close(w, slot);
+}
+
+static void on_cqe(struct uworker *w, struct io_uring_cqe *cqe) {
+    uint32_t op = cqe->user_data >> 32;
+    uint32_t slot = (uint32_t)cqe->user_data;
+
+    switch (op) {
+        case OP_ACCEPT:
+            if (cqe->res >= 0 && (unsigned)cqe->res < w->nfiles) {
+                struct uconn *c = &w->conns[cqe->res];
+
+                memset(c, 0, sizeof(*c));
+                c->head = c->tail = BUF_NONE;
+                c->open = 1;
+                arm_recv(w, cqe->res);
+            } else if (cqe->res == -ENFILE) {
+                fprintf(stderr, "echo-server: a worker ring is out of file slots\n");
+            }
+            if (!(cqe->flags & IORING_CQE_F_MORE)) {
+                arm_accept(w);
+            }
+            break;
+        case OP_RECV:
+            on_recv(w, slot, cqe);
+            break;
+        case OP_SEND:
+            on_send(w, slot, cqe);
+            break;
+        default:
+            break;                                                      // Close and shutdown need nothing
+    }
+}
+
+static void uworker_loop(struct uworker *w) {
+    struct uring *r = &w->ring;
+    unsigned head, tail, i;
+
+    arm_accept(w);
+    for (;;) {
+        if (uring_submit(r, 1) < 0) {
+            perror("io_uring_enter");
+            return;
+        }
+        head = *r->cqHead;
+        tail = __atomic_load_n(r->cqTail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            on_cqe(w, &r->cqes[head & r->cqMask]);
+        }
+        __atomic_store_n(r->cqHead, head, __ATOMIC_RELEASE);
+
+        // Buffers may have come back, give the starved connections another recv
+        for (i = 0; i < w->nstarved; i++) {
+            struct uconn *c = &w->conns[w->starved[i]];
+
+            c->starved = 0;
+            if (c->open && !c->closing && !c->recving) {
+                arm_recv(w, w->starved[i]);
+            }
+        }
+        w->nstarved = 0;
+    }
+}
+
+// Frees what uworker_setup() made, closing the ring also drops its files and buffers
+static void uworker_free(struct uworker *w) {
+    if (w->bufRing != NULL) {
+        munmap(w->bufRing, BUF_COUNT * sizeof(struct io_uring_buf));
+    }
+    free(w->bufs);
+    free(w->conns);
+    free(w->starved);
+    uring_exit(&w->ring);
+}
+
+static int uworker_setup(struct uworker *w) {
+    unsigned i;
+    int error;
+
+    // With IORING_SETUP_SINGLE_ISSUER the ring belongs to the thread that made it
+    error = uring_init(&w->ring, URING_ENTRIES, setupFlags);
+    if (error < 0) {
+        fprintf(stderr, "io_uring_setup: %s\n", strerror(-error));
+        return -1;
+    }
+    w->nfiles = files_register(w->ring.fd, URING_FILES_MAX);
+    w->bufRing = buf_ring_register(w->ring.fd, BUF_COUNT);
+    w->bufs = malloc((size_t)BUF_COUNT * BUF_SIZE);
+    w->conns = calloc(w->nfiles > 0 ? w->nfiles : 1, sizeof(*w->conns));
+    w->starved = calloc(w->nfiles > 0 ? w->nfiles : 1, sizeof(*w->starved));
+    if (w->nfiles == 0 || w->bufRing == NULL || w->bufs == NULL || w->conns == NULL || w->starved == NULL) {
+        fprintf(stderr, "echo-server: cannot set up an io_uring worker\n");
+        uworker_free(w);
+        return -1;
+    }
+    for (i = 0; i < BUF_COUNT; i++) {
+        w->bufFd[i] = -1;
+        buf_recycle(w, i);
+    }
+    w->recvMsg.msg_controllen = CMSG_SPACE(sizeof(int));
+    return 0;
+}
+
+static void *uworker_start(void *arg) {
+    struct uworker *w = arg;
+    int ok = uworker_setup(w) == 0;
+    int go;
+
+    pthread_mutex_lock(&startLock);
+    startReady++;
+    startFailed += !ok;
+    pthread_cond_broadcast(&startCond);
+    while (ok && startGo == 0) {
+        pthread_cond_wait(&startCond, &startLock);
+    }
+    go = startGo;
+    pthread_mutex_unlock(&startLock);
+
+    if (!ok) {
+        return NULL;
+    }
+    if (go > 0) {
+        uworker_loop(w);                                                // Returns only on an error
+    }
+    uworker_free(w);
+    pthread_mutex_lock(&startLock);
+    workersDone++;
+    pthread_cond_broadcast(&startCond);
+    pthread_mutex_unlock(&startLock);
+    return NULL;
+}
+
+int echo_uring_run(int lfd, long nworkers) {
+    struct uworker *workers = calloc(nworkers, sizeof(*workers));
+    long started, i;
+
+    if (workers == NULL) {
+        return 1;
+    }
+    for (started = 0; started < nworkers; started++) {
+        workers[started].lfd = lfd;
+        if (pthread_create(&workers[started].thread, NULL, uworker_start, &workers[started]) != 0) {
+            perror("pthread_create");
+            break;
+        }
+    }
+
+    pthread_mutex_lock(&startLock);
+    while (startReady < started) {
+        pthread_cond_wait(&startCond, &startLock);
+    }
+    startGo = started == nworkers && startFailed == 0 ? 1 : -1;
+    pthread_cond_broadcast(&startCond);
+    if (startGo < 0) {
+        pthread_mutex_unlock(&startLock);
+        for (i = 0; i < started; i++) {
+            pthread_join(workers[i].thread, NULL);                      // Nothing was accepted yet
+        }
+        free(workers);
+        return 1;
+    }
+    while (workersDone == 0) {
+        pthread_cond_wait(&startCond, &startLock);                      // A worker died, its connections would hang
+    }
+    pthread_mutex_unlock(&startLock);
+    return -1;
+}
@@ -0,0 +1,159 @@
+// Copyright [2020] <Puchkov Kyryll>
+/*  Large messages by descriptor. Instead of the bytes a client sends one token byte that
+ *  carries a memfd with SCM_RIGHTS; the server transforms the memfd in place and answers
+ *  with a token carrying a descriptor of the result. Nothing is copied through the socket,
+ *  which is what makes messages of many megabytes cheap. Small messages stay inline,
+ *  mapping and passing a descriptor costs more than copying a few pages.
+ *
+ *  A token is told from data by its descriptor, not by its value, so the stream keeps
+ *  no framing. The kernel ends a read at the byte that carries descriptors, so a token is
+ *  always the last byte of what a read returns.
+ *
+ *  The sender seals the size of the memfd: the receiver maps it, and a peer that could
+ *  shrink the file under the mapping could kill the receiver with SIGBUS.
+ */
+#ifndef UNIX_SOCKET_ECHO_FD_H_
+#define UNIX_SOCKET_ECHO_FD_H_
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "echo_proto.h"
+
+#define ECHO_FD_TOKEN       '\0'
+#define ECHO_FD_SEALS       (F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL)
+#define ECHO_FD_THRESHOLD   (64 * 1024)                                 ///< Where clients switch, see make crossover
+
+union echo_fd_control {
+    struct cmsghdr align;
+    char           buf[CMSG_SPACE(sizeof(int))];
+};
+
+// A memfd of len bytes whose size cannot change any more, -1 on an error
+static inline int echo_memfd(const char *name, size_t len) {
+    int fd = memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+
+    if (fd < 0) {
+        return -1;
+    }
+    if (ftruncate(fd, len) < 0 || fcntl(fd, F_ADD_SEALS, ECHO_FD_SEALS) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Sends a token with fd, the caller keeps its own copy of the descriptor
+static inline ssize_t echo_send_fd(int sock, int fd) {
+    union echo_fd_control control;
+    char token = ECHO_FD_TOKEN;
+    struct iovec iov = { &token, 1 };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(&control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    return sendmsg(sock, &msg, MSG_NOSIGNAL);
+}
+
+/*  Takes the descriptor out of the control data of a received message, also for the
+ *  recvmsg results of io_uring. *fd is the descriptor, or -1 when none came. More than
+ *  one descriptor fails with EPROTO and all of them are closed.
+ */
+static inline int echo_take_fd(struct msghdr *msg, int *fd) {
+    struct cmsghdr *cmsg;
+
+    *fd = -1;
+    for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            size_t i;
+
+            for (i = 0; i < count; i++) {
+                int got;
+
+                memcpy(&got, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+                if (*fd < 0 && count == 1) {
+                    *fd = got;
+                } else {
+                    close(got);
+                }
+            }
+            if (count != 1) {
+                errno = EPROTO;
+                return -1;
+            }
+        }
+    }
+    if (msg->msg_flags & MSG_CTRUNC) {                                  // Descriptors that did not fit are lost
+        if (*fd >= 0) {
+            close(*fd);
+        }
+        *fd = -1;
+        errno = EPROTO;
+        return -1;
+    }
+    return 0;
+}
+
+/*  read() that also takes a descriptor. When one came, *fd is set and the last of the
+ *  returned bytes is its token, otherwise *fd is -1.
+ */
+static inline ssize_t echo_recv(int sock, char *buf, size_t len, int *fd) {
+    union echo_fd_control control;
+    struct iovec iov = { buf, len };
+    struct msghdr msg;
+    ssize_t n;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    *fd = -1;
+    n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    if (n <= 0) {
+        return n;
+    }
+    return echo_take_fd(&msg, fd) < 0 ? -1 : n;
+}
+
+/*  Transforms a memfd from a client in place. Only a memfd with a sealed size is mapped,
+ *  the client could shrink any other file under the mapping.
+ */
+static inline int echo_memfd_transform(int fd) {
+    struct stat st;
+    int seals = fcntl(fd, F_GET_SEALS);
+    char *map;
+
+    if (seals < 0 || (seals & F_SEAL_SHRINK) == 0 || fstat(fd, &st) < 0) {
+        return -1;
+    }
+    if (st.st_size == 0) {
+        return 0;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        return -1;                                                      // F_SEAL_WRITE, for one
+    }
+    echo_transform(map, st.st_size);
+    munmap(map, st.st_size);
+    return 0;
+}
+
+#endif  // UNIX_SOCKET_ECHO_FD_H_
@@ -0,0 +1,26 @@
+// Copyright [2020] <Puchkov Kyryll>
+/*  What the echo server and its clients agree on: where the socket lives and what the
+ *  server does to the text, so a client can tell the reply really came from the server.
+ *  The stream has no framing, every byte is answered by its transformed copy.
+ */
+#ifndef UNIX_SOCKET_ECHO_PROTO_H_
+#define UNIX_SOCKET_ECHO_PROTO_H_
+
+#include <stddef.h>
+
+#define ECHO_SOCKET_PATH    "/tmp/echo.sock"
+
+// ASCII upper case, other bytes pass unchanged
+static inline unsigned char echo_transform_byte(unsigned char c) {
+    return c >= 'a' && c <= 'z' ? c - 'a' + 'A' : c;
+}
+
+static inline void echo_transform(char *buf, size_t len) {
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        buf[i] = echo_transform_byte(buf[i]);
+    }
+}
+
+#endif  // UNIX_SOCKET_ECHO_PROTO_H_
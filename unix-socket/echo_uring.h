@@ -0,0 +1,23 @@
+// Copyright [2020] <Puchkov Kyryll>
+/*  Completion-based backend of echo-server on io_uring (echo-uring.c), next to the
+ *  epoll loops of echo-server.c. Talks to the kernel with the raw system calls, so it
+ *  needs no liburing, only kernel headers.
+ */
+#ifndef UNIX_SOCKET_ECHO_URING_H_
+#define UNIX_SOCKET_ECHO_URING_H_
+
+#include <stddef.h>
+
+/*  Checks that this kernel has everything the backend uses (multishot accept and recv,
+ *  provided buffer rings, a sparse registered file table). Returns 0, or -1 with the
+ *  reason in why, and then the server keeps to epoll.
+ */
+int echo_uring_probe(char *why, size_t len);
+
+/*  Serves the listening socket with one ring per worker thread. Returns 1 when a worker
+ *  could not be set up, before anything was accepted, so the caller can serve with
+ *  epoll instead; -1 when a worker stopped serving, and the process should exit.
+ */
+int echo_uring_run(int lfd, long nworkers);
+
+#endif  // UNIX_SOCKET_ECHO_URING_H_